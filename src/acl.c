@@ -0,0 +1,566 @@
+/*
+   acl.c
+   $Id$
+
+   This file is part of t-tftpd.
+
+   Copyright 2002,2007 Tomofumi Hayashi <s1061123@gmail.com>.
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+   3. All advertising materials mentioning features or use of this software
+      must display the following acknowledgement:
+
+        This product includes software developed by
+        Tomofumi Hayashi <s1061123@gmail.com> and its contributors.
+
+   4. Neither the name of authors nor the names of its contributors may be used
+      to endorse or promote products derived from this software without
+      specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND ANY
+   EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "shape.h"
+#include "acl.h"
+
+enum acl_access {
+  ACL_DENY,
+  ACL_RO,
+  ACL_RW
+};
+
+struct acl_policy {
+  enum acl_access access;
+  char *path[ACL_PATH_MAX];   /* under the root, without '/' at the ends */
+  int npath;
+  uint64_t rate;
+  struct acl_policy *next;    /* of the set, to free */
+};
+
+/* a prefix, with a policy, or only where two of them branch. */
+struct acl_node {
+  unsigned char addr[16];
+  int bits;
+  struct acl_policy *policy;
+  struct acl_node *child[2];
+};
+
+struct acl_set {
+  struct acl_node *root[2];   /* IPv4, IPv6 */
+  struct acl_policy *policies;
+  struct acl_policy *def;
+  unsigned long prefixes;
+  char *path;                 /* read from, until it is installed */
+  time_t mtime;
+};
+
+static int acl_on = 0;
+static char *acl_path = NULL;
+static time_t acl_mtime = 0;
+
+static pthread_mutex_t acl_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct acl_set *acls = NULL;
+static unsigned long total_allowed = 0, total_denied = 0;
+
+static int addr_bit(const unsigned char *addr, int n)
+{
+  return (addr[n / 8] >> (7 - n % 8)) & 1;
+}
+
+/* the bits a and b have in common, up to max. */
+static int common_bits(const unsigned char *a, const unsigned char *b,
+                       int max)
+{
+  int cnt;
+  unsigned char x;
+
+  for (cnt = 0; cnt < max; cnt += 8) {
+    if ((x = a[cnt / 8] ^ b[cnt / 8]) != 0) {
+      while (!(x & 0x80)) {
+        x <<= 1;
+        cnt++;
+      }
+      return cnt < max ? cnt : max;
+    }
+  }
+  return max;
+}
+
+static struct acl_node *node_new(const unsigned char *addr, int bits,
+                                 struct acl_policy *policy)
+{
+  struct acl_node *np;
+  int cnt;
+
+  if ((np = calloc(1, sizeof(*np))) == NULL) {
+    return NULL;
+  }
+  for (cnt = 0; cnt < 16 && cnt * 8 < bits; cnt++) {
+    np->addr[cnt] = addr[cnt];
+  }
+  if (bits % 8 != 0) {
+    np->addr[bits / 8] &= 0xff << (8 - bits % 8);
+  }
+  np->bits = bits;
+  np->policy = policy;
+  return np;
+}
+
+static void node_free(struct acl_node *np)
+{
+  if (np != NULL) {
+    node_free(np->child[0]);
+    node_free(np->child[1]);
+    free(np);
+  }
+}
+
+/*
+ * Return: 0 on success, -1 for a prefix already there or no memory.
+ */
+static int node_insert(struct acl_node **pp, const unsigned char *addr,
+                       int bits, struct acl_policy *policy)
+{
+  struct acl_node *np, *leaf, *branch;
+  int common;
+
+  while ((np = *pp) != NULL) {
+    common = common_bits(np->addr, addr, np->bits < bits ? np->bits : bits);
+    if (common == np->bits && common == bits) {
+      if (np->policy != NULL) {
+        return -1;
+      }
+      np->policy = policy;
+      return 0;
+    }
+    if (common == np->bits) {
+      /* under np */
+      pp = &np->child[addr_bit(addr, np->bits)];
+      continue;
+    }
+    if (common == bits) {
+      /* above np */
+      if ((leaf = node_new(addr, bits, policy)) == NULL) {
+        return -1;
+      }
+      leaf->child[addr_bit(np->addr, bits)] = np;
+      *pp = leaf;
+      return 0;
+    }
+    /* beside np, where they branch */
+    if ((leaf = node_new(addr, bits, policy)) == NULL) {
+      return -1;
+    }
+    if ((branch = node_new(addr, common, NULL)) == NULL) {
+      free(leaf);
+      return -1;
+    }
+    branch->child[addr_bit(np->addr, common)] = np;
+    branch->child[addr_bit(addr, common)] = leaf;
+    *pp = branch;
+    return 0;
+  }
+  if ((*pp = node_new(addr, bits, policy)) == NULL) {
+    return -1;
+  }
+  return 0;
+}
+
+/* the policy of the longest prefix addr is in. */
+static struct acl_policy *node_lookup(struct acl_node *np,
+                                      const unsigned char *addr, int max)
+{
+  struct acl_policy *best = NULL;
+
+  while (np != NULL && common_bits(np->addr, addr, np->bits) == np->bits) {
+    if (np->policy != NULL) {
+      best = np->policy;
+    }
+    if (np->bits == max) {
+      break;
+    }
+    np = np->child[addr_bit(addr, np->bits)];
+  }
+  return best;
+}
+
+static void set_free(struct acl_set *set)
+{
+  struct acl_policy *pp;
+  int cnt;
+
+  node_free(set->root[0]);
+  node_free(set->root[1]);
+  while ((pp = set->policies) != NULL) {
+    set->policies = pp->next;
+    for (cnt = 0; cnt < pp->npath; cnt++) {
+      free(pp->path[cnt]);
+    }
+    free(pp);
+  }
+  free(set->path);
+  free(set);
+}
+
+/*
+ * The policy items of a line, after the prefix.
+ * Return: 0 on success, -1 on error.
+ */
+static int policy_parse(struct acl_policy *pp, char **last)
+{
+  char *cp, *value;
+  size_t len;
+
+  if ((cp = strtok_r(NULL, " \t\r\n", last)) == NULL) {
+    return -1;
+  }
+  if (strcmp(cp, "deny") == 0) {
+    pp->access = ACL_DENY;
+  }
+  else if (strcmp(cp, "ro") == 0) {
+    pp->access = ACL_RO;
+  }
+  else if (strcmp(cp, "rw") == 0) {
+    pp->access = ACL_RW;
+  }
+  else {
+    return -1;
+  }
+  while ((cp = strtok_r(NULL, " \t\r\n", last)) != NULL) {
+    if ((value = strchr(cp, '=')) == NULL) {
+      return -1;
+    }
+    *value++ = '\0';
+    if (strcmp(cp, "rate") == 0) {
+      if (shape_rate(value, &pp->rate) == -1) {
+        return -1;
+      }
+    }
+    else if (strcmp(cp, "path") == 0 && pp->npath < ACL_PATH_MAX) {
+      while (*value == '/') {
+        value++;
+      }
+      for (len = strlen(value); len > 0 && value[len - 1] == '/'; len--)
+        ;
+      value[len] = '\0';
+      if ((pp->path[pp->npath] = strdup(value)) == NULL) {
+        return -1;
+      }
+      pp->npath++;
+    }
+    else {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * "ADDR" or "ADDR/LEN".
+ * Return: 0 for IPv4, 1 for IPv6, -1 on error.
+ */
+static int prefix_parse(char *str, unsigned char *addr, int *bits)
+{
+  char *cp, *end;
+  long len = -1;
+
+  if ((cp = strchr(str, '/')) != NULL) {
+    *cp++ = '\0';
+    len = strtol(cp, &end, 10);
+    if (*cp == '\0' || *end != '\0' || len < 0) {
+      return -1;
+    }
+  }
+  memset(addr, 0, 16);
+  if (inet_pton(AF_INET, str, addr) == 1 && len <= 32) {
+    *bits = len == -1 ? 32 : len;
+    return 0;
+  }
+  if (inet_pton(AF_INET6, str, addr) == 1 && len <= 128) {
+    *bits = len == -1 ? 128 : len;
+    return 1;
+  }
+  return -1;
+}
+
+/*
+ * Read the lists of path into a new set.
+ * Return: the set, or NULL on error.
+ */
+static struct acl_set *acl_parse(const char *path, time_t *mtime)
+{
+  FILE *fp;
+  struct stat st;
+  struct acl_set *set;
+  struct acl_policy *pp;
+  unsigned char addr[16];
+  char *line = NULL, *cp, *last;
+  size_t size = 0;
+  int lineno = 0, bits, family;
+
+  if ((fp = fopen(path, "r")) == NULL) {
+    return NULL;
+  }
+  if (fstat(fileno(fp), &st) == -1 || st.st_size > ACL_FILE_MAX ||
+      (set = calloc(1, sizeof(*set))) == NULL) {
+    fclose(fp);
+    return NULL;
+  }
+  *mtime = st.st_mtime;
+  /* a whole line, a long list is not cut in two. */
+  while (getline(&line, &size, fp) != -1) {
+    lineno++;
+    if ((cp = strchr(line, '#')) != NULL) {
+      *cp = '\0';
+    }
+    if ((cp = strtok_r(line, " \t\r\n", &last)) == NULL) {
+      continue;
+    }
+    if ((pp = calloc(1, sizeof(*pp))) == NULL) {
+      goto error;
+    }
+    pp->next = set->policies;
+    set->policies = pp;
+    if (policy_parse(pp, &last) == -1) {
+      goto error;
+    }
+    if (strcmp(cp, "default") == 0) {
+      if (set->def != NULL) {
+        goto error;
+      }
+      set->def = pp;
+      continue;
+    }
+    if ((family = prefix_parse(cp, addr, &bits)) == -1 ||
+        node_insert(&set->root[family], addr, bits, pp) == -1) {
+      goto error;
+    }
+    set->prefixes++;
+  }
+  free(line);
+  fclose(fp);
+  return set;
+
+ error:
+  fprintf(stderr, "%s:%d: invalid access list.\n", path, lineno);
+  free(line);
+  fclose(fp);
+  set_free(set);
+  return NULL;
+}
+
+/*
+ * Read the lists of path, for acl_install() or acl_discard().
+ * Return: the lists, or NULL when they are not valid.
+ */
+acl_set *acl_load(const char *path)
+{
+  struct acl_set *set;
+  time_t mtime;
+
+  if ((set = acl_parse(path, &mtime)) == NULL) {
+    return NULL;
+  }
+  if ((set->path = strdup(path)) == NULL) {
+    set_free(set);
+    return NULL;
+  }
+  set->mtime = mtime;
+  return set;
+}
+
+/* switch to the lists of acl_load(). */
+void acl_install(acl_set *set)
+{
+  struct acl_set *old;
+
+  pthread_mutex_lock(&acl_mutex);
+  old = acls;
+  acls = set;
+  free(acl_path);
+  acl_path = set->path;
+  acl_mtime = set->mtime;
+  set->path = NULL;
+  pthread_mutex_unlock(&acl_mutex);
+  if (old != NULL) {
+    set_free(old);
+  }
+  acl_on = 1;
+}
+
+void acl_discard(acl_set *set)
+{
+  set_free(set);
+}
+
+/*
+ * Return: 0 on success, -1 on error.
+ */
+int acl_config(const char *path)
+{
+  struct acl_set *set;
+
+  if ((set = acl_load(path)) == NULL) {
+    return -1;
+  }
+  acl_install(set);
+  return 0;
+}
+
+int acl_enabled(void)
+{
+  return acl_on;
+}
+
+/*
+ * Read the lists again if the file has been changed.  A broken file
+ * leaves the lists as they are.
+ */
+void acl_reload(void)
+{
+  struct stat st;
+  char path[PATH_MAX];
+
+  if (!acl_on) {
+    return;
+  }
+  pthread_mutex_lock(&acl_mutex);
+  snprintf(path, sizeof(path), "%s", acl_path);
+  if (stat(path, &st) == -1 || st.st_mtime == acl_mtime) {
+    pthread_mutex_unlock(&acl_mutex);
+    return;
+  }
+  acl_mtime = st.st_mtime;
+  pthread_mutex_unlock(&acl_mutex);
+
+  if (acl_config(path) == -1) {
+    fprintf(stderr, "access list %s is invalid, not changed.\n", path);
+  }
+  else {
+    fprintf(stderr, "access list %s is reloaded.\n", path);
+  }
+}
+
+/*
+ * Return: 0 when name is in a subtree of pp, -1 otherwise.
+ */
+static int policy_path(const struct acl_policy *pp, const char *name)
+{
+  const char *cp;
+  size_t len;
+  int cnt;
+
+  if (pp->npath == 0) {
+    return 0;
+  }
+  while (*name == '/' || (name[0] == '.' && name[1] == '/')) {
+    name += *name == '/' ? 1 : 2;
+  }
+  /* ".." would go out of the subtree. */
+  for (cp = name; *cp != '\0'; cp += len + (cp[len] == '/')) {
+    len = strcspn(cp, "/");
+    if (len == 2 && cp[0] == '.' && cp[1] == '.') {
+      return -1;
+    }
+  }
+  for (cnt = 0; cnt < pp->npath; cnt++) {
+    len = strlen(pp->path[cnt]);
+    if (len == 0 || (strncmp(name, pp->path[cnt], len) == 0 &&
+                     (name[len] == '\0' || name[len] == '/'))) {
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/*
+ * Decide on a request of client for name, *rate is set to the limit of
+ * its session (0 for none).
+ * Return: 0 when allowed, -1 otherwise.
+ */
+int acl_allow(const struct sockaddr *client, const char *name, int wr,
+              uint64_t *rate)
+{
+  struct acl_policy *pp = NULL;
+  const unsigned char *src;
+  unsigned char addr[16];
+  int ret = -1;
+
+  *rate = 0;
+  memset(addr, 0, sizeof(addr));
+  pthread_mutex_lock(&acl_mutex);
+  if (client->sa_family == AF_INET) {
+    src = (const unsigned char *)&((struct sockaddr_in *)client)->sin_addr;
+    memcpy(addr, src, 4);
+    pp = node_lookup(acls->root[0], addr, 32);
+  }
+  else if (client->sa_family == AF_INET6) {
+    src = (const unsigned char *)&((struct sockaddr_in6 *)client)->sin6_addr;
+    if (IN6_IS_ADDR_V4MAPPED((struct in6_addr *)src)) {
+      memcpy(addr, src + 12, 4);
+      pp = node_lookup(acls->root[0], addr, 32);
+    }
+    else {
+      memcpy(addr, src, 16);
+      pp = node_lookup(acls->root[1], addr, 128);
+    }
+  }
+  if (pp == NULL) {
+    pp = acls->def;
+  }
+  if (pp != NULL && pp->access != ACL_DENY &&
+      (!wr || pp->access == ACL_RW) && policy_path(pp, name) == 0) {
+    *rate = pp->rate;
+    ret = 0;
+  }
+  if (ret == 0) {
+    total_allowed++;
+  }
+  else {
+    total_denied++;
+  }
+  pthread_mutex_unlock(&acl_mutex);
+  return ret;
+}
+
+void acl_total_stat(unsigned long *prefixes, unsigned long *allowed,
+                    unsigned long *denied)
+{
+  pthread_mutex_lock(&acl_mutex);
+  *prefixes = acls != NULL ? acls->prefixes : 0;
+  *allowed = total_allowed;
+  *denied = total_denied;
+  pthread_mutex_unlock(&acl_mutex);
+}
@@ -0,0 +1,88 @@
+/*
+   acl.h
+   $Id$
+
+   This file is part of t-tftpd.
+
+   Copyright 2002,2007 Tomofumi Hayashi <s1061123@gmail.com>.
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+   3. All advertising materials mentioning features or use of this software
+      must display the following acknowledgement:
+
+        This product includes software developed by
+        Tomofumi Hayashi <s1061123@gmail.com> and its contributors.
+
+   4. Neither the name of authors nor the names of its contributors may be used
+      to endorse or promote products derived from this software without
+      specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND ANY
+   EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _ACL_H_
+#define _ACL_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/*
+ * Access lists of the clients by their address.
+ * -l takes a file with a policy for a prefix in a line:
+ *   PREFIX|default  deny|ro|rw  [path=DIR ...] [rate=RATE]
+ * ro allows RRQ only, rw WRQ as well (to the files which are writable
+ * for others, as without a list).  path= limits the client to the
+ * subtrees DIR of the root, up to ACL_PATH_MAX of them; a name with a
+ * ".." in it is refused then.  rate= limits each session of the client
+ * to RATE bytes/sec (with K, M or G, as -B).  A client gets the policy
+ * of the longest prefix it is in, of "default" if none, and is refused
+ * without a default.  The file is read again when it changes.
+ *
+ * The prefixes are in a radix tree (path compressed, one for IPv4 and
+ * one for IPv6, v4-mapped addresses are IPv4), so a lookup follows at
+ * most 32 or 128 bits whatever the number of prefixes.
+ */
+#define ACL_PATH_MAX 8
+#define ACL_FILE_MAX (4 * 1024 * 1024)
+
+typedef struct acl_set acl_set;
+
+acl_set *acl_load(const char *path);
+void acl_install(acl_set *set);
+void acl_discard(acl_set *set);
+int acl_config(const char *path);
+int acl_enabled(void);
+void acl_reload(void);
+int acl_allow(const struct sockaddr *client, const char *name, int wr,
+              uint64_t *rate);
+void acl_total_stat(unsigned long *prefixes, unsigned long *allowed,
+                    unsigned long *denied);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* !_ACL_H_ */
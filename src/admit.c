@@ -0,0 +1,474 @@
+/*
+   admit.c
+   $Id$
+
+   This file is part of t-tftpd.
+
+   Copyright 2002,2007 Tomofumi Hayashi <s1061123@gmail.com>.
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+   3. All advertising materials mentioning features or use of this software
+      must display the following acknowledgement:
+
+        This product includes software developed by
+        Tomofumi Hayashi <s1061123@gmail.com> and its contributors.
+
+   4. Neither the name of authors nor the names of its contributors may be used
+      to endorse or promote products derived from this software without
+      specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND ANY
+   EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "tftp.h"
+#include "admit.h"
+#include "affinity.h"
+
+#define ADMIT_PACKET_MAX 8192
+#define ADMIT_BUSY_MSG "Server is busy"
+
+struct admit_request {
+  char *buf;
+  size_t len;
+  struct sockaddr_storage from;
+  socklen_t fromlen;
+  uint64_t arrived;   /* usec, when it came into the socket buffer */
+  uint64_t due;       /* usec, arrived and the penalty of its size */
+  off_t size;         /* of the file, -1 if not known */
+  int cpu;            /* it came in on, -1 if not known */
+};
+
+/* the requests are kept in the order they arrived. */
+struct admit_queue {
+  int sock;
+  admit_recv_fn recv_fn;
+  admit_size_fn size_fn;
+  int nthreads;
+  int count;
+  struct admit_request *req;
+  pthread_t tid;
+};
+
+static int admit_on = 0;
+static int queue_size = ADMIT_DEFAULT_QUEUE;
+static int max_sessions = 0;
+static int max_large = 0;
+static int deadline = ADMIT_DEFAULT_DEADLINE;
+static int size_msec = ADMIT_DEFAULT_SIZE_MSEC;
+static int age_msec = -1;
+static int busy_error = 1;
+
+/* one lock for all queues, sessions are counted across them. */
+static pthread_mutex_t admit_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t admit_cond = PTHREAD_COND_INITIALIZER;
+static int threads = 0;
+static int active = 0, active_large = 0;
+static unsigned long pending = 0;
+static unsigned long total_admitted = 0, total_full = 0, total_late = 0;
+static unsigned long total_passed = 0;
+
+static uint64_t admit_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Return: 0 on success, -1 on error.
+ */
+int admit_config(const char *spec)
+{
+  char *str, *cp, *value, *end;
+  long val;
+
+  if ((str = strdup(spec)) == NULL) {
+    return -1;
+  }
+  for (cp = strtok(str, ","); cp != NULL; cp = strtok(NULL, ",")) {
+    if ((value = strchr(cp, '=')) == NULL) {
+      goto error;
+    }
+    *value++ = '\0';
+    if (strcmp(cp, "busy") == 0) {
+      if (strcmp(value, "error") == 0) {
+        busy_error = 1;
+      }
+      else if (strcmp(value, "drop") == 0) {
+        busy_error = 0;
+      }
+      else {
+        goto error;
+      }
+      continue;
+    }
+    val = strtol(value, &end, 10);
+    if (*end != '\0' || end == value || val < 0) {
+      goto error;
+    }
+    if (strcmp(cp, "queue") == 0 && val > 0 && val <= ADMIT_MAX_QUEUE) {
+      queue_size = val;
+    }
+    else if (strcmp(cp, "sessions") == 0) {
+      max_sessions = val;
+    }
+    else if (strcmp(cp, "large") == 0) {
+      max_large = val;
+    }
+    else if (strcmp(cp, "deadline") == 0 && val > 0) {
+      deadline = val;
+    }
+    else if (strcmp(cp, "size") == 0) {
+      size_msec = val;
+    }
+    else if (strcmp(cp, "age") == 0) {
+      age_msec = val;
+    }
+    else {
+      goto error;
+    }
+  }
+  free(str);
+  admit_on = 1;
+  return 0;
+
+ error:
+  free(str);
+  return -1;
+}
+
+int admit_enabled(void)
+{
+  return admit_on;
+}
+
+static int admit_large(off_t size)
+{
+  return size >= ADMIT_LARGE_SIZE;
+}
+
+/* the sessions large files may take.  Called with admit_mutex held. */
+static int large_limit(void)
+{
+  int limit;
+
+  if (max_large > 0) {
+    return max_large;
+  }
+  limit = (max_sessions > 0 ? max_sessions : threads) * ADMIT_LARGE_SHARE / 4;
+  return limit > 0 ? limit : 1;
+}
+
+/*
+ * A request waits longer the larger its file is, size_msec per MB
+ * (as much as for one MB when the size is not known), but never more
+ * than age_msec: one which has waited that long goes before all the
+ * later ones.
+ */
+static uint64_t admit_due(uint64_t arrived, off_t size)
+{
+  uint64_t penalty, cap;
+
+  if (size < 0) {
+    size = 1024 * 1024;
+  }
+  penalty = (uint64_t)size * size_msec / 1024 / 1024 * 1000;
+  cap = (uint64_t)(age_msec >= 0 ? age_msec : deadline / 2) * 1000;
+  return arrived + (penalty < cap ? penalty : cap);
+}
+
+static void admit_shed(admit_queue *q, struct admit_request *req)
+{
+  struct tftphdr *tp;
+  char pkt[sizeof(ADMIT_BUSY_MSG) + 4];
+
+  if (!busy_error) {
+    return;
+  }
+  tp = (struct tftphdr *)pkt;
+  tp->th_opcode = htons((u_short)ERROR);
+  tp->th_code = htons((u_short)EUNDEF);
+  memcpy(tp->th_msg, ADMIT_BUSY_MSG, sizeof(ADMIT_BUSY_MSG));
+  sendto(q->sock, pkt, sizeof(pkt), 0,
+         (struct sockaddr *)&req->from, req->fromlen);
+}
+
+/* Called with admit_mutex held. */
+static void admit_remove(admit_queue *q, int idx)
+{
+  q->count--;
+  memmove(&q->req[idx], &q->req[idx + 1],
+          sizeof(struct admit_request) * (q->count - idx));
+  pending--;
+}
+
+/*
+ * Shed the requests which are past the deadline, they are the oldest.
+ * Called with admit_mutex held.
+ */
+static void admit_expire(admit_queue *q, uint64_t now)
+{
+  struct admit_request *req;
+
+  while (q->count > 0) {
+    req = &q->req[0];
+    if (now - req->arrived < (uint64_t)deadline * 1000) {
+      break;
+    }
+    admit_shed(q, req);
+    free(req->buf);
+    admit_remove(q, 0);
+    total_late++;
+  }
+}
+
+/*
+ * The request to start next: the earliest due, leaving out large files
+ * while they have their share of the sessions.
+ * Return: its index, or -1 if none may start now.
+ * Called with admit_mutex held.
+ */
+static int admit_pick(admit_queue *q)
+{
+  int idx, best;
+
+  if (max_sessions > 0 && active >= max_sessions) {
+    return -1;
+  }
+  best = -1;
+  for (idx = 0; idx < q->count; idx++) {
+    if (admit_large(q->req[idx].size) && active_large >= large_limit()) {
+      continue;
+    }
+    if (best == -1 || q->req[idx].due < q->req[best].due) {
+      best = idx;
+    }
+  }
+  return best;
+}
+
+static void *admit_thread(void *param)
+{
+  admit_queue *q;
+  struct admit_request req;
+  struct pollfd pfd[1];
+  char *buf;
+  ssize_t len;
+  uint64_t wait, now, due;
+  int timeout;
+
+  q = (admit_queue *)param;
+  affinity_apply(AFFINITY_LISTEN);
+  if ((buf = (char *)malloc(ADMIT_PACKET_MAX)) == NULL) {
+    return NULL;
+  }
+  pfd[0].fd = q->sock;
+  pfd[0].events = POLLIN;
+  for (;;) {
+    /* answer the ones past the deadline while all workers are busy. */
+    pthread_mutex_lock(&admit_mutex);
+    now = admit_now();
+    admit_expire(q, now);
+    timeout = -1;
+    if (q->count > 0) {
+      due = q->req[0].arrived + (uint64_t)deadline * 1000;
+      timeout = (int)((due - now + 999) / 1000);
+    }
+    pthread_mutex_unlock(&admit_mutex);
+    if (poll(pfd, 1, timeout) <= 0) {
+      continue;
+    }
+
+    req.fromlen = sizeof(req.from);
+    len = q->recv_fn(q->sock, buf, ADMIT_PACKET_MAX,
+                     (struct sockaddr *)&req.from, &req.fromlen, &wait);
+    if (len < 0) {
+      if (errno != EINTR) {
+        perror("admission recv");
+        sleep(1);
+      }
+      continue;
+    }
+    req.cpu = affinity_incoming(q->sock);
+    now = admit_now();
+    req.arrived = now - wait;
+    req.len = len;
+    req.size = q->size_fn != NULL ?
+      q->size_fn(buf, len, (struct sockaddr *)&req.from) : -1;
+    req.due = admit_due(req.arrived, req.size);
+
+    pthread_mutex_lock(&admit_mutex);
+    admit_expire(q, now);
+    if (q->count == queue_size || (req.buf = malloc(len)) == NULL) {
+      total_full++;
+      pthread_mutex_unlock(&admit_mutex);
+      admit_shed(q, &req);
+      continue;
+    }
+    memcpy(req.buf, buf, len);
+    q->req[q->count++] = req;
+    pending++;
+    pthread_cond_broadcast(&admit_cond);
+    pthread_mutex_unlock(&admit_mutex);
+  }
+
+  return NULL;
+}
+
+/*
+ * Start taking the requests of sock into a queue, for nthreads workers.
+ * size_fn tells the size of the file a request of a client is for, it may
+ * be NULL.
+ * Return: the queue, or NULL on error.
+ */
+admit_queue *admit_create(int sock, int nthreads, admit_recv_fn recv_fn,
+                          admit_size_fn size_fn)
+{
+  admit_queue *q;
+
+  if ((q = (admit_queue *)calloc(1, sizeof(admit_queue))) == NULL) {
+    return NULL;
+  }
+  q->sock = sock;
+  q->recv_fn = recv_fn;
+  q->size_fn = size_fn;
+  q->nthreads = nthreads;
+  q->req = (struct admit_request *)calloc(queue_size,
+                                          sizeof(struct admit_request));
+  if (q->req == NULL) {
+    free(q);
+    return NULL;
+  }
+  if (pthread_create(&q->tid, NULL, admit_thread, q) != 0) {
+    free(q->req);
+    free(q);
+    return NULL;
+  }
+  pthread_detach(q->tid);
+
+  pthread_mutex_lock(&admit_mutex);
+  threads += nthreads;
+  pthread_mutex_unlock(&admit_mutex);
+  return q;
+}
+
+/* the pool of the workers of q has changed to nthreads. */
+void admit_resize(admit_queue *q, int nthreads)
+{
+  pthread_mutex_lock(&admit_mutex);
+  threads += nthreads - q->nthreads;
+  q->nthreads = nthreads;
+  pthread_mutex_unlock(&admit_mutex);
+}
+
+/*
+ * Wait for a request which may start a session, the same way as
+ * recv_request().  wait is how long (usec) it waited in the socket
+ * buffer and in the queue, size is the size of its file or -1, cpu the
+ * one it came in on or -1.
+ * admit_done() must be called with the size at the end of the session.
+ */
+ssize_t admit_take(admit_queue *q, char *buf, size_t len,
+                   struct sockaddr *from, socklen_t *fromlen,
+                   uint64_t *wait, off_t *size, int *cpu)
+{
+  struct admit_request req;
+  uint64_t now;
+  int idx;
+
+  pthread_mutex_lock(&admit_mutex);
+  for (;;) {
+    admit_expire(q, admit_now());
+    if ((idx = admit_pick(q)) != -1) {
+      break;
+    }
+    pthread_cond_wait(&admit_cond, &admit_mutex);
+  }
+  req = q->req[idx];
+  if (idx > 0) {
+    total_passed++;
+  }
+  admit_remove(q, idx);
+  active++;
+  if (admit_large(req.size)) {
+    active_large++;
+  }
+  total_admitted++;
+  pthread_mutex_unlock(&admit_mutex);
+
+  now = admit_now();
+  *wait = now - req.arrived;
+  *size = req.size;
+  *cpu = req.cpu;
+  if (len > req.len) {
+    len = req.len;
+  }
+  memcpy(buf, req.buf, len);
+  free(req.buf);
+  if (*fromlen > req.fromlen) {
+    *fromlen = req.fromlen;
+  }
+  memcpy(from, &req.from, *fromlen);
+  return len;
+}
+
+void admit_done(off_t size)
+{
+  pthread_mutex_lock(&admit_mutex);
+  active--;
+  if (admit_large(size)) {
+    active_large--;
+  }
+  pthread_cond_broadcast(&admit_cond);
+  pthread_mutex_unlock(&admit_mutex);
+}
+
+void admit_total_stat(unsigned long *admitted, unsigned long *full,
+                      unsigned long *late, unsigned long *queued,
+                      unsigned long *sessions, unsigned long *passed)
+{
+  pthread_mutex_lock(&admit_mutex);
+  *admitted = total_admitted;
+  *full = total_full;
+  *late = total_late;
+  *queued = pending;
+  *sessions = active;
+  *passed = total_passed;
+  pthread_mutex_unlock(&admit_mutex);
+}
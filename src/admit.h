@@ -0,0 +1,103 @@
+/*
+   admit.h
+   $Id$
+
+   This file is part of t-tftpd.
+
+   Copyright 2002,2007 Tomofumi Hayashi <s1061123@gmail.com>.
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+   3. All advertising materials mentioning features or use of this software
+      must display the following acknowledgement:
+
+        This product includes software developed by
+        Tomofumi Hayashi <s1061123@gmail.com> and its contributors.
+
+   4. Neither the name of authors nor the names of its contributors may be used
+      to endorse or promote products derived from this software without
+      specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND ANY
+   EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _ADMIT_H_
+#define _ADMIT_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/*
+ * Admission control in front of the worker threads.
+ * With -A "queue=N,sessions=N,deadline=MS,busy=error|drop", a thread
+ * per server socket takes the requests out of the socket buffer into a
+ * bounded queue, which the workers take them from.  A request is shed
+ * when the queue is full, or when it has waited longer than the
+ * deadline (the client has retried by then).  A shed request gets an
+ * ERROR "Server is busy" at once, or nothing with busy=drop.
+ * sessions=N lets at most N sessions run at the same time, 0 is as many
+ * as the threads.
+ *
+ * The workers do not take the requests in the order they came: a
+ * request is due when it arrived plus size=MS for each MB of its file
+ * (from the tree for an RRQ, under its name after the -R rules, the
+ * tsize option for a WRQ, as one MB when neither tells), so the many small boot files pass the large images.
+ * The delay is at most age=MS (half the deadline by default), which
+ * keeps a large file from waiting forever behind a stream of small
+ * ones.  Files of ADMIT_LARGE_SIZE or more take at most large=N of the
+ * sessions (3/4 of them by default), the rest are kept for the small.
+ */
+#define ADMIT_DEFAULT_QUEUE 64
+#define ADMIT_DEFAULT_DEADLINE 2000  /* msec */
+#define ADMIT_DEFAULT_SIZE_MSEC 50   /* msec per MB */
+#define ADMIT_MAX_QUEUE 65536
+#define ADMIT_LARGE_SIZE (1024 * 1024)
+#define ADMIT_LARGE_SHARE 3          /* in quarters of the sessions */
+
+typedef ssize_t (*admit_recv_fn)(int s, char *buf, size_t len,
+                                 struct sockaddr *from, socklen_t *fromlen,
+                                 uint64_t *wait);
+typedef off_t (*admit_size_fn)(const char *buf, size_t len,
+                               const struct sockaddr *from);
+typedef struct admit_queue admit_queue;
+
+int admit_config(const char *spec);
+int admit_enabled(void);
+admit_queue *admit_create(int sock, int nthreads, admit_recv_fn recv_fn,
+                          admit_size_fn size_fn);
+void admit_resize(admit_queue *q, int nthreads);
+ssize_t admit_take(admit_queue *q, char *buf, size_t len,
+                   struct sockaddr *from, socklen_t *fromlen,
+                   uint64_t *wait, off_t *size, int *cpu);
+void admit_done(off_t size);
+void admit_total_stat(unsigned long *admitted, unsigned long *full,
+                      unsigned long *late, unsigned long *queued,
+                      unsigned long *sessions, unsigned long *passed);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* !_ADMIT_H_ */
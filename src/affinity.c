@@ -0,0 +1,371 @@
+/*
+   affinity.c
+   $Id$
+
+   This file is part of t-tftpd.
+
+   Copyright 2002,2007 Tomofumi Hayashi <s1061123@gmail.com>.
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+   3. All advertising materials mentioning features or use of this software
+      must display the following acknowledgement:
+
+        This product includes software developed by
+        Tomofumi Hayashi <s1061123@gmail.com> and its contributors.
+
+   4. Neither the name of authors nor the names of its contributors may be used
+      to endorse or promote products derived from this software without
+      specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND ANY
+   EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for the CPU sets */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "affinity.h"
+
+#define AFFINITY_SYSFS "/sys/devices/system/node"
+
+static int affinity_on = 0;
+static int follow = 0, spread = 0;
+static int listen_on = 0, worker_on = 0;
+static cpu_set_t listen_set, worker_set, process_set;
+
+/* from sysfs */
+static int nnodes = 0;
+static cpu_set_t node_set[AFFINITY_MAX_NODES];
+static int cpu_node[CPU_SETSIZE];
+
+static unsigned long total_local = 0, total_moved = 0;
+static unsigned long total_remote = 0, total_unknown = 0;
+
+static int parse_cpus(const char *str, int sep, cpu_set_t *set);
+
+static void load_nodes(void)
+{
+  char path[64], buf[1024];
+  FILE *fp;
+  int node, cpu;
+
+  for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    cpu_node[cpu] = -1;
+  }
+  for (node = 0; node < AFFINITY_MAX_NODES; node++) {
+    CPU_ZERO(&node_set[node]);
+    snprintf(path, sizeof(path), AFFINITY_SYSFS "/node%d/cpulist", node);
+    if ((fp = fopen(path, "r")) == NULL) {
+      continue;
+    }
+    if (fgets(buf, sizeof(buf), fp) != NULL) {
+      buf[strcspn(buf, "\n")] = '\0';
+      parse_cpus(buf, ',', &node_set[node]);
+    }
+    fclose(fp);
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &node_set[node])) {
+        cpu_node[cpu] = node;
+      }
+    }
+    nnodes = node + 1;
+  }
+
+  /* without NUMA, all the CPUs are of node 0. */
+  if (nnodes == 0) {
+    nnodes = 1;
+    node_set[0] = process_set;
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &process_set)) {
+        cpu_node[cpu] = 0;
+      }
+    }
+  }
+}
+
+/*
+ * "0-3<sep>8<sep>node1" into set.
+ * Return: 0 on success, -1 on error.
+ */
+static int parse_cpus(const char *str, int sep, cpu_set_t *set)
+{
+  const char *cp;
+  char *end;
+  long first, last, node;
+
+  CPU_ZERO(set);
+  for (cp = str; *cp != '\0'; cp = end + (*end == sep)) {
+    if (strncmp(cp, "node", 4) == 0) {
+      node = strtol(cp + 4, &end, 10);
+      if (end == cp + 4 || node < 0 || node >= AFFINITY_MAX_NODES) {
+        return -1;
+      }
+      CPU_OR(set, set, &node_set[node]);
+    }
+    else {
+      first = last = strtol(cp, &end, 10);
+      if (end == cp) {
+        return -1;
+      }
+      if (*end == '-') {
+        cp = end + 1;
+        last = strtol(cp, &end, 10);
+        if (end == cp) {
+          return -1;
+        }
+      }
+      if (first < 0 || last >= CPU_SETSIZE || first > last) {
+        return -1;
+      }
+      for (; first <= last; first++) {
+        CPU_SET(first, set);
+      }
+    }
+    if (*end != sep && *end != '\0') {
+      return -1;
+    }
+  }
+  return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+static int parse_switch(const char *value)
+{
+  if (strcmp(value, "on") == 0) {
+    return 1;
+  }
+  if (strcmp(value, "off") == 0) {
+    return 0;
+  }
+  return -1;
+}
+
+/* some of set must be CPUs the process may run on. */
+static int parse_allowed(const char *str, cpu_set_t *set)
+{
+  cpu_set_t allowed;
+
+  if (parse_cpus(str, ':', set) == -1) {
+    return -1;
+  }
+  CPU_AND(&allowed, set, &process_set);
+  return CPU_COUNT(&allowed) > 0 ? 0 : -1;
+}
+
+/*
+ * Return: 0 on success, -1 on error.
+ */
+int affinity_config(const char *spec)
+{
+  char *str, *cp, *value;
+
+  if (sched_getaffinity(0, sizeof(process_set), &process_set) == -1) {
+    perror("sched_getaffinity");
+    return -1;
+  }
+  if (nnodes == 0) {
+    load_nodes();
+  }
+  if ((str = strdup(spec)) == NULL) {
+    return -1;
+  }
+  for (cp = strtok(str, ","); cp != NULL; cp = strtok(NULL, ",")) {
+    if ((value = strchr(cp, '=')) == NULL) {
+      goto error;
+    }
+    *value++ = '\0';
+    if (strcmp(cp, "listen") == 0) {
+      if (parse_allowed(value, &listen_set) == -1) {
+        goto error;
+      }
+      listen_on = 1;
+    }
+    else if (strcmp(cp, "workers") == 0) {
+      if (parse_allowed(value, &worker_set) == -1) {
+        goto error;
+      }
+      worker_on = 1;
+    }
+    else if (strcmp(cp, "follow") == 0) {
+      if ((follow = parse_switch(value)) == -1) {
+        goto error;
+      }
+    }
+    else if (strcmp(cp, "spread") == 0) {
+      if ((spread = parse_switch(value)) == -1) {
+        goto error;
+      }
+    }
+    else {
+      goto error;
+    }
+  }
+  free(str);
+  affinity_on = 1;
+  return 0;
+
+ error:
+  free(str);
+  return -1;
+}
+
+int affinity_enabled(void)
+{
+  return affinity_on;
+}
+
+/*
+ * Called in each prefork worker, with its number: with spread=on, the
+ * worker keeps to the CPUs it may run on of one node.
+ */
+void affinity_process(int slot)
+{
+  cpu_set_t set, allowed[AFFINITY_MAX_NODES];
+  int node, cnt;
+
+  if (!affinity_on || !spread) {
+    return;
+  }
+  /* the slot-th of the nodes which have CPUs the process may run on. */
+  cnt = 0;
+  for (node = 0; node < nnodes; node++) {
+    CPU_AND(&allowed[node], &process_set, &node_set[node]);
+    cnt += CPU_COUNT(&allowed[node]) > 0;
+  }
+  if (cnt == 0) {
+    return;
+  }
+  slot %= cnt;
+  for (node = 0; CPU_COUNT(&allowed[node]) == 0 || slot-- > 0; node++)
+    ;
+  if (sched_setaffinity(0, sizeof(allowed[node]), &allowed[node]) == -1) {
+    perror("sched_setaffinity");
+    return;
+  }
+  process_set = allowed[node];
+  CPU_AND(&set, &listen_set, &allowed[node]);
+  if (listen_on && CPU_COUNT(&set) > 0) {
+    listen_set = set;
+  }
+  CPU_AND(&set, &worker_set, &allowed[node]);
+  if (worker_on && CPU_COUNT(&set) > 0) {
+    worker_set = set;
+  }
+}
+
+/*
+ * Pin the calling thread for its role, or let it run on any CPU of the
+ * process when the role has no CPUs given.  A new thread has the CPUs
+ * of the thread which created it, until this.
+ */
+void affinity_apply(enum affinity_role role)
+{
+  cpu_set_t *set;
+
+  if (!affinity_on) {
+    return;
+  }
+  set = &process_set;
+  if (role == AFFINITY_LISTEN && listen_on) {
+    set = &listen_set;
+  }
+  else if (role == AFFINITY_WORKER && worker_on) {
+    set = &worker_set;
+  }
+  pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), set);
+}
+
+/*
+ * The CPU the last packet of sock was received on, just after a
+ * request is taken out of it.
+ * Return: the CPU, or -1 when it is not known.
+ */
+int affinity_incoming(int sock)
+{
+#ifdef SO_INCOMING_CPU
+  socklen_t len;
+  int cpu;
+
+  if (!affinity_on) {
+    return -1;
+  }
+  len = sizeof(cpu);
+  if (getsockopt(sock, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0) {
+    return cpu;
+  }
+#endif /* SO_INCOMING_CPU */
+  return -1;
+}
+
+/*
+ * A session starts on the calling thread for a request which came in
+ * on cpu: count where it is served, moving there with follow=on.
+ */
+void affinity_session(int cpu)
+{
+  cpu_set_t set;
+  int here, node;
+
+  if (!affinity_on) {
+    return;
+  }
+  if (cpu < 0 || cpu >= CPU_SETSIZE || cpu_node[cpu] == -1) {
+    __atomic_fetch_add(&total_unknown, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  node = cpu_node[cpu];
+  here = sched_getcpu();
+  if (here >= 0 && here < CPU_SETSIZE && cpu_node[here] == node) {
+    __atomic_fetch_add(&total_local, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  if (follow) {
+    /* but not out of the CPUs given for the workers. */
+    CPU_AND(&set, worker_on ? &worker_set : &process_set, &node_set[node]);
+    if (CPU_COUNT(&set) > 0 &&
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0) {
+      __atomic_fetch_add(&total_moved, 1, __ATOMIC_RELAXED);
+      return;
+    }
+  }
+  __atomic_fetch_add(&total_remote, 1, __ATOMIC_RELAXED);
+}
+
+void affinity_total_stat(unsigned long *local, unsigned long *moved,
+                         unsigned long *remote, unsigned long *unknown)
+{
+  *local = __atomic_load_n(&total_local, __ATOMIC_RELAXED);
+  *moved = __atomic_load_n(&total_moved, __ATOMIC_RELAXED);
+  *remote = __atomic_load_n(&total_remote, __ATOMIC_RELAXED);
+  *unknown = __atomic_load_n(&total_unknown, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,83 @@
+/*
+   affinity.h
+   $Id$
+
+   This file is part of t-tftpd.
+
+   Copyright 2002,2007 Tomofumi Hayashi <s1061123@gmail.com>.
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+   3. All advertising materials mentioning features or use of this software
+      must display the following acknowledgement:
+
+        This product includes software developed by
+        Tomofumi Hayashi <s1061123@gmail.com> and its contributors.
+
+   4. Neither the name of authors nor the names of its contributors may be used
+      to endorse or promote products derived from this software without
+      specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND ANY
+   EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _AFFINITY_H_
+#define _AFFINITY_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/*
+ * CPU and NUMA node affinity of the threads.
+ * -c takes "listen=CPUS,workers=CPUS,follow=on|off,spread=on|off".
+ * CPUS is a list of CPUs, ranges and nodes separated by colons, e.g.
+ * "0-3:8" or "node1"; the nodes are read from sysfs.
+ * listen pins the threads taking the requests out of the sockets,
+ * workers the transfer threads.  A thread pinned before it allocates
+ * its buffers gets them from its own node.
+ * With follow=on, a transfer thread moves to the node of the CPU its
+ * request came in on (SO_INCOMING_CPU), which is where the NIC queue
+ * of the client is.  With spread=on, the prefork workers are placed on
+ * the nodes in turn.
+ * The sessions served on the node of their request or not are counted,
+ * for the cross-node traffic.
+ */
+#define AFFINITY_MAX_NODES 64
+
+enum affinity_role {
+  AFFINITY_LISTEN,
+  AFFINITY_WORKER
+};
+
+int affinity_config(const char *spec);
+int affinity_enabled(void);
+void affinity_process(int slot);
+void affinity_apply(enum affinity_role role);
+int affinity_incoming(int sock);
+void affinity_session(int cpu);
+void affinity_total_stat(unsigned long *local, unsigned long *moved,
+                         unsigned long *remote, unsigned long *unknown);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* !_AFFINITY_H_ */
@@ -0,0 +1,843 @@
+/*
+   bench.c
+   $Id$
+
+   This file is part of t-tftpd.
+
+   Copyright 2002,2007 Tomofumi Hayashi <s1061123@gmail.com>.
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+   3. All advertising materials mentioning features or use of this software
+      must display the following acknowledgement:
+
+        This product includes software developed by
+        Tomofumi Hayashi <s1061123@gmail.com> and its contributors.
+
+   4. Neither the name of authors nor the names of its contributors may be used
+      to endorse or promote products derived from this software without
+      specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND ANY
+   EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * t-tftpd-bench: microbenchmarks for the inner loops of the server.
+ * tftpd.c is built into this program with its main() renamed, so the
+ * benchmarks call the very functions and static state the server uses.
+ * Every benchmark is calibrated to run BENCH_MIN_NSEC at least, then
+ * repeated; the median and the minimum per operation are printed as JSON.
+ */
+
+#define main tftpd_main
+#include "tftpd.c"
+#undef main
+
+#define BENCH_REPS 5
+#define BENCH_MAX_REPS 64
+#define BENCH_MIN_NSEC 20000000ULL
+#define BENCH_TEXT_SIZE (4 * 1024 * 1024)
+#define BENCH_FANOUT 100
+#define BENCH_LOOKUPS 64
+#define BENCH_MAX_SIZES 16
+
+/* returns nsec taken by "iters" rounds, *ops is the operations in a round */
+typedef uint64_t (*bench_fn)(void *arg, uint64_t iters, uint64_t *ops);
+
+struct bench_result {
+  uint64_t iters;
+  uint64_t ops;       /* operations in one round */
+  double median;      /* nsec per operation */
+  double min;
+};
+
+struct bench_text {
+  char *text;         /* plain text, as it is on the disk */
+  size_t size;
+  char *ascii;        /* the same text in netascii */
+  size_t ascii_size;
+  FILE *fp;
+  upload_writer *uw;
+};
+
+struct bench_tree {
+  f_node *root;
+  int entries;
+  int fanout;
+  int depth;
+  unsigned long nodes;
+  char paths[BENCH_LOOKUPS][PATH_SIZ];
+};
+
+static FILE *out;
+static int bench_reps = BENCH_REPS;
+static int bench_count = 0;
+static const char *bench_filter = NULL;
+static char bench_dir[PATH_SIZ];
+static tftpd_thread *bench_thread;
+static uint32_t bench_seed;
+
+void bench_usage(const char *name)
+{
+  fprintf(stderr,
+	  "usage: %s [options]\n"
+	  "  -f <name> \t\t run only benchmarks containing <name>\n"
+	  "  -g <n>[,<n>...] \t entries of the on-disk trees "
+	  "(default: 1000,10000)\n"
+	  "  -o <file> \t\t write the JSON to <file> (default: stdout)\n"
+	  "  -r <num> \t\t repetitions of every benchmark (default: %d)\n"
+	  "  -s <n>[,<n>...] \t entries of the in-memory trees "
+	  "(default: 1000,10000,100000,1000000)\n"
+	  "  -t <bytes> \t\t size of the text for the netascii "
+	  "benchmarks (default: %d)\n"
+	  "  -T <directory> \t where to create the on-disk trees "
+	  "(default: /tmp)\n",
+	  name, BENCH_REPS, BENCH_TEXT_SIZE);
+}
+
+uint64_t bench_nsec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* the inputs are made from a fixed seed, so every run sees the same data. */
+uint32_t bench_rand(void)
+{
+  bench_seed ^= bench_seed << 13;
+  bench_seed ^= bench_seed >> 17;
+  bench_seed ^= bench_seed << 5;
+  return bench_seed;
+}
+
+int bench_want(const char *name)
+{
+  return bench_filter == NULL || strstr(name, bench_filter) != NULL;
+}
+
+int bench_parse_list(char *str, int *val, int max)
+{
+  int cnt = 0;
+  char *cptr;
+
+  for (cptr = strtok(str, ","); cptr != NULL; cptr = strtok(NULL, ",")) {
+    if (cnt >= max || (val[cnt] = atoi(cptr)) <= 0) {
+      return -1;
+    }
+    cnt++;
+  }
+  return cnt;
+}
+
+int bench_double_cmp(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+void bench_run(bench_fn fn, void *arg, struct bench_result *res)
+{
+  double per_op[BENCH_MAX_REPS];
+  uint64_t iters = 1, nsec, ops;
+  int cnt;
+
+  /* calibration, this also warms up the caches. */
+  while (1) {
+    nsec = fn(arg, iters, &ops);
+    if (nsec >= BENCH_MIN_NSEC) {
+      break;
+    }
+    if (nsec < BENCH_MIN_NSEC / 8) {
+      iters *= 8;
+    }
+    else {
+      iters = iters * BENCH_MIN_NSEC / nsec + 1;
+    }
+  }
+
+  for (cnt = 0; cnt < bench_reps; cnt++) {
+    nsec = fn(arg, iters, &ops);
+    per_op[cnt] = (double)nsec / iters / (ops > 0 ? ops : 1);
+  }
+  qsort(per_op, bench_reps, sizeof(double), bench_double_cmp);
+
+  res->iters = iters;
+  res->ops = ops;
+  res->median = per_op[bench_reps / 2];
+  res->min = per_op[0];
+}
+
+/*
+ * params and extra are JSON members without the braces.
+ * With bytes_per_op, the throughput of the median is added.
+ */
+void bench_report(const char *name, const char *params,
+                  struct bench_result *res, double bytes_per_op,
+                  const char *extra)
+{
+  fprintf(out, "%s\n    {\"name\": \"%s\", \"params\": {%s}, "
+	  "\"iterations\": %llu, \"ops\": %llu, "
+	  "\"ns_per_op\": %.1f, \"ns_per_op_min\": %.1f",
+	  bench_count > 0 ? "," : "", name, params,
+	  (unsigned long long)res->iters, (unsigned long long)res->ops,
+	  res->median, res->min);
+  if (bytes_per_op > 0) {
+    fprintf(out, ", \"mb_per_sec\": %.1f",
+	    bytes_per_op * 1000.0 / res->median);
+  }
+  if (extra != NULL) {
+    fprintf(out, ", %s", extra);
+  }
+  fprintf(out, "}");
+  fflush(out);
+  bench_count++;
+}
+
+/*
+ * netascii
+ */
+void bench_reset_ascii(void)
+{
+  bench_thread->newline = 0;
+  bench_thread->prevchar = 0;
+}
+
+/* lines of 0 to 119 characters, one in eight ends with cr,lf. */
+char *bench_make_text(size_t size)
+{
+  char *text;
+  size_t pos = 0, len;
+
+  text = (char *)malloc(size);
+  if (text == NULL) {
+    return NULL;
+  }
+  bench_seed = 2463534242U;
+  while (pos < size) {
+    for (len = bench_rand() % 120; len > 0 && pos < size; len--) {
+      text[pos++] = ' ' + bench_rand() % 95;
+    }
+    if (pos < size && bench_rand() % 8 == 0) {
+      text[pos++] = '\r';
+    }
+    if (pos < size) {
+      text[pos++] = '\n';
+    }
+  }
+  return text;
+}
+
+uint64_t bench_read_ascii(void *arg, uint64_t iters, uint64_t *ops)
+{
+  struct bench_text *bt = arg;
+  char buf[SEGSIZE];
+  uint64_t start, cnt;
+
+  *ops = 0;
+  start = bench_nsec();
+  for (cnt = 0; cnt < iters; cnt++) {
+    rewind(bt->fp);
+    bench_reset_ascii();
+    do {
+      (*ops)++;
+    } while (read_data_ascii(bt->fp, buf, SEGSIZE) == SEGSIZE);
+  }
+  *ops /= iters;
+  return bench_nsec() - start;
+}
+
+uint64_t bench_read_ascii_mmap(void *arg, uint64_t iters, uint64_t *ops)
+{
+  struct bench_text *bt = arg;
+  char buf[SEGSIZE];
+  char *fptr;
+  size_t left, len, rd_size;
+  uint64_t start, cnt;
+
+  *ops = 0;
+  start = bench_nsec();
+  for (cnt = 0; cnt < iters; cnt++) {
+    bench_reset_ascii();
+    fptr = bt->text;
+    left = bt->size;
+    do {
+      len = read_data_ascii_mmap(fptr, buf, SEGSIZE, left, &rd_size);
+      fptr += rd_size;
+      left -= rd_size;
+      (*ops)++;
+    } while (len == SEGSIZE);
+  }
+  *ops /= iters;
+  return bench_nsec() - start;
+}
+
+uint64_t bench_write_ascii(void *arg, uint64_t iters, uint64_t *ops)
+{
+  struct bench_text *bt = arg;
+  char buf[SEGSIZE];
+  size_t pos, len;
+  uint64_t start, cnt;
+
+  *ops = 0;
+  start = bench_nsec();
+  for (cnt = 0; cnt < iters; cnt++) {
+    bench_reset_ascii();
+    for (pos = 0; pos < bt->ascii_size; pos += len) {
+      len = bt->ascii_size - pos;
+      if (len > SEGSIZE) {
+	len = SEGSIZE;
+      }
+      /* it is converted in place, as the DATA packet in recv_file(). */
+      memcpy(buf, bt->ascii + pos, len);
+      write_data_ascii(bt->uw, buf, len);
+      (*ops)++;
+    }
+  }
+  *ops /= iters;
+  return bench_nsec() - start;
+}
+
+void bench_ascii(size_t size)
+{
+  struct bench_text bt;
+  struct bench_result res;
+  char params[128], path[PATH_SIZ];
+  char *fptr;
+  size_t len, left, rd_size;
+  int fd = -1;
+
+  memset(&bt, 0, sizeof(bt));
+  if ((bt.text = bench_make_text(size)) == NULL) {
+    return;
+  }
+  bt.size = size;
+  snprintf(params, sizeof(params), "\"bytes\": %lu, \"blksize\": %d",
+	   (unsigned long)size, SEGSIZE);
+
+  if (bench_want("read_data_ascii") &&
+      snprintf(path, sizeof(path), "%s/text", bench_dir) < (int)sizeof(path)) {
+    bt.fp = fopen(path, "w+");
+    if (bt.fp != NULL && fwrite(bt.text, 1, size, bt.fp) == size) {
+      bench_run(bench_read_ascii, &bt, &res);
+      bench_report("read_data_ascii", params, &res,
+		   (double)size / res.ops, NULL);
+    }
+    if (bt.fp != NULL) {
+      fclose(bt.fp);
+    }
+    unlink(path);
+  }
+
+  if (bench_want("read_data_ascii_mmap")) {
+    bench_run(bench_read_ascii_mmap, &bt, &res);
+    bench_report("read_data_ascii_mmap", params, &res,
+		 (double)size / res.ops, NULL);
+  }
+
+  if (bench_want("write_data_ascii")) {
+    /* at most twice as large in netascii. */
+    bt.ascii = (char *)malloc(size * 2 + SEGSIZE);
+    fd = open("/dev/null", O_WRONLY);
+    if (bt.ascii != NULL && fd != -1) {
+      bench_reset_ascii();
+      fptr = bt.text;
+      left = size;
+      bt.ascii_size = 0;
+      do {
+	len = read_data_ascii_mmap(fptr, bt.ascii + bt.ascii_size, SEGSIZE,
+				   left, &rd_size);
+	fptr += rd_size;
+	left -= rd_size;
+	bt.ascii_size += len;
+      } while (len == SEGSIZE);
+      bt.uw = uw_create(fd, upload_chunk, 0, UW_SYNC_NONE, 0, 0, 0);
+    }
+    if (bt.uw != NULL) {
+      bench_run(bench_write_ascii, &bt, &res);
+      bench_report("write_data_ascii", params, &res,
+		   (double)bt.ascii_size / res.ops, NULL);
+      uw_destroy(bt.uw);
+    }
+    if (fd != -1) {
+      close(fd);
+    }
+    free(bt.ascii);
+  }
+  free(bt.text);
+}
+
+/*
+ * file tree
+ */
+
+/* leaves are numbered in order, so the path of leaf k is k in base fanout. */
+f_node *bench_synth(int depth, struct bench_tree *bt, int *left)
+{
+  f_node *head = NULL, *node, **tail = &head;
+  char name[NAME_SIZ];
+  int cnt;
+
+  for (cnt = 0; cnt < bt->fanout && *left > 0; cnt++) {
+    if (depth > 1) {
+      snprintf(name, sizeof(name), "d%d", cnt);
+      node = new_node(name, 1, 1);
+      node->child = bench_synth(depth - 1, bt, left);
+    }
+    else {
+      snprintf(name, sizeof(name), "f%d", cnt);
+      node = new_node(name, 0, 1);
+      (*left)--;
+    }
+    bt->nodes++;
+    *tail = node;
+    tail = &node->next;
+  }
+  return head;
+}
+
+void bench_leaf_path(struct bench_tree *bt, int leaf, char *path, size_t siz)
+{
+  int level, div = 1;
+  size_t len = 0;
+
+  for (level = 1; level < bt->depth; level++) {
+    div *= bt->fanout;
+  }
+  for (level = bt->depth; level > 1; level--) {
+    len += snprintf(path + len, siz - len, "d%d/", leaf / div % bt->fanout);
+    div /= bt->fanout;
+  }
+  snprintf(path + len, siz - len, "f%d", leaf % bt->fanout);
+}
+
+void bench_tree_init(struct bench_tree *bt, int entries, int fanout)
+{
+  int cnt, left = entries, span = 1;
+
+  memset(bt, 0, sizeof(*bt));
+  bt->entries = entries;
+  bt->fanout = fanout;
+  for (bt->depth = 1; span * (long)fanout < entries; bt->depth++) {
+    span *= fanout;
+  }
+  bt->root = bench_synth(bt->depth, bt, &left);
+
+  bench_seed = 88172645U;
+  for (cnt = 0; cnt < BENCH_LOOKUPS; cnt++) {
+    bench_leaf_path(bt, bench_rand() % entries, bt->paths[cnt], PATH_SIZ);
+  }
+}
+
+/* the same walk as file_open() does, without open(). */
+uint64_t bench_get_leaf(void *arg, uint64_t iters, uint64_t *ops)
+{
+  struct bench_tree *bt = arg;
+  char path[PATH_SIZ];
+  char *cptr, *last;
+  f_node *fptr;
+  uint64_t start, cnt;
+  int idx;
+
+  start = bench_nsec();
+  for (cnt = 0; cnt < iters; cnt++) {
+    for (idx = 0; idx < BENCH_LOOKUPS; idx++) {
+      strlcpy(path, bt->paths[idx], PATH_SIZ);
+      last = divide_token(path, '/');
+      fptr = bt->root;
+      for (cptr = path; cptr < last && fptr != NULL;
+	   cptr += strlen(cptr) + 1) {
+	fptr = get_leaf(fptr, cptr);
+	if (fptr != NULL && cptr + strlen(cptr) < last) {
+	  fptr = fptr->child;
+	}
+      }
+      if (fptr == NULL) {
+	fprintf(stderr, "%s is not found.\n", bt->paths[idx]);
+      }
+    }
+  }
+  *ops = BENCH_LOOKUPS;
+  return bench_nsec() - start;
+}
+
+uint64_t bench_file_open(void *arg, uint64_t iters, uint64_t *ops)
+{
+  struct bench_tree *bt = arg;
+  uint64_t start, cnt;
+  int idx, fd;
+
+  start = bench_nsec();
+  for (cnt = 0; cnt < iters; cnt++) {
+    for (idx = 0; idx < BENCH_LOOKUPS; idx++) {
+      fd = file_open(bt->paths[idx], 0, OCTET);
+      if (fd == -1) {
+	fprintf(stderr, "file_open(%s) failed.\n", bt->paths[idx]);
+      }
+      else {
+	/* the descriptor may be the one the cache keeps. */
+	bench_thread->fd = fd;
+	file_close(bench_thread);
+      }
+    }
+  }
+  *ops = BENCH_LOOKUPS;
+  return bench_nsec() - start;
+}
+
+/* creates the directories and an empty file for path under dir. */
+int bench_mkpath(const char *dir, const char *path)
+{
+  char full[PATH_SIZ];
+  char *cptr;
+  int fd;
+
+  snprintf(full, sizeof(full), "%s/%s", dir, path);
+  for (cptr = full + strlen(dir) + 1; (cptr = strchr(cptr, '/')) != NULL;
+       cptr++) {
+    *cptr = '\0';
+    if (mkdir(full, 0755) == -1 && errno != EEXIST) {
+      return -1;
+    }
+    *cptr = '/';
+  }
+  if ((fd = open(full, O_WRONLY|O_CREAT, 0644)) == -1) {
+    return -1;
+  }
+  close(fd);
+  return 0;
+}
+
+int bench_rmtree(const char *path)
+{
+  DIR *dp;
+  struct dirent *d_ent;
+  struct stat st;
+  char full[PATH_SIZ];
+
+  if ((dp = opendir(path)) == NULL) {
+    return unlink(path);
+  }
+  while ((d_ent = readdir(dp)) != NULL) {
+    if (strcmp(d_ent->d_name, ".") == 0 || strcmp(d_ent->d_name, "..") == 0) {
+      continue;
+    }
+    if (snprintf(full, sizeof(full), "%s/%s", path,
+		 d_ent->d_name) >= (int)sizeof(full)) {
+      continue;
+    }
+    if (lstat(full, &st) == 0 && S_ISDIR(st.st_mode)) {
+      bench_rmtree(full);
+    }
+    else {
+      unlink(full);
+    }
+  }
+  closedir(dp);
+  return rmdir(path);
+}
+
+void bench_lookup(int entries, int fanout)
+{
+  struct bench_tree *bt;
+  struct bench_result res;
+  char params[128], dir[PATH_SIZ];
+  int cnt, ok = 1;
+
+  if (!bench_want("get_leaf") && !bench_want("file_open")) {
+    return;
+  }
+  bt = (struct bench_tree *)malloc(sizeof(struct bench_tree));
+  if (bt == NULL) {
+    return;
+  }
+  bench_tree_init(bt, entries, fanout);
+  snprintf(params, sizeof(params),
+	   "\"entries\": %d, \"fanout\": %d, \"depth\": %d",
+	   entries, fanout, bt->depth);
+
+  if (bench_want("get_leaf")) {
+    bench_run(bench_get_leaf, bt, &res);
+    bench_report("get_leaf", params, &res, 0, NULL);
+  }
+
+  /* only the looked up files exist on the disk, the tree is synthetic. */
+  if (bench_want("file_open") &&
+      snprintf(dir, sizeof(dir), "%s/lookup", bench_dir) < (int)sizeof(dir)) {
+    mkdir(dir, 0755);
+    for (cnt = 0; cnt < BENCH_LOOKUPS; cnt++) {
+      if (bench_mkpath(dir, bt->paths[cnt]) == -1) {
+	perror("bench_mkpath");
+	ok = 0;
+	break;
+      }
+    }
+    if (ok) {
+      strlcpy(tftpd_root, dir, PATH_SIZ);
+      root_node = bt->root;
+      root_gen++;  /* the files of another lookup tree are not reused. */
+      bench_run(bench_file_open, bt, &res);
+      bench_report("file_open", params, &res, 0, NULL);
+      root_node = NULL;
+    }
+    bench_rmtree(dir);
+  }
+
+  free_node(bt->root);
+  free(bt);
+}
+
+/* a real tree of entries files, BENCH_FANOUT in each directory. */
+int bench_make_disk_tree(const char *dir, int entries)
+{
+  struct bench_tree bt;
+  char path[PATH_SIZ];
+  int cnt, span = 1;
+
+  memset(&bt, 0, sizeof(bt));
+  bt.fanout = BENCH_FANOUT;
+  for (bt.depth = 1; span * (long)BENCH_FANOUT < entries; bt.depth++) {
+    span *= BENCH_FANOUT;
+  }
+  if (mkdir(dir, 0755) == -1) {
+    return -1;
+  }
+  for (cnt = 0; cnt < entries; cnt++) {
+    bench_leaf_path(&bt, cnt, path, sizeof(path));
+    if (bench_mkpath(dir, path) == -1) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+unsigned long bench_count_nodes(f_node *ptr)
+{
+  unsigned long cnt = 0;
+
+  for (; ptr != NULL; ptr = ptr->next) {
+    cnt += 1 + bench_count_nodes(ptr->child);
+  }
+  return cnt;
+}
+
+uint64_t bench_get_node(void *arg, uint64_t iters, uint64_t *ops)
+{
+  f_node *tree;
+  uint64_t start, total = 0, cnt;
+
+  for (cnt = 0; cnt < iters; cnt++) {
+    start = bench_nsec();
+    tree = get_node((char *)arg, ".", 1, 1);
+    total += bench_nsec() - start;
+    free_node(tree);
+  }
+  *ops = 1;
+  return total;
+}
+
+uint64_t bench_change_node(void *arg, uint64_t iters, uint64_t *ops)
+{
+  uint64_t start, cnt;
+
+  start = bench_nsec();
+  for (cnt = 0; cnt < iters; cnt++) {
+    change_node(0);
+  }
+  *ops = 1;
+  return bench_nsec() - start;
+}
+
+void bench_disk_tree(int entries)
+{
+  struct bench_result res;
+  char params[128], extra[128], dir[PATH_SIZ];
+  unsigned long nodes;
+
+  if (!bench_want("get_node") && !bench_want("change_node")) {
+    return;
+  }
+  if (snprintf(dir, sizeof(dir), "%s/tree%d", bench_dir,
+	       entries) >= (int)sizeof(dir)) {
+    return;
+  }
+  if (bench_make_disk_tree(dir, entries) == -1) {
+    perror("bench_make_disk_tree");
+    bench_rmtree(dir);
+    return;
+  }
+  snprintf(params, sizeof(params), "\"entries\": %d, \"fanout\": %d",
+	   entries, BENCH_FANOUT);
+
+  root_node = get_node(dir, ".", 1, 1);
+  nodes = bench_count_nodes(root_node);
+
+  if (bench_want("get_node")) {
+    snprintf(extra, sizeof(extra), "\"nodes\": %lu, \"bytes\": %lu",
+	     nodes, nodes * (unsigned long)sizeof(f_node));
+    bench_run(bench_get_node, dir, &res);
+    bench_report("get_node", params, &res, 0, extra);
+  }
+
+  if (bench_want("change_node")) {
+    strlcpy(tftpd_root, dir, PATH_SIZ);
+    bench_run(bench_change_node, NULL, &res);
+    bench_report("change_node", params, &res, 0, NULL);
+  }
+
+  free_node(root_node);
+  root_node = NULL;
+  bench_rmtree(dir);
+}
+
+/*
+ * divide_token
+ */
+static const char *bench_token_paths[] = {
+  "./pxelinux.0",
+  "./pxelinux.cfg/default",
+  "./images/x86_64/boot/vmlinuz-2.6.32",
+  "./a/b/c/d/e/f/g/h/i/j/k/l/m/n/o/p/firmware.bin",
+  NULL
+};
+
+uint64_t bench_divide_token(void *arg, uint64_t iters, uint64_t *ops)
+{
+  const char *src = arg;
+  char path[PATH_SIZ];
+  size_t len = strlen(src) + 1;
+  uint64_t start, cnt;
+
+  start = bench_nsec();
+  for (cnt = 0; cnt < iters; cnt++) {
+    memcpy(path, src, len);
+    divide_token(path, '/');
+  }
+  *ops = 1;
+  return bench_nsec() - start;
+}
+
+void bench_tokens(void)
+{
+  struct bench_result res;
+  char params[128];
+  const char *cptr;
+  int cnt, parts;
+
+  if (!bench_want("divide_token")) {
+    return;
+  }
+  for (cnt = 0; bench_token_paths[cnt] != NULL; cnt++) {
+    parts = 1;
+    for (cptr = bench_token_paths[cnt]; *cptr != '\0'; cptr++) {
+      parts += (*cptr == '/');
+    }
+    snprintf(params, sizeof(params), "\"length\": %d, \"components\": %d",
+	     (int)strlen(bench_token_paths[cnt]), parts);
+    bench_run(bench_divide_token, (void *)bench_token_paths[cnt], &res);
+    bench_report("divide_token", params, &res, 0, NULL);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  int mem_sizes[BENCH_MAX_SIZES] = {1000, 10000, 100000, 1000000};
+  int disk_sizes[BENCH_MAX_SIZES] = {1000, 10000};
+  int num_mem = 4, num_disk = 2, cnt, ch;
+  size_t text_size = BENCH_TEXT_SIZE;
+  const char *tmp = "/tmp";
+  const char *output = NULL;
+
+  while ((ch = getopt(argc, argv, "f:g:ho:r:s:t:T:")) != -1) {
+    switch (ch) {
+    case 'f':
+      bench_filter = optarg;
+      break;
+    case 'g':
+      num_disk = bench_parse_list(optarg, disk_sizes, BENCH_MAX_SIZES);
+      break;
+    case 's':
+      num_mem = bench_parse_list(optarg, mem_sizes, BENCH_MAX_SIZES);
+      break;
+    case 'o':
+      output = optarg;
+      break;
+    case 'r':
+      bench_reps = atoi(optarg);
+      break;
+    case 't':
+      text_size = (size_t)atol(optarg);
+      break;
+    case 'T':
+      tmp = optarg;
+      break;
+    default:
+      bench_usage(argv[0]);
+      exit(1);
+    }
+  }
+  if (num_mem < 0 || num_disk < 0 || bench_reps < 1 ||
+      bench_reps > BENCH_MAX_REPS || text_size == 0) {
+    bench_usage(argv[0]);
+    exit(1);
+  }
+
+  out = stdout;
+  if (output != NULL && (out = fopen(output, "w")) == NULL) {
+    perror(output);
+    exit(1);
+  }
+
+  snprintf(bench_dir, sizeof(bench_dir), "%s/t-tftpd-bench.XXXXXX", tmp);
+  if (mkdtemp(bench_dir) == NULL) {
+    perror(bench_dir);
+    exit(1);
+  }
+
+  /* the netascii routines keep their state in the thread's data. */
+  pthread_once(&thread_once, fun_thread_once);
+  bench_thread = (tftpd_thread *)malloc(sizeof(tftpd_thread));
+  memset(bench_thread, 0, sizeof(tftpd_thread));
+  pthread_setspecific(thread_key, bench_thread);
+
+  fprintf(out, "{\n  \"program\": \"t-tftpd-bench\", \"version\": \"%s\", "
+	  "\"reps\": %d,\n  \"benchmarks\": [", VERSION, bench_reps);
+
+  bench_ascii(text_size);
+  for (cnt = 0; cnt < num_mem; cnt++) {
+    bench_lookup(mem_sizes[cnt], mem_sizes[cnt]);
+    if (mem_sizes[cnt] > BENCH_FANOUT) {
+      bench_lookup(mem_sizes[cnt], BENCH_FANOUT);
+    }
+  }
+  for (cnt = 0; cnt < num_disk; cnt++) {
+    bench_disk_tree(disk_sizes[cnt]);
+  }
+  bench_tokens();
+
+  fprintf(out, "\n  ]\n}\n");
+  if (out != stdout) {
+    fclose(out);
+  }
+  bench_rmtree(bench_dir);
+  return 0;
+}
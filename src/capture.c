@@ -0,0 +1,155 @@
+/*
+   capture.c
+   $Id$
+
+   This file is part of t-tftpd.
+
+   Copyright 2002,2007 Tomofumi Hayashi <s1061123@gmail.com>.
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+   3. All advertising materials mentioning features or use of this software
+      must display the following acknowledgement:
+
+        This product includes software developed by
+        Tomofumi Hayashi <s1061123@gmail.com> and its contributors.
+
+   4. Neither the name of authors nor the names of its contributors may be used
+      to endorse or promote products derived from this software without
+      specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND ANY
+   EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+#include "capture.h"
+
+static int capture_fd = -1;
+
+/*
+ * Return: 0 on success, -1 on error.
+ */
+int capture_open(const char *path)
+{
+  struct capture_header hdr;
+  struct stat st;
+
+  capture_fd = open(path, O_WRONLY|O_CREAT|O_APPEND, 0644);
+  if (capture_fd == -1) {
+    perror("capture open");
+    return -1;
+  }
+
+  if (fstat(capture_fd, &st) == 0 && st.st_size == 0) {
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, CAPTURE_MAGIC, sizeof(hdr.magic));
+    hdr.version = CAPTURE_VERSION;
+    hdr.record_size = sizeof(struct capture_record);
+    if (write(capture_fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+      perror("capture write");
+      close(capture_fd);
+      capture_fd = -1;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int capture_enabled(void)
+{
+  return capture_fd != -1;
+}
+
+uint64_t capture_now(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/*
+ * FNV-1a of the address, so clients can be told apart in the replay
+ * without the file carrying their addresses.
+ */
+uint32_t capture_client(const struct sockaddr *sa)
+{
+  const unsigned char *cp;
+  uint32_t hash = 2166136261U;
+  size_t len, cnt;
+
+  switch (sa->sa_family) {
+  case AF_INET:
+    cp = (const unsigned char *)&((const struct sockaddr_in *)sa)->sin_addr;
+    len = sizeof(struct in_addr);
+    break;
+#ifdef AF_INET6
+  case AF_INET6:
+    cp = (const unsigned char *)&((const struct sockaddr_in6 *)sa)->sin6_addr;
+    len = sizeof(struct in6_addr);
+    break;
+#endif
+  default:
+    return 0;
+  }
+  for (cnt = 0; cnt < len; cnt++) {
+    hash = (hash ^ cp[cnt]) * 16777619U;
+  }
+  return hash;
+}
+
+/*
+ * One writev() per request, O_APPEND keeps the records of concurrent
+ * sessions from overwriting each other.
+ */
+void capture_write(struct capture_record *rec, const char *request)
+{
+  struct iovec iov[2];
+  ssize_t len;
+
+  if (capture_fd == -1) {
+    return;
+  }
+  if (rec->request_len > CAPTURE_REQUEST_MAX) {
+    rec->request_len = CAPTURE_REQUEST_MAX;
+  }
+  rec->reserved = 0;
+  iov[0].iov_base = rec;
+  iov[0].iov_len = sizeof(struct capture_record);
+  iov[1].iov_base = (void *)request;
+  iov[1].iov_len = rec->request_len;
+  len = sizeof(struct capture_record) + rec->request_len;
+  if (writev(capture_fd, iov, 2) != len) {
+    perror("capture write");
+  }
+}
@@ -0,0 +1,97 @@
+/*
+   capture.h
+   $Id$
+
+   This file is part of t-tftpd.
+
+   Copyright 2002,2007 Tomofumi Hayashi <s1061123@gmail.com>.
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+   3. All advertising materials mentioning features or use of this software
+      must display the following acknowledgement:
+
+        This product includes software developed by
+        Tomofumi Hayashi <s1061123@gmail.com> and its contributors.
+
+   4. Neither the name of authors nor the names of its contributors may be used
+      to endorse or promote products derived from this software without
+      specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND ANY
+   EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+/*
+ * Request capture for t-tftpd-replay.
+ * The file starts with a capture_header, every request is a
+ * capture_record in host byte order followed by request_len bytes of
+ * the request after the opcode: filename, mode and options, each NUL
+ * terminated.  Records are written when the session ends, so they are
+ * not in arrival order.
+ */
+#define CAPTURE_MAGIC "TTCP"
+#define CAPTURE_VERSION 1
+#define CAPTURE_REQUEST_MAX 512
+
+/* outcome of a request */
+#define CAPTURE_OK 0
+#define CAPTURE_ABORTED 1            /* timed out or the client went away */
+#define CAPTURE_ERROR(code) (0x100 | (code))  /* ERROR packet sent */
+#define CAPTURE_IS_ERROR(out) (((out) & 0x100) != 0)
+#define CAPTURE_ERROR_CODE(out) ((out) & 0xff)
+
+struct capture_header {
+  char magic[4];
+  uint16_t version;
+  uint16_t record_size;
+};
+
+struct capture_record {
+  uint64_t time;         /* arrival, usec since the epoch */
+  uint64_t bytes;        /* bytes sent or received */
+  uint32_t client;       /* hash of the client address, not the port */
+  uint32_t latency;      /* usec from the arrival to the end */
+  uint16_t opcode;       /* RRQ or WRQ */
+  uint16_t outcome;
+  uint16_t request_len;
+  uint16_t reserved;
+};
+
+int capture_open(const char *path);
+int capture_enabled(void);
+uint64_t capture_now(void);
+uint32_t capture_client(const struct sockaddr *sa);
+void capture_write(struct capture_record *rec, const char *request);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* !_CAPTURE_H_ */
@@ -0,0 +1,218 @@
+/*
+   dedup.c
+   $Id$
+
+   This file is part of t-tftpd.
+
+   Copyright 2002,2007 Tomofumi Hayashi <s1061123@gmail.com>.
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+   3. All advertising materials mentioning features or use of this software
+      must display the following acknowledgement:
+
+        This product includes software developed by
+        Tomofumi Hayashi <s1061123@gmail.com> and its contributors.
+
+   4. Neither the name of authors nor the names of its contributors may be used
+      to endorse or promote products derived from this software without
+      specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND ANY
+   EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include "dedup.h"
+
+#define DEDUP_HASH 256
+
+struct dedup_entry {
+  int family;
+  unsigned char addr[16];
+  in_port_t port;
+  int opcode;
+  char *filename;
+  uint64_t done;     /* usec when it ended well, 0 while in progress */
+  struct dedup_entry *next;
+};
+
+static pthread_mutex_t dedup_mutex = PTHREAD_MUTEX_INITIALIZER;
+static dedup_entry *dedup_hash[DEDUP_HASH];
+static unsigned long total_active = 0, total_done = 0;
+
+static uint64_t dedup_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void dedup_key(const struct sockaddr *sa, dedup_entry *e)
+{
+  memset(e->addr, 0, sizeof(e->addr));
+  e->family = sa->sa_family;
+  e->port = 0;
+  if (sa->sa_family == AF_INET) {
+    memcpy(e->addr, &((struct sockaddr_in *)sa)->sin_addr, 4);
+    e->port = ((struct sockaddr_in *)sa)->sin_port;
+  }
+  else if (sa->sa_family == AF_INET6) {
+    memcpy(e->addr, &((struct sockaddr_in6 *)sa)->sin6_addr, 16);
+    e->port = ((struct sockaddr_in6 *)sa)->sin6_port;
+  }
+}
+
+static unsigned int dedup_index(const dedup_entry *e, const char *filename)
+{
+  unsigned int hash;
+  const unsigned char *cp;
+  int cnt;
+
+  hash = e->family * 31 + e->port + e->opcode;
+  for (cnt = 0; cnt < 16; cnt++) {
+    hash = hash * 31 + e->addr[cnt];
+  }
+  for (cp = (const unsigned char *)filename; *cp != '\0'; cp++) {
+    hash = hash * 31 + *cp;
+  }
+  return hash % DEDUP_HASH;
+}
+
+/*
+ * Enter a request into the table, arrived is when it came into the
+ * socket buffer (usec, CLOCK_MONOTONIC).
+ * Return: DEDUP_NEW with *ep set, which dedup_leave() takes at the end
+ * of the session.  DEDUP_ACTIVE or DEDUP_DONE when it is a copy of a
+ * request in progress or just served, then *ep is NULL.
+ */
+enum dedup_result dedup_enter(dedup_entry **ep, const struct sockaddr *client,
+                              int opcode, const char *filename,
+                              uint64_t arrived)
+{
+  dedup_entry key, *e, **prev;
+  enum dedup_result ret;
+  unsigned int idx;
+  uint64_t now;
+
+  *ep = NULL;
+  dedup_key(client, &key);
+  key.opcode = opcode;
+  idx = dedup_index(&key, filename);
+  now = dedup_now();
+
+  pthread_mutex_lock(&dedup_mutex);
+  prev = &dedup_hash[idx];
+  while ((e = *prev) != NULL) {
+    if (e->done != 0 && now - e->done >= DEDUP_LINGER) {
+      goto drop;
+    }
+    if (e->family == key.family && e->port == key.port &&
+        e->opcode == key.opcode &&
+        memcmp(e->addr, key.addr, sizeof(key.addr)) == 0 &&
+        strcmp(e->filename, filename) == 0) {
+      if (e->done == 0) {
+        ret = DEDUP_ACTIVE;
+        total_active++;
+      }
+      else if (arrived < e->done) {
+        ret = DEDUP_DONE;
+        total_done++;
+      }
+      else {
+        goto drop;
+      }
+      pthread_mutex_unlock(&dedup_mutex);
+      return ret;
+    }
+    prev = &e->next;
+    continue;
+
+  drop:
+    *prev = e->next;
+    free(e->filename);
+    free(e);
+  }
+
+  /* without memory, the request goes on without the check. */
+  if ((e = (dedup_entry *)malloc(sizeof(dedup_entry))) != NULL) {
+    *e = key;
+    if ((e->filename = strdup(filename)) == NULL) {
+      free(e);
+      e = NULL;
+    }
+  }
+  if (e != NULL) {
+    e->done = 0;
+    e->next = dedup_hash[idx];
+    dedup_hash[idx] = e;
+    *ep = e;
+  }
+  pthread_mutex_unlock(&dedup_mutex);
+  return DEDUP_NEW;
+}
+
+/*
+ * The session of e has ended.  An aborted one leaves the table at once,
+ * the client may well start it again.
+ */
+void dedup_leave(dedup_entry *e, int finished)
+{
+  dedup_entry **prev;
+  unsigned int idx;
+
+  if (e == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&dedup_mutex);
+  if (finished) {
+    e->done = dedup_now();
+    pthread_mutex_unlock(&dedup_mutex);
+    return;
+  }
+  idx = dedup_index(e, e->filename);
+  for (prev = &dedup_hash[idx]; *prev != NULL; prev = &(*prev)->next) {
+    if (*prev == e) {
+      *prev = e->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&dedup_mutex);
+  free(e->filename);
+  free(e);
+}
+
+void dedup_total_stat(unsigned long *active, unsigned long *done)
+{
+  pthread_mutex_lock(&dedup_mutex);
+  *active = total_active;
+  *done = total_done;
+  pthread_mutex_unlock(&dedup_mutex);
+}
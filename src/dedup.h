@@ -0,0 +1,78 @@
+/*
+   dedup.h
+   $Id$
+
+   This file is part of t-tftpd.
+
+   Copyright 2002,2007 Tomofumi Hayashi <s1061123@gmail.com>.
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+   3. All advertising materials mentioning features or use of this software
+      must display the following acknowledgement:
+
+        This product includes software developed by
+        Tomofumi Hayashi <s1061123@gmail.com> and its contributors.
+
+   4. Neither the name of authors nor the names of its contributors may be used
+      to endorse or promote products derived from this software without
+      specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND ANY
+   EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _DEDUP_H_
+#define _DEDUP_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/*
+ * Table of the sessions in progress, keyed by the client address and
+ * port, the opcode and the file name.  A client resending its request
+ * because the first DATA (or ACK) is late gets the one session, the
+ * request it sent again is dropped.  A session which ended well stays
+ * in the table for DEDUP_LINGER, so a copy of its request which arrived
+ * before the end (and waited for a thread) does not start it over for
+ * a client which is gone.  One which arrived after the end is a new
+ * request from a port used again.
+ */
+#define DEDUP_LINGER 2000000  /* usec, TIMEOUT of tftpd.c */
+
+enum dedup_result {DEDUP_NEW, DEDUP_ACTIVE, DEDUP_DONE};
+
+typedef struct dedup_entry dedup_entry;
+
+enum dedup_result dedup_enter(dedup_entry **ep, const struct sockaddr *client,
+                              int opcode, const char *filename,
+                              uint64_t arrived);
+void dedup_leave(dedup_entry *e, int finished);
+void dedup_total_stat(unsigned long *active, unsigned long *done);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* !_DEDUP_H_ */
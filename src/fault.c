@@ -0,0 +1,399 @@
+/*
+   fault.c
+   $Id$
+
+   This file is part of t-tftpd.
+
+   Copyright 2002,2007 Tomofumi Hayashi <s1061123@gmail.com>.
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+   3. All advertising materials mentioning features or use of this software
+      must display the following acknowledgement:
+
+        This product includes software developed by
+        Tomofumi Hayashi <s1061123@gmail.com> and its contributors.
+
+   4. Neither the name of authors nor the names of its contributors may be used
+      to endorse or promote products derived from this software without
+      specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND ANY
+   EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "fault.h"
+
+struct fault_config {
+  double loss, dup, delay, reorder;  /* probability */
+  int delay_msec, hold_msec;
+  uint32_t seed;
+  int dir;
+};
+
+static int fault_on = 0;
+static struct fault_config fc = {
+  0, 0, 0, 0, FAULT_DEFAULT_DELAY, FAULT_DEFAULT_HOLD, 1,
+  FAULT_SEND|FAULT_RECV
+};
+
+static uint64_t fault_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static double fault_rand(struct fault_state *fs)
+{
+  fs->seed ^= fs->seed << 13;
+  fs->seed ^= fs->seed >> 17;
+  fs->seed ^= fs->seed << 5;
+  return (double)fs->seed / 4294967296.0;
+}
+
+/*
+ * Return: 0 on success, -1 on error.
+ */
+int fault_config(const char *spec)
+{
+  char *str, *cp, *value, *end;
+
+  if ((str = strdup(spec)) == NULL) {
+    return -1;
+  }
+  for (cp = strtok(str, ","); cp != NULL; cp = strtok(NULL, ",")) {
+    if ((value = strchr(cp, '=')) == NULL) {
+      goto error;
+    }
+    *value++ = '\0';
+    if (strcmp(cp, "loss") == 0) {
+      fc.loss = strtod(value, &end);
+    }
+    else if (strcmp(cp, "dup") == 0) {
+      fc.dup = strtod(value, &end);
+    }
+    else if (strcmp(cp, "delay") == 0) {
+      fc.delay = strtod(value, &end);
+      if (*end == ':') {
+        fc.delay_msec = strtol(end + 1, &end, 10);
+      }
+    }
+    else if (strcmp(cp, "reorder") == 0) {
+      fc.reorder = strtod(value, &end);
+      if (*end == ':') {
+        fc.hold_msec = strtol(end + 1, &end, 10);
+      }
+    }
+    else if (strcmp(cp, "seed") == 0) {
+      fc.seed = strtoul(value, &end, 10);
+    }
+    else if (strcmp(cp, "dir") == 0) {
+      end = value + strlen(value);
+      if (strcmp(value, "send") == 0) {
+        fc.dir = FAULT_SEND;
+      }
+      else if (strcmp(value, "recv") == 0) {
+        fc.dir = FAULT_RECV;
+      }
+      else if (strcmp(value, "both") == 0) {
+        fc.dir = FAULT_SEND|FAULT_RECV;
+      }
+      else {
+        goto error;
+      }
+    }
+    else {
+      goto error;
+    }
+    if (*end != '\0') {
+      goto error;
+    }
+  }
+  free(str);
+
+  if (fc.loss < 0 || fc.loss > 1 || fc.dup < 0 || fc.dup > 1 ||
+      fc.delay < 0 || fc.delay > 1 || fc.reorder < 0 || fc.reorder > 1 ||
+      fc.delay_msec < 0 || fc.hold_msec < 0) {
+    return -1;
+  }
+  fault_on = 1;
+  return 0;
+
+ error:
+  free(str);
+  return -1;
+}
+
+int fault_enabled(void)
+{
+  return fault_on;
+}
+
+void fault_start(struct fault_state *fs, uint64_t session)
+{
+  memset(fs, 0, sizeof(*fs));
+  fs->seed = fc.seed ^ (uint32_t)(session * 2654435761U);
+  if (fs->seed == 0) {
+    fs->seed = 1;
+  }
+}
+
+/*
+ * Return: 0 when queued, -1 when the queue is full.
+ */
+static int fault_queue(struct fault_queue *q, const void *buf, size_t len,
+                       uint64_t due, int held)
+{
+  struct fault_packet *pkt;
+
+  if (q->count == FAULT_QUEUE) {
+    return -1;
+  }
+  pkt = &q->pkt[q->count];
+  if ((pkt->data = malloc(len)) == NULL) {
+    return -1;
+  }
+  memcpy(pkt->data, buf, len);
+  pkt->len = len;
+  pkt->due = due;
+  pkt->held = held;
+  q->count++;
+  return 0;
+}
+
+static void fault_dequeue(struct fault_queue *q, int idx)
+{
+  free(q->pkt[idx].data);
+  q->count--;
+  memmove(&q->pkt[idx], &q->pkt[idx + 1],
+          sizeof(struct fault_packet) * (q->count - idx));
+}
+
+/* the packets held for reordering go after the one just passed. */
+static void fault_release(struct fault_queue *q, uint64_t now)
+{
+  int cnt;
+
+  for (cnt = 0; cnt < q->count; cnt++) {
+    if (q->pkt[cnt].held) {
+      q->pkt[cnt].held = 0;
+      q->pkt[cnt].due = now;
+    }
+  }
+}
+
+static void fault_send_due(struct fault_state *fs, int s, uint64_t now)
+{
+  int cnt;
+
+  for (cnt = 0; cnt < fs->out.count; ) {
+    if (fs->out.pkt[cnt].due <= now) {
+      send(s, fs->out.pkt[cnt].data, fs->out.pkt[cnt].len, 0);
+      fault_dequeue(&fs->out, cnt);
+    }
+    else {
+      cnt++;
+    }
+  }
+}
+
+/*
+ * Decide what happens to a packet.
+ * Return: 0 pass, 1 lost, 2 queued; *dup is set for a duplicate.
+ */
+static int fault_judge(struct fault_state *fs, struct fault_queue *q,
+                       const void *buf, size_t len, int *dup)
+{
+  uint64_t now = fault_now();
+
+  *dup = 0;
+  if (fault_rand(fs) < fc.loss) {
+    fs->lost++;
+    return 1;
+  }
+  if (fault_rand(fs) < fc.delay &&
+      fault_queue(q, buf, len, now + fc.delay_msec * 1000ULL, 0) == 0) {
+    fs->delayed++;
+    return 2;
+  }
+  if (fault_rand(fs) < fc.reorder &&
+      fault_queue(q, buf, len, now + fc.hold_msec * 1000ULL, 1) == 0) {
+    fs->reordered++;
+    return 2;
+  }
+  if (fault_rand(fs) < fc.dup) {
+    fs->duplicated++;
+    *dup = 1;
+  }
+  return 0;
+}
+
+ssize_t fault_send(struct fault_state *fs, int s, const void *buf, size_t len)
+{
+  ssize_t ret;
+  int dup;
+
+  if (!fault_on || !(fc.dir & FAULT_SEND)) {
+    return send(s, buf, len, 0);
+  }
+  if (fault_judge(fs, &fs->out, buf, len, &dup) != 0) {
+    /* as far as the caller knows, it has gone. */
+    return len;
+  }
+  ret = send(s, buf, len, 0);
+  if (dup) {
+    send(s, buf, len, 0);
+  }
+  fault_release(&fs->out, 0);
+  fault_send_due(fs, s, fault_now());
+  return ret;
+}
+
+/*
+ * A lost packet is still returned, with opcode 0, which the transfer
+ * loops skip like any other stray packet before they wait again.
+ */
+ssize_t fault_recv(struct fault_state *fs, int s, void *buf, size_t len)
+{
+  struct fault_packet *pkt;
+  ssize_t ret;
+  uint64_t now;
+  int cnt, judge, dup;
+
+  if (!fault_on || !(fc.dir & FAULT_RECV)) {
+    return recv(s, buf, len, 0);
+  }
+
+  now = fault_now();
+  for (cnt = 0; cnt < fs->in.count; cnt++) {
+    pkt = &fs->in.pkt[cnt];
+    if (!pkt->held && pkt->due <= now) {
+      ret = pkt->len < len ? pkt->len : len;
+      memcpy(buf, pkt->data, ret);
+      fault_dequeue(&fs->in, cnt);
+      return ret;
+    }
+  }
+
+  ret = recv(s, buf, len, 0);
+  if (ret < 4) {
+    return ret;
+  }
+  judge = fault_judge(fs, &fs->in, buf, ret, &dup);
+  if (judge != 0) {
+    memset(buf, 0, 2);
+    return ret;
+  }
+  if (dup) {
+    fault_queue(&fs->in, buf, ret, now, 0);
+  }
+  fault_release(&fs->in, now);
+  return ret;
+}
+
+/*
+ * poll() for the one transfer socket, which also sends the queued
+ * packets when they are due and reports the queued incoming ones.
+ */
+int fault_poll(struct fault_state *fs, struct pollfd *pfd, int timeout)
+{
+  uint64_t now, deadline, next;
+  int cnt, ret;
+
+  if (!fault_on) {
+    return poll(pfd, 1, timeout);
+  }
+
+  now = fault_now();
+  deadline = now + timeout * 1000ULL;
+  for (;;) {
+    fault_send_due(fs, pfd->fd, now);
+    next = deadline;
+    for (cnt = 0; cnt < fs->out.count; cnt++) {
+      if (fs->out.pkt[cnt].due < next) {
+        next = fs->out.pkt[cnt].due;
+      }
+    }
+    if (pfd->events & POLLIN) {
+      for (cnt = 0; cnt < fs->in.count; cnt++) {
+        if (fs->in.pkt[cnt].due <= now) {
+          /* a held one is due after its time is up as well. */
+          fs->in.pkt[cnt].held = 0;
+          pfd->revents = POLLIN;
+          return 1;
+        }
+        if (fs->in.pkt[cnt].due < next) {
+          next = fs->in.pkt[cnt].due;
+        }
+      }
+    }
+    if (now >= deadline) {
+      return 0;
+    }
+
+    ret = poll(pfd, 1, (int)((next - now + 999) / 1000));
+    if (ret != 0) {
+      return ret;
+    }
+    now = fault_now();
+  }
+}
+
+/*
+ * The session is over: packets still queued to send go out when due,
+ * the incoming ones are dropped.  With s of -1, all of them are.
+ */
+void fault_finish(struct fault_state *fs, int s)
+{
+  uint64_t now;
+  int cnt;
+
+  if (!fault_on) {
+    return;
+  }
+  while (s != -1 && fs->out.count > 0) {
+    now = fault_now();
+    fault_send_due(fs, s, now);
+    if (fs->out.count > 0) {
+      for (cnt = 0; cnt < fs->out.count; cnt++) {
+        fs->out.pkt[cnt].held = 0;
+      }
+      usleep(1000);
+    }
+  }
+  while (fs->out.count > 0) {
+    fault_dequeue(&fs->out, 0);
+  }
+  while (fs->in.count > 0) {
+    fault_dequeue(&fs->in, 0);
+  }
+}
@@ -0,0 +1,101 @@
+/*
+   fault.h
+   $Id$
+
+   This file is part of t-tftpd.
+
+   Copyright 2002,2007 Tomofumi Hayashi <s1061123@gmail.com>.
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+   3. All advertising materials mentioning features or use of this software
+      must display the following acknowledgement:
+
+        This product includes software developed by
+        Tomofumi Hayashi <s1061123@gmail.com> and its contributors.
+
+   4. Neither the name of authors nor the names of its contributors may be used
+      to endorse or promote products derived from this software without
+      specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND ANY
+   EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _FAULT_H_
+#define _FAULT_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <poll.h>
+
+/*
+ * Fault injection on the transfer sockets, for retransmission tests on
+ * loopback.  -F takes "loss=P,dup=P,delay=P:MS,reorder=P:MS,seed=N,
+ * dir=send|recv|both", P a probability.  A delayed packet goes MS
+ * later, a reordered one goes after the next packet of the session (at
+ * most MS later).  The random numbers of a session only depend on the
+ * seed and the session number, so a run can be repeated.
+ *
+ * The queued packets are delivered from fault_poll(), which the
+ * transfer loops call instead of poll() while they wait.
+ */
+#define FAULT_QUEUE 8
+#define FAULT_DEFAULT_DELAY 10   /* msec */
+#define FAULT_DEFAULT_HOLD 50    /* msec, for reorder */
+
+#define FAULT_SEND 0x01
+#define FAULT_RECV 0x02
+
+struct fault_packet {
+  uint64_t due;      /* usec, CLOCK_MONOTONIC */
+  int held;          /* goes after the next packet */
+  size_t len;
+  char *data;
+};
+
+struct fault_queue {
+  int count;
+  struct fault_packet pkt[FAULT_QUEUE];
+};
+
+struct fault_state {
+  uint32_t seed;
+  struct fault_queue out;   /* to be sent */
+  struct fault_queue in;    /* to be received */
+  unsigned long lost, duplicated, delayed, reordered;
+};
+
+int fault_config(const char *spec);
+int fault_enabled(void);
+void fault_start(struct fault_state *fs, uint64_t session);
+void fault_finish(struct fault_state *fs, int s);
+ssize_t fault_send(struct fault_state *fs, int s, const void *buf, size_t len);
+ssize_t fault_recv(struct fault_state *fs, int s, void *buf, size_t len);
+int fault_poll(struct fault_state *fs, struct pollfd *pfd, int timeout);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* !_FAULT_H_ */
@@ -0,0 +1,326 @@
+/*
+   fdcache.c
+   $Id$
+
+   This file is part of t-tftpd.
+
+   Copyright 2002,2007 Tomofumi Hayashi <s1061123@gmail.com>.
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+   3. All advertising materials mentioning features or use of this software
+      must display the following acknowledgement:
+
+        This product includes software developed by
+        Tomofumi Hayashi <s1061123@gmail.com> and its contributors.
+
+   4. Neither the name of authors nor the names of its contributors may be used
+      to endorse or promote products derived from this software without
+      specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND ANY
+   EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "fdcache.h"
+
+struct fd_entry {
+  fd_entry *next;             /* in the hash chain */
+  fd_entry *older, *newer;    /* in the LRU list, while refs is 0 */
+  char path[FDC_PATH_SIZ];
+  int fd;
+  struct stat st;
+  unsigned long gen;          /* of the tree it was last looked up in */
+  int refs;
+  int stale;                  /* out of the hash, closed with the last ref */
+};
+
+static int fdc_max = FDC_DEFAULT_MAX;
+static fd_entry *fdc_hash[FDC_HASH_SIZE];
+static fd_entry *lru_old = NULL, *lru_new = NULL;
+static int fdc_count = 0;     /* open, stale ones too */
+static pthread_mutex_t fdc_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long fdc_hits = 0, fdc_checked = 0, fdc_opened = 0;
+
+static void fdc_close(fd_entry *e);
+
+/*
+ * Return: 0 on success, -1 on error.
+ */
+int fdc_config(int max)
+{
+  if (max < 0 || max > FDC_MAX) {
+    return -1;
+  }
+  /* a smaller budget of a reload closes the ones over it now. */
+  pthread_mutex_lock(&fdc_mutex);
+  fdc_max = max;
+  while (fdc_count > fdc_max && lru_old != NULL) {
+    fdc_close(lru_old);
+  }
+  pthread_mutex_unlock(&fdc_mutex);
+  return 0;
+}
+
+int fdc_enabled(void)
+{
+  return fdc_max > 0;
+}
+
+static unsigned int fdc_hash_path(const char *path)
+{
+  unsigned int h = 2166136261U;
+
+  for (; *path != '\0'; path++) {
+    h = (h ^ (unsigned char)*path) * 16777619U;
+  }
+  return h % FDC_HASH_SIZE;
+}
+
+/* called with fdc_mutex held. */
+static fd_entry *fdc_find(const char *path)
+{
+  fd_entry *e;
+
+  for (e = fdc_hash[fdc_hash_path(path)]; e != NULL; e = e->next) {
+    if (strcmp(e->path, path) == 0) {
+      return e;
+    }
+  }
+  return NULL;
+}
+
+static void fdc_unhash(fd_entry *e)
+{
+  fd_entry **ep;
+
+  for (ep = &fdc_hash[fdc_hash_path(e->path)]; *ep != NULL;
+       ep = &(*ep)->next) {
+    if (*ep == e) {
+      *ep = e->next;
+      break;
+    }
+  }
+  e->stale = 1;
+}
+
+static void lru_remove(fd_entry *e)
+{
+  if (e->older != NULL) {
+    e->older->newer = e->newer;
+  }
+  else {
+    lru_old = e->newer;
+  }
+  if (e->newer != NULL) {
+    e->newer->older = e->older;
+  }
+  else {
+    lru_new = e->older;
+  }
+  e->older = e->newer = NULL;
+}
+
+static void lru_append(fd_entry *e)
+{
+  e->older = lru_new;
+  e->newer = NULL;
+  if (lru_new != NULL) {
+    lru_new->newer = e;
+  }
+  else {
+    lru_old = e;
+  }
+  lru_new = e;
+}
+
+/* an entry no session uses. */
+static void fdc_close(fd_entry *e)
+{
+  if (!e->stale) {
+    lru_remove(e);
+    fdc_unhash(e);
+  }
+  close(e->fd);
+  free(e);
+  fdc_count--;
+}
+
+static void fdc_ref(fd_entry *e)
+{
+  if (e->refs++ == 0) {
+    lru_remove(e);
+  }
+}
+
+/*
+ * The file of path when it was opened in the tree gen.
+ * Return: its descriptor, with *entry to release, -1 when it is not
+ * open for gen (the caller looks it up and calls fdc_open()).
+ */
+int fdc_get(const char *path, unsigned long gen, fd_entry **entry)
+{
+  fd_entry *e;
+
+  pthread_mutex_lock(&fdc_mutex);
+  e = fdc_find(path);
+  if (e == NULL || e->gen != gen) {
+    pthread_mutex_unlock(&fdc_mutex);
+    return -1;
+  }
+  fdc_ref(e);
+  fdc_hits++;
+  pthread_mutex_unlock(&fdc_mutex);
+  *entry = e;
+  return e->fd;
+}
+
+/*
+ * Open path, found in the tree gen, for reading.
+ * Return: the descriptor, -1 on error.  *entry is the entry to release,
+ * or NULL when the descriptor is the caller's to close().
+ */
+int fdc_open(const char *path, unsigned long gen, fd_entry **entry)
+{
+  fd_entry *e;
+  struct stat st;
+  int fd;
+
+  *entry = NULL;
+  if (strlen(path) >= FDC_PATH_SIZ) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&fdc_mutex);
+  if ((e = fdc_find(path)) != NULL) {
+    /* the one kept is good while path is still the same file. */
+    if (e->gen == gen) {
+      fdc_hits++;
+    }
+    else if (stat(path, &st) == 0 && st.st_dev == e->st.st_dev &&
+             st.st_ino == e->st.st_ino && st.st_size == e->st.st_size &&
+             st.st_mtime == e->st.st_mtime) {
+      e->st = st;
+      e->gen = gen;
+      fdc_checked++;
+    }
+    else if (e->refs == 0) {
+      fdc_close(e);
+      e = NULL;
+    }
+    else {
+      fdc_unhash(e);
+      e = NULL;
+    }
+    if (e != NULL) {
+      fdc_ref(e);
+      pthread_mutex_unlock(&fdc_mutex);
+      *entry = e;
+      return e->fd;
+    }
+  }
+  pthread_mutex_unlock(&fdc_mutex);
+
+  if ((fd = open(path, O_RDONLY)) == -1) {
+    return -1;
+  }
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+      (e = malloc(sizeof(fd_entry))) == NULL) {
+    return fd;
+  }
+  strcpy(e->path, path);
+  e->fd = fd;
+  e->st = st;
+  e->gen = gen;
+  e->refs = 1;
+  e->stale = 0;
+  e->older = e->newer = NULL;
+
+  pthread_mutex_lock(&fdc_mutex);
+  fdc_opened++;
+  if (fdc_find(path) != NULL) {
+    /* opened by another session meanwhile, this one is not kept. */
+    pthread_mutex_unlock(&fdc_mutex);
+    free(e);
+    return fd;
+  }
+  while (fdc_count >= fdc_max && lru_old != NULL) {
+    fdc_close(lru_old);
+  }
+  if (fdc_count >= fdc_max) {
+    /* all of them are in use. */
+    pthread_mutex_unlock(&fdc_mutex);
+    free(e);
+    return fd;
+  }
+  e->next = fdc_hash[fdc_hash_path(path)];
+  fdc_hash[fdc_hash_path(path)] = e;
+  fdc_count++;
+  pthread_mutex_unlock(&fdc_mutex);
+  *entry = e;
+  return fd;
+}
+
+/* as fstat() saw the file when it was opened or checked last. */
+const struct stat *fdc_stat(fd_entry *entry)
+{
+  return &entry->st;
+}
+
+void fdc_release(fd_entry *entry)
+{
+  pthread_mutex_lock(&fdc_mutex);
+  if (--entry->refs == 0) {
+    if (entry->stale) {
+      close(entry->fd);
+      free(entry);
+      fdc_count--;
+    }
+    else {
+      lru_append(entry);
+    }
+  }
+  pthread_mutex_unlock(&fdc_mutex);
+}
+
+void fdc_total_stat(unsigned long *hits, unsigned long *checked,
+                    unsigned long *opened, unsigned long *open_now)
+{
+  pthread_mutex_lock(&fdc_mutex);
+  *hits = fdc_hits;
+  *checked = fdc_checked;
+  *opened = fdc_opened;
+  *open_now = fdc_count;
+  pthread_mutex_unlock(&fdc_mutex);
+}
@@ -0,0 +1,85 @@
+/*
+   fdcache.h
+   $Id$
+
+   This file is part of t-tftpd.
+
+   Copyright 2002,2007 Tomofumi Hayashi <s1061123@gmail.com>.
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+   3. All advertising materials mentioning features or use of this software
+      must display the following acknowledgement:
+
+        This product includes software developed by
+        Tomofumi Hayashi <s1061123@gmail.com> and its contributors.
+
+   4. Neither the name of authors nor the names of its contributors may be used
+      to endorse or promote products derived from this software without
+      specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND ANY
+   EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _FDCACHE_H_
+#define _FDCACHE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/*
+ * Open files kept for the RRQs of the files served often.
+ * -o takes the number of descriptors to keep (FDC_DEFAULT_MAX, 0 is
+ * off).  A file is kept open with its stat by the path in the root,
+ * and the sessions of it share the descriptor, which they only read
+ * with pread() or mmap().  netascii reads with stdio and opens its own.
+ *
+ * An entry is good for the tree it was looked up in: in the same tree
+ * neither the lookup nor open() and fstat() are done again.  With a
+ * new tree, the lookup is done and the file is stat()ed; it stays open
+ * when it is still the same file.  The entries used least recently and
+ * by no session are closed first for a new one; when all are in use,
+ * the file is opened for the session only.
+ */
+#define FDC_DEFAULT_MAX 64
+#define FDC_MAX 4096
+#define FDC_PATH_SIZ 128  /* PATH_SIZ, of the paths file_open() makes */
+#define FDC_HASH_SIZE 256
+
+typedef struct fd_entry fd_entry;
+
+int fdc_config(int max);
+int fdc_enabled(void);
+int fdc_get(const char *path, unsigned long gen, fd_entry **entry);
+int fdc_open(const char *path, unsigned long gen, fd_entry **entry);
+const struct stat *fdc_stat(fd_entry *entry);
+void fdc_release(fd_entry *entry);
+void fdc_total_stat(unsigned long *hits, unsigned long *checked,
+                    unsigned long *opened, unsigned long *open_now);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* !_FDCACHE_H_ */
@@ -0,0 +1,926 @@
+/*
+   loadgen.c
+   $Id$
+
+   This file is part of t-tftpd.
+
+   Copyright 2002,2007 Tomofumi Hayashi <s1061123@gmail.com>.
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+   3. All advertising materials mentioning features or use of this software
+      must display the following acknowledgement:
+
+        This product includes software developed by
+        Tomofumi Hayashi <s1061123@gmail.com> and its contributors.
+
+   4. Neither the name of authors nor the names of its contributors may be used
+      to endorse or promote products derived from this software without
+      specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND ANY
+   EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "tftp.h"
+
+/*
+ * t-tftpd-load: N concurrent TFTP clients against one server.
+ * Each run of the sweep prints requests/s, MB/s, completion time
+ * percentiles and timeouts as JSON.
+ */
+
+#define LOAD_TIMEOUT_MSEC 1000
+#define LOAD_MAX_RETRY 5
+#define LOAD_MAX_SIZES 16
+#define LOAD_MAX_STEPS 32
+#define LOAD_BLKSIZE_MAX 65464
+#define LOAD_SETTLE_MSEC 500
+/* a multicast client may wait while the master is replaced. */
+#define LOAD_MCAST_MAX_IDLE (LOAD_MAX_RETRY * 2)
+
+enum load_mode {LOAD_OCTET, LOAD_NETASCII, LOAD_MIXED};
+
+struct load_size {
+  size_t size;
+  int weight;
+};
+
+struct load_client {
+  int id;
+  int requests;
+  unsigned int seed;
+  /* results */
+  uint64_t *latency;   /* usec of every finished request */
+  int done, failed, timeouts;
+  uint64_t bytes;
+};
+
+static struct sockaddr_storage server;
+static socklen_t server_len;
+static const char *server_host = "127.0.0.1";
+static const char *server_port = "69";
+static int wrq_percent = 0;
+static enum load_mode load_mode = LOAD_OCTET;
+static int blksize = 0;
+static struct load_size sizes[LOAD_MAX_SIZES];
+static int num_sizes = 0, total_weight = 0;
+static int requests = 100;
+static char *pattern = NULL;
+static struct in_addr mcast_if;
+static int use_mcast = 0;
+
+void print_usage(const char *name)
+{
+  fprintf(stderr,
+	  "usage: %s [options]\n"
+	  "  -s <host> \t\t server (default: 127.0.0.1)\n"
+	  "  -p <port> \t\t port (default: 69)\n"
+	  "  -c <n>[,<n>...] \t concurrent clients, one run each "
+	  "(default: 1)\n"
+	  "  -n <num> \t\t requests per client (default: 100)\n"
+	  "  -w <percent> \t\t WRQ share of the requests (default: 0)\n"
+	  "  -m <mode> \t\t octet, netascii or mixed (default: octet)\n"
+	  "  -b <bytes> \t\t ask for blksize (default: none)\n"
+	  "  -f <size>[:<weight>],... file sizes, k/m suffixes "
+	  "(default: 64k)\n"
+	  "  -g <address> \t\t RRQs ask for multicast, groups are joined "
+	  "on\n\t\t\t the interface of <address>\n"
+	  "  -r <directory> \t server root, load-<size>.bin are created there\n"
+	  "  -x <t-tftpd> \t\t start this server on -r for every run\n"
+	  "  -t <n>[,<n>...] \t server threads, with -x one sweep each\n"
+	  "\n"
+	  "RRQs read load-<size>.bin, WRQs write load-w<client>.bin.\n"
+	  "Without -x the server must already see the load-*.bin files\n"
+	  "(the tree is rescanned every 10 seconds).\n",
+	  name);
+}
+
+uint64_t now_usec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+size_t parse_size(const char *str)
+{
+  char *end;
+  size_t size;
+
+  size = strtoul(str, &end, 10);
+  if (*end == 'k' || *end == 'K') {
+    size *= 1024;
+  }
+  else if (*end == 'm' || *end == 'M') {
+    size *= 1024 * 1024;
+  }
+  return size;
+}
+
+/*
+ * Return: number of values parsed from "n,n,...", -1 on error.
+ */
+int parse_list(char *str, int *val, int max)
+{
+  char *cp;
+  int num = 0;
+
+  for (cp = strtok(str, ","); cp != NULL; cp = strtok(NULL, ",")) {
+    if (num == max || (val[num] = atoi(cp)) <= 0) {
+      return -1;
+    }
+    num++;
+  }
+  return num;
+}
+
+int parse_sizes(char *str)
+{
+  char *cp, *weight;
+
+  num_sizes = total_weight = 0;
+  for (cp = strtok(str, ","); cp != NULL; cp = strtok(NULL, ",")) {
+    if (num_sizes == LOAD_MAX_SIZES) {
+      return -1;
+    }
+    sizes[num_sizes].size = parse_size(cp);
+    sizes[num_sizes].weight = 1;
+    if ((weight = strchr(cp, ':')) != NULL) {
+      sizes[num_sizes].weight = atoi(weight + 1);
+    }
+    if (sizes[num_sizes].weight <= 0) {
+      return -1;
+    }
+    total_weight += sizes[num_sizes].weight;
+    num_sizes++;
+  }
+  return num_sizes > 0 ? 0 : -1;
+}
+
+size_t pick_size(unsigned int *seed)
+{
+  int cnt, val;
+
+  val = rand_r(seed) % total_weight;
+  for (cnt = 0; cnt < num_sizes - 1; cnt++) {
+    if ((val -= sizes[cnt].weight) < 0) {
+      break;
+    }
+  }
+  return sizes[cnt].size;
+}
+
+/*
+ * Return: 0 on success, -1 on error.
+ */
+int create_files(const char *dir, int nclients)
+{
+  char path[1024];
+  struct stat st;
+  size_t left, len;
+  int cnt, fd;
+
+  /* t-tftpd only overwrites files writable by others. */
+  for (cnt = 0; cnt < nclients; cnt++) {
+    snprintf(path, sizeof(path), "%s/load-w%d.bin", dir, cnt);
+    if ((fd = open(path, O_WRONLY|O_CREAT, 0666)) == -1 ||
+        fchmod(fd, 0666) == -1) {
+      perror(path);
+      return -1;
+    }
+    close(fd);
+  }
+
+  for (cnt = 0; cnt < num_sizes; cnt++) {
+    snprintf(path, sizeof(path), "%s/load-%lu.bin", dir,
+	     (unsigned long)sizes[cnt].size);
+    if (stat(path, &st) == 0 && (size_t)st.st_size == sizes[cnt].size) {
+      continue;
+    }
+    if ((fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644)) == -1) {
+      perror(path);
+      return -1;
+    }
+    for (left = sizes[cnt].size; left > 0; left -= len) {
+      len = left < LOAD_BLKSIZE_MAX ? left : LOAD_BLKSIZE_MAX;
+      if (write(fd, pattern, len) != (ssize_t)len) {
+	perror(path);
+	close(fd);
+	return -1;
+      }
+    }
+    close(fd);
+  }
+  return 0;
+}
+
+/*
+ * Wait for a packet from the server for LOAD_TIMEOUT_MSEC.
+ * Return: its length, 0 on timeout, -1 on error.
+ */
+ssize_t recv_reply(int s, char *buf, size_t len,
+		   struct sockaddr_storage *peer, int *locked)
+{
+  struct sockaddr_storage from;
+  socklen_t fromlen;
+  struct pollfd pfd;
+  ssize_t ret;
+
+  pfd.fd = s;
+  pfd.events = POLLIN;
+  for (;;) {
+    if (poll(&pfd, 1, LOAD_TIMEOUT_MSEC) <= 0) {
+      return 0;
+    }
+    fromlen = sizeof(from);
+    ret = recvfrom(s, buf, len, 0, (struct sockaddr *)&from, &fromlen);
+    if (ret < 4) {
+      return -1;
+    }
+    /* the first reply decides the server's TID. */
+    if (!*locked) {
+      memcpy(peer, &from, fromlen);
+      *locked = 1;
+      return ret;
+    }
+    if (memcmp(peer, &from, fromlen) == 0) {
+      return ret;
+    }
+  }
+}
+
+/*
+ * Build RRQ/WRQ in buf.
+ * Return: its length.
+ */
+size_t make_request(char *buf, int opcode, const char *file, const char *mode)
+{
+  size_t len;
+
+  *(unsigned short *)buf = htons(opcode);
+  len = 2;
+  len += sprintf(buf + len, "%s", file) + 1;
+  len += sprintf(buf + len, "%s", mode) + 1;
+  if (blksize > 0) {
+    len += sprintf(buf + len, "blksize") + 1;
+    len += sprintf(buf + len, "%d", blksize) + 1;
+  }
+  return len;
+}
+
+/*
+ * blksize from an OACK, SEGSIZE if it has none.
+ */
+int oack_blksize(char *buf, ssize_t len)
+{
+  char *cp = buf + 2, *end = buf + len;
+
+  while (cp < end) {
+    if (strcasecmp(cp, "blksize") == 0 && cp + strlen(cp) + 1 < end) {
+      return atoi(cp + strlen(cp) + 1);
+    }
+    cp += strlen(cp) + 1;
+    cp += strlen(cp) + 1;
+  }
+  return SEGSIZE;
+}
+
+/*
+ * Return: bytes received, -1 on failure.
+ */
+ssize_t load_rrq(int s, struct load_client *cl, const char *file,
+		 const char *mode, char *buf, char *last)
+{
+  struct sockaddr_storage peer;
+  ssize_t len, lastlen, total = 0;
+  unsigned short block = 1, got;
+  int locked = 0, retry = 0, blk = SEGSIZE;
+
+  lastlen = make_request(last, RRQ, file, mode);
+  memcpy(&peer, &server, server_len);
+  sendto(s, last, lastlen, 0, (struct sockaddr *)&server, server_len);
+
+  for (;;) {
+    len = recv_reply(s, buf, LOAD_BLKSIZE_MAX + 4, &peer, &locked);
+    if (len == 0) {
+      cl->timeouts++;
+      if (++retry > LOAD_MAX_RETRY) {
+	return -1;
+      }
+      sendto(s, last, lastlen, 0, (struct sockaddr *)&peer, server_len);
+      continue;
+    }
+    if (len < 0) {
+      return -1;
+    }
+    retry = 0;
+
+    switch (ntohs(*(unsigned short *)buf)) {
+    case OACK:
+      blk = oack_blksize(buf, len);
+      *(unsigned short *)last = htons(ACK);
+      *(unsigned short *)(last + 2) = htons(0);
+      lastlen = 4;
+      break;
+    case DATA:
+      got = ntohs(*(unsigned short *)(buf + 2));
+      if (got != block) {
+	/* a duplicate, ACK it again. */
+	sendto(s, last, lastlen, 0, (struct sockaddr *)&peer, server_len);
+	continue;
+      }
+      *(unsigned short *)last = htons(ACK);
+      *(unsigned short *)(last + 2) = htons(block);
+      lastlen = 4;
+      total += len - 4;
+      block++;
+      if (len - 4 < blk) {
+	sendto(s, last, lastlen, 0, (struct sockaddr *)&peer, server_len);
+	return total;
+      }
+      break;
+    default:
+      return -1;
+    }
+    sendto(s, last, lastlen, 0, (struct sockaddr *)&peer, server_len);
+  }
+}
+
+/*
+ * Return: bytes sent, -1 on failure.
+ */
+ssize_t load_wrq(int s, struct load_client *cl, const char *file,
+		 const char *mode, size_t size, char *buf, char *last)
+{
+  struct sockaddr_storage peer;
+  ssize_t len, lastlen;
+  size_t off = 0, chunk = 0;
+  unsigned short block = 0, got;
+  int locked = 0, retry = 0, blk = SEGSIZE, sent_last = 0;
+
+  lastlen = make_request(last, WRQ, file, mode);
+  memcpy(&peer, &server, server_len);
+  sendto(s, last, lastlen, 0, (struct sockaddr *)&server, server_len);
+
+  for (;;) {
+    len = recv_reply(s, buf, LOAD_BLKSIZE_MAX + 4, &peer, &locked);
+    if (len == 0) {
+      cl->timeouts++;
+      if (++retry > LOAD_MAX_RETRY) {
+	return -1;
+      }
+      sendto(s, last, lastlen, 0, (struct sockaddr *)&peer, server_len);
+      continue;
+    }
+    if (len < 0) {
+      return -1;
+    }
+
+    switch (ntohs(*(unsigned short *)buf)) {
+    case OACK:
+      if (block != 0) {
+	continue;
+      }
+      blk = oack_blksize(buf, len);
+      break;
+    case ACK:
+      got = ntohs(*(unsigned short *)(buf + 2));
+      if (got != block) {
+	continue;
+      }
+      break;
+    default:
+      return -1;
+    }
+    retry = 0;
+    off += chunk;
+    if (sent_last) {
+      return off;
+    }
+
+    chunk = size - off < (size_t)blk ? size - off : (size_t)blk;
+    block++;
+    *(unsigned short *)last = htons(DATA);
+    *(unsigned short *)(last + 2) = htons(block);
+    memcpy(last + 4, pattern + off % SEGSIZE, chunk);
+    lastlen = chunk + 4;
+    sent_last = chunk < (size_t)blk;
+    sendto(s, last, lastlen, 0, (struct sockaddr *)&peer, server_len);
+  }
+}
+
+/*
+ * Join the group of a "multicast" OACK value, "<addr>,<port>,<mc>".
+ * Return: the group socket, -1 on error.
+ */
+int mcast_open(char *value)
+{
+  struct sockaddr_in sin;
+  struct ip_mreq mreq;
+  char *port;
+  int s, on = 1;
+
+  if ((port = strchr(value, ',')) == NULL) {
+    return -1;
+  }
+  *port++ = '\0';
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(atoi(port));
+  if (inet_pton(AF_INET, value, &sin.sin_addr) != 1 ||
+      (s = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+    return -1;
+  }
+  mreq.imr_multiaddr = sin.sin_addr;
+  mreq.imr_interface = mcast_if;
+  /* the clients of this process share the port. */
+  if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1 ||
+      bind(s, (struct sockaddr *)&sin, sizeof(sin)) == -1 ||
+      setsockopt(s, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+		 &mreq, sizeof(mreq)) == -1) {
+    perror("multicast group");
+    close(s);
+    return -1;
+  }
+  return s;
+}
+
+/*
+ * RRQ with the multicast option (RFC 2090).  DATA comes to the group,
+ * the master client ACKs the last block it has without a gap, the
+ * others only wait, and every client ACKs the last block when it has
+ * the whole file.
+ * Return: bytes received, -1 on failure.
+ */
+ssize_t load_rrq_mcast(int s, struct load_client *cl, const char *file,
+		       char *buf, char *last)
+{
+  struct sockaddr_storage peer;
+  struct pollfd pfd[2];
+  unsigned char *have;
+  ssize_t len, lastlen, total = 0;
+  unsigned short block;
+  int locked = 0, master = 0, idle = 0, nblocks = 0, next = 1;
+  char *cp, *end, *value, group[64];
+
+  if ((have = calloc(65536, 1)) == NULL) {
+    return -1;
+  }
+  lastlen = make_request(last, RRQ, file, "octet");
+  lastlen += sprintf(last + lastlen, "multicast") + 1;
+  last[lastlen++] = '\0';
+  lastlen += sprintf(last + lastlen, "tsize") + 1;
+  lastlen += sprintf(last + lastlen, "0") + 1;
+  memcpy(&peer, &server, server_len);
+  sendto(s, last, lastlen, 0, (struct sockaddr *)&server, server_len);
+
+  pfd[0].fd = s;
+  pfd[0].events = POLLIN;
+  pfd[1].fd = -1;
+  pfd[1].events = POLLIN;
+  while (nblocks == 0 || next <= nblocks) {
+    if (poll(pfd, 2, LOAD_TIMEOUT_MSEC) <= 0) {
+      cl->timeouts++;
+      if (++idle > LOAD_MCAST_MAX_IDLE) {
+	goto error;
+      }
+      /* the RRQ, or the ACK of the master. */
+      if (!locked || master) {
+	sendto(s, last, lastlen, 0, (struct sockaddr *)&peer, server_len);
+      }
+      continue;
+    }
+
+    if (pfd[0].revents & POLLIN) {
+      len = recv_reply(s, buf, LOAD_BLKSIZE_MAX + 4, &peer, &locked);
+      if (len <= 0 || ntohs(*(unsigned short *)buf) != OACK) {
+	/* an ERROR, or the server does not do multicast. */
+	goto error;
+      }
+      end = buf + len;
+      buf[len - 1] = '\0';
+      for (cp = buf + 2; cp < end; cp = value + strlen(value) + 1) {
+	value = cp + strlen(cp) + 1;
+	if (value >= end) {
+	  break;
+	}
+	if (strcasecmp(cp, "tsize") == 0) {
+	  nblocks = atoll(value) / SEGSIZE + 1;
+	}
+	else if (strcasecmp(cp, "multicast") == 0) {
+	  master = value[0] != '\0' && value[strlen(value) - 1] == '1';
+	  if (pfd[1].fd == -1) {
+	    /* mcast_open() cuts up its string. */
+	    snprintf(group, sizeof(group), "%s", value);
+	    if ((pfd[1].fd = mcast_open(group)) == -1) {
+	      goto error;
+	    }
+	  }
+	}
+      }
+      if (pfd[1].fd == -1) {
+	goto error;
+      }
+      idle = 0;
+      if (master) {
+	*(unsigned short *)last = htons(ACK);
+	*(unsigned short *)(last + 2) = htons(next - 1);
+	lastlen = 4;
+	sendto(s, last, lastlen, 0, (struct sockaddr *)&peer, server_len);
+      }
+    }
+
+    if (pfd[1].fd != -1 && (pfd[1].revents & POLLIN)) {
+      len = recv(pfd[1].fd, buf, LOAD_BLKSIZE_MAX + 4, 0);
+      if (len < 4 || ntohs(*(unsigned short *)buf) != DATA) {
+	continue;
+      }
+      idle = 0;
+      block = ntohs(*(unsigned short *)(buf + 2));
+      if (block != 0 && !have[block]) {
+	have[block] = 1;
+	total += len - 4;
+	if (len - 4 < SEGSIZE) {
+	  nblocks = block;
+	}
+	while (have[next] && next < 65535) {
+	  next++;
+	}
+      }
+      if (master) {
+	*(unsigned short *)last = htons(ACK);
+	*(unsigned short *)(last + 2) = htons(next - 1);
+	lastlen = 4;
+	sendto(s, last, lastlen, 0, (struct sockaddr *)&peer, server_len);
+      }
+    }
+  }
+
+  /* done, the master has sent this already. */
+  if (!master) {
+    *(unsigned short *)last = htons(ACK);
+    *(unsigned short *)(last + 2) = htons(nblocks);
+    sendto(s, last, 4, 0, (struct sockaddr *)&peer, server_len);
+  }
+  close(pfd[1].fd);
+  free(have);
+  return total;
+
+ error:
+  if (pfd[1].fd != -1) {
+    close(pfd[1].fd);
+  }
+  free(have);
+  return -1;
+}
+
+void *client_main(void *arg)
+{
+  struct load_client *cl = arg;
+  char *buf, *last, file[64];
+  const char *mode;
+  uint64_t start;
+  ssize_t ret;
+  size_t size;
+  int s, cnt;
+
+  buf = malloc(LOAD_BLKSIZE_MAX + 4);
+  last = malloc(LOAD_BLKSIZE_MAX + 4);
+  if (buf == NULL || last == NULL) {
+    perror("client");
+    cl->failed = cl->requests;
+    return NULL;
+  }
+
+  for (cnt = 0; cnt < cl->requests; cnt++) {
+    /* a new port per request, like real clients, so late packets of
+       the previous transfer can't be taken for the next one. */
+    if ((s = socket(server.ss_family, SOCK_DGRAM, 0)) == -1) {
+      perror("socket");
+      cl->failed++;
+      continue;
+    }
+    size = pick_size(&cl->seed);
+    if (load_mode == LOAD_MIXED) {
+      mode = rand_r(&cl->seed) % 2 ? "netascii" : "octet";
+    }
+    else {
+      mode = load_mode == LOAD_NETASCII ? "netascii" : "octet";
+    }
+
+    start = now_usec();
+    if ((int)(rand_r(&cl->seed) % 100) < wrq_percent) {
+      snprintf(file, sizeof(file), "load-w%d.bin", cl->id);
+      ret = load_wrq(s, cl, file, mode, size, buf, last);
+    }
+    else {
+      snprintf(file, sizeof(file), "load-%lu.bin", (unsigned long)size);
+      if (use_mcast) {
+	ret = load_rrq_mcast(s, cl, file, buf, last);
+      }
+      else {
+	ret = load_rrq(s, cl, file, mode, buf, last);
+      }
+    }
+    close(s);
+    if (ret < 0) {
+      cl->failed++;
+      continue;
+    }
+    cl->latency[cl->done++] = now_usec() - start;
+    cl->bytes += ret;
+  }
+
+  free(buf);
+  free(last);
+  return NULL;
+}
+
+int latency_cmp(const void *a, const void *b)
+{
+  uint64_t va = *(const uint64_t *)a, vb = *(const uint64_t *)b;
+
+  return va < vb ? -1 : va > vb;
+}
+
+/*
+ * Run nclients clients to the end and print one JSON object.
+ */
+void load_run(int threads, int nclients, int first)
+{
+  struct load_client *cl;
+  pthread_t *tid;
+  uint64_t start, elapsed, bytes = 0, *all;
+  int cnt, done = 0, failed = 0, timeouts = 0, num;
+  char tbuf[16];
+
+  cl = calloc(nclients, sizeof(struct load_client));
+  tid = calloc(nclients, sizeof(pthread_t));
+  all = malloc(sizeof(uint64_t) * nclients * requests);
+  if (cl == NULL || tid == NULL || all == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+
+  start = now_usec();
+  for (cnt = 0; cnt < nclients; cnt++) {
+    cl[cnt].id = cnt;
+    cl[cnt].requests = requests;
+    cl[cnt].seed = cnt + 1;
+    cl[cnt].latency = all + (size_t)cnt * requests;
+    pthread_create(&tid[cnt], NULL, client_main, &cl[cnt]);
+  }
+  for (cnt = 0; cnt < nclients; cnt++) {
+    pthread_join(tid[cnt], NULL);
+  }
+  elapsed = now_usec() - start;
+
+  /* pack the latencies of all clients together. */
+  for (num = 0, cnt = 0; cnt < nclients; cnt++) {
+    memmove(all + num, cl[cnt].latency, sizeof(uint64_t) * cl[cnt].done);
+    num += cl[cnt].done;
+    done += cl[cnt].done;
+    failed += cl[cnt].failed;
+    timeouts += cl[cnt].timeouts;
+    bytes += cl[cnt].bytes;
+  }
+  qsort(all, num, sizeof(uint64_t), latency_cmp);
+
+#define PCT(p) (num ? all[(size_t)(num * (p))] / 1000.0 : 0)
+  if (threads > 0) {
+    snprintf(tbuf, sizeof(tbuf), "%d", threads);
+  }
+  else {
+    strcpy(tbuf, "null");   /* unknown without -t */
+  }
+  printf("%s\n    {\"threads\": %s, \"clients\": %d, \"requests\": %d, "
+	 "\"completed\": %d, \"failed\": %d, \"timeouts\": %d,\n"
+	 "     \"elapsed_sec\": %.3f, \"requests_per_sec\": %.1f, "
+	 "\"mbytes_per_sec\": %.2f,\n"
+	 "     \"latency_ms\": {\"p50\": %.3f, \"p99\": %.3f, "
+	 "\"p999\": %.3f, \"max\": %.3f}}",
+	 first ? "" : ",", tbuf, nclients, nclients * requests,
+	 done, failed, timeouts, elapsed / 1e6,
+	 done / (elapsed / 1e6), bytes / (elapsed / 1e6) / (1024 * 1024),
+	 PCT(0.50), PCT(0.99), PCT(0.999),
+	 num ? all[num - 1] / 1000.0 : 0);
+#undef PCT
+  fflush(stdout);
+
+  free(all);
+  free(tid);
+  free(cl);
+}
+
+pid_t server_start(const char *path, const char *root, int threads)
+{
+  char tbuf[16];
+  struct timespec ts;
+  pid_t pid;
+  int fd;
+
+  snprintf(tbuf, sizeof(tbuf), "%d", threads);
+  if ((pid = fork()) == -1) {
+    perror("fork");
+    exit(1);
+  }
+  if (pid == 0) {
+    if ((fd = open("/dev/null", O_WRONLY)) != -1) {
+      dup2(fd, 1);
+      dup2(fd, 2);
+    }
+    execl(path, path, "-p", server_port, "-r", root, "-t", tbuf,
+	  (char *)NULL);
+    _exit(127);
+  }
+
+  /* let it bind. */
+  ts.tv_sec = 0;
+  ts.tv_nsec = LOAD_SETTLE_MSEC * 1000000L;
+  nanosleep(&ts, NULL);
+  return pid;
+}
+
+void server_stop(pid_t pid)
+{
+  kill(pid, SIGTERM);
+  waitpid(pid, NULL, 0);
+}
+
+int main(int argc, char **argv)
+{
+  struct addrinfo hints, *res;
+  char *root = NULL, *server_bin = NULL;
+  char size_spec[] = "64k";
+  int clients[LOAD_MAX_STEPS] = {1}, threads[LOAD_MAX_STEPS] = {0};
+  int nclients = 1, nthreads = 1, max_clients, ch, cnt, step, err = 0;
+  pid_t pid = -1;
+
+  parse_sizes(size_spec);
+  while ((ch = getopt(argc, argv, "b:c:f:g:hm:n:p:r:s:t:w:x:")) != EOF) {
+    switch (ch) {
+    case 'b':
+      blksize = atoi(optarg);
+      if (blksize < 8 || blksize > LOAD_BLKSIZE_MAX) {
+	err = 1;
+      }
+      break;
+    case 'c':
+      if ((nclients = parse_list(optarg, clients, LOAD_MAX_STEPS)) <= 0) {
+	err = 1;
+      }
+      break;
+    case 'f':
+      if (parse_sizes(optarg) == -1) {
+	err = 1;
+      }
+      break;
+    case 'g':
+      if (inet_pton(AF_INET, optarg, &mcast_if) != 1) {
+	err = 1;
+      }
+      use_mcast = 1;
+      break;
+    case 'm':
+      if (strcmp(optarg, "octet") == 0) {
+	load_mode = LOAD_OCTET;
+      }
+      else if (strcmp(optarg, "netascii") == 0) {
+	load_mode = LOAD_NETASCII;
+      }
+      else if (strcmp(optarg, "mixed") == 0) {
+	load_mode = LOAD_MIXED;
+      }
+      else {
+	err = 1;
+      }
+      break;
+    case 'n':
+      if ((requests = atoi(optarg)) <= 0) {
+	err = 1;
+      }
+      break;
+    case 'p':
+      server_port = optarg;
+      break;
+    case 'r':
+      root = optarg;
+      break;
+    case 's':
+      server_host = optarg;
+      break;
+    case 't':
+      if ((nthreads = parse_list(optarg, threads, LOAD_MAX_STEPS)) <= 0) {
+	err = 1;
+      }
+      break;
+    case 'w':
+      wrq_percent = atoi(optarg);
+      if (wrq_percent < 0 || wrq_percent > 100) {
+	err = 1;
+      }
+      break;
+    case 'x':
+      server_bin = optarg;
+      break;
+    default:
+      err = 1;
+      break;
+    }
+  }
+  if (err || optind != argc || (server_bin != NULL && root == NULL)) {
+    print_usage(argv[0]);
+    exit(1);
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_DGRAM;
+  if ((err = getaddrinfo(server_host, server_port, &hints, &res)) != 0) {
+    fprintf(stderr, "%s: %s\n", server_host, gai_strerror(err));
+    exit(1);
+  }
+  memcpy(&server, res->ai_addr, res->ai_addrlen);
+  server_len = res->ai_addrlen;
+  freeaddrinfo(res);
+
+  /* netascii safe text, so both modes move the same bytes. */
+  pattern = malloc(LOAD_BLKSIZE_MAX + SEGSIZE);
+  for (cnt = 0; cnt < LOAD_BLKSIZE_MAX + SEGSIZE; cnt++) {
+    pattern[cnt] = cnt % 64 == 63 ? '\n' : 'a' + cnt % 26;
+  }
+  for (max_clients = 0, cnt = 0; cnt < nclients; cnt++) {
+    if (clients[cnt] > max_clients) {
+      max_clients = clients[cnt];
+    }
+  }
+  if (root != NULL && create_files(root, max_clients) == -1) {
+    exit(1);
+  }
+
+  printf("{\"server\": \"%s\", \"port\": \"%s\", \"mode\": \"%s\", "
+	 "\"wrq_percent\": %d, \"blksize\": %d, \"multicast\": %s,\n"
+	 " \"sizes\": [",
+	 server_host, server_port,
+	 load_mode == LOAD_OCTET ? "octet" :
+	 load_mode == LOAD_NETASCII ? "netascii" : "mixed",
+	 wrq_percent, blksize, use_mcast ? "true" : "false");
+  for (cnt = 0; cnt < num_sizes; cnt++) {
+    printf("%s{\"bytes\": %lu, \"weight\": %d}", cnt ? ", " : "",
+	   (unsigned long)sizes[cnt].size, sizes[cnt].weight);
+  }
+  printf("],\n \"runs\": [");
+
+  for (step = 0; step < nthreads; step++) {
+    if (server_bin != NULL) {
+      pid = server_start(server_bin, root, threads[step]);
+    }
+    for (cnt = 0; cnt < nclients; cnt++) {
+      load_run(threads[step], clients[cnt], step == 0 && cnt == 0);
+    }
+    if (pid != -1) {
+      server_stop(pid);
+      pid = -1;
+    }
+  }
+  printf("\n ]}\n");
+  return 0;
+}
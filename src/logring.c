@@ -0,0 +1,376 @@
+/*
+   logring.c
+   $Id$
+
+   This file is part of t-tftpd.
+
+   Copyright 2002,2007 Tomofumi Hayashi <s1061123@gmail.com>.
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+   3. All advertising materials mentioning features or use of this software
+      must display the following acknowledgement:
+
+        This product includes software developed by
+        Tomofumi Hayashi <s1061123@gmail.com> and its contributors.
+
+   4. Neither the name of authors nor the names of its contributors may be used
+      to endorse or promote products derived from this software without
+      specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND ANY
+   EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <syslog.h>
+#include <pthread.h>
+
+#include "logring.h"
+
+#ifndef LOG_TFTP
+#define LOG_TFTP LOG_DAEMON
+#endif /* LOG_TFTP */
+
+struct log_record {
+  uint64_t time;      /* CLOCK_REALTIME, usec */
+  uint64_t session;
+  uint64_t args[4];
+  unsigned long thread;
+  int priority;       /* syslog priority */
+  int event;
+  char text[LOG_TEXT_SIZE];
+};
+
+/*
+ * head is only written by the owner thread and tail only by the
+ * drainer.  A ring outlives its thread and is reused by the next one.
+ */
+struct log_ring {
+  struct log_ring *next;       /* list of all rings */
+  struct log_ring *next_free;
+  uint64_t session;
+  unsigned long dropped;
+  unsigned long reported;      /* drops already reported */
+  unsigned int head;
+  unsigned int tail;
+  struct log_record rec[LOG_RING_SIZE];
+};
+
+static const char *event_fmt[LE_NUM] = {
+  "%s",
+  "block %llu: %llu bytes read",
+  "block %llu: %llu bytes sent",
+  "block %llu: ack sent",
+  "total: %llu/%llu bytes",
+  "%s",
+};
+
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static pthread_key_t log_key;
+static pthread_mutex_t ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct log_ring *rings = NULL;
+static struct log_ring *free_rings = NULL;
+static int log_running = 0;
+static int use_syslog = 0;
+static FILE *log_fp = NULL;
+
+static void ring_release(void *p)
+{
+  struct log_ring *ring = p;
+
+  pthread_mutex_lock(&ring_mutex);
+  ring->next_free = free_rings;
+  free_rings = ring;
+  pthread_mutex_unlock(&ring_mutex);
+}
+
+static void log_key_create(void)
+{
+  pthread_key_create(&log_key, ring_release);
+}
+
+static struct log_ring *ring_get(void)
+{
+  struct log_ring *ring;
+
+  pthread_once(&log_once, log_key_create);
+  ring = pthread_getspecific(log_key);
+  if (ring != NULL) {
+    return ring;
+  }
+
+  pthread_mutex_lock(&ring_mutex);
+  if (free_rings != NULL) {
+    ring = free_rings;
+    free_rings = ring->next_free;
+  }
+  else if ((ring = calloc(1, sizeof(struct log_ring))) != NULL) {
+    ring->next = rings;
+    __atomic_store_n(&rings, ring, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&ring_mutex);
+  if (ring != NULL) {
+    ring->session = 0;
+    pthread_setspecific(log_key, ring);
+  }
+  return ring;
+}
+
+/*
+ * Return: a free slot of the calling thread's ring, NULL if it is full.
+ */
+static struct log_record *ring_slot(int priority, int event)
+{
+  struct log_ring *ring;
+  struct log_record *rp;
+  struct timespec ts;
+  unsigned int head;
+
+  if ((ring = ring_get()) == NULL) {
+    return NULL;
+  }
+  head = ring->head;
+  if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) ==
+      LOG_RING_SIZE) {
+    __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+
+  rp = &ring->rec[head & (LOG_RING_SIZE - 1)];
+  clock_gettime(CLOCK_REALTIME, &ts);
+  rp->time = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  rp->session = ring->session;
+  rp->thread = (unsigned long)pthread_self();
+  rp->priority = priority;
+  rp->event = event;
+  return rp;
+}
+
+static void ring_commit(void)
+{
+  struct log_ring *ring = pthread_getspecific(log_key);
+
+  __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+static void record_write(struct log_record *rp)
+{
+  char msg[LOG_TEXT_SIZE + 128], stamp[32];
+  const char *outcome;
+  struct tm tm;
+  time_t sec;
+  size_t len;
+
+  if (rp->event == LE_ACCESS) {
+    outcome = rp->args[2] == LOG_DUPLICATE ? "duplicate" :
+      rp->args[2] ? "done" : "aborted";
+    snprintf(msg, sizeof(msg), "%s %llu bytes %llu.%03llu ms %s",
+	     rp->text, (unsigned long long)rp->args[0],
+	     (unsigned long long)rp->args[1] / 1000,
+	     (unsigned long long)rp->args[1] % 1000, outcome);
+    if (rp->args[3] != 0) {
+      len = strlen(msg);
+      snprintf(msg + len, sizeof(msg) - len, " (error %llu)",
+	       (unsigned long long)rp->args[3] - 1);
+    }
+  }
+  else if (rp->event == LE_TEXT) {
+    strcpy(msg, rp->text);
+    len = strlen(msg);
+    if (len > 0 && msg[len - 1] == '\n') {
+      msg[len - 1] = '\0';
+    }
+  }
+  else {
+    snprintf(msg, sizeof(msg), event_fmt[rp->event],
+	     (unsigned long long)rp->args[0], (unsigned long long)rp->args[1]);
+  }
+
+  if (use_syslog) {
+    syslog(rp->priority, "[%lu] #%llu %s", rp->thread,
+	   (unsigned long long)rp->session, msg);
+    return;
+  }
+  sec = rp->time / 1000000;
+  localtime_r(&sec, &tm);
+  strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+  fprintf(log_fp, "%s.%06d [%lu] #%llu %s\n", stamp,
+	  (int)(rp->time % 1000000), rp->thread,
+	  (unsigned long long)rp->session, msg);
+}
+
+/*
+ * Return: number of records written.
+ */
+static int log_drain(void)
+{
+  struct log_ring *ring;
+  unsigned long dropped;
+  unsigned int head;
+  int cnt = 0;
+
+  pthread_mutex_lock(&drain_mutex);
+  for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL;
+       ring = ring->next) {
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    while (ring->tail != head) {
+      record_write(&ring->rec[ring->tail & (LOG_RING_SIZE - 1)]);
+      __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+      cnt++;
+    }
+    dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    if (dropped != ring->reported) {
+      if (use_syslog) {
+	syslog(LOG_WARNING, "%lu log records dropped",
+	       dropped - ring->reported);
+      }
+      else {
+	fprintf(log_fp, "%lu log records dropped\n", dropped - ring->reported);
+      }
+      ring->reported = dropped;
+    }
+  }
+  if (cnt > 0 && !use_syslog) {
+    fflush(log_fp);
+  }
+  pthread_mutex_unlock(&drain_mutex);
+  return cnt;
+}
+
+static void *log_thread(void *arg)
+{
+  struct timespec ts;
+
+  (void)arg;
+
+  ts.tv_sec = 0;
+  ts.tv_nsec = LOG_POLL_MSEC * 1000000;
+  for (;;) {
+    if (log_drain() == 0) {
+      nanosleep(&ts, NULL);
+    }
+  }
+  return NULL;
+}
+
+/*
+ * dest is "syslog", a file name, or NULL/"-" for stdout.
+ * Return: 0 on success, -1 on error.
+ */
+int log_start(const char *dest)
+{
+  pthread_t tid;
+
+  if (dest == NULL || strcmp(dest, "-") == 0) {
+    log_fp = stdout;
+  }
+  else if (strcmp(dest, "syslog") == 0) {
+    openlog("t-tftpd", LOG_PID, LOG_TFTP);
+    use_syslog = 1;
+  }
+  else if ((log_fp = fopen(dest, "a")) == NULL) {
+    perror(dest);
+    return -1;
+  }
+
+  if (pthread_create(&tid, NULL, log_thread, NULL) != 0) {
+    fprintf(stderr, "can't create log thread.\n");
+    return -1;
+  }
+  pthread_detach(tid);
+  log_running = 1;
+  atexit(log_flush);
+  return 0;
+}
+
+void log_flush(void)
+{
+  if (log_running) {
+    log_drain();
+  }
+}
+
+void log_session(uint64_t session)
+{
+  struct log_ring *ring;
+
+  if ((ring = ring_get()) != NULL) {
+    ring->session = session;
+  }
+}
+
+void log_printf(const char *fmt, ...)
+{
+  struct log_record *rp;
+  va_list ap;
+
+  va_start(ap, fmt);
+  if (!log_running) {
+    /* before log_start(), nobody drains the rings. */
+    vprintf(fmt, ap);
+  }
+  else if ((rp = ring_slot(LOG_DEBUG, LE_TEXT)) != NULL) {
+    vsnprintf(rp->text, LOG_TEXT_SIZE, fmt, ap);
+    ring_commit();
+  }
+  va_end(ap);
+}
+
+void log_event(enum log_event event, uint64_t arg0, uint64_t arg1)
+{
+  struct log_record *rp;
+
+  if (!log_running) {
+    printf(event_fmt[event], (unsigned long long)arg0,
+	   (unsigned long long)arg1);
+    printf("\n");
+  }
+  else if ((rp = ring_slot(LOG_DEBUG, event)) != NULL) {
+    rp->args[0] = arg0;
+    rp->args[1] = arg1;
+    ring_commit();
+  }
+}
+
+void log_access(const char *client, const char *file, const char *mode,
+                int wrq, uint64_t bytes, uint64_t usec,
+                int finished, int error)
+{
+  struct log_record *rp;
+
+  if (!log_running || (rp = ring_slot(LOG_INFO, LE_ACCESS)) == NULL) {
+    return;
+  }
+  snprintf(rp->text, LOG_TEXT_SIZE, "%s %s %s %s", client,
+	   wrq ? "WRQ" : "RRQ", file, mode);
+  rp->args[0] = bytes;
+  rp->args[1] = usec;
+  rp->args[2] = finished;
+  rp->args[3] = error + 1;
+  ring_commit();
+}
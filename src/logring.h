@@ -0,0 +1,85 @@
+/*
+   logring.h
+   $Id$
+
+   This file is part of t-tftpd.
+
+   Copyright 2002,2007 Tomofumi Hayashi <s1061123@gmail.com>.
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+   3. All advertising materials mentioning features or use of this software
+      must display the following acknowledgement:
+
+        This product includes software developed by
+        Tomofumi Hayashi <s1061123@gmail.com> and its contributors.
+
+   4. Neither the name of authors nor the names of its contributors may be used
+      to endorse or promote products derived from this software without
+      specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND ANY
+   EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _LOGRING_H_
+#define _LOGRING_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdint.h>
+
+/*
+ * Asynchronous logging.
+ * Each thread pushes fixed size records into its own single-producer
+ * ring, a background thread formats them to stdout, a file or syslog.
+ * A full ring drops records instead of blocking the transfer.
+ */
+#define LOG_RING_SIZE 256   /* records per thread, power of 2 */
+#define LOG_TEXT_SIZE 200
+#define LOG_POLL_MSEC 10
+
+enum log_event {
+  LE_TEXT,        /* d_printf() message */
+  LE_READ,        /* block, bytes read from the file */
+  LE_DATA_SENT,   /* block, bytes sent */
+  LE_ACK_SENT,    /* block */
+  LE_PROGRESS,    /* bytes done, file size */
+  LE_ACCESS,      /* access log: bytes, usec, finished, error code + 1 */
+  LE_NUM
+};
+
+int log_start(const char *dest);
+void log_flush(void);
+void log_session(uint64_t session);
+void log_printf(const char *fmt, ...);
+void log_event(enum log_event event, uint64_t arg0, uint64_t arg1);
+/* finished of log_access(), besides 0 (aborted) and 1 (done). */
+#define LOG_DUPLICATE 2
+
+void log_access(const char *client, const char *file, const char *mode,
+                int wrq, uint64_t bytes, uint64_t usec,
+                int finished, int error);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* !_LOGRING_H_ */
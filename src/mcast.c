@@ -0,0 +1,473 @@
+/*
+   mcast.c
+   $Id$
+
+   This file is part of t-tftpd.
+
+   Copyright 2002,2007 Tomofumi Hayashi <s1061123@gmail.com>.
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+   3. All advertising materials mentioning features or use of this software
+      must display the following acknowledgement:
+
+        This product includes software developed by
+        Tomofumi Hayashi <s1061123@gmail.com> and its contributors.
+
+   4. Neither the name of authors nor the names of its contributors may be used
+      to endorse or promote products derived from this software without
+      specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND ANY
+   EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "tftp.h"
+#include "mcast.h"
+
+#define MCAST_TIMEOUT 2     /* sec, as TIMEOUT of tftpd.c */
+#define MCAST_MAXTIMEOUT 6  /* sec, then the master is taken as gone */
+#define MCAST_PKTSIZE (SEGSIZE + 4)
+
+struct mcast_member {
+  struct sockaddr_in addr;
+  int tsize;        /* asked for tsize */
+  struct mcast_member *next;
+};
+
+struct mcast_group {
+  int index;        /* the group address is mcast_base + index */
+  int sock;
+  int fd;
+  /* the file, as fstat() saw it */
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  time_t mtime;
+  struct sockaddr_in addr;
+  /*
+   * in the order they joined, the head is the master.  Only
+   * mcast_serve() removes members, mcast_join() appends them.
+   */
+  struct mcast_member *members;
+  struct mcast_group *next;
+};
+
+static int mcast_on = 0;
+static struct in_addr mcast_base;
+static struct in_addr mcast_if;
+static in_port_t mcast_port = MCAST_DEFAULT_PORT;
+
+static pthread_mutex_t mcast_mutex = PTHREAD_MUTEX_INITIALIZER;
+static mcast_group *mcast_list = NULL;
+static unsigned int mcast_used = 0;  /* group addresses in use, a bit each */
+static unsigned long mcast_groups = 0, mcast_clients = 0, mcast_packets = 0;
+
+static uint64_t mcast_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* msec left of MCAST_TIMEOUT since the last packet was sent. */
+static int mcast_wait_left(uint64_t since)
+{
+  uint64_t passed;
+
+  passed = mcast_now() - since;
+  if (passed >= MCAST_TIMEOUT * 1000000ULL) {
+    return 0;
+  }
+  return (int)((MCAST_TIMEOUT * 1000000ULL - passed + 999) / 1000);
+}
+
+/*
+ * Return: 0 on success, -1 on error.
+ */
+int mcast_config(const char *spec)
+{
+  char *str, *cp;
+  int port;
+
+  if ((str = strdup(spec)) == NULL) {
+    return -1;
+  }
+  mcast_if.s_addr = htonl(INADDR_ANY);
+  if ((cp = strchr(str, ',')) != NULL) {
+    *cp++ = '\0';
+    if (inet_pton(AF_INET, cp, &mcast_if) != 1) {
+      goto error;
+    }
+  }
+  if ((cp = strchr(str, ':')) != NULL) {
+    *cp++ = '\0';
+    port = atoi(cp);
+    if (port <= 0 || port > 65535) {
+      goto error;
+    }
+    mcast_port = port;
+  }
+  if (inet_pton(AF_INET, str, &mcast_base) != 1 ||
+      !IN_MULTICAST(ntohl(mcast_base.s_addr)) ||
+      !IN_MULTICAST(ntohl(mcast_base.s_addr) + MCAST_MAX_GROUPS - 1)) {
+    goto error;
+  }
+  free(str);
+  mcast_on = 1;
+  return 0;
+
+ error:
+  free(str);
+  return -1;
+}
+
+int mcast_enabled(void)
+{
+  return mcast_on;
+}
+
+/* OACK to a member, from the group socket which is its server TID. */
+static void mcast_oack(mcast_group *g, struct mcast_member *m, int master)
+{
+  char buf[128], addr[INET_ADDRSTRLEN];
+  size_t len;
+
+  inet_ntop(AF_INET, &g->addr.sin_addr, addr, sizeof(addr));
+  *(unsigned short *)buf = htons(OACK);
+  len = 2;
+  len += sprintf(buf + len, "multicast") + 1;
+  len += sprintf(buf + len, "%s,%u,%d", addr, mcast_port, master) + 1;
+  if (m->tsize) {
+    len += sprintf(buf + len, "tsize") + 1;
+    len += sprintf(buf + len, "%lld", (long long)g->size) + 1;
+  }
+  sendto(g->sock, buf, len, 0, (struct sockaddr *)&m->addr, sizeof(m->addr));
+}
+
+static int mcast_same(const struct sockaddr_in *a, const struct sockaddr_in *b)
+{
+  return a->sin_addr.s_addr == b->sin_addr.s_addr &&
+    a->sin_port == b->sin_port;
+}
+
+/*
+ * Put a client in the group of the file of fd.
+ * Return: 1 when it joined a running transfer, 0 when a new group is
+ * in *group and the caller must run mcast_serve() for it, -1 when
+ * multicast can't be used (the caller goes on with unicast).
+ */
+int mcast_join(int fd, const struct sockaddr_in *client, int tsize,
+               mcast_group **group)
+{
+  struct sockaddr_in sin;
+  struct stat st;
+  struct mcast_member *m, **mp;
+  mcast_group *g;
+  unsigned char ttl = 1, loop = 1;
+  int idx;
+
+  if (!mcast_on || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+      st.st_size / SEGSIZE >= MCAST_MAX_BLOCKS) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&mcast_mutex);
+  for (g = mcast_list; g != NULL; g = g->next) {
+    if (g->dev == st.st_dev && g->ino == st.st_ino &&
+        g->size == st.st_size && g->mtime == st.st_mtime) {
+      break;
+    }
+  }
+  if (g != NULL) {
+    for (mp = &g->members; *mp != NULL; mp = &(*mp)->next) {
+      if (mcast_same(&(*mp)->addr, client)) {
+        break;
+      }
+    }
+    /* a known member sent the RRQ again, its OACK was lost. */
+    if ((m = *mp) == NULL) {
+      if ((m = calloc(1, sizeof(struct mcast_member))) == NULL) {
+        pthread_mutex_unlock(&mcast_mutex);
+        return -1;
+      }
+      m->addr = *client;
+      m->tsize = tsize;
+      *mp = m;
+      mcast_clients++;
+    }
+    mcast_oack(g, m, m == g->members);
+    pthread_mutex_unlock(&mcast_mutex);
+    return 1;
+  }
+
+  for (idx = 0; idx < MCAST_MAX_GROUPS; idx++) {
+    if (!(mcast_used & (1U << idx))) {
+      break;
+    }
+  }
+  if (idx == MCAST_MAX_GROUPS) {
+    pthread_mutex_unlock(&mcast_mutex);
+    return -1;
+  }
+  g = calloc(1, sizeof(mcast_group));
+  m = calloc(1, sizeof(struct mcast_member));
+  if (g == NULL || m == NULL ||
+      (g->sock = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+    goto error;
+  }
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(g->sock, (struct sockaddr *)&sin, sizeof(sin)) == -1 ||
+      setsockopt(g->sock, IPPROTO_IP, IP_MULTICAST_TTL,
+                 &ttl, sizeof(ttl)) == -1 ||
+      setsockopt(g->sock, IPPROTO_IP, IP_MULTICAST_LOOP,
+                 &loop, sizeof(loop)) == -1 ||
+      (mcast_if.s_addr != htonl(INADDR_ANY) &&
+       setsockopt(g->sock, IPPROTO_IP, IP_MULTICAST_IF,
+                  &mcast_if, sizeof(mcast_if)) == -1)) {
+    close(g->sock);
+    goto error;
+  }
+
+  g->index = idx;
+  g->fd = fd;
+  g->dev = st.st_dev;
+  g->ino = st.st_ino;
+  g->size = st.st_size;
+  g->mtime = st.st_mtime;
+  g->addr.sin_family = AF_INET;
+  g->addr.sin_addr.s_addr = htonl(ntohl(mcast_base.s_addr) + idx);
+  g->addr.sin_port = htons(mcast_port);
+  m->addr = *client;
+  m->tsize = tsize;
+  g->members = m;
+  g->next = mcast_list;
+  mcast_list = g;
+  mcast_used |= 1U << idx;
+  mcast_groups++;
+  mcast_clients++;
+  pthread_mutex_unlock(&mcast_mutex);
+
+  *group = g;
+  return 0;
+
+ error:
+  pthread_mutex_unlock(&mcast_mutex);
+  free(g);
+  free(m);
+  return -1;
+}
+
+static struct mcast_member *mcast_find(mcast_group *g,
+                                       const struct sockaddr_in *addr)
+{
+  struct mcast_member *m;
+
+  pthread_mutex_lock(&mcast_mutex);
+  for (m = g->members; m != NULL; m = m->next) {
+    if (mcast_same(&m->addr, addr)) {
+      break;
+    }
+  }
+  pthread_mutex_unlock(&mcast_mutex);
+  return m;
+}
+
+static void mcast_leave(mcast_group *g, struct mcast_member *m)
+{
+  struct mcast_member **mp;
+
+  pthread_mutex_lock(&mcast_mutex);
+  for (mp = &g->members; *mp != NULL; mp = &(*mp)->next) {
+    if (*mp == m) {
+      *mp = m->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&mcast_mutex);
+  free(m);
+}
+
+/*
+ * Make the first member the master and tell it so.  Without members,
+ * the group is closed, as nobody can join it any more.
+ * Return: the master, NULL when the group is closed.
+ */
+static struct mcast_member *mcast_promote(mcast_group *g)
+{
+  struct mcast_member *m;
+  mcast_group **gp;
+
+  pthread_mutex_lock(&mcast_mutex);
+  if ((m = g->members) != NULL) {
+    mcast_oack(g, m, 1);
+    pthread_mutex_unlock(&mcast_mutex);
+    return m;
+  }
+  for (gp = &mcast_list; *gp != NULL; gp = &(*gp)->next) {
+    if (*gp == g) {
+      *gp = g->next;
+      break;
+    }
+  }
+  mcast_used &= ~(1U << g->index);
+  pthread_mutex_unlock(&mcast_mutex);
+
+  close(g->sock);
+  free(g);
+  return NULL;
+}
+
+/*
+ * Run the transfer of a group until its last member is done.  The
+ * caller still owns the file descriptor.
+ * Return: bytes sent to the group.
+ */
+uint64_t mcast_serve(mcast_group *g)
+{
+  struct mcast_member *m, *master;
+  struct sockaddr_in from;
+  socklen_t fromlen;
+  struct pollfd pfd;
+  struct tftphdr *dp, *ap;
+  char data[MCAST_PKTSIZE], ack[MCAST_PKTSIZE];
+  uint64_t since, bytes = 0;
+  unsigned short last, block;
+  ssize_t len, data_len = 0;
+  int timeout = 0, acked = 0, was_master;
+
+  /* the last block is the short one, it may be empty. */
+  last = g->size / SEGSIZE + 1;
+  dp = (struct tftphdr *)data;
+  ap = (struct tftphdr *)ack;
+  dp->th_opcode = htons((unsigned short)DATA);
+  pfd.fd = g->sock;
+  pfd.events = POLLIN;
+
+  master = mcast_promote(g);
+  since = mcast_now();
+  while (master != NULL) {
+    if (poll(&pfd, 1, mcast_wait_left(since)) <= 0) {
+      timeout += MCAST_TIMEOUT;
+      if (timeout >= MCAST_MAXTIMEOUT) {
+        /* the master is gone, the next one goes on from its blocks. */
+        mcast_leave(g, master);
+        goto promote;
+      }
+      if (acked) {
+        sendto(g->sock, data, data_len, 0,
+               (struct sockaddr *)&g->addr, sizeof(g->addr));
+      }
+      else {
+        mcast_oack(g, master, 1);
+      }
+      since = mcast_now();
+      continue;
+    }
+
+    fromlen = sizeof(from);
+    len = recvfrom(g->sock, ack, sizeof(ack), 0,
+                   (struct sockaddr *)&from, &fromlen);
+    if (len < 4 || (m = mcast_find(g, &from)) == NULL) {
+      continue;
+    }
+    was_master = m == master;
+    if (ntohs(ap->th_opcode) == ERROR) {
+      mcast_leave(g, m);
+      if (was_master) {
+        goto promote;
+      }
+      continue;
+    }
+    if (ntohs(ap->th_opcode) != ACK) {
+      continue;
+    }
+
+    block = ntohs(ap->th_block);
+    if (block == last) {
+      /* it has the whole file, whether master or not. */
+      mcast_leave(g, m);
+      if (was_master) {
+        goto promote;
+      }
+      continue;
+    }
+    if (!was_master || block > last) {
+      continue;
+    }
+
+    /* the master has all blocks up to this one, send the next. */
+    block++;
+    len = pread(g->fd, dp->th_data, SEGSIZE, (off_t)(block - 1) * SEGSIZE);
+    if (len < 0) {
+      perror("mcast_serve: pread");
+      while (g->members != NULL) {
+        mcast_leave(g, g->members);
+      }
+      goto promote;
+    }
+    dp->th_block = htons(block);
+    data_len = len + 4;
+    sendto(g->sock, data, data_len, 0,
+           (struct sockaddr *)&g->addr, sizeof(g->addr));
+    __atomic_add_fetch(&mcast_packets, 1, __ATOMIC_RELAXED);
+    bytes += len;
+    timeout = 0;
+    acked = 1;
+    since = mcast_now();
+    continue;
+
+  promote:
+    master = mcast_promote(g);
+    timeout = 0;
+    acked = 0;
+    since = mcast_now();
+  }
+  return bytes;
+}
+
+void mcast_total_stat(unsigned long *groups, unsigned long *clients,
+                      unsigned long *packets)
+{
+  pthread_mutex_lock(&mcast_mutex);
+  *groups = mcast_groups;
+  *clients = mcast_clients;
+  pthread_mutex_unlock(&mcast_mutex);
+  *packets = __atomic_load_n(&mcast_packets, __ATOMIC_RELAXED);
+}
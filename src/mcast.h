@@ -0,0 +1,80 @@
+/*
+   mcast.h
+   $Id$
+
+   This file is part of t-tftpd.
+
+   Copyright 2002,2007 Tomofumi Hayashi <s1061123@gmail.com>.
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+   3. All advertising materials mentioning features or use of this software
+      must display the following acknowledgement:
+
+        This product includes software developed by
+        Tomofumi Hayashi <s1061123@gmail.com> and its contributors.
+
+   4. Neither the name of authors nor the names of its contributors may be used
+      to endorse or promote products derived from this software without
+      specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND ANY
+   EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _MCAST_H_
+#define _MCAST_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+/*
+ * Multicast TFTP (RFC 2090) for RRQs in octet mode.
+ * The clients reading the same file share one group: DATA goes to the
+ * group address, and only the master client ACKs.  When the master has
+ * all blocks, the next member becomes the master and ACKs the blocks
+ * it is still missing, so a late joiner gets the start of the file.
+ *
+ * -G takes "<group>[:<port>][,<interface>]"; every running transfer
+ * gets an address of its own, counted up from <group>.
+ */
+typedef struct mcast_group mcast_group;
+
+#define MCAST_DEFAULT_PORT 1758
+#define MCAST_MAX_GROUPS 16
+/* block numbers are 16 bits and must not wrap in a group. */
+#define MCAST_MAX_BLOCKS 65535
+
+int mcast_config(const char *spec);
+int mcast_enabled(void);
+int mcast_join(int fd, const struct sockaddr_in *client, int tsize,
+               mcast_group **group);
+uint64_t mcast_serve(mcast_group *group);
+void mcast_total_stat(unsigned long *groups, unsigned long *clients,
+                      unsigned long *packets);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* !_MCAST_H_ */
@@ -0,0 +1,699 @@
+/*
+   metrics.c
+   $Id$
+
+   This file is part of t-tftpd.
+
+   Copyright 2002,2007 Tomofumi Hayashi <s1061123@gmail.com>.
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+   3. All advertising materials mentioning features or use of this software
+      must display the following acknowledgement:
+
+        This product includes software developed by
+        Tomofumi Hayashi <s1061123@gmail.com> and its contributors.
+
+   4. Neither the name of authors nor the names of its contributors may be used
+      to endorse or promote products derived from this software without
+      specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND ANY
+   EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "metrics.h"
+#include "readahead.h"
+#include "stream.h"
+#include "upload.h"
+#include "mcast.h"
+#include "shape.h"
+#include "admit.h"
+#include "dedup.h"
+#include "affinity.h"
+#include "reload.h"
+#include "vfile.h"
+#include "proxy.h"
+#include "rewrite.h"
+#include "acl.h"
+#include "fdcache.h"
+
+/*
+ * Histogram buckets (HDR style): values below 4 usec have their own
+ * bucket, above that every power of two is split into 4 linear buckets.
+ * The last bucket takes everything from 2^MH_MAX_EXP usec (~19h) on.
+ */
+#define MH_SUB_BITS 2
+#define MH_SUB (1 << MH_SUB_BITS)
+#define MH_MAX_EXP 36
+#define MH_BUCKETS ((MH_MAX_EXP - MH_SUB_BITS + 2) * MH_SUB + 1)
+
+#define METRICS_BACKLOG 8
+#define METRICS_REQUEST_WAIT 200 /* msec */
+
+struct metric_shard {
+  uint64_t counter[MC_NUM];
+  uint64_t bucket[MH_NUM][MH_BUCKETS];
+  uint64_t sum[MH_NUM];
+  struct metric_shard *next;       /* all shards, never removed */
+  struct metric_shard *next_free;
+};
+
+/*
+ * shards shared by the processes of prefork mode, size of them for each
+ * process slot.  A process started again in a slot counts on in the
+ * shards of the one before it.
+ */
+struct metric_area {
+  unsigned long slots, size;
+  unsigned long unshared;      /* shards taken outside of the area */
+  unsigned long *used;         /* shards of each slot ever taken */
+  struct metric_shard shard[1];
+};
+
+static pthread_once_t metrics_once = PTHREAD_ONCE_INIT;
+static pthread_key_t metrics_key;
+static pthread_mutex_t metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct metric_shard *shard_list = NULL;
+static struct metric_shard *shard_free = NULL;
+static struct metric_area *area = NULL;
+static unsigned long area_slot = 0, area_taken = 0;
+static int metrics_sock = -1;
+
+static const char *histogram_name[MH_NUM] = {
+  "tftpd_first_byte_seconds",
+  "tftpd_transfer_duration_seconds",
+  "tftpd_ack_rtt_seconds",
+  "tftpd_queue_wait_seconds",
+  "tftpd_rewrite_lookup_seconds",
+};
+
+static const char *histogram_help[MH_NUM] = {
+  "Time from request receipt to the first DATA packet.",
+  "Time from request receipt to the end of the session.",
+  "Time from sending a DATA packet to its ACK.",
+  "Time a request waited in the socket buffer for a thread.",
+  "Time to put a requested name through the rewrite rules.",
+};
+
+static void metrics_key_create(void);
+static void shard_release(void *ptr);
+static struct metric_shard *metrics_shard(void);
+static struct metric_shard *shard_next(struct metric_shard *sp);
+static int bucket_index(uint64_t usec);
+static uint64_t bucket_upper(int idx);
+static void *metrics_thread(void *param);
+static void metrics_write(FILE *fp);
+
+uint64_t metrics_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void metrics_key_create(void)
+{
+  pthread_key_create(&metrics_key, shard_release);
+}
+
+/* thread exit: the next thread continues counting in this shard. */
+static void shard_release(void *ptr)
+{
+  struct metric_shard *sp;
+
+  sp = (struct metric_shard *)ptr;
+  pthread_mutex_lock(&metrics_mutex);
+  sp->next_free = shard_free;
+  shard_free = sp;
+  pthread_mutex_unlock(&metrics_mutex);
+}
+
+static struct metric_shard *metrics_shard(void)
+{
+  struct metric_shard *sp;
+  unsigned long idx;
+
+  pthread_once(&metrics_once, metrics_key_create);
+  sp = pthread_getspecific(metrics_key);
+  if (sp != NULL) {
+    return sp;
+  }
+
+  pthread_mutex_lock(&metrics_mutex);
+  if (shard_free != NULL) {
+    sp = shard_free;
+    shard_free = sp->next_free;
+  }
+  else {
+    sp = NULL;
+    if (area != NULL) {
+      if ((idx = area_taken) < area->size) {
+        area_taken++;
+        sp = &area->shard[area_slot * area->size + idx];
+        if (area->used[area_slot] < area_taken) {
+          __atomic_store_n(&area->used[area_slot], area_taken,
+                           __ATOMIC_RELAXED);
+        }
+      }
+      else {
+        /* more threads than at the start, counted by this process only. */
+        __atomic_fetch_add(&area->unshared, 1, __ATOMIC_RELAXED);
+      }
+    }
+    if (sp == NULL &&
+        (sp = (struct metric_shard *)calloc(1,
+                                            sizeof(struct metric_shard)))
+        != NULL) {
+      sp->next = shard_list;
+      __atomic_store_n(&shard_list, sp, __ATOMIC_RELEASE);
+    }
+  }
+  pthread_mutex_unlock(&metrics_mutex);
+
+  if (sp != NULL) {
+    pthread_setspecific(metrics_key, sp);
+  }
+  return sp;
+}
+
+/*
+ * Walk all the shards: the shared ones of every process, then the
+ * ones of this process only.  Start with NULL.
+ */
+static struct metric_shard *shard_next(struct metric_shard *sp)
+{
+  unsigned long pos, end, slot;
+
+  end = area != NULL ? area->slots * area->size : 0;
+  if (area != NULL &&
+      (sp == NULL || (sp >= area->shard && sp < area->shard + end))) {
+    pos = sp == NULL ? 0 : (unsigned long)(sp - area->shard) + 1;
+    while (pos < end) {
+      slot = pos / area->size;
+      if (pos % area->size <
+          __atomic_load_n(&area->used[slot], __ATOMIC_RELAXED)) {
+        return &area->shard[pos];
+      }
+      pos = (slot + 1) * area->size;
+    }
+    sp = NULL;
+  }
+  if (sp == NULL) {
+    return __atomic_load_n(&shard_list, __ATOMIC_ACQUIRE);
+  }
+  return sp->next;
+}
+
+/*
+ * Count in shards shared with the processes forked after this, so the
+ * endpoint of any of them shows the counts and histograms of all.
+ * Each of slots processes has shards of them, see metrics_slot().
+ * Return: 0 on success, -1 on error.
+ */
+int metrics_share(int slots, int shards)
+{
+  void *map;
+
+  map = mmap(NULL, sizeof(struct metric_area) +
+             sizeof(struct metric_shard) * (slots * shards - 1) +
+             sizeof(unsigned long) * slots,
+             PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED) {
+    perror("metrics share");
+    return -1;
+  }
+  area = (struct metric_area *)map;
+  area->slots = slots;
+  area->size = shards;
+  area->used = (unsigned long *)&area->shard[slots * shards];
+  return 0;
+}
+
+/* the forked process counts in the shards of slot, before any thread. */
+void metrics_slot(int slot)
+{
+  if (area != NULL && slot >= 0 && (unsigned long)slot < area->slots) {
+    area_slot = slot;
+    area_taken = 0;
+  }
+}
+
+void metrics_count(enum metric_counter c, uint64_t n)
+{
+  struct metric_shard *sp;
+
+  if ((sp = metrics_shard()) == NULL) {
+    return;
+  }
+  __atomic_fetch_add(&sp->counter[c], n, __ATOMIC_RELAXED);
+}
+
+static int bucket_index(uint64_t usec)
+{
+  int exp;
+
+  if (usec < MH_SUB) {
+    return (int)usec;
+  }
+  exp = 63 - __builtin_clzll(usec);
+  if (exp > MH_MAX_EXP) {
+    return MH_BUCKETS - 1;
+  }
+  return (exp - MH_SUB_BITS + 1) * MH_SUB +
+    (int)((usec >> (exp - MH_SUB_BITS)) & (MH_SUB - 1));
+}
+
+/* exclusive upper bound (usec) of a bucket. */
+static uint64_t bucket_upper(int idx)
+{
+  int exp;
+
+  if (idx < MH_SUB) {
+    return idx + 1;
+  }
+  exp = idx / MH_SUB + MH_SUB_BITS - 1;
+  return (uint64_t)(MH_SUB + idx % MH_SUB + 1) << (exp - MH_SUB_BITS);
+}
+
+void metrics_observe(enum metric_histogram h, uint64_t usec)
+{
+  struct metric_shard *sp;
+
+  if ((sp = metrics_shard()) == NULL) {
+    return;
+  }
+  __atomic_fetch_add(&sp->bucket[h][bucket_index(usec)], 1,
+                     __ATOMIC_RELAXED);
+  __atomic_fetch_add(&sp->sum[h], usec, __ATOMIC_RELAXED);
+}
+
+static void metrics_write(FILE *fp)
+{
+  struct metric_shard *sp;
+  uint64_t counter[MC_NUM];
+  uint64_t bucket[MH_BUCKETS], sum, total;
+  unsigned long ready, waited, writes, stalls, groups, clients, packets;
+  unsigned long files, sessions, shared, loaded, own, shaped, delayed;
+  unsigned long admitted, full, late, queued, admitted_active, passed;
+  unsigned long dup_active, dup_done;
+  unsigned long numa_local, numa_moved, numa_remote, numa_unknown;
+  unsigned long config_loaded, config_failed;
+  unsigned long vfile_rendered, vfile_cached;
+  unsigned long proxy_hit, proxy_fetched, proxy_shared, proxy_failed;
+  unsigned long proxy_missed;
+  unsigned long long proxy_bytes;
+  unsigned long rewrite_lookups, rewrite_cached, rewrite_done, rule_hits;
+  int rule_line;
+  unsigned long acl_prefixes, acl_allowed, acl_denied;
+  unsigned long fdc_hits, fdc_checked, fdc_opened, fdc_open;
+  unsigned long long bytes, shape_wait;
+  int cnt, h, idx;
+
+  memset(counter, 0, sizeof(counter));
+  for (sp = shard_next(NULL); sp != NULL; sp = shard_next(sp)) {
+    for (cnt = 0; cnt < MC_NUM; cnt++) {
+      counter[cnt] += __atomic_load_n(&sp->counter[cnt], __ATOMIC_RELAXED);
+    }
+  }
+
+  fprintf(fp, "# HELP tftpd_requests_total Requests by opcode.\n"
+          "# TYPE tftpd_requests_total counter\n"
+          "tftpd_requests_total{op=\"rrq\"} %llu\n"
+          "tftpd_requests_total{op=\"wrq\"} %llu\n",
+          (unsigned long long)counter[MC_RRQ],
+          (unsigned long long)counter[MC_WRQ]);
+  fprintf(fp, "# HELP tftpd_errors_total ERROR packets sent by code.\n"
+          "# TYPE tftpd_errors_total counter\n");
+  for (cnt = MC_ERROR; cnt <= MC_ERROR_LAST; cnt++) {
+    fprintf(fp, "tftpd_errors_total{code=\"%d\"} %llu\n",
+            cnt - MC_ERROR, (unsigned long long)counter[cnt]);
+  }
+  fprintf(fp, "# HELP tftpd_retransmits_total DATA or ACK packets sent again.\n"
+          "# TYPE tftpd_retransmits_total counter\n"
+          "tftpd_retransmits_total %llu\n"
+          "# HELP tftpd_timeouts_total Waits for the peer that timed out.\n"
+          "# TYPE tftpd_timeouts_total counter\n"
+          "tftpd_timeouts_total %llu\n",
+          (unsigned long long)counter[MC_RETRANSMIT],
+          (unsigned long long)counter[MC_TIMEOUT]);
+  fprintf(fp, "# HELP tftpd_bytes_sent_total File data served.\n"
+          "# TYPE tftpd_bytes_sent_total counter\n"
+          "tftpd_bytes_sent_total %llu\n"
+          "# HELP tftpd_bytes_received_total File data uploaded.\n"
+          "# TYPE tftpd_bytes_received_total counter\n"
+          "tftpd_bytes_received_total %llu\n",
+          (unsigned long long)counter[MC_BYTES_SENT],
+          (unsigned long long)counter[MC_BYTES_RECEIVED]);
+  fprintf(fp, "# HELP tftpd_sessions_total Sessions started.\n"
+          "# TYPE tftpd_sessions_total counter\n"
+          "tftpd_sessions_total %llu\n"
+          "# HELP tftpd_sessions_active Sessions in progress.\n"
+          "# TYPE tftpd_sessions_active gauge\n"
+          "tftpd_sessions_active %lld\n",
+          (unsigned long long)counter[MC_SESSION_START],
+          (long long)(counter[MC_SESSION_START] - counter[MC_SESSION_END]));
+  admit_total_stat(&admitted, &full, &late, &queued, &admitted_active,
+                    &passed);
+  fprintf(fp, "# HELP tftpd_admission_requests_total Requests admitted or "
+          "shed by the admission control.\n"
+          "# TYPE tftpd_admission_requests_total counter\n"
+          "tftpd_admission_requests_total{result=\"admitted\"} %lu\n"
+          "tftpd_admission_requests_total{result=\"queue_full\"} %lu\n"
+          "tftpd_admission_requests_total{result=\"deadline\"} %lu\n"
+          "# HELP tftpd_admission_queue_depth Requests waiting for a "
+          "thread.\n"
+          "# TYPE tftpd_admission_queue_depth gauge\n"
+          "tftpd_admission_queue_depth %lu\n"
+          "# HELP tftpd_admission_reordered_total Requests admitted ahead "
+          "of ones for larger files.\n"
+          "# TYPE tftpd_admission_reordered_total counter\n"
+          "tftpd_admission_reordered_total %lu\n",
+          admitted, full, late, queued, passed);
+  dedup_total_stat(&dup_active, &dup_done);
+  fprintf(fp, "# HELP tftpd_duplicates_total Requests dropped as copies of "
+          "a session in progress or just ended.\n"
+          "# TYPE tftpd_duplicates_total counter\n"
+          "tftpd_duplicates_total{session=\"active\"} %lu\n"
+          "tftpd_duplicates_total{session=\"done\"} %lu\n",
+          dup_active, dup_done);
+  affinity_total_stat(&numa_local, &numa_moved, &numa_remote, &numa_unknown);
+  fprintf(fp, "# HELP tftpd_numa_sessions_total Sessions by the node they "
+          "were served on, against the node their request came in on.\n"
+          "# TYPE tftpd_numa_sessions_total counter\n"
+          "tftpd_numa_sessions_total{placement=\"local\"} %lu\n"
+          "tftpd_numa_sessions_total{placement=\"moved\"} %lu\n"
+          "tftpd_numa_sessions_total{placement=\"remote\"} %lu\n"
+          "tftpd_numa_sessions_total{placement=\"unknown\"} %lu\n",
+          numa_local, numa_moved, numa_remote, numa_unknown);
+  reload_total_stat(&config_loaded, &config_failed);
+  fprintf(fp, "# HELP tftpd_config_loads_total Reads of the config file, "
+          "set or refused.\n"
+          "# TYPE tftpd_config_loads_total counter\n"
+          "tftpd_config_loads_total{result=\"loaded\"} %lu\n"
+          "tftpd_config_loads_total{result=\"failed\"} %lu\n",
+          config_loaded, config_failed);
+  vfile_total_stat(&vfile_rendered, &vfile_cached);
+  fprintf(fp, "# HELP tftpd_virtual_files_total Virtual files made from "
+          "a template or found in the cache.\n"
+          "# TYPE tftpd_virtual_files_total counter\n"
+          "tftpd_virtual_files_total{how=\"rendered\"} %lu\n"
+          "tftpd_virtual_files_total{how=\"cached\"} %lu\n",
+          vfile_rendered, vfile_cached);
+  proxy_total_stat(&proxy_hit, &proxy_fetched, &proxy_shared, &proxy_failed,
+                   &proxy_missed, &proxy_bytes);
+  fprintf(fp, "# HELP tftpd_proxy_files_total Files not in the tree, found "
+          "in the cache or fetched from the upstream.\n"
+          "# TYPE tftpd_proxy_files_total counter\n"
+          "tftpd_proxy_files_total{how=\"hit\"} %lu\n"
+          "tftpd_proxy_files_total{how=\"fetched\"} %lu\n"
+          "tftpd_proxy_files_total{how=\"shared\"} %lu\n"
+          "tftpd_proxy_files_total{how=\"failed\"} %lu\n"
+          "tftpd_proxy_files_total{how=\"missed\"} %lu\n"
+          "# HELP tftpd_proxy_bytes_total File data from the upstream.\n"
+          "# TYPE tftpd_proxy_bytes_total counter\n"
+          "tftpd_proxy_bytes_total %llu\n",
+          proxy_hit, proxy_fetched, proxy_shared, proxy_failed, proxy_missed,
+          proxy_bytes);
+  rewrite_total_stat(&rewrite_lookups, &rewrite_cached, &rewrite_done);
+  fprintf(fp, "# HELP tftpd_rewrite_lookups_total Names put through the "
+          "rewrite rules, found in the cache or rewritten.\n"
+          "# TYPE tftpd_rewrite_lookups_total counter\n"
+          "tftpd_rewrite_lookups_total{how=\"all\"} %lu\n"
+          "tftpd_rewrite_lookups_total{how=\"cached\"} %lu\n"
+          "tftpd_rewrite_lookups_total{how=\"rewritten\"} %lu\n"
+          "# HELP tftpd_rewrite_hits_total Names matched by each rule, by "
+          "its line.\n"
+          "# TYPE tftpd_rewrite_hits_total counter\n",
+          rewrite_lookups, rewrite_cached, rewrite_done);
+  for (idx = 0; rewrite_rule_stat(idx, &rule_line, &rule_hits) == 0; idx++) {
+    fprintf(fp, "tftpd_rewrite_hits_total{line=\"%d\"} %lu\n",
+            rule_line, rule_hits);
+  }
+  acl_total_stat(&acl_prefixes, &acl_allowed, &acl_denied);
+  fprintf(fp, "# HELP tftpd_acl_requests_total Requests allowed or refused "
+          "by the access list.\n"
+          "# TYPE tftpd_acl_requests_total counter\n"
+          "tftpd_acl_requests_total{result=\"allowed\"} %lu\n"
+          "tftpd_acl_requests_total{result=\"denied\"} %lu\n"
+          "# HELP tftpd_acl_prefixes Prefixes in the access list.\n"
+          "# TYPE tftpd_acl_prefixes gauge\n"
+          "tftpd_acl_prefixes %lu\n",
+          acl_allowed, acl_denied, acl_prefixes);
+  fdc_total_stat(&fdc_hits, &fdc_checked, &fdc_opened, &fdc_open);
+  fprintf(fp, "# HELP tftpd_fdcache_opens_total RRQ files by how the "
+          "descriptor was found.\n"
+          "# TYPE tftpd_fdcache_opens_total counter\n"
+          "tftpd_fdcache_opens_total{how=\"hit\"} %lu\n"
+          "tftpd_fdcache_opens_total{how=\"checked\"} %lu\n"
+          "tftpd_fdcache_opens_total{how=\"opened\"} %lu\n"
+          "# HELP tftpd_fdcache_open Descriptors kept open by the cache.\n"
+          "# TYPE tftpd_fdcache_open gauge\n"
+          "tftpd_fdcache_open %lu\n",
+          fdc_hits, fdc_checked, fdc_opened, fdc_open);
+  if (area != NULL) {
+    fprintf(fp, "# HELP tftpd_metrics_unshared_shards_total Shards the "
+            "workers took outside of the shared area, their counts are "
+            "missing here.\n"
+            "# TYPE tftpd_metrics_unshared_shards_total counter\n"
+            "tftpd_metrics_unshared_shards_total %lu\n",
+            __atomic_load_n(&area->unshared, __ATOMIC_RELAXED));
+  }
+
+  ra_total_stat(&ready, &waited);
+  rs_total_stat(&files, &sessions, &shared, &loaded, &own);
+  fprintf(fp, "# HELP tftpd_stream_files_total Shared read streams opened.\n"
+          "# TYPE tftpd_stream_files_total counter\n"
+          "tftpd_stream_files_total %lu\n"
+          "# HELP tftpd_stream_sessions_total Sessions reading through a "
+          "shared stream.\n"
+          "# TYPE tftpd_stream_sessions_total counter\n"
+          "tftpd_stream_sessions_total %lu\n"
+          "# HELP tftpd_stream_chunks_total Chunks found in a shared "
+          "stream, read into it "
+          "or read alone.\n"
+          "# TYPE tftpd_stream_chunks_total counter\n"
+          "tftpd_stream_chunks_total{how=\"shared\"} %lu\n"
+          "tftpd_stream_chunks_total{how=\"read\"} %lu\n"
+          "tftpd_stream_chunks_total{how=\"alone\"} %lu\n",
+          files, sessions, shared, loaded, own);
+  uw_total_stat(&writes, &bytes);
+  uw_total_stall(&stalls);
+  fprintf(fp, "# HELP tftpd_readahead_blocks_total Blocks the sender found "
+          "ready or waited for.\n"
+          "# TYPE tftpd_readahead_blocks_total counter\n"
+          "tftpd_readahead_blocks_total{state=\"ready\"} %lu\n"
+          "tftpd_readahead_blocks_total{state=\"waited\"} %lu\n",
+          ready, waited);
+  fprintf(fp, "# HELP tftpd_upload_writes_total write() calls for uploads.\n"
+          "# TYPE tftpd_upload_writes_total counter\n"
+          "tftpd_upload_writes_total %lu\n"
+          "# HELP tftpd_upload_bytes_total Bytes written for uploads.\n"
+          "# TYPE tftpd_upload_bytes_total counter\n"
+          "tftpd_upload_bytes_total %llu\n"
+          "# HELP tftpd_upload_stalls_total ACKs delayed by a full "
+          "write-behind ring.\n"
+          "# TYPE tftpd_upload_stalls_total counter\n"
+          "tftpd_upload_stalls_total %lu\n",
+          writes, bytes, stalls);
+  mcast_total_stat(&groups, &clients, &packets);
+  fprintf(fp, "# HELP tftpd_multicast_groups_total Multicast transfers "
+          "started.\n"
+          "# TYPE tftpd_multicast_groups_total counter\n"
+          "tftpd_multicast_groups_total %lu\n"
+          "# HELP tftpd_multicast_clients_total Clients served by "
+          "multicast.\n"
+          "# TYPE tftpd_multicast_clients_total counter\n"
+          "tftpd_multicast_clients_total %lu\n"
+          "# HELP tftpd_multicast_packets_total DATA packets sent to "
+          "multicast groups.\n"
+          "# TYPE tftpd_multicast_packets_total counter\n"
+          "tftpd_multicast_packets_total %lu\n",
+          groups, clients, packets);
+  shape_total_stat(&shaped, &delayed, &shape_wait);
+  fprintf(fp, "# HELP tftpd_shape_packets_total DATA packets sent at once or "
+          "delayed by the bandwidth limits.\n"
+          "# TYPE tftpd_shape_packets_total counter\n"
+          "tftpd_shape_packets_total{state=\"passed\"} %lu\n"
+          "tftpd_shape_packets_total{state=\"delayed\"} %lu\n"
+          "# HELP tftpd_shape_wait_seconds_total Time DATA packets waited "
+          "for the bandwidth limits.\n"
+          "# TYPE tftpd_shape_wait_seconds_total counter\n"
+          "tftpd_shape_wait_seconds_total %.6f\n",
+          shaped - delayed, delayed, shape_wait / 1000000.0);
+
+  for (h = 0; h < MH_NUM; h++) {
+    memset(bucket, 0, sizeof(bucket));
+    sum = 0;
+    for (sp = shard_next(NULL); sp != NULL; sp = shard_next(sp)) {
+      for (idx = 0; idx < MH_BUCKETS; idx++) {
+        bucket[idx] += __atomic_load_n(&sp->bucket[h][idx], __ATOMIC_RELAXED);
+      }
+      sum += __atomic_load_n(&sp->sum[h], __ATOMIC_RELAXED);
+    }
+
+    fprintf(fp, "# HELP %s %s\n# TYPE %s histogram\n",
+            histogram_name[h], histogram_help[h], histogram_name[h]);
+    total = 0;
+    for (idx = 0; idx < MH_BUCKETS - 1; idx++) {
+      total += bucket[idx];
+      fprintf(fp, "%s_bucket{le=\"%.6f\"} %llu\n", histogram_name[h],
+              bucket_upper(idx) / 1000000.0, (unsigned long long)total);
+    }
+    total += bucket[MH_BUCKETS - 1];
+    fprintf(fp, "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.6f\n%s_count %llu\n",
+            histogram_name[h], (unsigned long long)total,
+            histogram_name[h], sum / 1000000.0,
+            histogram_name[h], (unsigned long long)total);
+  }
+}
+
+/*
+ * Serve one scrape per connection.  An HTTP request gets an HTTP reply,
+ * anything else (or nothing within a short wait) gets the bare text.
+ */
+static void *metrics_thread(void *param)
+{
+  int conn;
+  char req[1024];
+  ssize_t len;
+
+  (void)param;
+  struct pollfd pfd[1];
+  FILE *fp;
+
+  for (;;) {
+    conn = accept(metrics_sock, NULL, NULL);
+    if (conn == -1) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      perror("metrics accept");
+      sleep(1);
+      continue;
+    }
+
+    len = 0;
+    pfd[0].fd = conn;
+    pfd[0].events = POLLIN;
+    if (poll(pfd, 1, METRICS_REQUEST_WAIT) > 0) {
+      len = recv(conn, req, sizeof(req) - 1, 0);
+    }
+
+    fp = fdopen(conn, "w");
+    if (fp == NULL) {
+      close(conn);
+      continue;
+    }
+    if (len >= 4 && strncmp(req, "GET ", 4) == 0) {
+      fprintf(fp, "HTTP/1.0 200 OK\r\n"
+              "Content-Type: text/plain; version=0.0.4\r\n"
+              "Connection: close\r\n\r\n");
+    }
+    metrics_write(fp);
+    fclose(fp);
+  }
+
+  return NULL;
+}
+
+/*
+ * listen_on: a path for a UNIX socket, or a TCP port on the loopback.
+ * Return: 0 on success, -1 on error.
+ */
+int metrics_start(const char *listen_on)
+{
+  struct sockaddr_un sun;
+  struct sockaddr_in sin;
+  pthread_t tid;
+  const int on = 1;
+  int port;
+
+  if (listen_on[0] == '/') {
+    if (strlen(listen_on) >= sizeof(sun.sun_path)) {
+      fprintf(stderr, "metrics socket path is too long.\n");
+      return -1;
+    }
+    metrics_sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (metrics_sock == -1) {
+      perror("metrics socket");
+      return -1;
+    }
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strncpy(sun.sun_path, listen_on, sizeof(sun.sun_path) - 1);
+    unlink(listen_on);
+    if (bind(metrics_sock, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+      perror("metrics bind");
+      close(metrics_sock);
+      return -1;
+    }
+  }
+  else {
+    port = atoi(listen_on);
+    if (port <= 0 || port > 65535) {
+      fprintf(stderr, "metrics port (%s) is invalid.\n", listen_on);
+      return -1;
+    }
+    metrics_sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (metrics_sock == -1) {
+      perror("metrics socket");
+      return -1;
+    }
+    setsockopt(metrics_sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin.sin_port = htons(port);
+    if (bind(metrics_sock, (struct sockaddr *)&sin, sizeof(sin)) == -1) {
+      perror("metrics bind");
+      close(metrics_sock);
+      return -1;
+    }
+  }
+
+  if (listen(metrics_sock, METRICS_BACKLOG) == -1 ||
+      pthread_create(&tid, NULL, metrics_thread, NULL) != 0) {
+    perror("metrics listen");
+    close(metrics_sock);
+    return -1;
+  }
+  pthread_detach(tid);
+
+  return 0;
+}
@@ -0,0 +1,92 @@
+/*
+   metrics.h
+   $Id$
+
+   This file is part of t-tftpd.
+
+   Copyright 2002,2007 Tomofumi Hayashi <s1061123@gmail.com>.
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+   3. All advertising materials mentioning features or use of this software
+      must display the following acknowledgement:
+
+        This product includes software developed by
+        Tomofumi Hayashi <s1061123@gmail.com> and its contributors.
+
+   4. Neither the name of authors nor the names of its contributors may be used
+      to endorse or promote products derived from this software without
+      specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND ANY
+   EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdint.h>
+
+/*
+ * Server metrics.
+ * Every thread counts into its own shard with relaxed atomic adds, so the
+ * transfer paths never take a lock for it.  The shards are only summed
+ * when somebody reads the metrics endpoint (Prometheus text format).
+ * In prefork mode the shards are in a mapping shared by the workers;
+ * the gauges and counters of the other modules are of the process
+ * serving the endpoint.
+ */
+enum metric_counter {
+  MC_RRQ,
+  MC_WRQ,
+  MC_RETRANSMIT,      /* DATA or ACK sent again */
+  MC_TIMEOUT,         /* poll() expired while waiting for the peer */
+  MC_BYTES_SENT,      /* file data in DATA packets that were ACKed */
+  MC_BYTES_RECEIVED,  /* file data in accepted DATA packets */
+  MC_SESSION_START,
+  MC_SESSION_END,
+  MC_ERROR,           /* MC_ERROR + TFTP error code, see tftp.h */
+  MC_ERROR_LAST = MC_ERROR + 7,
+  MC_NUM
+};
+
+enum metric_histogram {
+  MH_FIRST_BYTE,      /* request received -> first DATA sent */
+  MH_DURATION,        /* request received -> session finished */
+  MH_ACK_RTT,         /* DATA sent -> its ACK (not retransmitted ones) */
+  MH_QUEUE_WAIT,      /* request queued in the kernel -> read by a thread */
+  MH_REWRITE,         /* lookup of the rewrite rules for a name */
+  MH_NUM
+};
+
+uint64_t metrics_now(void);
+void metrics_count(enum metric_counter c, uint64_t n);
+void metrics_observe(enum metric_histogram h, uint64_t usec);
+int metrics_share(int slots, int shards);
+void metrics_slot(int slot);
+int metrics_start(const char *listen_on);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* !_METRICS_H_ */
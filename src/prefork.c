@@ -0,0 +1,335 @@
+/*
+   prefork.c
+   $Id$
+
+   This file is part of t-tftpd.
+
+   Copyright 2002,2007 Tomofumi Hayashi <s1061123@gmail.com>.
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+   3. All advertising materials mentioning features or use of this software
+      must display the following acknowledgement:
+
+        This product includes software developed by
+        Tomofumi Hayashi <s1061123@gmail.com> and its contributors.
+
+   4. Neither the name of authors nor the names of its contributors may be used
+      to endorse or promote products derived from this software without
+      specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND ANY
+   EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif /* __linux__ */
+
+#include "prefork.h"
+
+struct prefork_index {
+  int current;        /* the half in use */
+  f_node *root[2];
+  char path[2][PATH_MAX];
+  unsigned long gen[2];  /* counts the trees published */
+  size_t size;        /* of a half */
+};
+
+struct prefork_worker {
+  pid_t pid;
+  time_t started;
+};
+
+/* mapped before fork(), at the same address in all the processes. */
+static struct prefork_index *index_map = NULL;
+static char *index_half[2];
+
+static volatile sig_atomic_t prefork_quit = 0;
+static volatile sig_atomic_t prefork_reload = 0;
+static sigset_t worker_mask;
+
+static time_t prefork_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+/*
+ * Return: 0 on success, -1 on error.
+ */
+int prefork_index_init(size_t size)
+{
+  void *map;
+
+  map = mmap(NULL, sizeof(struct prefork_index) + size * 2,
+             PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS|MAP_NORESERVE,
+             -1, 0);
+  if (map == MAP_FAILED) {
+    perror("prefork index");
+    return -1;
+  }
+  index_map = (struct prefork_index *)map;
+  index_map->size = size;
+  index_half[0] = (char *)map + sizeof(struct prefork_index);
+  index_half[1] = index_half[0] + size;
+  return 0;
+}
+
+/*
+ * Copy the entries of a directory, and the ones below them, to *cur.
+ * Return: the copy, NULL when it doesn't fit (*cur is set to NULL).
+ */
+static f_node *index_copy(f_node *src, char **cur, char *end)
+{
+  f_node *head, **tail, *dst;
+
+  head = NULL;
+  tail = &head;
+  for (; src != NULL; src = src->next) {
+    if (*cur == NULL || end - *cur < (ptrdiff_t)sizeof(f_node)) {
+      *cur = NULL;
+      return NULL;
+    }
+    dst = (f_node *)*cur;
+    *cur += sizeof(f_node);
+    *dst = *src;
+    dst->next = NULL;
+    dst->child = NULL;
+    if (src->child != NULL) {
+      dst->child = index_copy(src->child, cur, end);
+    }
+    *tail = dst;
+    tail = &dst->next;
+  }
+  return head;
+}
+
+/*
+ * Copy tree, read from path, into the half not in use and switch to it.
+ * Return: 0 on success, -1 when the tree doesn't fit.
+ */
+int prefork_index_publish(f_node *tree, const char *path)
+{
+  char *cur;
+  int half;
+
+  half = !index_map->current;
+  cur = index_half[half];
+  index_map->root[half] = index_copy(tree, &cur,
+                                     index_half[half] + index_map->size);
+  if (cur == NULL) {
+    return -1;
+  }
+  snprintf(index_map->path[half], PATH_MAX, "%s", path);
+  index_map->gen[half] = index_map->gen[!half] + 1;
+  __atomic_store_n(&index_map->current, half, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/*
+ * path, when not NULL, is set to the directory of the tree, and gen to
+ * the number of the tree.
+ */
+f_node *prefork_index(const char **path, unsigned long *gen)
+{
+  int half;
+
+  half = __atomic_load_n(&index_map->current, __ATOMIC_ACQUIRE);
+  if (path != NULL) {
+    *path = index_map->path[half];
+  }
+  if (gen != NULL) {
+    *gen = index_map->gen[half];
+  }
+  return index_map->root[half];
+}
+
+static void prefork_signal(int sig)
+{
+  (void)sig;
+  prefork_quit = 1;
+}
+
+static void prefork_child(int sig)
+{
+  (void)sig;
+}
+
+static void prefork_hangup(int sig)
+{
+  (void)sig;
+  prefork_reload = 1;
+}
+
+/*
+ * Fork a worker.
+ * Return: 0 in the worker, the pid in the supervisor, -1 on error.
+ */
+static pid_t prefork_spawn(struct prefork_worker *wp)
+{
+  pid_t pid;
+
+  /* or the worker writes out what is buffered once more. */
+  fflush(NULL);
+  if ((pid = fork()) == -1) {
+    perror("prefork fork");
+    return -1;
+  }
+  if (pid == 0) {
+    signal(SIGINT, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGHUP, SIG_DFL);
+    sigprocmask(SIG_SETMASK, &worker_mask, NULL);
+#ifdef PR_SET_PDEATHSIG
+    /* the worker goes with the supervisor. */
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif /* PR_SET_PDEATHSIG */
+    return 0;
+  }
+  wp->pid = pid;
+  wp->started = prefork_now();
+  return pid;
+}
+
+/*
+ * Become the supervisor of workers worker processes, calling refresh
+ * every interval seconds.  Must be called before any thread is started.
+ * reload, when not NULL, is called on SIGHUP; the workers get the
+ * signal with the mask they were started with.
+ * Return: the number of the worker (0 to workers - 1), in each worker.
+ * The supervisor exits when it gets SIGTERM or SIGINT, or when a worker
+ * fails to start.
+ */
+int prefork_run(int workers, int interval, prefork_refresh_fn refresh,
+                prefork_refresh_fn reload)
+{
+  struct prefork_worker worker[PREFORK_MAX_WORKERS];
+  void (*term)(int);
+  sigset_t hup;
+  time_t refreshed;
+  pid_t pid;
+  int cnt, status, fatal;
+
+  term = signal(SIGTERM, prefork_signal);
+  signal(SIGINT, prefork_signal);
+  signal(SIGCHLD, prefork_child);
+  sigprocmask(SIG_SETMASK, NULL, &worker_mask);
+  if (reload != NULL) {
+    signal(SIGHUP, prefork_hangup);
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+    sigprocmask(SIG_UNBLOCK, &hup, NULL);
+  }
+  for (cnt = 0; cnt < workers; cnt++) {
+    if ((pid = prefork_spawn(&worker[cnt])) == 0) {
+      signal(SIGTERM, term);
+      return cnt;
+    }
+    if (pid == -1) {
+      exit(1);
+    }
+  }
+  printf("prefork: %d workers started.\n", workers);
+
+  fatal = 0;
+  refreshed = prefork_now();
+  while (!prefork_quit) {
+    if (prefork_reload) {
+      prefork_reload = 0;
+      reload();
+      /* a new root waits for the half not in use to be an interval old. */
+      if (prefork_now() - refreshed >= interval) {
+        refresh();
+        refreshed = prefork_now();
+      }
+      for (cnt = 0; cnt < workers; cnt++) {
+        if (worker[cnt].pid > 0) {
+          kill(worker[cnt].pid, SIGHUP);
+        }
+      }
+    }
+    pid = waitpid(-1, &status, WNOHANG);
+    if (pid <= 0) {
+      sleep(1);
+      if (prefork_now() - refreshed >= interval) {
+        refresh();
+        refreshed = prefork_now();
+      }
+      continue;
+    }
+    for (cnt = 0; cnt < workers && worker[cnt].pid != pid; cnt++)
+      ;
+    if (cnt == workers) {
+      continue;
+    }
+    if (WIFSIGNALED(status)) {
+      fprintf(stderr, "prefork: worker %d (pid %d) killed by signal %d.\n",
+              cnt, (int)pid, WTERMSIG(status));
+    }
+    else {
+      fprintf(stderr, "prefork: worker %d (pid %d) exited with %d.\n",
+              cnt, (int)pid, WEXITSTATUS(status));
+    }
+    worker[cnt].pid = 0;
+    if (prefork_now() - worker[cnt].started < PREFORK_MIN_LIFE) {
+      if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+        /* it couldn't start, the others won't either. */
+        fatal = 1;
+        break;
+      }
+      sleep(PREFORK_MIN_LIFE);
+    }
+    if ((pid = prefork_spawn(&worker[cnt])) == 0) {
+      signal(SIGTERM, term);
+      return cnt;
+    }
+    if (pid == -1) {
+      fatal = 1;
+      break;
+    }
+  }
+
+  signal(SIGCHLD, SIG_DFL);
+  for (cnt = 0; cnt < workers; cnt++) {
+    if (worker[cnt].pid > 0) {
+      kill(worker[cnt].pid, SIGTERM);
+    }
+  }
+  while (wait(&status) != -1 || errno == EINTR)
+    ;
+  exit(fatal);
+}
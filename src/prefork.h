@@ -0,0 +1,87 @@
+/*
+   prefork.h
+   $Id$
+
+   This file is part of t-tftpd.
+
+   Copyright 2002,2007 Tomofumi Hayashi <s1061123@gmail.com>.
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+   3. All advertising materials mentioning features or use of this software
+      must display the following acknowledgement:
+
+        This product includes software developed by
+        Tomofumi Hayashi <s1061123@gmail.com> and its contributors.
+
+   4. Neither the name of authors nor the names of its contributors may be used
+      to endorse or promote products derived from this software without
+      specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND ANY
+   EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _PREFORK_H_
+#define _PREFORK_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stddef.h>
+
+#include "tftpdsubs.h"
+
+/*
+ * Prefork mode.
+ * With -P N, the process binds the server sockets and then forks N
+ * worker processes, each of them serving the sockets with its own
+ * threads.  The first process stays as the supervisor: it starts a
+ * worker again when one dies, and builds the tree of the files for all
+ * of them.  A crash in a transfer takes down one worker, not the
+ * service.
+ *
+ * The tree is copied into a mapping shared by all the processes.  It
+ * has two halves, the supervisor fills the one not in use and then
+ * switches to it; a half is not written again until an interval after
+ * it went out of use, far longer than a lookup takes.  Each half has
+ * the directory its tree was read from, a new root is switched with it.
+ * On SIGHUP, the supervisor calls reload and then passes the signal to
+ * the workers; the tree is published again at once when the last one
+ * is an interval old, else at the next refresh, so that a SIGHUP never
+ * rewrites a half which is just out of use.
+ */
+#define PREFORK_MAX_WORKERS 64
+#define PREFORK_INDEX_SIZE (64 * 1024 * 1024)  /* bytes, for each half */
+#define PREFORK_MIN_LIFE 1  /* sec, a worker failing sooner didn't start */
+
+typedef void (*prefork_refresh_fn)(void);
+
+int prefork_index_init(size_t size);
+int prefork_index_publish(f_node *tree, const char *path);
+f_node *prefork_index(const char **path, unsigned long *gen);
+int prefork_run(int workers, int interval, prefork_refresh_fn refresh,
+                prefork_refresh_fn reload);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* !_PREFORK_H_ */
@@ -0,0 +1,795 @@
+/*
+   proxy.c
+   $Id$
+
+   This file is part of t-tftpd.
+
+   Copyright 2002,2007 Tomofumi Hayashi <s1061123@gmail.com>.
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+   3. All advertising materials mentioning features or use of this software
+      must display the following acknowledgement:
+
+        This product includes software developed by
+        Tomofumi Hayashi <s1061123@gmail.com> and its contributors.
+
+   4. Neither the name of authors nor the names of its contributors may be used
+      to endorse or promote products derived from this software without
+      specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND ANY
+   EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <time.h>
+
+#include "tftp.h"
+#include "proxy.h"
+
+/* room for ".<name>.part.<pid>.<seq>" in a directory entry. */
+#define PROXY_NAME_SIZ (NAME_MAX - 32)
+
+struct proxy_fetch {
+  proxy_fetch *next;
+  char name[PATH_MAX];   /* as requested */
+  char path[PATH_MAX];   /* in the cache */
+  char part[PATH_MAX];   /* while it comes in */
+  int fd;                /* for the fetch thread to write */
+  int refs;
+  int started, done, failed;
+  off_t size;            /* written so far */
+  pthread_cond_t cond;
+};
+
+/* a name the upstream didn't give, not asked again until "until". */
+struct proxy_miss {
+  struct proxy_miss *next;
+  time_t until;
+  char name[1];          /* allocated to its length */
+};
+
+struct proxy_entry {
+  char name[NAME_MAX + 1];
+  time_t mtime;
+  off_t size;
+};
+
+static int proxy_on = 0;
+static struct sockaddr_storage upstream;
+static socklen_t upstream_len;
+static char cache_dir[PATH_MAX];
+static off_t budget = (off_t)PROXY_DEFAULT_CACHE * 1024 * 1024;
+static int req_blksize = PROXY_DEFAULT_BLKSIZE;
+static int req_window = PROXY_DEFAULT_WINDOW;
+static int miss_ttl = PROXY_DEFAULT_MISS;
+
+/* the fetches in progress */
+static pthread_mutex_t proxy_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t evict_mutex = PTHREAD_MUTEX_INITIALIZER;
+static proxy_fetch *fetch_list = NULL;
+static struct proxy_miss *miss_list = NULL;
+static int miss_count = 0;
+static unsigned long part_seq = 0;
+static unsigned long total_hit = 0, total_fetched = 0, total_shared = 0;
+static unsigned long total_failed = 0, total_missed = 0;
+static unsigned long long total_bytes = 0;
+
+/*
+ * "host", "host:port", "[addr]" or "[addr]:port".
+ * Return: 0 on success, -1 on error.
+ */
+static int proxy_upstream(char *str)
+{
+  struct addrinfo hints, *res;
+  char *host, *port, *cp;
+
+  host = str;
+  port = PROXY_DEFAULT_PORT;
+  if (*str == '[') {
+    host = str + 1;
+    if ((cp = strchr(host, ']')) == NULL) {
+      return -1;
+    }
+    *cp++ = '\0';
+    if (*cp == ':') {
+      port = cp + 1;
+    }
+    else if (*cp != '\0') {
+      return -1;
+    }
+  }
+  else if ((cp = strchr(str, ':')) != NULL && strchr(cp + 1, ':') == NULL) {
+    *cp = '\0';
+    port = cp + 1;
+  }
+
+  memset(&hints, 0, sizeof(hints));
+#ifdef TFTPD_V4ONLY
+  hints.ai_family = AF_INET;
+#else
+  hints.ai_family = AF_UNSPEC;
+#endif
+  hints.ai_socktype = SOCK_DGRAM;
+  if (getaddrinfo(host, port, &hints, &res) != 0) {
+    return -1;
+  }
+  memcpy(&upstream, res->ai_addr, res->ai_addrlen);
+  upstream_len = res->ai_addrlen;
+  freeaddrinfo(res);
+  return 0;
+}
+
+/* the part files left by a process which is gone. */
+static void proxy_clean(void)
+{
+  DIR *dir;
+  struct dirent *de;
+  char path[PATH_MAX], *cp;
+  long pid;
+
+  if ((dir = opendir(cache_dir)) == NULL) {
+    return;
+  }
+  while ((de = readdir(dir)) != NULL) {
+    if (de->d_name[0] != '.' ||
+        (cp = strstr(de->d_name, ".part.")) == NULL) {
+      continue;
+    }
+    pid = strtol(cp + 6, NULL, 10);
+    if (pid > 0 && (kill((pid_t)pid, 0) == 0 || errno != ESRCH)) {
+      continue;
+    }
+    if (snprintf(path, sizeof(path), "%s/%s", cache_dir,
+                 de->d_name) < (int)sizeof(path)) {
+      unlink(path);
+    }
+  }
+  closedir(dir);
+}
+
+/*
+ * Return: 0 on success, -1 on error.
+ */
+int proxy_config(const char *spec)
+{
+  struct stat st;
+  char *str, *cp, *value, *end;
+  long num;
+
+  if ((str = strdup(spec)) == NULL) {
+    return -1;
+  }
+  cache_dir[0] = '\0';
+  cp = strtok(str, ",");
+  if (cp == NULL || strchr(cp, '=') != NULL || proxy_upstream(cp) == -1) {
+    goto error;
+  }
+  for (cp = strtok(NULL, ","); cp != NULL; cp = strtok(NULL, ",")) {
+    if ((value = strchr(cp, '=')) == NULL) {
+      goto error;
+    }
+    *value++ = '\0';
+    if (strcmp(cp, "cache") == 0) {
+      if (*value != '/' || strlen(value) >= sizeof(cache_dir) - NAME_MAX) {
+        goto error;
+      }
+      snprintf(cache_dir, sizeof(cache_dir), "%s", value);
+      continue;
+    }
+    num = strtol(value, &end, 10);
+    if (*value == '\0' || *end != '\0') {
+      goto error;
+    }
+    if (strcmp(cp, "size") == 0 && num > 0) {
+      budget = (off_t)num * 1024 * 1024;
+    }
+    else if (strcmp(cp, "blksize") == 0 && num >= 8 &&
+             num <= PROXY_BLKSIZE_MAX) {
+      req_blksize = num;
+    }
+    else if (strcmp(cp, "window") == 0 && num >= 1 &&
+             num <= PROXY_WINDOW_MAX) {
+      req_window = num;
+    }
+    else if (strcmp(cp, "miss") == 0 && num >= 0 && num <= PROXY_MISS_TTL_MAX) {
+      miss_ttl = num;
+    }
+    else {
+      goto error;
+    }
+  }
+  free(str);
+
+  if (cache_dir[0] == '\0' || stat(cache_dir, &st) == -1 ||
+      !S_ISDIR(st.st_mode) || access(cache_dir, W_OK) == -1) {
+    return -1;
+  }
+  proxy_clean();
+  proxy_on = 1;
+  return 0;
+
+ error:
+  free(str);
+  return -1;
+}
+
+int proxy_enabled(void)
+{
+  return proxy_on;
+}
+
+/*
+ * The name in the cache directory, with no '/' in it.
+ * Return: 0 on success, -1 when it is too long.
+ */
+static int proxy_name(const char *name, char *buf)
+{
+  size_t len = 0;
+
+  for (; *name != '\0'; name++) {
+    if (len + 4 > PROXY_NAME_SIZ) {
+      return -1;
+    }
+    /* a leading '.' is for the part files. */
+    if (*name == '/' || *name == '%' || (*name == '.' && len == 0)) {
+      len += sprintf(buf + len, "%%%02X", (unsigned char)*name);
+    }
+    else {
+      buf[len++] = *name;
+    }
+  }
+  buf[len] = '\0';
+  return len > 0 ? 0 : -1;
+}
+
+static int proxy_entry_cmp(const void *a, const void *b)
+{
+  const struct proxy_entry *ea = a, *eb = b;
+
+  return ea->mtime < eb->mtime ? -1 : ea->mtime > eb->mtime;
+}
+
+/* remove the files used least recently while there are too many. */
+static void proxy_evict(void)
+{
+  DIR *dir;
+  struct dirent *de;
+  struct stat st;
+  struct proxy_entry *ent = NULL, *tmp;
+  char path[PATH_MAX];
+  size_t nent = 0, max = 0, cnt;
+  off_t total = 0;
+
+  pthread_mutex_lock(&evict_mutex);
+  if ((dir = opendir(cache_dir)) == NULL) {
+    pthread_mutex_unlock(&evict_mutex);
+    return;
+  }
+  while ((de = readdir(dir)) != NULL) {
+    if (de->d_name[0] == '.') {
+      continue;
+    }
+    if (snprintf(path, sizeof(path), "%s/%s", cache_dir,
+                 de->d_name) >= (int)sizeof(path) ||
+        lstat(path, &st) == -1 || !S_ISREG(st.st_mode)) {
+      continue;
+    }
+    if (nent == max) {
+      max = max ? max * 2 : 64;
+      if ((tmp = realloc(ent, sizeof(*ent) * max)) == NULL) {
+        break;
+      }
+      ent = tmp;
+    }
+    snprintf(ent[nent].name, sizeof(ent[nent].name), "%s", de->d_name);
+    ent[nent].mtime = st.st_mtime;
+    ent[nent].size = st.st_size;
+    total += st.st_size;
+    nent++;
+  }
+  closedir(dir);
+
+  if (total > budget) {
+    qsort(ent, nent, sizeof(*ent), proxy_entry_cmp);
+    for (cnt = 0; cnt < nent && total > budget; cnt++) {
+      if (snprintf(path, sizeof(path), "%s/%s", cache_dir,
+                   ent[cnt].name) >= (int)sizeof(path)) {
+        continue;
+      }
+      /* the sessions which have it open still read it. */
+      if (unlink(path) == 0) {
+        total -= ent[cnt].size;
+      }
+    }
+  }
+  free(ent);
+  pthread_mutex_unlock(&evict_mutex);
+}
+
+/* called with proxy_mutex held. */
+static void proxy_unlink(proxy_fetch *f)
+{
+  proxy_fetch **pp;
+
+  for (pp = &fetch_list; *pp != NULL; pp = &(*pp)->next) {
+    if (*pp == f) {
+      *pp = f->next;
+      break;
+    }
+  }
+}
+
+static time_t proxy_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+/*
+ * Whether the upstream didn't give name a moment ago; the expired
+ * entries are dropped on the way.  Called with proxy_mutex held.
+ */
+static int proxy_missed(const char *name)
+{
+  struct proxy_miss **mp, *m;
+  time_t now = proxy_now();
+
+  for (mp = &miss_list; (m = *mp) != NULL; ) {
+    if (m->until <= now) {
+      *mp = m->next;
+      free(m);
+      miss_count--;
+      continue;
+    }
+    if (strcmp(m->name, name) == 0) {
+      return 1;
+    }
+    mp = &m->next;
+  }
+  return 0;
+}
+
+/* called with proxy_mutex held, after proxy_missed() has said no. */
+static void proxy_miss_add(const char *name)
+{
+  struct proxy_miss *m;
+
+  if (miss_ttl == 0 || miss_count >= PROXY_MISS_MAX ||
+      (m = malloc(sizeof(*m) + strlen(name))) == NULL) {
+    return;
+  }
+  strcpy(m->name, name);
+  m->until = proxy_now() + miss_ttl;
+  m->next = miss_list;
+  miss_list = m;
+  miss_count++;
+}
+
+/* called with proxy_mutex held. */
+static void proxy_put(proxy_fetch *f)
+{
+  if (--f->refs == 0) {
+    pthread_cond_destroy(&f->cond);
+    free(f);
+  }
+}
+
+static size_t proxy_request(char *buf, const char *name)
+{
+  size_t len;
+
+  *(unsigned short *)buf = htons(RRQ);
+  len = 2;
+  len += sprintf(buf + len, "%s", name) + 1;
+  len += sprintf(buf + len, "octet") + 1;
+  len += sprintf(buf + len, "blksize") + 1;
+  len += sprintf(buf + len, "%d", req_blksize) + 1;
+  if (req_window > 1) {
+    len += sprintf(buf + len, "windowsize") + 1;
+    len += sprintf(buf + len, "%d", req_window) + 1;
+  }
+  len += sprintf(buf + len, "tsize") + 1;
+  len += sprintf(buf + len, "0") + 1;
+  return len;
+}
+
+/* what the upstream agreed to, the defaults for what it left out. */
+static void proxy_oack(char *buf, ssize_t len, int *blk, int *window)
+{
+  char *cp = buf + 2, *end = buf + len, *value;
+  int num;
+
+  *blk = SEGSIZE;
+  *window = 1;
+  while (cp < end) {
+    value = cp + strlen(cp) + 1;
+    if (value >= end) {
+      break;
+    }
+    num = atoi(value);
+    if (strcasecmp(cp, "blksize") == 0 && num >= 8 && num <= req_blksize) {
+      *blk = num;
+    }
+    else if (strcasecmp(cp, "windowsize") == 0 && num >= 1 &&
+             num <= req_window) {
+      *window = num;
+    }
+    cp = value + strlen(value) + 1;
+  }
+}
+
+static void proxy_ack(int s, char *last, uint16_t block)
+{
+  *(unsigned short *)last = htons(ACK);
+  *(unsigned short *)(last + 2) = htons(block);
+  send(s, last, 4, 0);
+}
+
+/*
+ * The upstream side, a TFTP client which writes what it gets to the
+ * part file and tells the sessions how far it is.
+ * Return: 0 when the file is complete, -1 otherwise.
+ */
+static int proxy_get(proxy_fetch *f)
+{
+  struct sockaddr_storage from;
+  socklen_t fromlen;
+  struct pollfd pfd;
+  char *buf, last[PATH_MAX + 64];
+  ssize_t len, lastlen;
+  off_t off = 0;
+  uint16_t expect = 1, got;
+  int s, ret = -1, retry = 0, locked = 0, blk = SEGSIZE, window = 1;
+  int inwin = 0, gap = 0;
+
+  /* and a '\0' after the message of an ERROR. */
+  if ((buf = malloc(PROXY_BLKSIZE_MAX + 5)) == NULL) {
+    return -1;
+  }
+  if ((s = socket(upstream.ss_family, SOCK_DGRAM, 0)) == -1) {
+    free(buf);
+    return -1;
+  }
+  lastlen = proxy_request(last, f->name);
+  sendto(s, last, lastlen, 0, (struct sockaddr *)&upstream, upstream_len);
+
+  pfd.fd = s;
+  pfd.events = POLLIN;
+  for (;;) {
+    if (poll(&pfd, 1, PROXY_TIMEOUT * 1000) <= 0) {
+      if (++retry > PROXY_RETRY) {
+        break;
+      }
+      if (locked) {
+        send(s, last, lastlen, 0);
+      }
+      else {
+        sendto(s, last, lastlen, 0, (struct sockaddr *)&upstream,
+               upstream_len);
+      }
+      continue;
+    }
+    fromlen = sizeof(from);
+    len = recvfrom(s, buf, PROXY_BLKSIZE_MAX + 4, 0,
+                   (struct sockaddr *)&from, &fromlen);
+    if (len < 4) {
+      continue;
+    }
+    if (!locked) {
+      /* the server answers from a port of the transfer (TID). */
+      if (from.ss_family != upstream.ss_family ||
+          (from.ss_family == AF_INET &&
+           memcmp(&((struct sockaddr_in *)&from)->sin_addr,
+                  &((struct sockaddr_in *)&upstream)->sin_addr,
+                  sizeof(struct in_addr)) != 0)
+#ifndef TFTPD_V4ONLY
+          || (from.ss_family == AF_INET6 &&
+              memcmp(&((struct sockaddr_in6 *)&from)->sin6_addr,
+                     &((struct sockaddr_in6 *)&upstream)->sin6_addr,
+                     sizeof(struct in6_addr)) != 0)
+#endif
+          ) {
+        continue;
+      }
+      if (connect(s, (struct sockaddr *)&from, fromlen) == -1) {
+        break;
+      }
+      locked = 1;
+    }
+
+    got = ntohs(*(unsigned short *)(buf + 2));
+    switch (ntohs(*(unsigned short *)buf)) {
+    case OACK:
+      if (f->started) {
+        continue;
+      }
+      proxy_oack(buf, len, &blk, &window);
+      pthread_mutex_lock(&proxy_mutex);
+      f->started = 1;
+      pthread_cond_broadcast(&f->cond);
+      pthread_mutex_unlock(&proxy_mutex);
+      proxy_ack(s, last, 0);
+      lastlen = 4;
+      retry = 0;
+      continue;
+    case DATA:
+      break;
+    case ERROR:
+      buf[len] = '\0';
+      fprintf(stderr, "proxy: %s: %s (%u).\n", f->name, buf + 4, got);
+      goto out;
+    default:
+      continue;
+    }
+
+    if (!f->started) {
+      /* the options are refused, which is RFC 1350. */
+      pthread_mutex_lock(&proxy_mutex);
+      f->started = 1;
+      pthread_cond_broadcast(&f->cond);
+      pthread_mutex_unlock(&proxy_mutex);
+    }
+    retry = 0;
+    if (got != expect || len - 4 > blk) {
+      /* a block is lost, ask for the window again from it. */
+      if (!gap) {
+        proxy_ack(s, last, expect - 1);
+        lastlen = 4;
+        gap = 1;
+      }
+      inwin = 0;
+      continue;
+    }
+    gap = 0;
+    if (len > 4 && pwrite(f->fd, buf + 4, len - 4, off) != len - 4) {
+      perror("proxy: pwrite");
+      goto out;
+    }
+    off += len - 4;
+    pthread_mutex_lock(&proxy_mutex);
+    f->size = off;
+    total_bytes += len - 4;
+    pthread_cond_broadcast(&f->cond);
+    pthread_mutex_unlock(&proxy_mutex);
+
+    if (len - 4 < blk) {
+      proxy_ack(s, last, got);
+      ret = 0;
+      break;
+    }
+    /* the block number rolls over to 0 like the sending side. */
+    expect++;
+    if (++inwin >= window) {
+      proxy_ack(s, last, got);
+      lastlen = 4;
+      inwin = 0;
+    }
+  }
+
+ out:
+  close(s);
+  free(buf);
+  return ret;
+}
+
+static void *proxy_thread(void *arg)
+{
+  proxy_fetch *f = arg;
+  int ret;
+
+  ret = proxy_get(f);
+  close(f->fd);
+
+  pthread_mutex_lock(&proxy_mutex);
+  if (ret == 0 && rename(f->part, f->path) == 0) {
+    f->done = 1;
+    total_fetched++;
+  }
+  else {
+    unlink(f->part);
+    f->failed = 1;
+    total_failed++;
+    /* not found, or no answer: the probes of the name don't go up again. */
+    if (ret == -1 && !f->started && !proxy_missed(f->name)) {
+      proxy_miss_add(f->name);
+    }
+  }
+  proxy_unlink(f);
+  pthread_cond_broadcast(&f->cond);
+  ret = f->done;
+  proxy_put(f);
+  pthread_mutex_unlock(&proxy_mutex);
+
+  if (ret) {
+    proxy_evict();
+  }
+  return NULL;
+}
+
+/*
+ * Open name in the cache, or as much of it as has come so far.  For
+ * the latter *fetch is set, which the caller gives to proxy_wait()
+ * before it reads, and to proxy_release() at the end.
+ * Return: file descriptor, -1 when the upstream has no such file.
+ */
+int proxy_open(const char *name, proxy_fetch **fetch)
+{
+  proxy_fetch *f;
+  pthread_t tid;
+  pthread_attr_t attr;
+  char enc[PROXY_NAME_SIZ + 1], path[PATH_MAX];
+  int fd;
+
+  *fetch = NULL;
+  if (proxy_name(name, enc) == -1 || strlen(name) >= sizeof(f->name) ||
+      snprintf(path, sizeof(path), "%s/%s", cache_dir,
+               enc) >= (int)sizeof(path)) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&proxy_mutex);
+  if ((fd = open(path, O_RDONLY)) != -1) {
+    /* the mtime is when it was used last, for proxy_evict(). */
+    futimens(fd, NULL);
+    total_hit++;
+    pthread_mutex_unlock(&proxy_mutex);
+    return fd;
+  }
+
+  for (f = fetch_list; f != NULL; f = f->next) {
+    if (strcmp(f->name, name) == 0) {
+      break;
+    }
+  }
+  if (f == NULL && proxy_missed(name)) {
+    total_missed++;
+    pthread_mutex_unlock(&proxy_mutex);
+    return -1;
+  }
+  if (f != NULL) {
+    if ((fd = open(f->part, O_RDONLY)) == -1) {
+      pthread_mutex_unlock(&proxy_mutex);
+      return -1;
+    }
+    f->refs++;
+    total_shared++;
+  }
+  else {
+    if ((f = calloc(1, sizeof(*f))) == NULL) {
+      pthread_mutex_unlock(&proxy_mutex);
+      return -1;
+    }
+    snprintf(f->name, sizeof(f->name), "%s", name);
+    snprintf(f->path, sizeof(f->path), "%s", path);
+    if (snprintf(f->part, sizeof(f->part), "%s/.%s.part.%ld.%lu", cache_dir,
+                 enc, (long)getpid(), part_seq++) >= (int)sizeof(f->part)) {
+      pthread_mutex_unlock(&proxy_mutex);
+      free(f);
+      return -1;
+    }
+    pthread_cond_init(&f->cond, NULL);
+    f->fd = open(f->part, O_WRONLY|O_CREAT|O_EXCL, 0644);
+    fd = f->fd == -1 ? -1 : open(f->part, O_RDONLY);
+    if (fd == -1) {
+      if (f->fd != -1) {
+        close(f->fd);
+        unlink(f->part);
+      }
+      pthread_mutex_unlock(&proxy_mutex);
+      pthread_cond_destroy(&f->cond);
+      free(f);
+      return -1;
+    }
+    /* one for the fetch thread, one for the caller. */
+    f->refs = 2;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&tid, &attr, proxy_thread, f) != 0) {
+      pthread_attr_destroy(&attr);
+      close(f->fd);
+      close(fd);
+      unlink(f->part);
+      pthread_mutex_unlock(&proxy_mutex);
+      pthread_cond_destroy(&f->cond);
+      free(f);
+      return -1;
+    }
+    pthread_attr_destroy(&attr);
+    f->next = fetch_list;
+    fetch_list = f;
+  }
+
+  /* a file the upstream does not have is an error of the request. */
+  while (!f->started && !f->done && !f->failed) {
+    pthread_cond_wait(&f->cond, &proxy_mutex);
+  }
+  if (f->failed) {
+    proxy_put(f);
+    pthread_mutex_unlock(&proxy_mutex);
+    close(fd);
+    return -1;
+  }
+  pthread_mutex_unlock(&proxy_mutex);
+  *fetch = f;
+  return fd;
+}
+
+/*
+ * Wait for size bytes of the file, or all of it with a negative size.
+ * Return: 0 when they are there or the file is complete, -1 when the
+ * fetch has failed.
+ */
+int proxy_wait(proxy_fetch *f, off_t size)
+{
+  int ret;
+
+  pthread_mutex_lock(&proxy_mutex);
+  while (!f->done && !f->failed && (size < 0 || f->size < size)) {
+    pthread_cond_wait(&f->cond, &proxy_mutex);
+  }
+  ret = f->failed ? -1 : 0;
+  pthread_mutex_unlock(&proxy_mutex);
+  return ret;
+}
+
+void proxy_release(proxy_fetch *f)
+{
+  pthread_mutex_lock(&proxy_mutex);
+  proxy_put(f);
+  pthread_mutex_unlock(&proxy_mutex);
+}
+
+void proxy_total_stat(unsigned long *hit, unsigned long *fetched,
+                      unsigned long *shared, unsigned long *failed,
+                      unsigned long *missed, unsigned long long *bytes)
+{
+  pthread_mutex_lock(&proxy_mutex);
+  *hit = total_hit;
+  *fetched = total_fetched;
+  *shared = total_shared;
+  *failed = total_failed;
+  *missed = total_missed;
+  *bytes = total_bytes;
+  pthread_mutex_unlock(&proxy_mutex);
+}
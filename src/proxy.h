@@ -0,0 +1,98 @@
+/*
+   proxy.h
+   $Id$
+
+   This file is part of t-tftpd.
+
+   Copyright 2002,2007 Tomofumi Hayashi <s1061123@gmail.com>.
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+   3. All advertising materials mentioning features or use of this software
+      must display the following acknowledgement:
+
+        This product includes software developed by
+        Tomofumi Hayashi <s1061123@gmail.com> and its contributors.
+
+   4. Neither the name of authors nor the names of its contributors may be used
+      to endorse or promote products derived from this software without
+      specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND ANY
+   EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _PROXY_H_
+#define _PROXY_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <sys/types.h>
+
+/*
+ * Proxy of an upstream TFTP server, for a site which has no copy of
+ * the image store.
+ * -u takes "HOST[:PORT],cache=DIR,size=MB,blksize=N,window=N,miss=SEC",
+ * an IPv6 address in brackets.  An RRQ for a name that is not in the tree (nor
+ * a virtual file) is asked of HOST, with blksize and windowsize
+ * (RFC 2348, 7440) which it may refuse, and the file is kept in DIR.
+ *
+ * The file is sent to the client while it comes in: the session reads
+ * what is written so far and waits for the rest.  The other requests
+ * for the file share the same fetch.  When the file is complete it is
+ * renamed to its name in DIR, '/' encoded as %2F, where the following
+ * requests find it.  The files used least recently are removed while
+ * DIR holds more than size=MB (PROXY_DEFAULT_CACHE).  The processes of
+ * -P share DIR, but each fetches the files of its own requests.
+ *
+ * A name the upstream has not got, or didn't answer for, is refused
+ * without asking again for miss=SEC (PROXY_DEFAULT_MISS, 0 is off), so
+ * the probes of the PXE clients for their own config files don't wait
+ * on the upstream every time.
+ */
+#define PROXY_DEFAULT_PORT "69"
+#define PROXY_DEFAULT_CACHE 1024    /* MB */
+#define PROXY_DEFAULT_BLKSIZE 1428  /* fits in an Ethernet frame */
+#define PROXY_DEFAULT_WINDOW 16
+#define PROXY_BLKSIZE_MAX 65464
+#define PROXY_WINDOW_MAX 256
+#define PROXY_TIMEOUT 2             /* sec. */
+#define PROXY_RETRY 5
+#define PROXY_DEFAULT_MISS 10       /* sec. */
+#define PROXY_MISS_TTL_MAX 3600
+#define PROXY_MISS_MAX 4096         /* names remembered */
+
+typedef struct proxy_fetch proxy_fetch;
+
+int proxy_config(const char *spec);
+int proxy_enabled(void);
+int proxy_open(const char *name, proxy_fetch **fetch);
+int proxy_wait(proxy_fetch *fetch, off_t size);
+void proxy_release(proxy_fetch *fetch);
+void proxy_total_stat(unsigned long *hit, unsigned long *fetched,
+                      unsigned long *shared, unsigned long *failed,
+                      unsigned long *missed, unsigned long long *bytes);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* !_PROXY_H_ */
@@ -0,0 +1,284 @@
+/*
+   readahead.c
+   $Id$
+
+   This file is part of t-tftpd.
+
+   Copyright 2002,2007 Tomofumi Hayashi <s1061123@gmail.com>.
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+   3. All advertising materials mentioning features or use of this software
+      must display the following acknowledgement:
+
+        This product includes software developed by
+        Tomofumi Hayashi <s1061123@gmail.com> and its contributors.
+
+   4. Neither the name of authors nor the names of its contributors may be used
+      to endorse or promote products derived from this software without
+      specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND ANY
+   EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "readahead.h"
+
+struct ra_slot {
+  char *data;
+  ssize_t len;     /* -1 when read() failed */
+  int err;         /* errno of the failed read() */
+};
+
+struct read_ahead {
+  int fd;
+  off_t off;       /* of the next block, the fd may be shared */
+  int depth;
+  size_t blksize;
+  struct ra_slot *slot;
+  int head;        /* next slot handed to the sender */
+  int count;       /* slots filled and not yet consumed */
+  int eof;         /* reader has seen EOF or an error */
+  int stop;
+  pthread_mutex_t mutex;
+  pthread_cond_t filled;
+  pthread_cond_t drained;
+  pthread_t tid;
+  /* how often a block was ready / the sender had to wait for it */
+  unsigned long ready, waited;
+};
+
+static pthread_mutex_t ra_total_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long ra_total_ready = 0, ra_total_waited = 0;
+
+static void *ra_thread(void *param);
+
+read_ahead *ra_create(int fd, int depth, size_t blksize)
+{
+  read_ahead *ra;
+  char *mem;
+  int cnt;
+
+  if (depth <= 0) {
+    return NULL;
+  }
+  if (depth > READ_AHEAD_MAX_DEPTH) {
+    depth = READ_AHEAD_MAX_DEPTH;
+  }
+
+  ra = (read_ahead *)malloc(sizeof(read_ahead));
+  if (ra == NULL) {
+    return NULL;
+  }
+  memset(ra, 0, sizeof(read_ahead));
+  ra->slot = (struct ra_slot *)malloc(sizeof(struct ra_slot) * depth);
+  mem = malloc(blksize * depth);
+  if (ra->slot == NULL || mem == NULL) {
+    free(ra->slot);
+    free(mem);
+    free(ra);
+    return NULL;
+  }
+  for (cnt = 0; cnt < depth; cnt++) {
+    ra->slot[cnt].data = mem + blksize * cnt;
+    ra->slot[cnt].len = 0;
+    ra->slot[cnt].err = 0;
+  }
+
+  ra->fd = fd;
+  ra->off = 0;
+  ra->depth = depth;
+  ra->blksize = blksize;
+  pthread_mutex_init(&ra->mutex, NULL);
+  pthread_cond_init(&ra->filled, NULL);
+  pthread_cond_init(&ra->drained, NULL);
+
+  if (pthread_create(&ra->tid, NULL, ra_thread, ra) != 0) {
+    pthread_mutex_destroy(&ra->mutex);
+    pthread_cond_destroy(&ra->filled);
+    pthread_cond_destroy(&ra->drained);
+    free(ra->slot[0].data);
+    free(ra->slot);
+    free(ra);
+    return NULL;
+  }
+
+  return ra;
+}
+
+/*
+ * I/O thread: fill free slots in file order until EOF, an error,
+ * or ra_destroy().
+ */
+static void *ra_thread(void *param)
+{
+  read_ahead *ra;
+  struct ra_slot *sp;
+  ssize_t len, ret;
+  int err;
+
+  ra = (read_ahead *)param;
+
+  for (;;) {
+    pthread_mutex_lock(&ra->mutex);
+    while (ra->count == ra->depth && !ra->stop) {
+      pthread_cond_wait(&ra->drained, &ra->mutex);
+    }
+    if (ra->stop) {
+      pthread_mutex_unlock(&ra->mutex);
+      break;
+    }
+    /* the slot behind the filled ones is not touched by the sender. */
+    sp = &ra->slot[(ra->head + ra->count) % ra->depth];
+    pthread_mutex_unlock(&ra->mutex);
+
+    /* a regular file returns short counts only at EOF, but be careful. */
+    err = 0;
+    for (len = 0; len < (ssize_t)ra->blksize; len += ret) {
+      ret = pread(ra->fd, sp->data + len, ra->blksize - len, ra->off + len);
+      if (ret == -1 && errno == EINTR) {
+        ret = 0;
+        continue;
+      }
+      if (ret == -1) {
+        err = errno;
+        len = -1;
+        break;
+      }
+      if (ret == 0) {
+        break;
+      }
+    }
+
+    if (len > 0) {
+      ra->off += len;
+    }
+    pthread_mutex_lock(&ra->mutex);
+    sp->len = len;
+    sp->err = err;
+    ra->count++;
+    if (len < (ssize_t)ra->blksize) {
+      ra->eof = 1;
+    }
+    pthread_cond_signal(&ra->filled);
+    pthread_mutex_unlock(&ra->mutex);
+
+    if (len < (ssize_t)ra->blksize) {
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Copy the next block to buf.
+ * Return: the block length (0 at EOF), or -1 with errno set.
+ */
+ssize_t ra_read(read_ahead *ra, char *buf, size_t siz)
+{
+  struct ra_slot *sp;
+  ssize_t len;
+
+  pthread_mutex_lock(&ra->mutex);
+  if (ra->count > 0) {
+    ra->ready++;
+  }
+  else if (!ra->eof) {
+    ra->waited++;
+    while (ra->count == 0 && !ra->eof) {
+      pthread_cond_wait(&ra->filled, &ra->mutex);
+    }
+  }
+
+  if (ra->count == 0) {
+    /* EOF was already handed out. */
+    pthread_mutex_unlock(&ra->mutex);
+    return 0;
+  }
+
+  sp = &ra->slot[ra->head];
+  len = sp->len;
+  if (len > (ssize_t)siz) {
+    len = siz;
+  }
+  if (len > 0) {
+    memcpy(buf, sp->data, len);
+  }
+  else if (len == -1) {
+    errno = sp->err;
+  }
+  ra->head = (ra->head + 1) % ra->depth;
+  ra->count--;
+  pthread_cond_signal(&ra->drained);
+  pthread_mutex_unlock(&ra->mutex);
+
+  return len;
+}
+
+void ra_session_stat(read_ahead *ra,
+                     unsigned long *ready, unsigned long *waited)
+{
+  pthread_mutex_lock(&ra->mutex);
+  *ready = ra->ready;
+  *waited = ra->waited;
+  pthread_mutex_unlock(&ra->mutex);
+}
+
+void ra_total_stat(unsigned long *ready, unsigned long *waited)
+{
+  pthread_mutex_lock(&ra_total_mutex);
+  *ready = ra_total_ready;
+  *waited = ra_total_waited;
+  pthread_mutex_unlock(&ra_total_mutex);
+}
+
+void ra_destroy(read_ahead *ra)
+{
+  if (ra == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&ra->mutex);
+  ra->stop = 1;
+  pthread_cond_signal(&ra->drained);
+  pthread_mutex_unlock(&ra->mutex);
+  pthread_join(ra->tid, NULL);
+
+  pthread_mutex_lock(&ra_total_mutex);
+  ra_total_ready += ra->ready;
+  ra_total_waited += ra->waited;
+  pthread_mutex_unlock(&ra_total_mutex);
+
+  pthread_mutex_destroy(&ra->mutex);
+  pthread_cond_destroy(&ra->filled);
+  pthread_cond_destroy(&ra->drained);
+  free(ra->slot[0].data);
+  free(ra->slot);
+  free(ra);
+}
@@ -0,0 +1,214 @@
+/*
+   reload.c
+   $Id$
+
+   This file is part of t-tftpd.
+
+   Copyright 2002,2007 Tomofumi Hayashi <s1061123@gmail.com>.
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+   3. All advertising materials mentioning features or use of this software
+      must display the following acknowledgement:
+
+        This product includes software developed by
+        Tomofumi Hayashi <s1061123@gmail.com> and its contributors.
+
+   4. Neither the name of authors nor the names of its contributors may be used
+      to endorse or promote products derived from this software without
+      specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND ANY
+   EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "reload.h"
+
+#define RELOAD_BLANK " \t\r\n"
+
+static const char *reload_path = NULL;
+static reload_item_fn reload_item = NULL;
+static unsigned long total_loaded = 0, total_failed = 0;
+
+/*
+ * Read the file, without the comments.
+ * Return: the text (to be freed), or NULL on error.
+ */
+static char *read_file(const char *path)
+{
+  FILE *fp;
+  char *line = NULL, *str, *cp;
+  size_t len, size = 0;
+
+  if ((fp = fopen(path, "r")) == NULL) {
+    return NULL;
+  }
+  if ((str = (char *)malloc(RELOAD_FILE_MAX)) == NULL) {
+    fclose(fp);
+    return NULL;
+  }
+  len = 0;
+  str[0] = '\0';
+  /* a whole line, a long value is not cut in two. */
+  while (getline(&line, &size, fp) != -1) {
+    if ((cp = strchr(line, '#')) != NULL) {
+      *cp = '\0';
+    }
+    if (len + strlen(line) + 2 > RELOAD_FILE_MAX) {
+      free(line);
+      free(str);
+      fclose(fp);
+      return NULL;
+    }
+    len += snprintf(str + len, RELOAD_FILE_MAX - len, "%s ", line);
+  }
+  free(line);
+  fclose(fp);
+  return str;
+}
+
+/*
+ * Give each item of str to item() to be read.
+ * Return: 0 on success, -1 when an item is not valid.
+ */
+static int reload_check(const char *path, const char *str,
+                        reload_item_fn item)
+{
+  char *copy, *cp, *value, *last;
+  int ret;
+
+  if ((copy = strdup(str)) == NULL) {
+    return -1;
+  }
+  ret = 0;
+  for (cp = strtok_r(copy, RELOAD_BLANK, &last); cp != NULL;
+       cp = strtok_r(NULL, RELOAD_BLANK, &last)) {
+    if ((value = strchr(cp, '=')) == NULL) {
+      fprintf(stderr, "%s: \"%s\" is not key=value.\n", path, cp);
+      ret = -1;
+      break;
+    }
+    *value++ = '\0';
+    if (item(cp, value, RELOAD_CHECK) == -1) {
+      fprintf(stderr, "%s: %s=%s is invalid.\n", path, cp, value);
+      ret = -1;
+      break;
+    }
+  }
+  free(copy);
+  return ret;
+}
+
+/*
+ * Read the file and set its items, when all of them are valid.
+ * Return: 0 on success, -1 on error.
+ */
+int reload_config(const char *path, reload_item_fn item)
+{
+  char *str;
+  int ret;
+
+  if ((str = read_file(path)) == NULL) {
+    fprintf(stderr, "Can't read the config file %s\n", path);
+    total_failed++;
+    return -1;
+  }
+  ret = reload_check(path, str, item);
+  free(str);
+  if (ret == 0) {
+    ret = item(NULL, NULL, RELOAD_APPLY);
+  }
+  if (ret == 0) {
+    total_loaded++;
+  }
+  else {
+    item(NULL, NULL, RELOAD_DROP);
+    total_failed++;
+  }
+  return ret;
+}
+
+/*
+ * Keep SIGHUP for the reload thread.  Must be called before any thread
+ * is started (and before the prefork workers), which all inherit it.
+ */
+void reload_block(void)
+{
+  sigset_t set;
+
+  sigemptyset(&set);
+  sigaddset(&set, SIGHUP);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+}
+
+static void *reload_thread(void *arg)
+{
+  sigset_t set;
+  int sig;
+
+  (void)arg;
+
+  sigemptyset(&set);
+  sigaddset(&set, SIGHUP);
+  while (1) {
+    if (sigwait(&set, &sig) != 0) {
+      continue;
+    }
+    if (reload_config(reload_path, reload_item) == 0) {
+      fprintf(stderr, "config %s is reloaded.\n", reload_path);
+    }
+    else {
+      fprintf(stderr, "config %s is invalid, not changed.\n", reload_path);
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Start a thread reading the file again on each SIGHUP.
+ * Return: 0 on success, -1 on error.
+ */
+int reload_start(const char *path, reload_item_fn item)
+{
+  pthread_t tid;
+
+  reload_path = path;
+  reload_item = item;
+  if (pthread_create(&tid, NULL, reload_thread, NULL) != 0) {
+    return -1;
+  }
+  pthread_detach(tid);
+  return 0;
+}
+
+void reload_total_stat(unsigned long *loaded, unsigned long *failed)
+{
+  *loaded = total_loaded;
+  *failed = total_failed;
+}
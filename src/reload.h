@@ -0,0 +1,83 @@
+/*
+   reload.h
+   $Id$
+
+   This file is part of t-tftpd.
+
+   Copyright 2002,2007 Tomofumi Hayashi <s1061123@gmail.com>.
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+   3. All advertising materials mentioning features or use of this software
+      must display the following acknowledgement:
+
+        This product includes software developed by
+        Tomofumi Hayashi <s1061123@gmail.com> and its contributors.
+
+   4. Neither the name of authors nor the names of its contributors may be used
+      to endorse or promote products derived from this software without
+      specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND ANY
+   EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _RELOAD_H_
+#define _RELOAD_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/*
+ * Runtime configuration.
+ * -f <file> reads settings from <file> after the options, and again on
+ * SIGHUP.  The file has "key=value" items, separated by blanks or
+ * lines; # starts a comment.  All the items are checked before any is
+ * set, so a broken file changes nothing.  Sessions in progress are not
+ * stopped by a reload, they go on with what they have started with or
+ * pick up the new values where they read them again.
+ */
+#define RELOAD_FILE_MAX (64 * 1024)  /* bytes */
+
+/*
+ * The item function is called with RELOAD_CHECK for each item, to read
+ * it into new settings (a file it names is read here, once), then with
+ * RELOAD_APPLY to set them all, which may still refuse the items that
+ * don't agree with each other, or with RELOAD_DROP to forget them after
+ * an error.  key and value are NULL but for RELOAD_CHECK.
+ */
+enum reload_step {
+  RELOAD_CHECK,
+  RELOAD_APPLY,
+  RELOAD_DROP
+};
+
+typedef int (*reload_item_fn)(const char *key, const char *value, int step);
+
+int reload_config(const char *path, reload_item_fn item);
+void reload_block(void);
+int reload_start(const char *path, reload_item_fn item);
+void reload_total_stat(unsigned long *loaded, unsigned long *failed);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* !_RELOAD_H_ */
@@ -0,0 +1,810 @@
+/*
+   replay.c
+   $Id$
+
+   This file is part of t-tftpd.
+
+   Copyright 2002,2007 Tomofumi Hayashi <s1061123@gmail.com>.
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+   3. All advertising materials mentioning features or use of this software
+      must display the following acknowledgement:
+
+        This product includes software developed by
+        Tomofumi Hayashi <s1061123@gmail.com> and its contributors.
+
+   4. Neither the name of authors nor the names of its contributors may be used
+      to endorse or promote products derived from this software without
+      specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND ANY
+   EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "tftp.h"
+#include "capture.h"
+
+/*
+ * t-tftpd-replay: replays a capture taken with "t-tftpd -C" against a
+ * test server, at the captured pace or faster.  Requests of one client
+ * are sent one after another as the client did, the others overlap as
+ * they did.  With several servers (-x a,b) every one gets the same
+ * replay and the latency distributions are compared against the first;
+ * with one, against the captured latencies.
+ */
+
+#define REPLAY_TIMEOUT_MSEC 1000
+#define REPLAY_MAX_RETRY 5
+#define REPLAY_MAX_SERVERS 8
+#define REPLAY_BLKSIZE_MAX 65464
+#define REPLAY_SETTLE_MSEC 500
+#define REPLAY_LARGE (1024 * 1024)   /* smaller transfers are "small" */
+
+/* latency classes, by what the captured request did. */
+enum replay_class {RC_ALL, RC_MISS, RC_SMALL, RC_LARGE, RC_NUM};
+static const char *class_names[RC_NUM] = {"all", "miss", "small", "large"};
+
+struct replay_req {
+  struct capture_record rec;
+  char *request;         /* filename, mode and options */
+  enum replay_class class;
+  /* results of the current run */
+  uint64_t latency;      /* usec */
+  int done;              /* 1: finished, -1: failed */
+  int mismatch;          /* the outcome differs from the capture */
+};
+
+struct replay_client {
+  uint32_t id;
+  int num;
+  struct replay_req **req;  /* in arrival order */
+  int timeouts;
+  uint64_t max_lag;
+};
+
+struct replay_dist {
+  int num;
+  uint64_t *val;            /* sorted, usec */
+};
+
+static struct replay_req *reqs;
+static int num_reqs = 0;
+static struct replay_client *clients;
+static int num_clients = 0;
+static struct sockaddr_storage server;
+static socklen_t server_len;
+static const char *server_host = "127.0.0.1";
+static const char *server_port = "69";
+static double speed = 1.0;
+static uint64_t run_start;
+static char *pattern = NULL;
+
+void print_usage(const char *name)
+{
+  fprintf(stderr,
+	  "usage: %s [options] <capture>\n"
+	  "  -s <host> \t\t server (default: 127.0.0.1)\n"
+	  "  -p <port> \t\t port (default: 69)\n"
+	  "  -S <speed> \t\t 1 as captured, 10 ten times faster, "
+	  "0 without pauses\n\t\t\t (default: 1)\n"
+	  "  -r <directory> \t server root for -x and -c\n"
+	  "  -c \t\t\t create the files the captured requests read "
+	  "under -r\n"
+	  "  -x <t-tftpd>[,...] \t start each server on -r in turn and "
+	  "compare them\n"
+	  "  -t <num> \t\t threads of the servers started by -x "
+	  "(default: 4)\n",
+	  name);
+}
+
+uint64_t now_usec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void sleep_usec(uint64_t usec)
+{
+  struct timespec ts;
+
+  ts.tv_sec = usec / 1000000;
+  ts.tv_nsec = (usec % 1000000) * 1000;
+  while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+    ;
+}
+
+int req_time_cmp(const void *a, const void *b)
+{
+  const struct replay_req *ra = a, *rb = b;
+
+  if (ra->rec.time != rb->rec.time) {
+    return ra->rec.time < rb->rec.time ? -1 : 1;
+  }
+  return 0;
+}
+
+int u64_cmp(const void *a, const void *b)
+{
+  uint64_t va = *(const uint64_t *)a, vb = *(const uint64_t *)b;
+
+  return va < vb ? -1 : va > vb;
+}
+
+/*
+ * Return: 0 on success, -1 on error.
+ */
+int load_capture(const char *path)
+{
+  struct capture_header hdr;
+  struct capture_record rec;
+  int cap = 0, cnt, idx;
+  FILE *fp;
+
+  if ((fp = fopen(path, "r")) == NULL) {
+    perror(path);
+    return -1;
+  }
+  if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+      memcmp(hdr.magic, CAPTURE_MAGIC, sizeof(hdr.magic)) != 0 ||
+      hdr.version != CAPTURE_VERSION ||
+      hdr.record_size != sizeof(struct capture_record)) {
+    fprintf(stderr, "%s is not a t-tftpd capture.\n", path);
+    fclose(fp);
+    return -1;
+  }
+
+  while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+    if (num_reqs == cap) {
+      cap = cap ? cap * 2 : 1024;
+      reqs = realloc(reqs, sizeof(struct replay_req) * cap);
+      if (reqs == NULL) {
+	perror("realloc");
+	exit(1);
+      }
+    }
+    memset(&reqs[num_reqs], 0, sizeof(struct replay_req));
+    reqs[num_reqs].rec = rec;
+    /* one more NUL, so a cut request still ends. */
+    reqs[num_reqs].request = calloc(1, rec.request_len + 1);
+    if (reqs[num_reqs].request == NULL ||
+	fread(reqs[num_reqs].request, 1, rec.request_len, fp)
+	!= rec.request_len) {
+      fprintf(stderr, "%s: short record.\n", path);
+      break;
+    }
+    if (rec.opcode != RRQ && rec.opcode != WRQ) {
+      free(reqs[num_reqs].request);
+      continue;
+    }
+    if (rec.outcome != CAPTURE_OK) {
+      reqs[num_reqs].class = RC_MISS;
+    }
+    else {
+      reqs[num_reqs].class = rec.bytes < REPLAY_LARGE ? RC_SMALL : RC_LARGE;
+    }
+    num_reqs++;
+  }
+  fclose(fp);
+  if (num_reqs == 0) {
+    fprintf(stderr, "%s has no requests.\n", path);
+    return -1;
+  }
+
+  /* records are written at the end of sessions. */
+  qsort(reqs, num_reqs, sizeof(struct replay_req), req_time_cmp);
+
+  clients = calloc(num_reqs, sizeof(struct replay_client));
+  for (cnt = 0; cnt < num_reqs; cnt++) {
+    for (idx = 0; idx < num_clients; idx++) {
+      if (clients[idx].id == reqs[cnt].rec.client) {
+	break;
+      }
+    }
+    if (idx == num_clients) {
+      clients[idx].id = reqs[cnt].rec.client;
+      clients[idx].req = malloc(sizeof(struct replay_req *) * num_reqs);
+      num_clients++;
+    }
+    clients[idx].req[clients[idx].num++] = &reqs[cnt];
+  }
+  return 0;
+}
+
+/*
+ * Creates what the captured requests need under root: the files read
+ * with their captured size, and world writable targets for uploads.
+ * Return: 0 on success, -1 on error.
+ */
+int create_files(const char *root)
+{
+  char path[1024], *cp;
+  struct stat st;
+  uint64_t left;
+  size_t len;
+  int cnt, fd, wr;
+
+  for (cnt = 0; cnt < num_reqs; cnt++) {
+    if (reqs[cnt].rec.outcome != CAPTURE_OK ||
+	strstr(reqs[cnt].request, "..") != NULL) {
+      continue;
+    }
+    wr = reqs[cnt].rec.opcode == WRQ;
+    snprintf(path, sizeof(path), "%s/%s", root, reqs[cnt].request);
+    for (cp = path + strlen(root) + 1; (cp = strchr(cp, '/')) != NULL; cp++) {
+      *cp = '\0';
+      if (mkdir(path, wr ? 0777 : 0755) == 0 && wr) {
+	chmod(path, 0777);
+      }
+      *cp = '/';
+    }
+    if (stat(path, &st) == 0 &&
+	(wr ? (st.st_mode & S_IWOTH) != 0
+	 : (uint64_t)st.st_size == reqs[cnt].rec.bytes)) {
+      continue;
+    }
+    if ((fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644)) == -1) {
+      perror(path);
+      return -1;
+    }
+    if (wr) {
+      /* t-tftpd only overwrites files writable by others. */
+      fchmod(fd, 0666);
+    }
+    else {
+      for (left = reqs[cnt].rec.bytes; left > 0; left -= len) {
+	len = left < REPLAY_BLKSIZE_MAX ? left : REPLAY_BLKSIZE_MAX;
+	if (write(fd, pattern, len) != (ssize_t)len) {
+	  perror(path);
+	  close(fd);
+	  return -1;
+	}
+      }
+    }
+    close(fd);
+  }
+  return 0;
+}
+
+/*
+ * Wait for a packet from the server for REPLAY_TIMEOUT_MSEC.
+ * Return: its length, 0 on timeout, -1 on error.
+ */
+ssize_t recv_reply(int s, char *buf, size_t len,
+		   struct sockaddr_storage *peer, int *locked)
+{
+  struct sockaddr_storage from;
+  socklen_t fromlen;
+  struct pollfd pfd;
+  ssize_t ret;
+
+  pfd.fd = s;
+  pfd.events = POLLIN;
+  for (;;) {
+    if (poll(&pfd, 1, REPLAY_TIMEOUT_MSEC) <= 0) {
+      return 0;
+    }
+    fromlen = sizeof(from);
+    ret = recvfrom(s, buf, len, 0, (struct sockaddr *)&from, &fromlen);
+    if (ret < 4) {
+      return -1;
+    }
+    /* the first reply decides the server's TID. */
+    if (!*locked) {
+      memcpy(peer, &from, fromlen);
+      *locked = 1;
+      return ret;
+    }
+    if (memcmp(peer, &from, fromlen) == 0) {
+      return ret;
+    }
+  }
+}
+
+/*
+ * blksize from an OACK, SEGSIZE if it has none.
+ */
+int oack_blksize(char *buf, ssize_t len)
+{
+  char *cp = buf + 2, *end = buf + len;
+
+  while (cp < end) {
+    if (strcasecmp(cp, "blksize") == 0 && cp + strlen(cp) + 1 < end) {
+      return atoi(cp + strlen(cp) + 1);
+    }
+    cp += strlen(cp) + 1;
+    cp += strlen(cp) + 1;
+  }
+  return SEGSIZE;
+}
+
+/*
+ * One transfer of rq over s, its request sent verbatim.
+ * Return: CAPTURE_OK, CAPTURE_ABORTED or CAPTURE_ERROR() of the reply.
+ */
+int replay_one(int s, struct replay_client *cl, struct replay_req *rq,
+	       char *buf, char *last)
+{
+  struct sockaddr_storage peer;
+  ssize_t len, lastlen;
+  uint64_t off = 0, chunk = 0, size = rq->rec.bytes;
+  unsigned short block, got;
+  int locked = 0, retry = 0, blk = SEGSIZE, wr, sent_last = 0;
+
+  wr = rq->rec.opcode == WRQ;
+  *(unsigned short *)last = htons(rq->rec.opcode);
+  memcpy(last + 2, rq->request, rq->rec.request_len);
+  lastlen = rq->rec.request_len + 2;
+  memcpy(&peer, &server, server_len);
+  sendto(s, last, lastlen, 0, (struct sockaddr *)&server, server_len);
+  block = wr ? 0 : 1;
+
+  for (;;) {
+    len = recv_reply(s, buf, REPLAY_BLKSIZE_MAX + 4, &peer, &locked);
+    if (len == 0) {
+      cl->timeouts++;
+      if (++retry > REPLAY_MAX_RETRY) {
+	return CAPTURE_ABORTED;
+      }
+      sendto(s, last, lastlen, 0, (struct sockaddr *)&peer, server_len);
+      continue;
+    }
+    if (len < 0) {
+      return CAPTURE_ABORTED;
+    }
+
+    switch (ntohs(*(unsigned short *)buf)) {
+    case ERROR:
+      return CAPTURE_ERROR(ntohs(*(unsigned short *)(buf + 2)));
+    case OACK:
+      if (wr ? block != 0 : block != 1) {
+	continue;
+      }
+      blk = oack_blksize(buf, len);
+      if (!wr) {
+	*(unsigned short *)last = htons(ACK);
+	*(unsigned short *)(last + 2) = htons(0);
+	lastlen = 4;
+	sendto(s, last, lastlen, 0, (struct sockaddr *)&peer, server_len);
+	retry = 0;
+	continue;
+      }
+      break;
+    case DATA:
+      if (wr) {
+	return CAPTURE_ABORTED;
+      }
+      got = ntohs(*(unsigned short *)(buf + 2));
+      if (got != block) {
+	/* a duplicate, ACK it again. */
+	sendto(s, last, lastlen, 0, (struct sockaddr *)&peer, server_len);
+	continue;
+      }
+      retry = 0;
+      *(unsigned short *)last = htons(ACK);
+      *(unsigned short *)(last + 2) = htons(block);
+      lastlen = 4;
+      block++;
+      sendto(s, last, lastlen, 0, (struct sockaddr *)&peer, server_len);
+      if (len - 4 < blk) {
+	return CAPTURE_OK;
+      }
+      continue;
+    case ACK:
+      if (!wr) {
+	return CAPTURE_ABORTED;
+      }
+      got = ntohs(*(unsigned short *)(buf + 2));
+      if (got != block) {
+	continue;
+      }
+      break;
+    default:
+      return CAPTURE_ABORTED;
+    }
+
+    /* the upload goes on. */
+    retry = 0;
+    off += chunk;
+    if (sent_last) {
+      return CAPTURE_OK;
+    }
+    chunk = size - off < (uint64_t)blk ? size - off : (uint64_t)blk;
+    block++;
+    *(unsigned short *)last = htons(DATA);
+    *(unsigned short *)(last + 2) = htons(block);
+    memcpy(last + 4, pattern + off % SEGSIZE, chunk);
+    lastlen = chunk + 4;
+    sent_last = chunk < (uint64_t)blk;
+    sendto(s, last, lastlen, 0, (struct sockaddr *)&peer, server_len);
+  }
+}
+
+void *client_main(void *arg)
+{
+  struct replay_client *cl = arg;
+  struct replay_req *rq;
+  char *buf, *last;
+  uint64_t due, now, start, first = reqs[0].rec.time;
+  int cnt, s, outcome;
+
+  buf = malloc(REPLAY_BLKSIZE_MAX + 4);
+  last = malloc(REPLAY_BLKSIZE_MAX + 4);
+  if (buf == NULL || last == NULL) {
+    perror("client");
+    exit(1);
+  }
+
+  for (cnt = 0; cnt < cl->num; cnt++) {
+    rq = cl->req[cnt];
+    /* a request due while the previous one still runs starts late. */
+    if (speed > 0) {
+      due = run_start + (uint64_t)((rq->rec.time - first) / speed);
+      now = now_usec();
+      if (now < due) {
+	sleep_usec(due - now);
+      }
+      else if (now - due > cl->max_lag) {
+	cl->max_lag = now - due;
+      }
+    }
+
+    /* a new port per request, like real clients. */
+    if ((s = socket(server.ss_family, SOCK_DGRAM, 0)) == -1) {
+      perror("socket");
+      rq->done = -1;
+      continue;
+    }
+    start = now_usec();
+    outcome = replay_one(s, cl, rq, buf, last);
+    rq->latency = now_usec() - start;
+    close(s);
+
+    rq->done = outcome == CAPTURE_ABORTED ? -1 : 1;
+    /* an error is as good as the captured one, aborts are not. */
+    rq->mismatch = CAPTURE_IS_ERROR(outcome) != 
+      CAPTURE_IS_ERROR(rq->rec.outcome) || outcome == CAPTURE_ABORTED;
+  }
+
+  free(buf);
+  free(last);
+  return NULL;
+}
+
+/*
+ * Latencies of the class, from this run or from the capture.
+ */
+void make_dist(struct replay_dist *dist, enum replay_class class,
+	       int captured)
+{
+  int cnt;
+
+  dist->num = 0;
+  dist->val = malloc(sizeof(uint64_t) * num_reqs);
+  for (cnt = 0; cnt < num_reqs; cnt++) {
+    if (class != RC_ALL && reqs[cnt].class != class) {
+      continue;
+    }
+    if (captured) {
+      if (reqs[cnt].rec.outcome != CAPTURE_ABORTED) {
+	dist->val[dist->num++] = reqs[cnt].rec.latency;
+      }
+    }
+    else if (reqs[cnt].done == 1) {
+      dist->val[dist->num++] = reqs[cnt].latency;
+    }
+  }
+  qsort(dist->val, dist->num, sizeof(uint64_t), u64_cmp);
+}
+
+double dist_pct(struct replay_dist *dist, double p)
+{
+  if (dist->num == 0) {
+    return 0;
+  }
+  return dist->val[(size_t)(dist->num * p)] / 1000.0;
+}
+
+/*
+ * Two-sample Kolmogorov-Smirnov statistic: the largest distance
+ * between the two cumulative distributions, 0 (same) to 1.
+ */
+double dist_ks(struct replay_dist *a, struct replay_dist *b)
+{
+  int ia = 0, ib = 0;
+  uint64_t val;
+  double d, max = 0;
+
+  if (a->num == 0 || b->num == 0) {
+    return 0;
+  }
+  while (ia < a->num && ib < b->num) {
+    val = a->val[ia] < b->val[ib] ? a->val[ia] : b->val[ib];
+    while (ia < a->num && a->val[ia] == val) {
+      ia++;
+    }
+    while (ib < b->num && b->val[ib] == val) {
+      ib++;
+    }
+    d = (double)ia / a->num - (double)ib / b->num;
+    if (d < 0) {
+      d = -d;
+    }
+    if (d > max) {
+      max = d;
+    }
+  }
+  return max;
+}
+
+void print_dists(struct replay_dist *dist)
+{
+  int cls;
+
+  printf("{");
+  for (cls = 0; cls < RC_NUM; cls++) {
+    printf("%s\n      \"%s\": {\"count\": %d, \"p50\": %.3f, \"p90\": %.3f, "
+	   "\"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f}",
+	   cls ? "," : "", class_names[cls], dist[cls].num,
+	   dist_pct(&dist[cls], 0.50), dist_pct(&dist[cls], 0.90),
+	   dist_pct(&dist[cls], 0.99), dist_pct(&dist[cls], 0.999),
+	   dist[cls].num ? dist[cls].val[dist[cls].num - 1] / 1000.0 : 0);
+  }
+  printf("}");
+}
+
+/*
+ * Replay the whole capture once and keep the distributions in dist.
+ */
+void replay_run(const char *name, int first, struct replay_dist *dist)
+{
+  pthread_t *tid;
+  uint64_t elapsed, max_lag = 0;
+  int cnt, done = 0, failed = 0, timeouts = 0, mismatch = 0;
+
+  tid = calloc(num_clients, sizeof(pthread_t));
+  run_start = now_usec();
+  for (cnt = 0; cnt < num_clients; cnt++) {
+    clients[cnt].timeouts = 0;
+    clients[cnt].max_lag = 0;
+    if (pthread_create(&tid[cnt], NULL, client_main, &clients[cnt]) != 0) {
+      perror("pthread_create");
+      exit(1);
+    }
+  }
+  for (cnt = 0; cnt < num_clients; cnt++) {
+    pthread_join(tid[cnt], NULL);
+    timeouts += clients[cnt].timeouts;
+    if (clients[cnt].max_lag > max_lag) {
+      max_lag = clients[cnt].max_lag;
+    }
+  }
+  elapsed = now_usec() - run_start;
+  free(tid);
+
+  for (cnt = 0; cnt < num_reqs; cnt++) {
+    if (reqs[cnt].done == 1) {
+      done++;
+    }
+    else {
+      failed++;
+    }
+    mismatch += reqs[cnt].mismatch;
+  }
+  for (cnt = 0; cnt < RC_NUM; cnt++) {
+    make_dist(&dist[cnt], cnt, 0);
+  }
+
+  printf("%s\n    {\"server\": \"%s\", \"completed\": %d, \"failed\": %d, "
+	 "\"timeouts\": %d, \"outcome_mismatch\": %d,\n"
+	 "     \"elapsed_sec\": %.3f, \"max_lag_ms\": %.3f,\n"
+	 "     \"latency_ms\": ",
+	 first ? "" : ",", name, done, failed, timeouts, mismatch,
+	 elapsed / 1e6, max_lag / 1000.0);
+  print_dists(dist);
+  printf("}");
+  fflush(stdout);
+}
+
+pid_t server_start(const char *path, const char *root, int threads)
+{
+  char tbuf[16];
+  pid_t pid;
+  int fd;
+
+  snprintf(tbuf, sizeof(tbuf), "%d", threads);
+  if ((pid = fork()) == -1) {
+    perror("fork");
+    exit(1);
+  }
+  if (pid == 0) {
+    if ((fd = open("/dev/null", O_WRONLY)) != -1) {
+      dup2(fd, 1);
+      dup2(fd, 2);
+    }
+    execl(path, path, "-p", server_port, "-r", root, "-t", tbuf,
+	  (char *)NULL);
+    _exit(127);
+  }
+
+  /* let it bind. */
+  sleep_usec(REPLAY_SETTLE_MSEC * 1000);
+  return pid;
+}
+
+void server_stop(pid_t pid)
+{
+  kill(pid, SIGTERM);
+  waitpid(pid, NULL, 0);
+}
+
+void print_compare(int run, const char *base, struct replay_dist *a,
+		   struct replay_dist *b, int first)
+{
+  int cls;
+
+  for (cls = 0; cls < RC_NUM; cls++) {
+    printf("%s\n    {\"run\": %d, \"base\": \"%s\", \"class\": \"%s\", "
+	   "\"p50_ratio\": %.3f, \"p90_ratio\": %.3f, \"p99_ratio\": %.3f, "
+	   "\"ks_d\": %.3f}",
+	   first && cls == 0 ? "" : ",", run, base, class_names[cls],
+	   dist_pct(&b[cls], 0.50) > 0 ?
+	   dist_pct(&a[cls], 0.50) / dist_pct(&b[cls], 0.50) : 0,
+	   dist_pct(&b[cls], 0.90) > 0 ?
+	   dist_pct(&a[cls], 0.90) / dist_pct(&b[cls], 0.90) : 0,
+	   dist_pct(&b[cls], 0.99) > 0 ?
+	   dist_pct(&a[cls], 0.99) / dist_pct(&b[cls], 0.99) : 0,
+	   dist_ks(&a[cls], &b[cls]));
+  }
+}
+
+int main(int argc, char **argv)
+{
+  struct addrinfo hints, *res;
+  struct replay_dist captured[RC_NUM], runs[REPLAY_MAX_SERVERS][RC_NUM];
+  char *root = NULL, *servers[REPLAY_MAX_SERVERS], *cp, name[64];
+  int num_servers = 0, threads = 4, create = 0, ch, cnt, err = 0;
+  pid_t pid;
+
+  while ((ch = getopt(argc, argv, "chp:r:s:S:t:x:")) != EOF) {
+    switch (ch) {
+    case 'c':
+      create = 1;
+      break;
+    case 'p':
+      server_port = optarg;
+      break;
+    case 'r':
+      root = optarg;
+      break;
+    case 's':
+      server_host = optarg;
+      break;
+    case 'S':
+      if ((speed = atof(optarg)) < 0) {
+	err = 1;
+      }
+      break;
+    case 't':
+      if ((threads = atoi(optarg)) <= 0) {
+	err = 1;
+      }
+      break;
+    case 'x':
+      for (cp = strtok(optarg, ","); cp != NULL; cp = strtok(NULL, ",")) {
+	if (num_servers == REPLAY_MAX_SERVERS) {
+	  err = 1;
+	  break;
+	}
+	servers[num_servers++] = cp;
+      }
+      break;
+    default:
+      err = 1;
+      break;
+    }
+  }
+  if (err || optind != argc - 1 ||
+      ((num_servers > 0 || create) && root == NULL)) {
+    print_usage(argv[0]);
+    exit(1);
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_DGRAM;
+  if ((err = getaddrinfo(server_host, server_port, &hints, &res)) != 0) {
+    fprintf(stderr, "%s: %s\n", server_host, gai_strerror(err));
+    exit(1);
+  }
+  memcpy(&server, res->ai_addr, res->ai_addrlen);
+  server_len = res->ai_addrlen;
+  freeaddrinfo(res);
+
+  /* netascii safe text, so both modes move the same bytes. */
+  pattern = malloc(REPLAY_BLKSIZE_MAX + SEGSIZE);
+  for (cnt = 0; cnt < REPLAY_BLKSIZE_MAX + SEGSIZE; cnt++) {
+    pattern[cnt] = cnt % 64 == 63 ? '\n' : 'a' + cnt % 26;
+  }
+
+  if (load_capture(argv[optind]) == -1) {
+    exit(1);
+  }
+  if (create && create_files(root) == -1) {
+    exit(1);
+  }
+
+  printf("{\"capture\": \"%s\", \"requests\": %d, \"clients\": %d, "
+	 "\"span_sec\": %.3f, \"speed\": %g,\n \"captured\": ",
+	 argv[optind], num_reqs, num_clients,
+	 (reqs[num_reqs - 1].rec.time - reqs[0].rec.time) / 1e6, speed);
+  for (cnt = 0; cnt < RC_NUM; cnt++) {
+    make_dist(&captured[cnt], cnt, 1);
+  }
+  print_dists(captured);
+  printf(",\n \"runs\": [");
+
+  if (num_servers == 0) {
+    snprintf(name, sizeof(name), "%s:%s", server_host, server_port);
+    replay_run(name, 1, runs[0]);
+    num_servers = 1;
+    servers[0] = name;
+  }
+  else {
+    for (cnt = 0; cnt < num_servers; cnt++) {
+      pid = server_start(servers[cnt], root, threads);
+      replay_run(servers[cnt], cnt == 0, runs[cnt]);
+      server_stop(pid);
+    }
+  }
+
+  /* one server is held against the capture, more against the first. */
+  printf("\n ],\n \"compare\": [");
+  if (num_servers == 1) {
+    print_compare(0, "captured", runs[0], captured, 1);
+  }
+  for (cnt = 1; cnt < num_servers; cnt++) {
+    print_compare(cnt, servers[0], runs[cnt], runs[0], cnt == 1);
+  }
+  printf("\n ]}\n");
+  return 0;
+}
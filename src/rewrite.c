@@ -0,0 +1,671 @@
+/*
+   rewrite.c
+   $Id$
+
+   This file is part of t-tftpd.
+
+   Copyright 2002,2007 Tomofumi Hayashi <s1061123@gmail.com>.
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+   3. All advertising materials mentioning features or use of this software
+      must display the following acknowledgement:
+
+        This product includes software developed by
+        Tomofumi Hayashi <s1061123@gmail.com> and its contributors.
+
+   4. Neither the name of authors nor the names of its contributors may be used
+      to endorse or promote products derived from this software without
+      specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND ANY
+   EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <limits.h>
+#include <regex.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "rewrite.h"
+
+#define RW_ICASE  0x01
+#define RW_GLOBAL 0x02
+#define RW_LOWER  0x04
+#define RW_LAST   0x08
+
+struct rewrite_rule {
+  int line;
+  regex_t re;
+  char *repl;
+  char prefix[REWRITE_NAME_SIZ];  /* literal head of a ^ pattern */
+  size_t prefix_len;
+  int flags;
+  /* from=, family 0 for every client */
+  int family;
+  unsigned char addr[16];
+  int bits;
+  unsigned long hits;
+};
+
+struct rewrite_set {
+  struct rewrite_rule *rule;
+  int nrule;
+  int refs;
+  unsigned long gen;
+  uint64_t from;          /* rules with from= */
+  char *path;             /* read from, until it is installed */
+  time_t mtime;
+};
+
+struct rewrite_slot {
+  unsigned long gen;
+  uint64_t mask;          /* the from= rules the client meets */
+  uint64_t applied;       /* the rules which matched */
+  char name[REWRITE_NAME_SIZ];
+  char out[REWRITE_NAME_SIZ];
+};
+
+static int rewrite_on = 0;
+static char *rule_path = NULL;
+static time_t rule_mtime = 0;
+static unsigned long generation = 0;
+
+static pthread_mutex_t rewrite_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct rewrite_set *rules = NULL;
+static struct rewrite_slot cache[REWRITE_CACHE_SIZE];
+static unsigned long total_lookups = 0, total_cached = 0;
+static unsigned long total_rewritten = 0;
+
+static void set_free(struct rewrite_set *set)
+{
+  int cnt;
+
+  for (cnt = 0; cnt < set->nrule; cnt++) {
+    regfree(&set->rule[cnt].re);
+    free(set->rule[cnt].repl);
+  }
+  free(set->rule);
+  free(set->path);
+  free(set);
+}
+
+/* Called with rewrite_mutex held. */
+static void set_put(struct rewrite_set *set)
+{
+  if (--set->refs == 0) {
+    set_free(set);
+  }
+}
+
+/* the literal head of a pattern anchored by ^, which a name must have. */
+static void rule_prefix(struct rewrite_rule *rp, const char *pattern)
+{
+  size_t len = 0;
+
+  rp->prefix_len = 0;
+  /* with an alternative, the head is not needed. */
+  if (*pattern++ != '^' || strchr(pattern, '|') != NULL) {
+    return;
+  }
+  for (; *pattern != '\0' && len < sizeof(rp->prefix) - 1; pattern++) {
+    if (strchr(".[]()*+?{}|^$", *pattern) != NULL) {
+      break;
+    }
+    if (*pattern == '\\') {
+      /* \. and the like are literals, \1 and the rest are not. */
+      if (pattern[1] == '\0' || isalnum((unsigned char)pattern[1])) {
+        break;
+      }
+      pattern++;
+    }
+    rp->prefix[len++] = *pattern;
+  }
+  /* the last one is optional before a quantifier. */
+  if (len > 0 && *pattern != '\0' && strchr("*?{", *pattern) != NULL) {
+    len--;
+  }
+  rp->prefix[len] = '\0';
+  rp->prefix_len = len;
+}
+
+/*
+ * "ADDR" or "ADDR/LEN".
+ * Return: 0 on success, -1 on error.
+ */
+static int rule_from(struct rewrite_rule *rp, char *value)
+{
+  char *cp, *end;
+  long bits = -1;
+
+  if ((cp = strchr(value, '/')) != NULL) {
+    *cp++ = '\0';
+    bits = strtol(cp, &end, 10);
+    if (*cp == '\0' || *end != '\0') {
+      return -1;
+    }
+  }
+  if (inet_pton(AF_INET, value, rp->addr) == 1) {
+    rp->family = AF_INET;
+    rp->bits = bits == -1 ? 32 : bits;
+    return bits > 32 ? -1 : 0;
+  }
+  if (inet_pton(AF_INET6, value, rp->addr) == 1) {
+    rp->family = AF_INET6;
+    rp->bits = bits == -1 ? 128 : bits;
+    return bits > 128 ? -1 : 0;
+  }
+  return -1;
+}
+
+/*
+ * One line of the file, which has no comment left.
+ * Return: 1 for a rule, 0 for an empty line, -1 on error.
+ */
+static int rule_parse(struct rewrite_rule *rp, char *line, int lineno)
+{
+  char *pattern, *repl, *cp, *last;
+  int err;
+
+  if ((pattern = strtok_r(line, " \t\r\n", &last)) == NULL) {
+    return 0;
+  }
+  if ((repl = strtok_r(NULL, " \t\r\n", &last)) == NULL) {
+    return -1;
+  }
+  memset(rp, 0, sizeof(*rp));
+  rp->line = lineno;
+  while ((cp = strtok_r(NULL, " \t\r\n", &last)) != NULL) {
+    if (strcmp(cp, "i") == 0) {
+      rp->flags |= RW_ICASE;
+    }
+    else if (strcmp(cp, "g") == 0) {
+      rp->flags |= RW_GLOBAL;
+    }
+    else if (strcmp(cp, "lower") == 0) {
+      rp->flags |= RW_LOWER;
+    }
+    else if (strcmp(cp, "last") == 0) {
+      rp->flags |= RW_LAST;
+    }
+    else if (strncmp(cp, "from=", 5) == 0 && rp->family == 0) {
+      if (rule_from(rp, cp + 5) == -1) {
+        return -1;
+      }
+    }
+    else {
+      return -1;
+    }
+  }
+
+  if ((rp->repl = strdup(strcmp(repl, "-") == 0 ? "" : repl)) == NULL) {
+    return -1;
+  }
+  err = regcomp(&rp->re, pattern,
+                REG_EXTENDED | (rp->flags & RW_ICASE ? REG_ICASE : 0));
+  if (err != 0) {
+    free(rp->repl);
+    return -1;
+  }
+  rule_prefix(rp, pattern);
+  return 1;
+}
+
+/*
+ * Read and compile the rules of path.
+ * Return: the set, or NULL on error.
+ */
+static struct rewrite_set *rewrite_parse(const char *path, time_t *mtime)
+{
+  FILE *fp;
+  struct stat st;
+  struct rewrite_set *set;
+  struct rewrite_rule rule;
+  char *line = NULL, *cp;
+  size_t size = 0;
+  int lineno = 0, ret;
+
+  if ((fp = fopen(path, "r")) == NULL) {
+    return NULL;
+  }
+  if (fstat(fileno(fp), &st) == -1 || st.st_size > REWRITE_FILE_MAX ||
+      (set = calloc(1, sizeof(*set))) == NULL) {
+    fclose(fp);
+    return NULL;
+  }
+  if ((set->rule = calloc(REWRITE_MAX, sizeof(*set->rule))) == NULL) {
+    free(set);
+    fclose(fp);
+    return NULL;
+  }
+  *mtime = st.st_mtime;
+  /* a whole line, a long rule is not cut in two. */
+  while (getline(&line, &size, fp) != -1) {
+    lineno++;
+    if ((cp = strchr(line, '#')) != NULL) {
+      *cp = '\0';
+    }
+    ret = rule_parse(&rule, line, lineno);
+    if (ret == 0) {
+      continue;
+    }
+    if (ret == -1 || set->nrule == REWRITE_MAX) {
+      if (ret == 1) {
+        regfree(&rule.re);
+        free(rule.repl);
+      }
+      fprintf(stderr, "%s:%d: invalid rule.\n", path, lineno);
+      free(line);
+      fclose(fp);
+      set_free(set);
+      return NULL;
+    }
+    if (rule.family != 0) {
+      set->from |= (uint64_t)1 << set->nrule;
+    }
+    set->rule[set->nrule++] = rule;
+  }
+  free(line);
+  fclose(fp);
+  set->refs = 1;
+  return set;
+}
+
+/*
+ * Read the rules of path, for rewrite_install() or rewrite_discard().
+ * Return: the rules, or NULL when they are not valid.
+ */
+rewrite_set *rewrite_load(const char *path)
+{
+  struct rewrite_set *set;
+  time_t mtime;
+
+  if ((set = rewrite_parse(path, &mtime)) == NULL) {
+    return NULL;
+  }
+  if ((set->path = strdup(path)) == NULL) {
+    set_free(set);
+    return NULL;
+  }
+  set->mtime = mtime;
+  return set;
+}
+
+/* switch to the rules of rewrite_load(). */
+void rewrite_install(rewrite_set *set)
+{
+  struct rewrite_set *old;
+
+  pthread_mutex_lock(&rewrite_mutex);
+  set->gen = ++generation;
+  old = rules;
+  rules = set;
+  if (old != NULL) {
+    set_put(old);
+  }
+  free(rule_path);
+  rule_path = set->path;
+  rule_mtime = set->mtime;
+  set->path = NULL;
+  pthread_mutex_unlock(&rewrite_mutex);
+  rewrite_on = 1;
+}
+
+void rewrite_discard(rewrite_set *set)
+{
+  set_free(set);
+}
+
+/*
+ * Return: 0 on success, -1 on error.
+ */
+int rewrite_config(const char *path)
+{
+  struct rewrite_set *set;
+
+  if ((set = rewrite_load(path)) == NULL) {
+    return -1;
+  }
+  rewrite_install(set);
+  return 0;
+}
+
+int rewrite_enabled(void)
+{
+  return rewrite_on;
+}
+
+/*
+ * Read the rules again if the file has been changed.  A broken file
+ * leaves the rules as they are.
+ */
+void rewrite_reload(void)
+{
+  struct stat st;
+  char path[PATH_MAX];
+
+  if (!rewrite_on) {
+    return;
+  }
+  pthread_mutex_lock(&rewrite_mutex);
+  snprintf(path, sizeof(path), "%s", rule_path);
+  if (stat(path, &st) == -1 || st.st_mtime == rule_mtime) {
+    pthread_mutex_unlock(&rewrite_mutex);
+    return;
+  }
+  rule_mtime = st.st_mtime;
+  pthread_mutex_unlock(&rewrite_mutex);
+
+  if (rewrite_config(path) == -1) {
+    fprintf(stderr, "rewrite rules %s are invalid, not changed.\n", path);
+  }
+  else {
+    fprintf(stderr, "rewrite rules %s are reloaded.\n", path);
+  }
+}
+
+static int rule_client(const struct rewrite_rule *rp,
+                       const struct sockaddr *sa)
+{
+  const unsigned char *src;
+  int family, bits, cnt;
+
+  family = sa->sa_family;
+  if (family == AF_INET) {
+    src = (const unsigned char *)&((struct sockaddr_in *)sa)->sin_addr;
+  }
+  else if (family == AF_INET6) {
+    src = (const unsigned char *)&((struct sockaddr_in6 *)sa)->sin6_addr;
+    if (IN6_IS_ADDR_V4MAPPED((struct in6_addr *)src)) {
+      family = AF_INET;
+      src += 12;
+    }
+  }
+  else {
+    return 0;
+  }
+  if (family != rp->family) {
+    return 0;
+  }
+  for (cnt = 0, bits = rp->bits; bits > 0; cnt++, bits -= 8) {
+    if (bits >= 8) {
+      if (src[cnt] != rp->addr[cnt]) {
+        return 0;
+      }
+    }
+    else if ((src[cnt] ^ rp->addr[cnt]) & (0xff << (8 - bits))) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static unsigned int slot_hash(const char *name, uint64_t mask)
+{
+  unsigned int hash = 2166136261U;
+
+  for (; *name != '\0'; name++) {
+    hash = (hash ^ (unsigned char)*name) * 16777619U;
+  }
+  hash ^= (unsigned int)(mask ^ (mask >> 32));
+  return hash % REWRITE_CACHE_SIZE;
+}
+
+/*
+ * Replace the match(es) of rp in in, into out.
+ * Return: 1 when it has matched, 0 when not, -1 when out is too short.
+ */
+static int rule_subst(const struct rewrite_rule *rp, const char *in,
+                      char *out, size_t outlen)
+{
+  regmatch_t m[10];
+  const char *cp, *r;
+  size_t len = 0, n;
+  int eflags = 0, matched = 0, g;
+
+  if (rp->prefix_len > 0 &&
+      ((rp->flags & RW_ICASE) ?
+       strncasecmp(in, rp->prefix, rp->prefix_len) :
+       strncmp(in, rp->prefix, rp->prefix_len)) != 0) {
+    return 0;
+  }
+
+  cp = in;
+  while (regexec(&rp->re, cp, 10, m, eflags) == 0) {
+    matched = 1;
+    /* what is before the match */
+    n = m[0].rm_so;
+    if (len + n >= outlen) {
+      return -1;
+    }
+    memcpy(out + len, cp, n);
+    len += n;
+    for (r = rp->repl; *r != '\0'; r++) {
+      if (*r == '\\' && r[1] >= '0' && r[1] <= '9') {
+        g = *++r - '0';
+        if (m[g].rm_so == -1) {
+          continue;
+        }
+        n = m[g].rm_eo - m[g].rm_so;
+        if (len + n >= outlen) {
+          return -1;
+        }
+        memcpy(out + len, cp + m[g].rm_so, n);
+        len += n;
+        continue;
+      }
+      if (*r == '\\' && r[1] != '\0') {
+        r++;
+      }
+      if (len + 1 >= outlen) {
+        return -1;
+      }
+      out[len++] = *r;
+    }
+    if (m[0].rm_eo == m[0].rm_so) {
+      /* an empty match, go on from the next character. */
+      if (cp[m[0].rm_eo] == '\0') {
+        cp += m[0].rm_eo;
+        break;
+      }
+      if (len + 1 >= outlen) {
+        return -1;
+      }
+      out[len++] = cp[m[0].rm_eo];
+      cp += m[0].rm_eo + 1;
+    }
+    else {
+      cp += m[0].rm_eo;
+    }
+    if (!(rp->flags & RW_GLOBAL)) {
+      break;
+    }
+    eflags = REG_NOTBOL;
+  }
+  if (!matched) {
+    return 0;
+  }
+  n = strlen(cp);
+  if (len + n >= outlen) {
+    return -1;
+  }
+  memcpy(out + len, cp, n + 1);
+  if (rp->flags & RW_LOWER) {
+    for (n = 0; out[n] != '\0'; n++) {
+      out[n] = tolower((unsigned char)out[n]);
+    }
+  }
+  return 1;
+}
+
+/*
+ * Put the name after the rules for client into out, counting the lookup
+ * in the statistics when counted is set.
+ * Return: the number of rules which matched, 0 when out is the name.
+ */
+static int apply_rules(const char *name, const struct sockaddr *client,
+                       char *out, size_t outlen, int counted)
+{
+  struct rewrite_set *set;
+  struct rewrite_slot *sp;
+  char buf[2][REWRITE_NAME_SIZ];
+  uint64_t mask = 0, applied = 0;
+  int cnt, cur = 0, count = 0;
+
+  snprintf(out, outlen, "%s", name);
+  if (!rewrite_on || strlen(name) >= REWRITE_NAME_SIZ) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&rewrite_mutex);
+  set = rules;
+  set->refs++;
+  if (counted) {
+    total_lookups++;
+  }
+  pthread_mutex_unlock(&rewrite_mutex);
+
+  for (cnt = 0; cnt < set->nrule; cnt++) {
+    if ((set->from & ((uint64_t)1 << cnt)) &&
+        rule_client(&set->rule[cnt], client)) {
+      mask |= (uint64_t)1 << cnt;
+    }
+  }
+
+  sp = &cache[slot_hash(name, mask)];
+  pthread_mutex_lock(&rewrite_mutex);
+  if (sp->gen == set->gen && sp->mask == mask &&
+      strcmp(sp->name, name) == 0) {
+    applied = sp->applied;
+    snprintf(buf[0], sizeof(buf[0]), "%s", sp->out);
+    if (counted) {
+      total_cached++;
+    }
+    pthread_mutex_unlock(&rewrite_mutex);
+    goto done;
+  }
+  pthread_mutex_unlock(&rewrite_mutex);
+
+  snprintf(buf[0], sizeof(buf[0]), "%s", name);
+  for (cnt = 0; cnt < set->nrule; cnt++) {
+    if ((set->from & ((uint64_t)1 << cnt)) && !(mask & ((uint64_t)1 << cnt))) {
+      continue;
+    }
+    if (rule_subst(&set->rule[cnt], buf[cur], buf[!cur],
+                   sizeof(buf[0])) != 1) {
+      continue;
+    }
+    cur = !cur;
+    applied |= (uint64_t)1 << cnt;
+    if (set->rule[cnt].flags & RW_LAST) {
+      break;
+    }
+  }
+  if (cur != 0) {
+    memcpy(buf[0], buf[1], sizeof(buf[0]));
+  }
+
+  pthread_mutex_lock(&rewrite_mutex);
+  sp->gen = set->gen;
+  sp->mask = mask;
+  sp->applied = applied;
+  snprintf(sp->name, sizeof(sp->name), "%s", name);
+  snprintf(sp->out, sizeof(sp->out), "%s", buf[0]);
+  pthread_mutex_unlock(&rewrite_mutex);
+
+ done:
+  for (cnt = 0; cnt < set->nrule; cnt++) {
+    if (applied & ((uint64_t)1 << cnt)) {
+      if (counted) {
+        __atomic_add_fetch(&set->rule[cnt].hits, 1, __ATOMIC_RELAXED);
+      }
+      count++;
+    }
+  }
+  pthread_mutex_lock(&rewrite_mutex);
+  if (counted && count > 0 && strcmp(buf[0], name) != 0) {
+    total_rewritten++;
+  }
+  set_put(set);
+  pthread_mutex_unlock(&rewrite_mutex);
+  if (count > 0) {
+    snprintf(out, outlen, "%s", buf[0]);
+  }
+  return count;
+}
+
+/*
+ * Put the name after the rules for client into out.
+ * Return: the number of rules which matched, 0 when out is the name.
+ */
+int rewrite_apply(const char *name, const struct sockaddr *client,
+                  char *out, size_t outlen)
+{
+  return apply_rules(name, client, out, outlen, 1);
+}
+
+/*
+ * As rewrite_apply(), for a look at the name ahead of the request which
+ * is counted when it is served.
+ */
+int rewrite_peek(const char *name, const struct sockaddr *client,
+                 char *out, size_t outlen)
+{
+  return apply_rules(name, client, out, outlen, 0);
+}
+
+/*
+ * The rule idx of the rules in use, with its line in the file.
+ * Return: 0 on success, -1 when there is no such rule.
+ */
+int rewrite_rule_stat(int idx, int *line, unsigned long *hits)
+{
+  int ret = -1;
+
+  pthread_mutex_lock(&rewrite_mutex);
+  if (rules != NULL && idx >= 0 && idx < rules->nrule) {
+    *line = rules->rule[idx].line;
+    *hits = __atomic_load_n(&rules->rule[idx].hits, __ATOMIC_RELAXED);
+    ret = 0;
+  }
+  pthread_mutex_unlock(&rewrite_mutex);
+  return ret;
+}
+
+void rewrite_total_stat(unsigned long *lookups, unsigned long *cached,
+                        unsigned long *rewritten)
+{
+  pthread_mutex_lock(&rewrite_mutex);
+  *lookups = total_lookups;
+  *cached = total_cached;
+  *rewritten = total_rewritten;
+  pthread_mutex_unlock(&rewrite_mutex);
+}
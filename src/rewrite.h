@@ -0,0 +1,98 @@
+/*
+   rewrite.h
+   $Id$
+
+   This file is part of t-tftpd.
+
+   Copyright 2002,2007 Tomofumi Hayashi <s1061123@gmail.com>.
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+   3. All advertising materials mentioning features or use of this software
+      must display the following acknowledgement:
+
+        This product includes software developed by
+        Tomofumi Hayashi <s1061123@gmail.com> and its contributors.
+
+   4. Neither the name of authors nor the names of its contributors may be used
+      to endorse or promote products derived from this software without
+      specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND ANY
+   EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _REWRITE_H_
+#define _REWRITE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/*
+ * Rewrite of the requested names, for the firmware which asks for the
+ * files of the tree under names of its own.
+ * -R takes a file of rules, one in a line:
+ *   PATTERN  REPLACEMENT  [i] [g] [lower] [last] [from=ADDR[/LEN]]
+ * PATTERN is an extended regular expression (no white space in it, use
+ * [[:space:]]), REPLACEMENT has \1..\9 for the groups and \0 for all of
+ * it, "-" is an empty one.  i ignores the case, g replaces every match,
+ * lower puts the result in lower case, last stops after this rule, and
+ * from= takes the rule only for the clients in the prefix.  The rules
+ * are taken in order, each on the result of the ones before, e.g.
+ *   \\          /   g            backslashes
+ *   ^/tftpboot/ -                absolute names
+ *   ^pxelinux\.cfg/.*  \0  lower from=10.1.0.0/16
+ * The file is read again when it changes.
+ *
+ * The patterns are compiled when the file is read, and a rule whose
+ * pattern starts with ^ and a literal is only tried on the names which
+ * begin with it.  The results are kept in a direct mapped cache of
+ * REWRITE_CACHE_SIZE by the name and the from= rules the client meets.
+ */
+#define REWRITE_MAX 64      /* rules */
+#define REWRITE_NAME_SIZ 256
+#define REWRITE_CACHE_SIZE 512
+#define REWRITE_FILE_MAX (64 * 1024)
+
+typedef struct rewrite_set rewrite_set;
+
+rewrite_set *rewrite_load(const char *path);
+void rewrite_install(rewrite_set *set);
+void rewrite_discard(rewrite_set *set);
+int rewrite_config(const char *path);
+int rewrite_enabled(void);
+void rewrite_reload(void);
+int rewrite_apply(const char *name, const struct sockaddr *client,
+                  char *out, size_t outlen);
+int rewrite_peek(const char *name, const struct sockaddr *client,
+                 char *out, size_t outlen);
+int rewrite_rule_stat(int idx, int *line, unsigned long *hits);
+void rewrite_total_stat(unsigned long *lookups, unsigned long *cached,
+                        unsigned long *rewritten);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* !_REWRITE_H_ */
@@ -0,0 +1,772 @@
+/*
+   shape.c
+   $Id$
+
+   This file is part of t-tftpd.
+
+   Copyright 2002,2007 Tomofumi Hayashi <s1061123@gmail.com>.
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+   3. All advertising materials mentioning features or use of this software
+      must display the following acknowledgement:
+
+        This product includes software developed by
+        Tomofumi Hayashi <s1061123@gmail.com> and its contributors.
+
+   4. Neither the name of authors nor the names of its contributors may be used
+      to endorse or promote products derived from this software without
+      specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND ANY
+   EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+
+#include "shape.h"
+
+#define SHAPE_CLIENT_HASH 256
+#define SHAPE_PATTERN_SIZ 128
+#define SHAPE_SPEC_MAX 4096
+#define SHAPE_MAX_SLEEP 100000  /* usec */
+
+struct shape_bucket {
+  uint64_t rate;      /* bytes/sec, 0 is unlimited */
+  double tokens;      /* bytes, below 0 while in debt */
+  uint64_t stamp;     /* usec of the last refill */
+  int refs;           /* sessions using it */
+  int retired;        /* no longer in the configuration */
+  /* client buckets */
+  int family;
+  unsigned char addr[16];
+  /* class buckets */
+  char pattern[SHAPE_PATTERN_SIZ];
+  struct shape_bucket *next;
+};
+
+struct shape_conf {
+  uint64_t total, client;
+  int prefix, prefix6;
+  int burst;
+  int nclasses;
+  char pattern[SHAPE_MAX_CLASSES][SHAPE_PATTERN_SIZ];
+  uint64_t class_rate[SHAPE_MAX_CLASSES];
+};
+
+/* a spec read, before it is installed. */
+struct shape_spec {
+  struct shape_conf conf;
+  char *path;         /* of an @file */
+  time_t mtime;
+};
+
+/* a packet waiting for its turn, on the stack of the sender. */
+struct shape_waiter {
+  struct shape_state *ss;
+  uint64_t start;     /* virtual start */
+  size_t len;
+  int granted;
+  struct shape_waiter *next;
+};
+
+static int shape_on = 0;
+static pthread_once_t shape_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t shape_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t shape_cond;
+static struct shape_conf sc;
+static struct shape_bucket total_bucket;
+static struct shape_bucket *class_bucket[SHAPE_MAX_CLASSES];
+static struct shape_bucket *client_hash[SHAPE_CLIENT_HASH];
+static struct shape_waiter *waiters = NULL;
+static uint64_t vtime = 0;
+static char *spec_path = NULL;
+static time_t spec_mtime = 0;
+
+static unsigned long total_packets = 0, total_delayed = 0;
+static unsigned long long total_waited = 0;
+
+static uint64_t shape_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * "1500", "64K", "10M" or "1G" bytes/sec.
+ * Return: 0 on success, -1 on error.
+ */
+static int parse_rate(const char *str, uint64_t *rate)
+{
+  char *end;
+  unsigned long long val;
+
+  errno = 0;
+  val = strtoull(str, &end, 10);
+  if (errno != 0 || end == str) {
+    return -1;
+  }
+  switch (toupper((int)*end)) {
+  case 'G':
+    val *= 1024;
+    /* FALLTHROUGH */
+  case 'M':
+    val *= 1024;
+    /* FALLTHROUGH */
+  case 'K':
+    val *= 1024;
+    end++;
+    break;
+  }
+  if (*end != '\0') {
+    return -1;
+  }
+  *rate = val;
+  return 0;
+}
+
+/*
+ * A rate for the other modules, in the same form.
+ * Return: 0 on success, -1 on error.
+ */
+int shape_rate(const char *str, uint64_t *rate)
+{
+  return parse_rate(str, rate);
+}
+
+/*
+ * Return: 0 on success, -1 on error.
+ */
+static int parse_spec(char *str, struct shape_conf *conf)
+{
+  char *cp, *value, *rate, *end, *save;
+
+  for (cp = strtok_r(str, ", \t\r\n", &save); cp != NULL;
+       cp = strtok_r(NULL, ", \t\r\n", &save)) {
+    if ((value = strchr(cp, '=')) == NULL) {
+      return -1;
+    }
+    *value++ = '\0';
+    if (strcmp(cp, "total") == 0) {
+      if (parse_rate(value, &conf->total) == -1) {
+        return -1;
+      }
+    }
+    else if (strcmp(cp, "client") == 0) {
+      if (parse_rate(value, &conf->client) == -1) {
+        return -1;
+      }
+    }
+    else if (strcmp(cp, "prefix") == 0) {
+      conf->prefix = strtol(value, &end, 10);
+      if (*end != '\0' || conf->prefix < 0 || conf->prefix > 32) {
+        return -1;
+      }
+    }
+    else if (strcmp(cp, "prefix6") == 0) {
+      conf->prefix6 = strtol(value, &end, 10);
+      if (*end != '\0' || conf->prefix6 < 0 || conf->prefix6 > 128) {
+        return -1;
+      }
+    }
+    else if (strcmp(cp, "burst") == 0) {
+      conf->burst = strtol(value, &end, 10);
+      if (*end != '\0' || conf->burst <= 0) {
+        return -1;
+      }
+    }
+    else if (strcmp(cp, "class") == 0) {
+      if ((rate = strrchr(value, ':')) == NULL ||
+          conf->nclasses == SHAPE_MAX_CLASSES ||
+          rate - value >= SHAPE_PATTERN_SIZ) {
+        return -1;
+      }
+      *rate++ = '\0';
+      if (parse_rate(rate, &conf->class_rate[conf->nclasses]) == -1) {
+        return -1;
+      }
+      strcpy(conf->pattern[conf->nclasses], value);
+      conf->nclasses++;
+    }
+    else {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Read the items of a spec file, leaving out the comments.
+ * Return: the spec to be freed, or NULL on error.
+ */
+static char *read_spec(const char *path, time_t *mtime)
+{
+  FILE *fp;
+  struct stat st;
+  char *line = NULL, *str, *cp;
+  size_t len, size = 0;
+
+  if ((fp = fopen(path, "r")) == NULL) {
+    return NULL;
+  }
+  if (fstat(fileno(fp), &st) == -1 ||
+      (str = (char *)malloc(SHAPE_SPEC_MAX)) == NULL) {
+    fclose(fp);
+    return NULL;
+  }
+  *mtime = st.st_mtime;
+  len = 0;
+  str[0] = '\0';
+  /* a whole line, a long item is not cut in two. */
+  while (getline(&line, &size, fp) != -1) {
+    if ((cp = strchr(line, '#')) != NULL) {
+      *cp = '\0';
+    }
+    if (len + strlen(line) + 2 > SHAPE_SPEC_MAX) {
+      free(line);
+      free(str);
+      fclose(fp);
+      return NULL;
+    }
+    len += snprintf(str + len, SHAPE_SPEC_MAX - len, "%s ", line);
+  }
+  free(line);
+  fclose(fp);
+  return str;
+}
+
+static uint64_t bucket_cap(struct shape_bucket *bp)
+{
+  uint64_t cap;
+
+  cap = bp->rate * sc.burst / 1000;
+  return cap > 0 ? cap : 1;
+}
+
+static void bucket_init(struct shape_bucket *bp, uint64_t rate)
+{
+  bp->rate = rate;
+  bp->stamp = shape_now();
+  bp->tokens = bucket_cap(bp);
+}
+
+static void bucket_refill(struct shape_bucket *bp, uint64_t now)
+{
+  double cap;
+
+  if (bp->rate == 0 || now <= bp->stamp) {
+    return;
+  }
+  bp->tokens += (double)bp->rate * (now - bp->stamp) / 1000000.0;
+  bp->stamp = now;
+  cap = bucket_cap(bp);
+  if (bp->tokens > cap) {
+    bp->tokens = cap;
+  }
+}
+
+/* usec until the bucket has tokens again, 0 if it has them now. */
+static uint64_t bucket_ready(struct shape_bucket *bp)
+{
+  if (bp == NULL || bp->rate == 0 || bp->tokens > 0) {
+    return 0;
+  }
+  return (uint64_t)(-bp->tokens * 1000000.0 / bp->rate) + 1;
+}
+
+static void bucket_take(struct shape_bucket *bp, size_t len)
+{
+  if (bp != NULL && bp->rate != 0) {
+    bp->tokens -= len;
+  }
+}
+
+static void bucket_release(struct shape_bucket *bp)
+{
+  if (bp != NULL && --bp->refs == 0 && bp->retired) {
+    free(bp);
+  }
+}
+
+/*
+ * Apply a configuration, keeping the tokens of the buckets which stay.
+ * Called with shape_mutex held.
+ */
+static void shape_apply(struct shape_conf *conf)
+{
+  struct shape_bucket *keep[SHAPE_MAX_CLASSES], *bp;
+  int cnt, idx;
+
+  sc = *conf;
+  total_bucket.rate = sc.total;
+
+  for (cnt = 0; cnt < sc.nclasses; cnt++) {
+    keep[cnt] = NULL;
+    for (idx = 0; idx < SHAPE_MAX_CLASSES; idx++) {
+      bp = class_bucket[idx];
+      if (bp != NULL && strcmp(bp->pattern, sc.pattern[cnt]) == 0) {
+        class_bucket[idx] = NULL;
+        bp->rate = sc.class_rate[cnt];
+        keep[cnt] = bp;
+        break;
+      }
+    }
+    if (keep[cnt] == NULL &&
+        (keep[cnt] = calloc(1, sizeof(struct shape_bucket))) != NULL) {
+      strcpy(keep[cnt]->pattern, sc.pattern[cnt]);
+      bucket_init(keep[cnt], sc.class_rate[cnt]);
+    }
+  }
+  /* the sessions in a removed class go on unlimited by it. */
+  for (idx = 0; idx < SHAPE_MAX_CLASSES; idx++) {
+    bp = class_bucket[idx];
+    class_bucket[idx] = idx < sc.nclasses ? keep[idx] : NULL;
+    if (bp != NULL) {
+      bp->rate = 0;
+      bp->retired = 1;
+      if (bp->refs == 0) {
+        free(bp);
+      }
+    }
+  }
+
+  for (idx = 0; idx < SHAPE_CLIENT_HASH; idx++) {
+    for (bp = client_hash[idx]; bp != NULL; bp = bp->next) {
+      bp->rate = sc.client;
+    }
+  }
+  pthread_cond_broadcast(&shape_cond);
+}
+
+/*
+ * Read the spec (@file for a file) into *conf.
+ * Return: 0 on success, -1 on error.
+ */
+static int shape_parse(const char *spec, struct shape_conf *conf,
+                       time_t *mtime)
+{
+  char *str;
+  int ret;
+
+  if (spec[0] == '@') {
+    str = read_spec(spec + 1, mtime);
+  }
+  else {
+    str = strdup(spec);
+  }
+  if (str == NULL) {
+    return -1;
+  }
+  memset(conf, 0, sizeof(*conf));
+  conf->prefix = 32;
+  conf->prefix6 = 64;
+  conf->burst = SHAPE_DEFAULT_BURST;
+  ret = parse_spec(str, conf);
+  free(str);
+  return ret;
+}
+
+static void shape_init(void)
+{
+  pthread_condattr_t attr;
+
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&shape_cond, &attr);
+  pthread_condattr_destroy(&attr);
+  bucket_init(&total_bucket, 0);
+}
+
+/*
+ * Read spec, for shape_install() or shape_discard().
+ * Return: the spec, or NULL when it is not valid.
+ */
+shape_spec *shape_load(const char *spec)
+{
+  struct shape_spec *sp;
+
+  if ((sp = (struct shape_spec *)calloc(1, sizeof(*sp))) == NULL) {
+    return NULL;
+  }
+  if (shape_parse(spec, &sp->conf, &sp->mtime) == -1 ||
+      (spec[0] == '@' && (sp->path = strdup(spec + 1)) == NULL)) {
+    free(sp);
+    return NULL;
+  }
+  return sp;
+}
+
+/* switch to the limits of shape_load(). */
+void shape_install(shape_spec *sp)
+{
+  pthread_once(&shape_once, shape_init);
+
+  pthread_mutex_lock(&shape_mutex);
+  shape_apply(&sp->conf);
+  if (sp->path != NULL) {
+    free(spec_path);
+    spec_path = sp->path;
+  }
+  spec_mtime = sp->mtime;
+  pthread_mutex_unlock(&shape_mutex);
+  free(sp);
+  shape_on = 1;
+}
+
+void shape_discard(shape_spec *sp)
+{
+  free(sp->path);
+  free(sp);
+}
+
+/*
+ * Return: 0 on success, -1 on error.
+ */
+int shape_config(const char *spec)
+{
+  struct shape_spec *sp;
+
+  if ((sp = shape_load(spec)) == NULL) {
+    return -1;
+  }
+  shape_install(sp);
+  return 0;
+}
+
+int shape_enabled(void)
+{
+  return shape_on;
+}
+
+/*
+ * Read the spec file again if it has been changed.  A broken file
+ * leaves the limits as they are.
+ */
+void shape_reload(void)
+{
+  struct stat st;
+  char spec[PATH_MAX + 2];
+
+  if (!shape_on || spec_path == NULL ||
+      stat(spec_path, &st) == -1 || st.st_mtime == spec_mtime) {
+    return;
+  }
+  snprintf(spec, sizeof(spec), "@%s", spec_path);
+  if (shape_config(spec) == -1) {
+    fprintf(stderr, "shaping spec %s is invalid, not changed.\n", spec_path);
+    spec_mtime = st.st_mtime;
+  }
+  else {
+    fprintf(stderr, "shaping spec %s is reloaded.\n", spec_path);
+  }
+}
+
+/* the client address masked to its prefix. */
+static void client_key(const struct sockaddr *sa, int *family,
+                       unsigned char *addr)
+{
+  const unsigned char *src;
+  int len, prefix, cnt;
+
+  memset(addr, 0, 16);
+  *family = sa->sa_family;
+  if (sa->sa_family == AF_INET) {
+    src = (const unsigned char *)&((struct sockaddr_in *)sa)->sin_addr;
+    len = 4;
+    prefix = sc.prefix;
+  }
+  else if (sa->sa_family == AF_INET6) {
+    src = (const unsigned char *)&((struct sockaddr_in6 *)sa)->sin6_addr;
+    len = 16;
+    prefix = sc.prefix6;
+    if (IN6_IS_ADDR_V4MAPPED((struct in6_addr *)src)) {
+      *family = AF_INET;
+      src += 12;
+      len = 4;
+      prefix = sc.prefix;
+    }
+  }
+  else {
+    return;
+  }
+  for (cnt = 0; cnt < len && prefix > 0; cnt++, prefix -= 8) {
+    addr[cnt] = src[cnt] & (prefix >= 8 ? 0xff : 0xff << (8 - prefix));
+  }
+}
+
+/* Called with shape_mutex held. */
+static struct shape_bucket *client_bucket(const struct sockaddr *sa)
+{
+  struct shape_bucket *bp, **prev;
+  unsigned char addr[16];
+  unsigned int hash;
+  int family, cnt;
+  uint64_t now;
+
+  client_key(sa, &family, addr);
+  hash = family;
+  for (cnt = 0; cnt < 16; cnt++) {
+    hash = hash * 31 + addr[cnt];
+  }
+  hash %= SHAPE_CLIENT_HASH;
+
+  now = shape_now();
+  prev = &client_hash[hash];
+  while ((bp = *prev) != NULL) {
+    if (bp->family == family && memcmp(bp->addr, addr, 16) == 0) {
+      bp->refs++;
+      return bp;
+    }
+    /* unused ones are dropped once they have refilled. */
+    if (bp->refs == 0) {
+      bucket_refill(bp, now);
+      if (bp->rate == 0 || bp->tokens >= bucket_cap(bp)) {
+        *prev = bp->next;
+        free(bp);
+        continue;
+      }
+    }
+    prev = &bp->next;
+  }
+
+  if ((bp = calloc(1, sizeof(struct shape_bucket))) == NULL) {
+    return NULL;
+  }
+  bp->family = family;
+  memcpy(bp->addr, addr, 16);
+  bucket_init(bp, sc.client);
+  bp->refs = 1;
+  bp->next = client_hash[hash];
+  client_hash[hash] = bp;
+  return bp;
+}
+
+/*
+ * size is the size of the file, -1 if not known.
+ */
+void shape_start(struct shape_state *ss, const struct sockaddr *client,
+                 const char *filename, off_t size)
+{
+  int cnt;
+
+  memset(ss, 0, sizeof(*ss));
+  if (!shape_on) {
+    return;
+  }
+  pthread_mutex_lock(&shape_mutex);
+  ss->active = 1;
+  if (size >= 0 && size < SHAPE_SMALL_SIZE) {
+    ss->weight = SHAPE_WEIGHT_MAX;
+  }
+  else if (size >= 0 && size < SHAPE_LARGE_SIZE) {
+    ss->weight = SHAPE_WEIGHT_MAX / 2;
+  }
+  else {
+    ss->weight = 1;
+  }
+  ss->client = client_bucket(client);
+  for (cnt = 0; cnt < sc.nclasses; cnt++) {
+    if (class_bucket[cnt] != NULL &&
+        fnmatch(class_bucket[cnt]->pattern, filename, 0) == 0) {
+      ss->class = class_bucket[cnt];
+      ss->class->refs++;
+      break;
+    }
+  }
+  ss->finish = vtime;
+  pthread_mutex_unlock(&shape_mutex);
+}
+
+/*
+ * Let the waiting packets go in order of their virtual start, as far
+ * as their buckets allow.  Called with shape_mutex held.
+ * Return: usec until a bucket of a waiting packet refills.
+ */
+static uint64_t shape_dispatch(void)
+{
+  struct shape_waiter *wp, **prev;
+  uint64_t now, next, ready, wait;
+  int granted = 0;
+
+  now = shape_now();
+  bucket_refill(&total_bucket, now);
+  next = SHAPE_MAX_SLEEP;
+  prev = &waiters;
+  while ((wp = *prev) != NULL) {
+    if (wp->ss->client != NULL) {
+      bucket_refill(wp->ss->client, now);
+    }
+    if (wp->ss->class != NULL) {
+      bucket_refill(wp->ss->class, now);
+    }
+    if (wp->ss->session != NULL) {
+      bucket_refill(wp->ss->session, now);
+    }
+    ready = bucket_ready(&total_bucket);
+    if ((wait = bucket_ready(wp->ss->client)) > ready) {
+      ready = wait;
+    }
+    if ((wait = bucket_ready(wp->ss->class)) > ready) {
+      ready = wait;
+    }
+    if ((wait = bucket_ready(wp->ss->session)) > ready) {
+      ready = wait;
+    }
+    if (ready > 0) {
+      if (ready < next) {
+        next = ready;
+      }
+      prev = &wp->next;
+      continue;
+    }
+    bucket_take(&total_bucket, wp->len);
+    bucket_take(wp->ss->client, wp->len);
+    bucket_take(wp->ss->class, wp->len);
+    bucket_take(wp->ss->session, wp->len);
+    vtime = wp->start;
+    wp->granted = 1;
+    *prev = wp->next;
+    granted = 1;
+  }
+  if (granted) {
+    pthread_cond_broadcast(&shape_cond);
+  }
+  return next;
+}
+
+/*
+ * Wait until a packet of len bytes may be sent.
+ */
+void shape_wait(struct shape_state *ss, size_t len)
+{
+  struct shape_waiter w, **prev;
+  struct timespec ts;
+  uint64_t start, next;
+
+  if (!ss->active || (total_bucket.rate == 0 &&
+                      (ss->client == NULL || ss->client->rate == 0) &&
+                      (ss->class == NULL || ss->class->rate == 0) &&
+                      ss->session == NULL)) {
+    return;
+  }
+
+  pthread_mutex_lock(&shape_mutex);
+  w.ss = ss;
+  w.start = ss->finish > vtime ? ss->finish : vtime;
+  w.len = len;
+  w.granted = 0;
+  for (prev = &waiters; *prev != NULL && (*prev)->start <= w.start;
+       prev = &(*prev)->next)
+    ;
+  w.next = *prev;
+  *prev = &w;
+
+  start = 0;
+  while (!w.granted) {
+    next = shape_dispatch();
+    if (w.granted) {
+      break;
+    }
+    if (start == 0) {
+      start = shape_now();
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_nsec += next * 1000;
+    ts.tv_sec += ts.tv_nsec / 1000000000;
+    ts.tv_nsec %= 1000000000;
+    pthread_cond_timedwait(&shape_cond, &shape_mutex, &ts);
+  }
+  ss->finish = w.start + len * SHAPE_WEIGHT_MAX / ss->weight;
+  ss->packets++;
+  total_packets++;
+  if (start != 0) {
+    ss->delayed++;
+    ss->waited += shape_now() - start;
+    total_delayed++;
+    total_waited += shape_now() - start;
+  }
+  pthread_mutex_unlock(&shape_mutex);
+}
+
+void shape_finish(struct shape_state *ss)
+{
+  if (!ss->active) {
+    return;
+  }
+  pthread_mutex_lock(&shape_mutex);
+  bucket_release(ss->client);
+  bucket_release(ss->class);
+  bucket_release(ss->session);
+  ss->client = ss->class = ss->session = NULL;
+  ss->active = 0;
+  pthread_mutex_unlock(&shape_mutex);
+}
+
+/*
+ * Limit the session to rate bytes/sec on top of the buckets it has,
+ * also when -B is not given.
+ */
+void shape_limit(struct shape_state *ss, uint64_t rate)
+{
+  struct shape_bucket *bp;
+
+  if (rate == 0 || (bp = calloc(1, sizeof(struct shape_bucket))) == NULL) {
+    return;
+  }
+  pthread_once(&shape_once, shape_init);
+  bucket_init(bp, rate);
+  bp->refs = 1;
+  /* freed by shape_finish(). */
+  bp->retired = 1;
+  pthread_mutex_lock(&shape_mutex);
+  if (!ss->active) {
+    ss->active = 1;
+    ss->weight = 1;
+    ss->finish = vtime;
+  }
+  ss->session = bp;
+  pthread_mutex_unlock(&shape_mutex);
+}
+
+void shape_total_stat(unsigned long *packets, unsigned long *delayed,
+                      unsigned long long *waited)
+{
+  pthread_mutex_lock(&shape_mutex);
+  *packets = total_packets;
+  *delayed = total_delayed;
+  *waited = total_waited;
+  pthread_mutex_unlock(&shape_mutex);
+}
@@ -0,0 +1,110 @@
+/*
+   shape.h
+   $Id$
+
+   This file is part of t-tftpd.
+
+   Copyright 2002,2007 Tomofumi Hayashi <s1061123@gmail.com>.
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+   3. All advertising materials mentioning features or use of this software
+      must display the following acknowledgement:
+
+        This product includes software developed by
+        Tomofumi Hayashi <s1061123@gmail.com> and its contributors.
+
+   4. Neither the name of authors nor the names of its contributors may be used
+      to endorse or promote products derived from this software without
+      specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND ANY
+   EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _SHAPE_H_
+#define _SHAPE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/*
+ * Bandwidth shaping of the DATA packets sent by send_file().
+ * -B takes "total=RATE,client=RATE,prefix=N,prefix6=N,class=GLOB:RATE,
+ * burst=MS" (RATE in bytes/sec, with K, M or G), or "@file" with the
+ * same items separated by commas or white space.  A file is read again
+ * when it changes, so the limits can be adjusted while running.
+ *
+ * A packet goes when every bucket of its session (the total, the one of
+ * the client address or prefix, the one of the first class matching
+ * the file name, and the one of the session given by shape_limit() for
+ * the rate of an access list) has tokens; buckets go into debt for the
+ * rest of it.
+ * Waiting packets are taken in order of start-time fair queuing, so the
+ * sessions sharing a bucket get shares by the size of their files and
+ * a short transfer is not stuck behind the long ones: a file smaller
+ * than SHAPE_SMALL_SIZE gets SHAPE_WEIGHT_MAX times the share of one of
+ * SHAPE_LARGE_SIZE or more (or of unknown size), one in between half.
+ */
+#define SHAPE_MAX_CLASSES 8
+#define SHAPE_DEFAULT_BURST 100  /* msec */
+#define SHAPE_SMALL_SIZE (64 * 1024)
+#define SHAPE_LARGE_SIZE (1024 * 1024)
+#define SHAPE_WEIGHT_MAX 4
+
+struct shape_bucket;
+
+struct shape_state {
+  int active;
+  struct shape_bucket *client;
+  struct shape_bucket *class;
+  struct shape_bucket *session;  /* of shape_limit() */
+  uint64_t finish;          /* virtual finish of the last packet */
+  int weight;               /* 1 to SHAPE_WEIGHT_MAX */
+  unsigned long packets, delayed;
+  uint64_t waited;          /* usec */
+};
+
+typedef struct shape_spec shape_spec;
+
+shape_spec *shape_load(const char *spec);
+void shape_install(shape_spec *sp);
+void shape_discard(shape_spec *sp);
+int shape_config(const char *spec);
+int shape_rate(const char *str, uint64_t *rate);
+int shape_enabled(void);
+void shape_reload(void);
+void shape_start(struct shape_state *ss, const struct sockaddr *client,
+                 const char *filename, off_t size);
+void shape_limit(struct shape_state *ss, uint64_t rate);
+void shape_wait(struct shape_state *ss, size_t len);
+void shape_finish(struct shape_state *ss);
+void shape_total_stat(unsigned long *packets, unsigned long *delayed,
+                      unsigned long long *waited);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* !_SHAPE_H_ */
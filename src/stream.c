@@ -0,0 +1,365 @@
+/*
+   stream.c
+   $Id$
+
+   This file is part of t-tftpd.
+
+   Copyright 2002,2007 Tomofumi Hayashi <s1061123@gmail.com>.
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+   3. All advertising materials mentioning features or use of this software
+      must display the following acknowledgement:
+
+        This product includes software developed by
+        Tomofumi Hayashi <s1061123@gmail.com> and its contributors.
+
+   4. Neither the name of authors nor the names of its contributors may be used
+      to endorse or promote products derived from this software without
+      specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND ANY
+   EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "stream.h"
+
+enum rs_state {RS_EMPTY, RS_LOADING, RS_READY, RS_FAILED};
+
+struct rs_chunk {
+  off_t index;           /* chunk number in the file, -1 if none */
+  enum rs_state state;
+  int refs;              /* sessions in this chunk */
+  int err;               /* errno of a failed read */
+  ssize_t len;
+  unsigned long used;    /* for LRU */
+  char *data;
+};
+
+/* one per file being read, shared by its sessions. */
+struct rs_file {
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  time_t mtime;
+  int fd;
+  int refs;                 /* sessions reading it now */
+  unsigned long sessions;   /* sessions which have read it */
+  unsigned long clock;
+  int nchunks;
+  struct rs_chunk *chunk;
+  pthread_mutex_t mutex;
+  pthread_cond_t loaded;
+  struct rs_file *next;
+};
+
+struct read_stream {
+  struct rs_file *file;
+  off_t offset;
+  struct rs_chunk *held;    /* a chunk of file, or &own */
+  struct rs_chunk own;      /* when all chunks of file are in use */
+  unsigned long shared;      /* chunks found in the cache */
+  unsigned long loaded;      /* chunks read into the cache */
+};
+
+static pthread_mutex_t rs_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct rs_file *rs_list = NULL;
+static unsigned long rs_total_files = 0, rs_total_sessions = 0;
+static unsigned long rs_total_shared = 0, rs_total_loaded = 0;
+static unsigned long rs_total_own = 0;
+
+/*
+ * Return: a reader of the shared stream of the file of fd, NULL when
+ * it can't be shared (the caller reads fd itself).
+ */
+read_stream *rs_open(int fd, int chunks)
+{
+  struct rs_file *file;
+  read_stream *rs;
+  struct stat st;
+  int cnt;
+
+  if (chunks <= 0 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+    return NULL;
+  }
+  if (chunks > RS_MAX_CHUNKS) {
+    chunks = RS_MAX_CHUNKS;
+  }
+  if ((rs = calloc(1, sizeof(read_stream))) == NULL) {
+    return NULL;
+  }
+  rs->own.index = -1;
+
+  pthread_mutex_lock(&rs_list_mutex);
+  for (file = rs_list; file != NULL; file = file->next) {
+    if (file->dev == st.st_dev && file->ino == st.st_ino &&
+        file->size == st.st_size && file->mtime == st.st_mtime) {
+      break;
+    }
+  }
+  if (file == NULL) {
+    file = calloc(1, sizeof(struct rs_file));
+    if (file == NULL ||
+        (file->chunk = calloc(chunks, sizeof(struct rs_chunk))) == NULL ||
+        (file->fd = dup(fd)) == -1) {
+      pthread_mutex_unlock(&rs_list_mutex);
+      if (file != NULL) {
+        free(file->chunk);
+      }
+      free(file);
+      free(rs);
+      return NULL;
+    }
+    file->dev = st.st_dev;
+    file->ino = st.st_ino;
+    file->size = st.st_size;
+    file->mtime = st.st_mtime;
+    file->nchunks = chunks;
+    for (cnt = 0; cnt < chunks; cnt++) {
+      file->chunk[cnt].index = -1;
+    }
+    pthread_mutex_init(&file->mutex, NULL);
+    pthread_cond_init(&file->loaded, NULL);
+    file->next = rs_list;
+    rs_list = file;
+    rs_total_files++;
+  }
+  file->refs++;
+  file->sessions++;
+  rs_total_sessions++;
+  pthread_mutex_unlock(&rs_list_mutex);
+
+  rs->file = file;
+  return rs;
+}
+
+/* the file mutex is held. */
+static void rs_release(read_stream *rs)
+{
+  if (rs->held != NULL && rs->held != &rs->own) {
+    rs->held->refs--;
+  }
+  rs->held = NULL;
+}
+
+/*
+ * Make rs->held the chunk idx, reading it when nobody has.
+ * Return: 0 on success, -1 on read error.
+ */
+static int rs_acquire(read_stream *rs, off_t idx)
+{
+  struct rs_file *file = rs->file;
+  struct rs_chunk *chunk, *victim;
+  int cnt, err;
+
+  pthread_mutex_lock(&file->mutex);
+  rs_release(rs);
+
+  victim = NULL;
+  for (cnt = 0; cnt < file->nchunks; cnt++) {
+    chunk = &file->chunk[cnt];
+    if (chunk->index == idx) {
+      break;
+    }
+    if (chunk->refs == 0 && (victim == NULL || chunk->used < victim->used)) {
+      victim = chunk;
+    }
+  }
+
+  if (cnt < file->nchunks) {
+    chunk->refs++;
+    while (chunk->state == RS_LOADING) {
+      pthread_cond_wait(&file->loaded, &file->mutex);
+    }
+    if (chunk->state == RS_FAILED) {
+      err = chunk->err;
+      chunk->refs--;
+      pthread_mutex_unlock(&file->mutex);
+      errno = err;
+      return -1;
+    }
+    chunk->used = ++file->clock;
+    rs->held = chunk;
+    rs->shared++;
+    pthread_mutex_unlock(&file->mutex);
+    return 0;
+  }
+
+  if (victim != NULL && victim->data == NULL &&
+      (victim->data = malloc(RS_CHUNK_SIZE)) == NULL) {
+    victim = NULL;
+  }
+  if (victim == NULL) {
+    /* every chunk is in use, read it alone. */
+    pthread_mutex_unlock(&file->mutex);
+    chunk = &rs->own;
+    if (chunk->data == NULL &&
+        (chunk->data = malloc(RS_CHUNK_SIZE)) == NULL) {
+      return -1;
+    }
+    chunk->len = pread(file->fd, chunk->data, RS_CHUNK_SIZE,
+                       idx * RS_CHUNK_SIZE);
+    if (chunk->len == -1) {
+      return -1;
+    }
+    chunk->index = idx;
+    rs->held = chunk;
+    __atomic_add_fetch(&rs_total_own, 1, __ATOMIC_RELAXED);
+    return 0;
+  }
+
+  /* the others needing it wait for us. */
+  chunk = victim;
+  chunk->index = idx;
+  chunk->state = RS_LOADING;
+  chunk->refs = 1;
+  pthread_mutex_unlock(&file->mutex);
+
+  chunk->len = pread(file->fd, chunk->data, RS_CHUNK_SIZE,
+                     idx * RS_CHUNK_SIZE);
+  err = errno;
+
+  pthread_mutex_lock(&file->mutex);
+  if (chunk->len == -1) {
+    chunk->state = RS_FAILED;
+    chunk->err = err;
+    chunk->index = -1;
+    chunk->refs--;
+    pthread_cond_broadcast(&file->loaded);
+    pthread_mutex_unlock(&file->mutex);
+    errno = err;
+    return -1;
+  }
+  chunk->state = RS_READY;
+  chunk->used = ++file->clock;
+  rs->held = chunk;
+  rs->loaded++;
+  pthread_cond_broadcast(&file->loaded);
+  pthread_mutex_unlock(&file->mutex);
+  return 0;
+}
+
+/*
+ * read() from the shared stream, it only returns short at EOF.
+ */
+ssize_t rs_read(read_stream *rs, char *buf, size_t siz)
+{
+  struct rs_chunk *chunk;
+  off_t idx, pos;
+  size_t done, len;
+
+  for (done = 0; done < siz; done += len) {
+    idx = rs->offset / RS_CHUNK_SIZE;
+    if (rs->held == NULL || rs->held->index != idx) {
+      if (rs_acquire(rs, idx) == -1) {
+        return done > 0 ? (ssize_t)done : -1;
+      }
+    }
+    /* a held chunk is not changed, no lock to read it. */
+    chunk = rs->held;
+    pos = rs->offset - idx * RS_CHUNK_SIZE;
+    if (pos >= chunk->len) {
+      break;
+    }
+    len = chunk->len - pos < (off_t)(siz - done) ?
+      (size_t)(chunk->len - pos) : siz - done;
+    memcpy(buf + done, chunk->data + pos, len);
+    rs->offset += len;
+  }
+  return done;
+}
+
+/*
+ * Return: the number of sessions which have read the file, when rs was
+ * the last one and the stream is gone, 0 otherwise.
+ */
+unsigned long rs_close(read_stream *rs)
+{
+  struct rs_file *file = rs->file, **fp;
+  unsigned long sessions = 0;
+  int cnt;
+
+  pthread_mutex_lock(&file->mutex);
+  rs_release(rs);
+  pthread_mutex_unlock(&file->mutex);
+  __atomic_add_fetch(&rs_total_shared, rs->shared, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&rs_total_loaded, rs->loaded, __ATOMIC_RELAXED);
+  free(rs->own.data);
+  free(rs);
+
+  pthread_mutex_lock(&rs_list_mutex);
+  if (--file->refs == 0) {
+    for (fp = &rs_list; *fp != NULL; fp = &(*fp)->next) {
+      if (*fp == file) {
+        *fp = file->next;
+        break;
+      }
+    }
+    sessions = file->sessions;
+  }
+  pthread_mutex_unlock(&rs_list_mutex);
+  if (sessions == 0) {
+    return 0;
+  }
+
+  close(file->fd);
+  for (cnt = 0; cnt < file->nchunks; cnt++) {
+    free(file->chunk[cnt].data);
+  }
+  free(file->chunk);
+  pthread_mutex_destroy(&file->mutex);
+  pthread_cond_destroy(&file->loaded);
+  free(file);
+  return sessions;
+}
+
+void rs_session_stat(read_stream *rs, unsigned long *sessions,
+                     unsigned long *shared, unsigned long *loaded)
+{
+  pthread_mutex_lock(&rs_list_mutex);
+  *sessions = rs->file->sessions;
+  pthread_mutex_unlock(&rs_list_mutex);
+  *shared = rs->shared;
+  *loaded = rs->loaded;
+}
+
+void rs_total_stat(unsigned long *files, unsigned long *sessions,
+                   unsigned long *shared, unsigned long *loaded,
+                   unsigned long *own)
+{
+  pthread_mutex_lock(&rs_list_mutex);
+  *files = rs_total_files;
+  *sessions = rs_total_sessions;
+  pthread_mutex_unlock(&rs_list_mutex);
+  *shared = __atomic_load_n(&rs_total_shared, __ATOMIC_RELAXED);
+  *loaded = __atomic_load_n(&rs_total_loaded, __ATOMIC_RELAXED);
+  *own = __atomic_load_n(&rs_total_own, __ATOMIC_RELAXED);
+}
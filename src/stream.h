@@ -0,0 +1,77 @@
+/*
+   stream.h
+   $Id$
+
+   This file is part of t-tftpd.
+
+   Copyright 2002,2007 Tomofumi Hayashi <s1061123@gmail.com>.
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+   3. All advertising materials mentioning features or use of this software
+      must display the following acknowledgement:
+
+        This product includes software developed by
+        Tomofumi Hayashi <s1061123@gmail.com> and its contributors.
+
+   4. Neither the name of authors nor the names of its contributors may be used
+      to endorse or promote products derived from this software without
+      specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND ANY
+   EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _STREAM_H_
+#define _STREAM_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <sys/types.h>
+
+/*
+ * Shared read stream for send_file().
+ * The sessions reading the same file at the same time share its data:
+ * the file is read in chunks into a small per-file cache, and a session
+ * that needs a chunk which is already there (or being read) takes it
+ * from the cache instead of reading it again.  A chunk is referenced
+ * by every session in it, only unreferenced ones are replaced.  When
+ * all chunks are in use, a session reads into a buffer of its own.
+ */
+typedef struct read_stream read_stream;
+
+#define RS_CHUNK_SIZE (32 * 1024)
+#define RS_MAX_CHUNKS 1024
+
+read_stream *rs_open(int fd, int chunks);
+ssize_t rs_read(read_stream *rs, char *buf, size_t siz);
+unsigned long rs_close(read_stream *rs);
+void rs_session_stat(read_stream *rs, unsigned long *sessions,
+                     unsigned long *shared, unsigned long *loaded);
+void rs_total_stat(unsigned long *files, unsigned long *sessions,
+                   unsigned long *shared, unsigned long *loaded,
+                   unsigned long *own);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* !_STREAM_H_ */
@@ -45,6 +45,25 @@
 
 #include "tftpd.h"
 #include "tftpdsubs.h"
+#include "readahead.h"
+#include "stream.h"
+#include "upload.h"
+#include "metrics.h"
+#include "trace.h"
+#include "capture.h"
+#include "fault.h"
+#include "mcast.h"
+#include "shape.h"
+#include "admit.h"
+#include "dedup.h"
+#include "prefork.h"
+#include "affinity.h"
+#include "reload.h"
+#include "vfile.h"
+#include "proxy.h"
+#include "rewrite.h"
+#include "acl.h"
+#include "fdcache.h"
 
 #define PKTSIZE SEGSIZE+4
 
@@ -54,6 +73,7 @@
 #define MAXTIMEOUT 6 /* sec */
 #define PATH_SIZ 128
 #define CHANGE_NODE_INTERVAL 10
+#define PREFORK_SHARDS(threads) ((threads) * 4 + 16)  /* of a worker */
 
 #ifndef BUFSIZ
 #define BUFSIZ 1024
@@ -74,6 +94,10 @@
 #define TFTP_OPTION_BLOCK_SIZE "blksize"
 #define TFTP_OPTION_BLOCK_SIZE_MAX 65464
 #define TFTP_OPTION_BLOCK_SIZE_MIN 8
+#define TFTP_OPTION_TSIZE "tsize"
+#define TFTP_OPTION_MULTICAST "multicast"
+#define TFTP_OPTION_ROLLOVER "rollover"
+#define TFTP_BLOCK_MAX 65535  /* the last block number before it rolls over */
 
 /* for pthread_t */
 #ifdef PTHREAD_T_POINTER
@@ -82,6 +106,18 @@
 #define PTHREAD_T_NULL -1
 #endif
 
+/* read-ahead depth (blocks) for send_file(), 0 means disabled */
+#define DEFAULT_READ_AHEAD 0
+/* upload write coalescing (KB) and periodic sync interval (MB) */
+#define DEFAULT_UPLOAD_CHUNK 64
+#define DEFAULT_SYNC_INTERVAL 16
+/* largest upload preallocated (MB), 0 means disabled */
+#define DEFAULT_PREALLOC_MAX 1024
+/* write-behind depth (blocks) for recv_file(), 0 means disabled */
+#define DEFAULT_WRITE_BEHIND 0
+/* chunks cached per file shared by send_file() sessions, 0 disables */
+#define DEFAULT_STREAM_CHUNKS 8
+
 #define MMAP_FILE_MAP_MULTIPLY  32
 #ifdef HAVE_SYSCONF
 #define MMAP_FILE_MAP_SIZE  	sysconf(_SC_PAGE_SIZE)*MMAP_FILE_MAP_MULTIPLY
@@ -98,6 +134,40 @@ struct _tftp_thread {
   char buf[BUFSIZ];
   /* for sending file */
   int newline, prevchar;
+  int fd;              /* of file_open(), -1 when none */
+  FILE *fp;            /* netascii reads with stdio */
+  fd_entry *fdc;       /* fd is shared, by the cache */
+  read_ahead *ra;
+  read_stream *rs;
+  proxy_fetch *fetch;  /* the file still comes from the upstream */
+  /* for receiving file */
+  upload_writer *uw;
+  off_t tsize; /* size announced by the client, -1 if unknown */
+  int rollover; /* the block number after TFTP_BLOCK_MAX, -1 for none */
+  /* for metrics */
+  uint64_t start;  /* when the request was received, 0 if no session */
+  int admitted;    /* taken from an admission queue */
+  off_t admit_size;  /* of the file, as the admission queue knew it */
+  uint64_t arrived;  /* when the request came into the socket buffer */
+  int first_data;  /* first DATA packet is already sent */
+  /* for tracing */
+  uint64_t session;  /* session number */
+  uint64_t bytes;    /* bytes sent or received */
+  int finished;      /* the transfer ended without thread_quit() */
+  dedup_entry *dedup;
+  int duplicate;     /* dropped as a copy of a request in progress */
+  struct trace_buf trace;
+  /* for the access log */
+  char filename[NAME_SIZ];
+  int wrq;
+  int error;  /* last ERROR code sent, -1 if none */
+  /* for the request capture */
+  struct capture_record capture;
+  char request[CAPTURE_REQUEST_MAX];
+  /* for the fault injection */
+  struct fault_state fault;
+  /* for the bandwidth shaping */
+  struct shape_state shape;
 #ifdef TFTPD_V4ONLY
   struct sockaddr_in client_addr;
   /* for option */
@@ -126,9 +196,52 @@ struct server_socket {
   pthread_cond_t thread_cond;
   pthread_mutex_t exit_mutex;
   pthread_t exited_tid;
+  int running;         /* threads in thread_tid[] */
+  admit_queue *admit;  /* NULL without admission control */
+  struct server_socket *next;
 };
 #endif
 
+/*
+ * The items of a config file, read before any of them is set, so that
+ * a file is read once and set as a whole.
+ */
+enum config_key {
+  CF_ROOT,
+  CF_BANDWIDTH,
+  CF_VIRTUAL,
+  CF_REWRITE,
+  CF_ACL,
+  CF_ROLLOVER,
+  CF_MMAP,
+  CF_THREADS,
+  CF_TIMEOUT,
+  CF_MAXTIMEOUT,
+  CF_READAHEAD,
+  CF_CACHE,
+  CF_FDCACHE,
+  CF_NUM
+};
+
+static const struct config_keyinfo {
+  const char *key;
+  long min, max;      /* of a number */
+} config_keys[CF_NUM] = {
+  { "root", 0, 0 },
+  { "bandwidth", 0, 0 },
+  { "virtual", 0, 0 },
+  { "rewrite", 0, 0 },
+  { "acl", 0, 0 },
+  { "rollover", 0, 0 },
+  { "mmap", 0, 0 },
+  { "threads", 1, MAX_THREAD },
+  { "timeout", 1, 60 },
+  { "maxtimeout", 1, 3600 },
+  { "readahead", 0, READ_AHEAD_MAX_DEPTH },
+  { "cache", 0, RS_MAX_CHUNKS },
+  { "fdcache", 0, FDC_MAX },
+};
+
 static struct errmsg {
   int	e_code;
   const char *e_msg;
@@ -147,21 +260,43 @@ static struct errmsg {
 void print_usage (void);
 void change_node_thread(void);
 void change_node(int sig);
+void publish_node(void);
+void set_root(const char *path, f_node *tree);
+f_node *tree_root(char *path, unsigned long *gen);
+int file_lookup(f_node *fptr, char *filename, int wr);
+void config_drop(void);
+int config_read(const char *key, const char *value);
+int config_set(void);
+int config_item(const char *key, const char *value, int step);
+int config_option(const char *key, const char *value);
+void config_reload(void);
+void pool_wake(void);
 void fun_thread_once(void);
 void thread_destructor(void *ptr);
 void thread_packet_parse(void); 
 size_t read_data_ascii(FILE *fp, char *buf, size_t siz);
 size_t read_data_ascii_mmap(char *fbuf, char *buf, size_t buf_size,
                             size_t max_read, size_t *fill_size);
-size_t write_data_ascii(int fd, char *buf, size_t size); 
+ssize_t write_data_ascii(upload_writer *uw, char *buf, size_t size); 
 void send_file(int fd); 
 void send_file_mmap(int fd); 
 void recv_file(int fd);
 int file_open(char *filename, int wd, enum mode mode); 
+void file_close(tftpd_thread *ptr);
 void thread_main(void *);
 void thread_quit(void); 
+void thread_cleanup(tftpd_thread *ptr);
 void send_error(int error);
 char *divide_token(char *src, char delim);
+char *option_value(char *opt, char *end, const char *name);
+off_t request_size(const char *buf, size_t len, const struct sockaddr *from);
+ssize_t recv_request(int s, char *buf, size_t len,
+                     struct sockaddr *from, socklen_t *fromlen,
+                     uint64_t *wait);
+void session_start(tftpd_thread *ptr, uint64_t wait);
+void session_trace(tftpd_thread *ptr, enum trace_event event, uint64_t arg);
+int wait_left(uint64_t since);
+int block_next(tftpd_thread *ptr, uint16_t *block);
 int serv_init(void);
 void init_signal(void);
 void quit(int sig);
@@ -171,28 +306,9 @@ void server_main (void *);
 #endif
 
 #ifdef _DEBUG
-#define PERFORMANCE_CHECK
 extern int debug_level;
 #endif /* #ifdef _DEBUG */
 
-// for performance mesurement
-#ifdef PERFORMANCE_CHECK
-unsigned long long rdtsc1 = 0, rdtsc2 = 0;
-#define RDTSC(X) \
-    do { \
-        unsigned int eax, edx; \
-        __asm__ __volatile__ ("cpuid"::: "eax", "ebx", "ecx", "edx"); \
-        __asm__ __volatile__ ("rdtsc": "=a"(eax), "=d"(edx)); \
-        X = ((unsigned long long)edx << 32) | eax; \
-    } while (0);
-
-unsigned long long rdtsc() {
-    unsigned long long r;
-    RDTSC(r);
-    return r;
-}
-#endif
-
 /* global variables */
 #ifdef TFTPD_V4ONLY
 static pthread_cond_t thread_cond = PTHREAD_COND_INITIALIZER;
@@ -202,28 +318,63 @@ static pthread_once_t thread_once = {PTHREAD_ONCE_INIT};
 static pthread_key_t thread_key;
 static pthread_t exited_tid = PTHREAD_T_NULL;
 static pthread_t thread_tid[MAX_THREAD];
+static int running_threads = 0;  /* in thread_tid[] */
 #else  /* for IPv6 */
 static pthread_mutex_t node_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_once_t thread_once = PTHREAD_ONCE_INIT;
 static pthread_key_t thread_key;
 static pthread_t thread_tid[MAX_THREAD];
+static struct server_socket *server_list = NULL;
 #endif
 
 #ifdef TFTPD_V4ONLY
 static int serv_port;
 static int sockfd;
 static struct sockaddr_in servaddr;
+static admit_queue *admit_q = NULL;
 #else /* IPv6 */
 static char serv_port[8];
 #endif 
 
 static f_node *root_node;
+static unsigned long root_gen = 0;  /* counts the trees read */
 static int sockfd;
 static char tftpd_root[PATH_SIZ];
 static int socket_threads;
 static char program_name[256];
 struct timeval timeout;
 static int use_mmap = 0;
+static int read_ahead_depth = DEFAULT_READ_AHEAD;
+static int stream_chunks = DEFAULT_STREAM_CHUNKS;
+static size_t upload_chunk = DEFAULT_UPLOAD_CHUNK * 1024;
+static enum uw_sync upload_sync = UW_SYNC_NONE;
+static size_t upload_sync_interval = DEFAULT_SYNC_INTERVAL * 1024 * 1024;
+static int write_behind_depth = DEFAULT_WRITE_BEHIND;
+static off_t prealloc_max = (off_t)DEFAULT_PREALLOC_MAX * 1024 * 1024;
+static char *metrics_listen = NULL;
+static char *trace_path = NULL;
+static char *capture_path = NULL;
+static char *log_dest = NULL;
+static uint64_t session_seq = 0;
+static int prefork_workers = 0;
+static int prefork_slot = 0;
+static char *config_path = NULL;
+static pthread_mutex_t change_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* changed by a reload, read again where they are used. */
+static int packet_timeout = TIMEOUT;
+static int max_timeout = MAXTIMEOUT;
+static int block_rollover = 0;
+/* the items of a config file read, until they are set. */
+static struct config_items {
+  unsigned int given;       /* 1 << the key of each item read */
+  char root[PATH_SIZ];
+  f_node *tree;             /* of root, when it is switched at once */
+  shape_spec *shape;
+  vfile_set *vfile;
+  rewrite_set *rewrite;
+  acl_set *acl;
+  long num[CF_NUM];
+} config_new;
 
 /* functions */
 int main(int argc, char **argv)
@@ -231,15 +382,15 @@ int main(int argc, char **argv)
   int cnt, ch, root, err;
   pthread_t change_tree_tid;
 
+  const int on = 1;
 #ifdef TFTPD_V4ONLY
   struct sockaddr_in *svp;
 #else /* for IPv6 */
   pthread_t serv_tid;
   struct addrinfo hints;
   struct addrinfo *res, *addpt;
-  const int on = 1;
   int open_socket;
-  struct server_socket *serv;
+  struct server_socket *serv, *serv_list;
   char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV]; /* buffer for hostname/service */
 
 #endif
@@ -261,9 +412,9 @@ int main(int argc, char **argv)
 #endif
   socket_threads = DEFAULT_THREAD;
 #ifdef _DEBUG
-  while ((ch = getopt(argc, argv, "hmr:p:t:d:")) != EOF)
+  while ((ch = getopt(argc, argv, "a:A:b:B:c:C:e:f:F:G:hl:L:mM:o:r:R:p:P:s:S:t:T:u:V:w:W:d:")) != EOF)
 #else
-  while ((ch = getopt(argc, argv, "hmr:p:t:")) != EOF)
+  while ((ch = getopt(argc, argv, "a:A:b:B:c:C:e:f:F:G:hl:L:mM:o:r:R:p:P:s:S:t:T:u:V:w:W:")) != EOF)
 #endif
     {
       switch (ch) 
@@ -296,6 +447,17 @@ int main(int argc, char **argv)
 	    fprintf(stderr, "port number (%s)is not invalid.\n", optarg);
 	  }
 	  break;
+	case 'P': /* prefork workers */
+	  cnt = atoi(optarg);
+	  if (cnt >= 0 && cnt <= PREFORK_MAX_WORKERS) {
+	    prefork_workers = cnt;
+	  }
+	  else {
+	    fprintf(stderr, "workers should be 0 to %d.\n",
+		    PREFORK_MAX_WORKERS);
+	    err = 1;
+	  }
+	  break;
 	case 't': /* number of waitingthreads */
 	  cnt = atoi(optarg);
 	  if (cnt != 0) {
@@ -317,6 +479,157 @@ int main(int argc, char **argv)
 	case 'm': /* use mmap() */
           use_mmap = 1;
 	  break;
+	case 'w': /* upload write chunk */
+	  cnt = atoi(optarg);
+	  if (cnt > 0 && cnt <= UPLOAD_CHUNK_MAX / 1024) {
+	    upload_chunk = (size_t)cnt * 1024;
+	  }
+	  else {
+	    fprintf(stderr, "write chunk should be 1 to %d KB.\n",
+		    UPLOAD_CHUNK_MAX / 1024);
+	    err = 1;
+	  }
+	  break;
+	case 'e': /* preallocation limit */
+	  cnt = atoi(optarg);
+	  if (cnt >= 0) {
+	    prealloc_max = (off_t)cnt * 1024 * 1024;
+	  }
+	  else {
+	    fprintf(stderr, "preallocation limit should be 0 or more MB.\n");
+	    err = 1;
+	  }
+	  break;
+	case 'l': /* access list */
+	  if (config_option("acl", optarg) == -1) {
+	    fprintf(stderr, "access list (%s) is invalid.\n", optarg);
+	    err = 1;
+	  }
+	  break;
+	case 'L': /* log destination */
+	  log_dest = optarg;
+	  break;
+	case 'M': /* metrics endpoint */
+	  metrics_listen = optarg;
+	  break;
+	case 'o': /* open files kept */
+	  if (config_option("fdcache", optarg) == -1) {
+	    fprintf(stderr, "open files (%s) should be 0 or more.\n", optarg);
+	    err = 1;
+	  }
+	  break;
+	case 'C': /* request capture file */
+	  capture_path = optarg;
+	  break;
+	case 'G': /* multicast group */
+	  if (mcast_config(optarg) == -1) {
+	    fprintf(stderr, "multicast group (%s) is invalid.\n", optarg);
+	    err = 1;
+	  }
+	  break;
+	case 'A': /* admission control */
+	  if (admit_config(optarg) == -1) {
+	    fprintf(stderr, "admission spec (%s) is invalid.\n", optarg);
+	    err = 1;
+	  }
+	  break;
+	case 'b': /* block number rollover */
+	  if (config_option("rollover", optarg) == -1) {
+	    fprintf(stderr, "rollover (%s) should be 0, 1 or off.\n", optarg);
+	    err = 1;
+	  }
+	  break;
+	case 'B': /* bandwidth shaping */
+	  if (shape_config(optarg) == -1) {
+	    fprintf(stderr, "shaping spec (%s) is invalid.\n", optarg);
+	    err = 1;
+	  }
+	  break;
+	case 'c': /* CPU affinity */
+	  if (affinity_config(optarg) == -1) {
+	    fprintf(stderr, "affinity spec (%s) is invalid.\n", optarg);
+	    err = 1;
+	  }
+	  break;
+	case 'f': /* config file */
+	  config_path = optarg;
+	  break;
+	case 'F': /* fault injection */
+	  if (fault_config(optarg) == -1) {
+	    fprintf(stderr, "fault spec (%s) is invalid.\n", optarg);
+	    err = 1;
+	  }
+	  break;
+	case 'u': /* upstream server */
+	  if (proxy_config(optarg) == -1) {
+	    fprintf(stderr, "upstream spec (%s) is invalid.\n", optarg);
+	    err = 1;
+	  }
+	  break;
+	case 'V': /* virtual files */
+	  if (vfile_config(optarg) == -1) {
+	    fprintf(stderr, "virtual file spec (%s) is invalid.\n", optarg);
+	    err = 1;
+	  }
+	  break;
+	case 'T': /* trace file */
+	  trace_path = optarg;
+	  break;
+	case 'W': /* write-behind depth */
+	  cnt = atoi(optarg);
+	  if (cnt >= 0 && cnt <= WRITE_BEHIND_MAX_DEPTH) {
+	    write_behind_depth = cnt;
+	  }
+	  else {
+	    fprintf(stderr, "write-behind depth should be 0 to %d.\n",
+		    WRITE_BEHIND_MAX_DEPTH);
+	    err = 1;
+	  }
+	  break;
+	case 'R': /* rewrite rules */
+	  if (config_option("rewrite", optarg) == -1) {
+	    fprintf(stderr, "rewrite rules (%s) are invalid.\n", optarg);
+	    err = 1;
+	  }
+	  break;
+	case 's': /* sync policy of uploaded files */
+	  if (strcmp(optarg, "none") == 0) {
+	    upload_sync = UW_SYNC_NONE;
+	  }
+	  else if (strcmp(optarg, "end") == 0) {
+	    upload_sync = UW_SYNC_END;
+	  }
+	  else if ((cnt = atoi(optarg)) > 0) {
+	    upload_sync = UW_SYNC_PERIODIC;
+	    upload_sync_interval = (size_t)cnt * 1024 * 1024;
+	  }
+	  else {
+	    fprintf(stderr, "sync policy (%s) is invalid.\n", optarg);
+	    err = 1;
+	  }
+	  break;
+	case 'S': /* shared read stream */
+	  cnt = atoi(optarg);
+	  if (cnt >= 0 && cnt <= RS_MAX_CHUNKS) {
+	    stream_chunks = cnt;
+	  }
+	  else {
+	    fprintf(stderr, "shared chunks should be 0 to %d.\n",
+		    RS_MAX_CHUNKS);
+	    err = 1;
+	  }
+	  break;
+	case 'a': /* read-ahead depth */
+	  cnt = atoi(optarg);
+	  if (cnt >= 0 && cnt <= READ_AHEAD_MAX_DEPTH) {
+	    read_ahead_depth = cnt;
+	  }
+	  else {
+	    fprintf(stderr, "read-ahead depth should be 0 to %d.\n",
+		    READ_AHEAD_MAX_DEPTH);
+	    err = 1;
+	  }
+	  break;
 	case 'h': /* help */
 	  err = 1;
 	  break;
@@ -327,26 +640,58 @@ int main(int argc, char **argv)
 	}
     }
 
-  /* openlog("t-tftpd", LOG_PID, LOG_TFTP);*/
-
   if (err == 1) {
     print_usage();
     exit(1);
   }
 
+  if (config_path != NULL) {
+    if (reload_config(config_path, config_item) == -1) {
+      exit(1);
+    }
+    /* for the reload thread, in the workers as well. */
+    reload_block();
+  }
+
   root_node = get_node(tftpd_root, ".", 1, 1);
   if (root_node == NULL) {
     fprintf(stderr, "Can't access to %s", tftpd_root);
     exit(0);
   }
 
-#ifdef PERFORMANCE_CHECK
-  printf("mmap map size: %d\n", MMAP_FILE_MAP_SIZE);
-#endif
+  if (prefork_workers > 0) {
+    if (prefork_index_init(PREFORK_INDEX_SIZE) == -1 ||
+	metrics_share(prefork_workers, PREFORK_SHARDS(socket_threads)) == -1) {
+      exit(1);
+    }
+    if (prefork_index_publish(root_node, tftpd_root) == -1) {
+      fprintf(stderr, "The tree of %s doesn't fit in the shared index\n",
+	      tftpd_root);
+      exit(1);
+    }
+    free_node(root_node);
+    root_node = NULL;
+  }
+
+  if (trace_path != NULL && trace_open(trace_path) == -1) {
+    fprintf(stderr, "Can't write trace to %s\n", trace_path);
+    exit(1);
+  }
+
+  if (capture_path != NULL && capture_open(capture_path) == -1) {
+    fprintf(stderr, "Can't capture requests to %s\n", capture_path);
+    exit(1);
+  }
+
+  d_printf(3, ("mmap map size: %d\n", (int)MMAP_FILE_MAP_SIZE));
   /* create a server socket and bind to port */
 #ifdef TFTPD_V4ONLY
   sockfd = socket(AF_INET, SOCK_DGRAM, 0);
   assert(sockfd!=-1);
+#ifdef SO_TIMESTAMP
+  /* for the time requests wait in the socket buffer. */
+  setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMP, &on, sizeof(on));
+#endif
 
   memset(&servaddr, '\0', sizeof(servaddr));
   svp = (struct sockaddr_in*)&servaddr;
@@ -373,6 +718,7 @@ int main(int argc, char **argv)
   }
 	
   open_socket = 0;
+  serv_list = NULL;
   /* for each addresses (IPv4/IPv6/mapped?) we bind to a port.
    * server waits therefore multiple ports/addresses, we need to 
    * have a multiple server environments(pthread_t, or so.)
@@ -391,6 +737,10 @@ int main(int argc, char **argv)
       continue;
     }
 #endif /* #ifdef IPV6_V6ONLY*/
+#ifdef SO_TIMESTAMP
+    /* for the time requests wait in the socket buffer. */
+    setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMP, &on, sizeof(on));
+#endif
     if (bind(sockfd, addpt->ai_addr, addpt->ai_addrlen) < 0) {
       fprintf(stderr, "bind failed\n");
       close(sockfd);
@@ -418,21 +768,73 @@ int main(int argc, char **argv)
     serv->thread_cond = (pthread_cond_t)PTHREAD_COND_INITIALIZER;
     serv->exit_mutex = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
     serv->exited_tid = PTHREAD_T_NULL;
-
-    /* create the server thread */
-    if (pthread_create(&serv_tid, NULL, 
-		       (void *(*)(void *))&server_main, serv) != 0)	{
-      fprintf(stderr, "pthread_create failed\n");
-    }
+    serv->running = 0;
+    serv->admit = NULL;
+    serv->next = serv_list;
+    serv_list = serv;
     open_socket++;
   }
   freeaddrinfo(res);
+  server_list = serv_list;
 
   /* If no socket cannot be opened */
   if (open_socket == 0)  {
     fprintf(stderr, "No sockets are available. quit.\n");
     exit(0);
   }
+#endif /* #ifdef TFTPD_V4ONLY ...*/
+
+  /* no threads before this, the workers are forked here. */
+  if (prefork_workers > 0) {
+    prefork_slot = prefork_run(prefork_workers, CHANGE_NODE_INTERVAL,
+			       publish_node,
+			       config_path != NULL ? config_reload : NULL);
+    metrics_slot(prefork_slot);
+    /* apart from the session numbers of the other workers. */
+    session_seq = (uint64_t)getpid() << 32;
+    trace_forked();
+    affinity_process(prefork_slot);
+  }
+
+  if (config_path != NULL && reload_start(config_path, config_item) == -1) {
+    fprintf(stderr, "Can't start the reload thread\n");
+    exit(1);
+  }
+
+  if (log_start(log_dest) == -1) {
+    fprintf(stderr, "Can't log to %s\n", log_dest);
+    exit(1);
+  }
+
+  /* in prefork mode, the first worker serves them. */
+  if (metrics_listen != NULL && prefork_slot == 0 &&
+      metrics_start(metrics_listen) == -1) {
+    fprintf(stderr, "Can't serve metrics on %s\n", metrics_listen);
+    exit(1);
+  }
+
+#ifdef TFTPD_V4ONLY
+  if (admit_enabled() &&
+      (admit_q = admit_create(sockfd, socket_threads, recv_request,
+                              request_size)) == NULL) {
+    fprintf(stderr, "Can't start the admission queue\n");
+    exit(1);
+  }
+#else /* for IPv6 */
+  for (serv = serv_list; serv != NULL; serv = serv->next) {
+    if (admit_enabled() &&
+        (serv->admit = admit_create(serv->socket, socket_threads,
+                                    recv_request, request_size)) == NULL) {
+      fprintf(stderr, "Can't start the admission queue\n");
+      exit(1);
+    }
+
+    /* create the server thread */
+    if (pthread_create(&serv_tid, NULL, 
+		       (void *(*)(void *))&server_main, serv) != 0)	{
+      fprintf(stderr, "pthread_create failed\n");
+    }
+  }
     
   d_printf(3, ("thread: (%d) / port: %s\n", socket_threads, serv_port));
 #endif /* #ifdef TFTPD_V4ONLY ...*/
@@ -447,34 +849,50 @@ int main(int argc, char **argv)
 
 #else 
   /* IPv4 server creates the thread here(IPv6 is upper). */
-  /* Create threads */
-  for (cnt = 0; cnt < socket_threads; cnt++)
-    {
-      pthread_create(&thread_tid[cnt], NULL, 
-		     (void *(*)(void *))&thread_main, NULL);
-    }
-    
+  for (cnt = 0; cnt < MAX_THREAD; cnt++) {
+    thread_tid[cnt] = PTHREAD_T_NULL;
+  }
+  pthread_mutex_lock(&exit_mutex);
   while (1)
     {
-      pthread_mutex_lock(&exit_mutex);
-      while(exited_tid == -1) {
+      /*
+       * Create threads up to socket_threads, again as they exit.  When
+       * a reload makes it smaller, the pool shrinks as sessions end.
+       */
+      for (cnt = 0; cnt < MAX_THREAD && running_threads < socket_threads;
+	   cnt++)
+	{
+	  if (thread_tid[cnt] == PTHREAD_T_NULL)
+	    {
+	      pthread_create(&thread_tid[cnt], NULL, 
+			     (void *(*)(void *))&thread_main, NULL);
+	      running_threads++;
+	    }
+	}
+      if (admit_q != NULL) {
+	admit_resize(admit_q, socket_threads);
+      }
+      while (exited_tid == PTHREAD_T_NULL &&
+	     running_threads >= socket_threads) {
 	pthread_cond_wait(&thread_cond, &exit_mutex);
       }
-      for (cnt = 0; cnt < socket_threads; cnt++)
+      if (exited_tid == PTHREAD_T_NULL) {
+	continue;
+      }
+      for (cnt = 0; cnt < MAX_THREAD; cnt++)
 	{
 	  if (thread_tid[cnt] == exited_tid) 
 	    {
 	      pthread_join(thread_tid[cnt], NULL);
-#ifndef _DEBUG
-	      /*		printf("thread restart\n"); */
-	      pthread_create(&thread_tid[cnt], NULL,
-			     (void *(*)(void *))&thread_main, NULL);
-#endif
-	      exited_tid = -1;
+	      d_printf(1, ("thread exited\n"));
+	      thread_tid[cnt] = PTHREAD_T_NULL;
+	      running_threads--;
 	    }
 	}
-      pthread_mutex_unlock(&exit_mutex);
+      exited_tid = PTHREAD_T_NULL;
+      pthread_cond_broadcast(&thread_cond);
     }
+  pthread_mutex_unlock(&exit_mutex);
     
   close(sockfd);
 #endif /* #ifndef TFTPD_V4ONLY */
@@ -487,7 +905,14 @@ void change_node_thread(void)
 
   while(1) {
     sleep(CHANGE_NODE_INTERVAL);
-    change_node(0);
+    /* in prefork mode, the supervisor does. */
+    if (prefork_workers == 0) {
+      change_node(0);
+    }
+    shape_reload();
+    vfile_reload();
+    rewrite_reload();
+    acl_reload();
   }
 }
 
@@ -498,34 +923,398 @@ void print_usage (void)
 	  "t-tftpd %s "
 	  "copyright by Tomofumi Hayashi (s1061123@gmail.com)\n\n"
 	  "Usage: %s [OPTION] ...\n"
+	  "  -a <num> \t\t blocks to read ahead when sending "
+	  "(default: %d, off)\n"
+	  "  -A <spec> \t\t admission control, e.g. queue=%d,sessions=32,"
+	  "\n\t\t\t deadline=%d,busy=error|drop,size=%d,age=MS,large=N\n"
+	  "  -b <0|1|off> \t\t block number after %d, unless the client asks "
+	  "with\n\t\t\t the rollover option (default: 0)\n"
+	  "  -B <spec|@file> \t limit the bandwidth, e.g. total=10M,client=1M,"
+	  "\n\t\t\t class=*.img:4M (a file is read again when changed)\n"
+	  "  -c <spec> \t\t pin the threads, e.g. listen=0-1,workers=node0,"
+	  "\n\t\t\t follow=on|off,spread=on|off\n"
+	  "  -C <file> \t\t append the requests to <file> for t-tftpd-replay\n"
+	  "  -e <num> \t\t preallocate the uploads up to <num> MB, by tsize"
+	  "\n\t\t\t (default: %d, 0 is off)\n"
+	  "  -f <file> \t\t read settings from <file>, again on SIGHUP: "
+	  "threads,\n\t\t\t root, timeout, maxtimeout, rollover, "
+	  "bandwidth,\n\t\t\t virtual, rewrite, acl, readahead, cache, fdcache "
+	  "and mmap,\n\t\t\t e.g. \"threads=16 timeout=3\"\n"
+	  "  -F <spec> \t\t inject packet faults, e.g. loss=0.01,seed=1 "
+	  "(for tests)\n"
+	  "  -G <addr>[:<port>][,<if>] serve multicast RRQs (RFC 2090) from "
+	  "<addr>\n\t\t\t (default port: %d)\n"
 	  "  -h \t\t\t display this help and exit\n"
+	  "  -l <file> \t\t policies of the client prefixes in <file>, e.g.\n"
+	  "\t\t\t \"10.0.0.0/8 ro path=/images rate=1M\" (read again when "
+	  "changed)\n"
+	  "  -L <dest> \t\t log to syslog, a file or - (default: -, stdout)\n"
           "  -m \t\t\t use mmap() for file sending (experimental)\n"
+	  "  -M <path|port> \t serve metrics on a UNIX socket or a "
+	  "loopback TCP port\n"
+	  "  -o <num> \t\t files kept open for the RRQs (default: %d, 0 is "
+	  "off)\n"
 #ifdef TFTPD_V4ONLY
 	  "  -p <num> \t\t port number (default: %d)\n"
 #else
 	  "  -p <num> \t\t port number (default: %s)\n"
 #endif
+	  "  -P <num> \t\t worker processes, each with the threads "
+	  "(default: 0, off)\n"
 	  "  -r <directory> \t tftpd's rootdir (default: \".\")\n"
+	  "  -R <file> \t\t rewrite the requested names by the rules in "
+	  "<file>,\n\t\t\t e.g. \"^/tftpboot/ - \" (read again when changed)\n"
+	  "  -s <policy> \t\t sync of uploaded files: none, end or every "
+	  "<num> MB\n\t\t\t (default: none)\n"
+	  "  -S <num> \t\t %d KB chunks cached for the sessions sharing "
+	  "a file\n\t\t\t (default: %d, 0 is off)\n"
 	  "  -t <num> \t\t threads for waiting client (default: %d)\n"
+	  "  -T <file> \t\t append per-session trace records to <file>\n"
+	  "  -u <spec> \t\t fetch the files not in the tree from a server, "
+	  "e.g.\n\t\t\t host:69,cache=DIR,size=%d,blksize=%d,window=%d,"
+	  "miss=%d\n"
+	  "  -V <spec> \t\t files made from templates, e.g. "
+	  "pxelinux.cfg/01-*=pxe.tmpl,\n\t\t\t cache=KB "
+	  "(${name}, ${base}, ${match}, ${ip}, ${hexip})\n"
+	  "  -w <num> \t\t upload write chunk in KB (default: %d)\n"
+	  "  -W <num> \t\t blocks to queue behind when receiving "
+	  "(default: %d, off)\n"
 	  "\n\n"
 	  ,
 	  VERSION, 
 	  program_name,
-	  SERV_PORT, DEFAULT_THREAD);
+	  DEFAULT_READ_AHEAD, ADMIT_DEFAULT_QUEUE, ADMIT_DEFAULT_DEADLINE,
+	  ADMIT_DEFAULT_SIZE_MSEC, TFTP_BLOCK_MAX, DEFAULT_PREALLOC_MAX,
+	  MCAST_DEFAULT_PORT, FDC_DEFAULT_MAX,
+	  SERV_PORT, RS_CHUNK_SIZE / 1024, DEFAULT_STREAM_CHUNKS,
+	  DEFAULT_THREAD, PROXY_DEFAULT_CACHE, PROXY_DEFAULT_BLKSIZE,
+	  PROXY_DEFAULT_WINDOW, PROXY_DEFAULT_MISS, DEFAULT_UPLOAD_CHUNK,
+	  DEFAULT_WRITE_BEHIND);
 }
 
 void change_node(int sig)
 {
   f_node *ptr, *old;
     
+  /* a new root of a reload is not switched back to the old one. */
+  pthread_mutex_lock(&change_mutex);
   ptr = get_node(tftpd_root, ".", 1, 1);
   pthread_mutex_lock(&node_mutex);
   old = root_node;
   root_node = ptr;
+  root_gen++;
+  pthread_mutex_unlock(&node_mutex);
+  pthread_mutex_unlock(&change_mutex);
+  free_node(old);
+}
+
+/*
+ * Switch to tree, read from a new root directory path.  The tree and
+ * the path change together, a request sees the one or the other.
+ */
+void set_root(const char *path, f_node *tree)
+{
+  f_node *old;
+
+  pthread_mutex_lock(&change_mutex);
+  pthread_mutex_lock(&node_mutex);
+  old = root_node;
+  root_node = tree;
+  root_gen++;
+  strlcpy(tftpd_root, path, PATH_SIZ);
   pthread_mutex_unlock(&node_mutex);
+  pthread_mutex_unlock(&change_mutex);
   free_node(old);
 }
 
+/* prefork: the supervisor builds the tree for the workers. */
+void publish_node(void)
+{
+  f_node *ptr;
+
+  ptr = get_node(tftpd_root, ".", 1, 1);
+  if (prefork_index_publish(ptr, tftpd_root) == -1) {
+    fprintf(stderr, "The tree of %s doesn't fit in the shared index\n",
+	    tftpd_root);
+  }
+  free_node(ptr);
+}
+
+/*
+ * The tree, and the directory it was read from in path (PATH_SIZ) when
+ * path is not NULL, the number of the tree in gen when gen is not NULL.
+ * Called with node_mutex held.
+ */
+f_node *tree_root(char *path, unsigned long *gen)
+{
+  const char *dir;
+  unsigned long num;
+  f_node *tree;
+
+  if (prefork_workers > 0) {
+    tree = prefork_index(&dir, &num);
+  }
+  else {
+    tree = root_node;
+    dir = tftpd_root;
+    num = root_gen;
+  }
+  if (gen != NULL) {
+    *gen = num;
+  }
+  if (path != NULL) {
+    strlcpy(path, dir, PATH_SIZ);
+  }
+  return tree;
+}
+
+/* forget the items read. */
+void config_drop(void)
+{
+  if (config_new.tree != NULL) {
+    free_node(config_new.tree);
+  }
+  if (config_new.shape != NULL) {
+    shape_discard(config_new.shape);
+  }
+  if (config_new.vfile != NULL) {
+    vfile_discard(config_new.vfile);
+  }
+  if (config_new.rewrite != NULL) {
+    rewrite_discard(config_new.rewrite);
+  }
+  if (config_new.acl != NULL) {
+    acl_discard(config_new.acl);
+  }
+  memset(&config_new, 0, sizeof(config_new));
+}
+
+/*
+ * Read an item of the config file into config_new, the file of an
+ * @spec, rewrite= or acl= and the tree of a new root included.
+ * Return: 0 on success, -1 when the item is not valid.
+ */
+int config_read(const char *key, const char *value)
+{
+  struct stat st;
+  char *end;
+  long num;
+  int idx;
+
+  for (idx = 0; idx < CF_NUM && strcmp(key, config_keys[idx].key) != 0;
+       idx++)
+    ;
+  switch (idx) {
+  case CF_ROOT:
+    if (value[0] != '/' || strlen(value) >= PATH_SIZ ||
+	stat(value, &st) == -1 || !S_ISDIR(st.st_mode)) {
+      return -1;
+    }
+    if (config_new.tree != NULL) {
+      free_node(config_new.tree);
+      config_new.tree = NULL;
+    }
+    strlcpy(config_new.root, value, PATH_SIZ);
+    /* the tree is read later: at the start, or by the supervisor. */
+    if (prefork_workers == 0 && root_node != NULL &&
+	strcmp(value, tftpd_root) != 0 &&
+	(config_new.tree = get_node((char *)value, ".", 1, 1)) == NULL) {
+      return -1;
+    }
+    break;
+  case CF_BANDWIDTH:
+    if (config_new.shape != NULL) {
+      shape_discard(config_new.shape);
+    }
+    if ((config_new.shape = shape_load(value)) == NULL) {
+      return -1;
+    }
+    break;
+  case CF_VIRTUAL:
+    if (config_new.vfile != NULL) {
+      vfile_discard(config_new.vfile);
+    }
+    if ((config_new.vfile = vfile_load(value)) == NULL) {
+      return -1;
+    }
+    break;
+  case CF_REWRITE:
+    if (config_new.rewrite != NULL) {
+      rewrite_discard(config_new.rewrite);
+    }
+    if ((config_new.rewrite = rewrite_load(value)) == NULL) {
+      return -1;
+    }
+    break;
+  case CF_ACL:
+    if (config_new.acl != NULL) {
+      acl_discard(config_new.acl);
+    }
+    if ((config_new.acl = acl_load(value)) == NULL) {
+      return -1;
+    }
+    break;
+  case CF_ROLLOVER:
+    if (strcmp(value, "0") != 0 && strcmp(value, "1") != 0 &&
+	strcmp(value, "off") != 0) {
+      return -1;
+    }
+    config_new.num[idx] = strcmp(value, "off") == 0 ? -1 : atoi(value);
+    break;
+  case CF_MMAP:
+    if (strcmp(value, "on") != 0 && strcmp(value, "off") != 0) {
+      return -1;
+    }
+    config_new.num[idx] = strcmp(value, "on") == 0;
+    break;
+  case CF_NUM:
+    return -1;
+  default:
+    num = strtol(value, &end, 10);
+    if (end == value || *end != '\0' ||
+	num < config_keys[idx].min || num > config_keys[idx].max) {
+      return -1;
+    }
+    config_new.num[idx] = num;
+    break;
+  }
+  config_new.given |= 1U << idx;
+  return 0;
+}
+
+/*
+ * Set the items read, when they agree with each other and with the
+ * settings they leave as they are.
+ * Return: 0 on success, -1 when they don't agree (nothing is set).
+ */
+int config_set(void)
+{
+  unsigned int given = config_new.given;
+  long pkt, max;
+
+  pkt = given & (1U << CF_TIMEOUT) ? config_new.num[CF_TIMEOUT] :
+    packet_timeout;
+  max = given & (1U << CF_MAXTIMEOUT) ? config_new.num[CF_MAXTIMEOUT] :
+    max_timeout;
+  if (pkt > max) {
+    fprintf(stderr, "timeout (%ld) should not be longer than "
+	    "maxtimeout (%ld).\n", pkt, max);
+    return -1;
+  }
+
+  if (given & (1U << CF_ROOT)) {
+    if (config_new.tree != NULL) {
+      set_root(config_new.root, config_new.tree);
+      config_new.tree = NULL;
+    }
+    else {
+      strlcpy(tftpd_root, config_new.root, PATH_SIZ);
+    }
+  }
+  if (config_new.shape != NULL) {
+    shape_install(config_new.shape);
+    config_new.shape = NULL;
+  }
+  if (config_new.vfile != NULL) {
+    vfile_install(config_new.vfile);
+    config_new.vfile = NULL;
+  }
+  if (config_new.rewrite != NULL) {
+    rewrite_install(config_new.rewrite);
+    config_new.rewrite = NULL;
+  }
+  if (config_new.acl != NULL) {
+    acl_install(config_new.acl);
+    config_new.acl = NULL;
+  }
+  if (given & (1U << CF_ROLLOVER)) {
+    block_rollover = config_new.num[CF_ROLLOVER];
+  }
+  if (given & (1U << CF_MMAP)) {
+    use_mmap = config_new.num[CF_MMAP];
+  }
+  if (given & (1U << CF_TIMEOUT)) {
+    packet_timeout = config_new.num[CF_TIMEOUT];
+  }
+  if (given & (1U << CF_MAXTIMEOUT)) {
+    max_timeout = config_new.num[CF_MAXTIMEOUT];
+  }
+  if (given & (1U << CF_READAHEAD)) {
+    read_ahead_depth = config_new.num[CF_READAHEAD];
+  }
+  if (given & (1U << CF_CACHE)) {
+    stream_chunks = config_new.num[CF_CACHE];
+  }
+  if (given & (1U << CF_FDCACHE)) {
+    fdc_config(config_new.num[CF_FDCACHE]);
+  }
+  if (given & (1U << CF_THREADS)) {
+    socket_threads = config_new.num[CF_THREADS];
+    pool_wake();
+  }
+  config_new.given = 0;
+  return 0;
+}
+
+/*
+ * An item of the config file (-f), read by step (see reload.h).  A
+ * session keeps the file it has opened and its read-ahead and stream;
+ * the timeouts and the bandwidth limits change for it as well.
+ * Return: 0 on success, -1 when the item is not valid.
+ */
+int config_item(const char *key, const char *value, int step)
+{
+  switch (step) {
+  case RELOAD_CHECK:
+    return config_read(key, value);
+  case RELOAD_APPLY:
+    return config_set();
+  default:
+    config_drop();
+    return 0;
+  }
+}
+
+/*
+ * An option which is an item of the config file as well.
+ * Return: 0 on success, -1 when it is not valid.
+ */
+int config_option(const char *key, const char *value)
+{
+  if (config_item(key, value, RELOAD_CHECK) == 0 &&
+      config_item(NULL, NULL, RELOAD_APPLY) == 0) {
+    return 0;
+  }
+  config_item(NULL, NULL, RELOAD_DROP);
+  return -1;
+}
+
+/* prefork: the supervisor reads the file on SIGHUP, for a new root. */
+void config_reload(void)
+{
+  if (reload_config(config_path, config_item) == -1) {
+    fprintf(stderr, "config %s is invalid, not changed.\n", config_path);
+  }
+}
+
+/* tell the pools socket_threads has changed. */
+void pool_wake(void)
+{
+#ifdef TFTPD_V4ONLY
+  pthread_mutex_lock(&exit_mutex);
+  pthread_cond_broadcast(&thread_cond);
+  pthread_mutex_unlock(&exit_mutex);
+#else /* IPv6 */
+  struct server_socket *ptr;
+
+  for (ptr = server_list; ptr != NULL; ptr = ptr->next) {
+    pthread_mutex_lock(&(ptr->exit_mutex));
+    pthread_cond_broadcast(&(ptr->thread_cond));
+    pthread_mutex_unlock(&(ptr->exit_mutex));
+  }
+#endif /* #ifdef TFTPD_V4ONLY */
+}
+
 void fun_thread_once(void)
 {
   d_printf(3, ("[%d]thrad_once called\n", pthread_self()));
@@ -540,19 +1329,34 @@ void thread_destructor(void *ptr)
 void thread_packet_parse(void)
 {
   char *cp;
-  char *filename, *mode;
-  int fd, rw_flag;
+  char *filename, *mode, *value;
+  char rewritten[NAME_SIZ];
+  int fd, rw_flag, multicast, ret;
   tftpd_thread *ptr;
   struct tftphdr *hdr;
+  struct stat st;
+  mcast_group *group;
+  uint64_t now, rate = 0;
 
   ptr = pthread_getspecific(thread_key);
   hdr = (struct tftphdr *)ptr->buf;
   filename = hdr->th_stuff;
 
+  /* as it came, before the mode is folded to lower case below. */
+  if (capture_enabled() && ptr->buflen > 2) {
+    ptr->capture.opcode = ntohs(hdr->th_opcode);
+    ptr->capture.request_len = ptr->buflen - 2 < CAPTURE_REQUEST_MAX ?
+      ptr->buflen - 2 : CAPTURE_REQUEST_MAX;
+    memcpy(ptr->request, hdr->th_stuff, ptr->capture.request_len);
+  }
+
   if (ntohs(hdr->th_opcode) == WRQ)
     rw_flag = 1;
   else 
     rw_flag = 0;
+  if (ntohs(hdr->th_opcode) == RRQ || ntohs(hdr->th_opcode) == WRQ) {
+    metrics_count(rw_flag ? MC_WRQ : MC_RRQ, 1);
+  }
 
   for (cp = hdr->th_data; cp < ptr->buf + ptr->buflen; cp++) {
     if (*cp == '\0') {
@@ -564,6 +1368,8 @@ void thread_packet_parse(void)
     send_error(EBADOP);
     thread_quit();
   }
+  strlcpy(ptr->filename, filename, NAME_SIZ);
+  ptr->wrq = rw_flag;
 
   mode = cp + 1;
   for (cp = cp + 1; cp < ptr->buf + ptr->buflen; cp++) {
@@ -595,6 +1401,64 @@ void thread_packet_parse(void)
     thread_quit();
   }
 
+  /* the name the client uses for a file of the tree, before it is used. */
+  if (rewrite_enabled()) {
+    now = metrics_now();
+    ret = rewrite_apply(filename, (struct sockaddr *)&ptr->client_addr,
+                        rewritten, sizeof(rewritten));
+    metrics_observe(MH_REWRITE, metrics_now() - now);
+    if (ret > 0 && strcmp(filename, rewritten) != 0) {
+      d_printf(1, ("rewrite: %s -> %s.\n", filename, rewritten));
+      filename = rewritten;
+    }
+  }
+  /* the policy of the client prefix, on the name which is opened. */
+  if (acl_enabled() &&
+      acl_allow((struct sockaddr *)&ptr->client_addr, filename, rw_flag,
+                &rate) == -1) {
+    d_printf(1, ("%s: refused by the access list.\n", filename));
+    send_error(EACCESS);
+    thread_quit();
+  }
+
+  /* a client resending its request gets the session already running. */
+  if (ntohs(hdr->th_opcode) == RRQ || ntohs(hdr->th_opcode) == WRQ) {
+    switch (dedup_enter(&ptr->dedup, (struct sockaddr *)&ptr->client_addr,
+                        ntohs(hdr->th_opcode), filename, ptr->arrived)) {
+    case DEDUP_ACTIVE:
+      d_printf(1, ("%s: the same request is in progress, dropped.\n",
+                   filename));
+      ptr->duplicate = 1;
+      thread_quit();
+    case DEDUP_DONE:
+      d_printf(1, ("%s: the same request is just served, dropped.\n",
+                   filename));
+      ptr->duplicate = 1;
+      thread_quit();
+    case DEDUP_NEW:
+      break;
+    }
+  }
+
+  /* options are not acknowledged yet, tsize is only a hint for WRQ. */
+  ptr->tsize = -1;
+  value = option_value(cp + 1, ptr->buf + ptr->buflen, TFTP_OPTION_TSIZE);
+  if (value != NULL && rw_flag == 1) {
+    ptr->tsize = strtoll(value, NULL, 10);
+  }
+  /* a client which tells how it rolls over is followed. */
+  ptr->rollover = block_rollover;
+  value = option_value(cp + 1, ptr->buf + ptr->buflen, TFTP_OPTION_ROLLOVER);
+  if (value != NULL && (strcmp(value, "0") == 0 || strcmp(value, "1") == 0)) {
+    ptr->rollover = atoi(value);
+  }
+  /* RFC 2090 is for IPv4, the group serves the file as it is. */
+  multicast = rw_flag == 0 && ptr->mode == OCTET && mcast_enabled() &&
+    ((struct sockaddr *)&ptr->client_addr)->sa_family == AF_INET &&
+    option_value(cp + 1, ptr->buf + ptr->buflen,
+                 TFTP_OPTION_MULTICAST) != NULL;
+  trace_event(&ptr->trace, ptr->session, TE_PARSED, 0, rw_flag ? TF_WRQ : 0);
+
 #ifdef TFTPD_OPTION_PACKET
   { 
     /* Option is recognized in this routine . */
@@ -636,9 +1500,30 @@ void thread_packet_parse(void)
   if ((fd = file_open(filename, rw_flag, ptr->mode)) == -1) {
     fprintf(stderr, "can't access\n");
     send_error(EACCESS);
-    pthread_mutex_unlock(&node_mutex);
     thread_quit();
   }
+  ptr->fd = fd;
+  session_trace(ptr, TE_OPENED, 0);
+
+  /* the group would read past what has come from the upstream. */
+  if (multicast && ptr->fetch == NULL) {
+    value = option_value(cp + 1, ptr->buf + ptr->buflen, TFTP_OPTION_TSIZE);
+    ret = mcast_join(fd, (struct sockaddr_in *)&ptr->client_addr,
+                     value != NULL, &group);
+    if (ret == 0) {
+      d_printf(1, ("multicast: %s, a new group.\n", filename));
+      ptr->bytes = mcast_serve(group);
+      metrics_count(MC_BYTES_SENT, ptr->bytes);
+    }
+    else if (ret == 1) {
+      d_printf(1, ("multicast: %s, joined.\n", filename));
+    }
+    if (ret != -1) {
+      /* without an OACK, the client goes on with unicast. */
+      file_close(ptr);
+      return;
+    }
+  }
 
   hdr->th_opcode = ntohs(hdr->th_opcode);
   /* File transfer */
@@ -652,11 +1537,26 @@ void thread_packet_parse(void)
     /*
       syslog(LOG_NOTICE, "tftpd RRQ: %s", filename);
     */
-    if (use_mmap) {
+    if (ptr->fdc != NULL) {
+      st = *fdc_stat(ptr->fdc);
+    }
+    else if (fstat(fd, &st) == -1) {
+      st.st_size = -1;
+    }
+    shape_start(&ptr->shape, (struct sockaddr *)&ptr->client_addr, filename,
+                st.st_size);
+    shape_limit(&ptr->shape, rate);
+    if (use_mmap && ptr->fetch == NULL) {
       send_file_mmap(fd);
     } else {
       send_file(fd);
     }
+    if (ptr->shape.active) {
+      d_printf(1, ("shape: %lu of %lu packets delayed, %.3f sec.\n",
+                   ptr->shape.delayed, ptr->shape.packets,
+                   ptr->shape.waited / 1000000.0));
+      shape_finish(&ptr->shape);
+    }
   }
   else {
     /*
@@ -665,7 +1565,7 @@ void thread_packet_parse(void)
     send_error(EBADOP);
   }
 
-  close(fd);
+  file_close(ptr);
 
   return;
 }
@@ -758,40 +1658,62 @@ size_t read_data_ascii_mmap(char *fbuf, char *buf, size_t buf_size,
   return size;
 }
 
-size_t write_data_ascii(int fd, char *buf, size_t size)
+/*
+ * cr,nul->cr   cr,lf->lf
+ * The data is converted in place and queued to the upload writer.
+ * A cr at the end of the block is kept in "newline" until the next one.
+ * Return: converted size, or -1 when it can't be written.
+ */
+ssize_t write_data_ascii(upload_writer *uw, char *buf, size_t size)
 {
-  char *cptr, ch;
-  size_t wr_size, actual_data;
+  char *cptr, *wptr, *end, ch;
+  tftpd_thread *thread_ptr;
 
-  cptr = buf;
-  actual_data = size;
+  thread_ptr = pthread_getspecific(thread_key);
+  cptr = wptr = buf;
+  end = buf + size;
+
+  if (thread_ptr->newline) {
+    thread_ptr->newline = 0;
+    ch = '\r';
+    if (cptr < end && (*cptr == '\0' || *cptr == '\n')) {
+      ch = (*cptr == '\n') ? '\n' : '\r';
+      cptr++;
+    }
+    if (uw_write(uw, &ch, sizeof(char)) == -1) {
+      return -1;
+    }
+  }
 
-  for (wr_size = 0; wr_size < actual_data ; wr_size++) {
+  while (cptr < end) {
     ch = *cptr;
+    cptr++;
     if (ch == '\r')	{
-      ch = *(cptr+1);
-      if (ch == '\0') {
-	ch = '\r';
+      if (cptr == end) {
+	thread_ptr->newline = 1;
+	break;
+      }
+      if (*cptr == '\0') {
 	cptr++;
-	actual_data--;
       }
-      else if (ch == '\n') {
+      else if (*cptr == '\n') {
 	ch = '\n';
 	cptr++;
-	actual_data--;
       }
     }
 
-    write(fd, &ch, sizeof(char));
-    cptr++;
+    *wptr = ch;
+    wptr++;
+  }
+  if (uw_write(uw, buf, wptr - buf) == -1) {
+    return -1;
   }
-  return wr_size;
+  return wptr - buf;
 }
 
 void send_file(int fd)
 {
   struct tftphdr *dp, *ack;
-  FILE *fp;
   int read_buf, read_pkt;
   char *buf;
   uint16_t block;
@@ -799,9 +1721,12 @@ void send_file(int fd)
   tftpd_thread *thread_ptr;
   struct pollfd file_fds[1], sock_fds[1];
   int ret;
+  uint64_t sent_at;
+  int resent;
+  off_t pos = 0;
 
 #ifdef _DEBUG
-  int total = 0;
+  off_t total = 0;
   struct stat st;
 
   if (fstat(fd, &st) == -1) {
@@ -813,7 +1738,12 @@ void send_file(int fd)
   thread_ptr = pthread_getspecific(thread_key);
   thread_ptr->total_timeout = 0;
 
-  fp = fdopen(fd, "r");
+  /* on a copy of fd, which fclose() closes; octet reads with pread(). */
+  if (thread_ptr->mode != OCTET &&
+      (thread_ptr->fp = fdopen(dup(fd), "r")) == NULL) {
+    send_error(EUNDEF);
+    thread_quit();
+  }
 
   dp = malloc(sizeof(char)*PKTSIZE);
   memset(dp, '\0', sizeof(char)*PKTSIZE);
@@ -823,17 +1753,60 @@ void send_file(int fd)
   ack = malloc(sizeof(char)*PKTSIZE);
   memset(ack, '\0', sizeof(char)*PKTSIZE);
 
+  /* stdio would take the end of what has come so far as EOF. */
+  if (thread_ptr->fetch != NULL && thread_ptr->mode != OCTET &&
+      proxy_wait(thread_ptr->fetch, -1) == -1) {
+    send_error(EUNDEF);
+    thread_quit();
+  }
+  /* the I/O thread reads raw blocks, so netascii keeps using stdio. */
+  if (thread_ptr->mode == OCTET && read_ahead_depth > 0 &&
+      thread_ptr->fetch == NULL) {
+    thread_ptr->ra = ra_create(fd, read_ahead_depth, SEGSIZE);
+    if (thread_ptr->ra == NULL) {
+      d_printf(1, ("read-ahead is not available, read synchronously.\n"));
+    }
+  }
+  /* otherwise the sessions of the same file share what is read. */
+  if (thread_ptr->mode == OCTET && thread_ptr->ra == NULL &&
+      thread_ptr->fetch == NULL) {
+    thread_ptr->rs = rs_open(fd, stream_chunks);
+  }
+
   file_fds[0].fd = fd;
   sock_fds[0].fd = thread_ptr->peer;
   do {
     buf = dp->th_data;
+    resent = 0;
+
+    if (thread_ptr->ra != NULL) {
+      read_buf = ra_read(thread_ptr->ra, buf, SEGSIZE);
+      d_event(10, LE_READ, block, read_buf);
+      if (read_buf == -1) {
+        /* a short DATA would end the transfer as if it were complete. */
+        fprintf(stderr, "read error.\n");
+        send_error(EUNDEF);
+        thread_quit();
+      }
+      goto send_data;
+    }
+    if (thread_ptr->rs != NULL) {
+      read_buf = rs_read(thread_ptr->rs, buf, SEGSIZE);
+      d_event(10, LE_READ, block, read_buf);
+      if (read_buf == -1) {
+        fprintf(stderr, "read error.\n");
+        send_error(EUNDEF);
+        thread_quit();
+      }
+      goto send_data;
+    }
       
   read_file:
     file_fds[0].events = POLLIN;
-    ret = poll(file_fds, 1, TIMEOUT * 1000);
+    ret = poll(file_fds, 1, packet_timeout * 1000);
     if (ret == 0 || ret == -1) {
-      thread_ptr->total_timeout += TIMEOUT;
-      if (thread_ptr->total_timeout >= MAXTIMEOUT) {
+      thread_ptr->total_timeout += packet_timeout;
+      if (thread_ptr->total_timeout >= max_timeout) {
         d_printf(10, ("Quit due to timeout1.\n"));
         thread_quit();
         return;
@@ -843,12 +1816,20 @@ void send_file(int fd)
     thread_ptr->total_timeout = 0;
 
     if (thread_ptr->mode == OCTET) {
-      read_buf = read(fd, buf, SEGSIZE);
+      /* a short read is the end only when the fetch is complete. */
+      if (thread_ptr->fetch != NULL &&
+          proxy_wait(thread_ptr->fetch, pos + SEGSIZE) == -1) {
+        send_error(EUNDEF);
+        thread_quit();
+      }
+      /* the offset of fd is not moved, another session may share it. */
+      read_buf = pread(fd, buf, SEGSIZE, pos);
+      pos += read_buf > 0 ? read_buf : 0;
     }
     else {
-      read_buf = read_data_ascii(fp, buf, SEGSIZE);
+      read_buf = read_data_ascii(thread_ptr->fp, buf, SEGSIZE);
     }
-    d_printf(10, ("%d bytes read.\n", read_buf));
+    d_event(10, LE_READ, block, read_buf);
 
     if (read_buf == -1) {
       fprintf(stderr, "read error.\n");
@@ -858,26 +1839,25 @@ void send_file(int fd)
     dp->th_block = htons(block);
 
     sock_fds[0].events = POLLOUT;
-    ret = poll(sock_fds, 1, TIMEOUT * 1000);
+    ret = poll(sock_fds, 1, packet_timeout * 1000);
     if (ret == 0 || ret == -1) {
-      thread_ptr->total_timeout += TIMEOUT;
-      if (thread_ptr->total_timeout >= MAXTIMEOUT) {
+      thread_ptr->total_timeout += packet_timeout;
+      if (thread_ptr->total_timeout >= max_timeout) {
         d_printf(10, ("Quit due to timeout2.\n"));
         thread_quit();
         return;
       }
       goto send_data;
     }
-    thread_ptr->total_timeout = 0;
+    /* a retransmission comes here, only an ACK resets total_timeout. */
 
-    tmp = send(thread_ptr->peer, dp, read_buf+4, 0) ;
-    d_printf(10, ("[thread:%u]: ack (block:%d) %d byte send.\n",
-		  pthread_self(),
-		  dp->th_block, tmp));
+    shape_wait(&thread_ptr->shape, read_buf + 4);
+    tmp = fault_send(&thread_ptr->fault, thread_ptr->peer, dp, read_buf+4);
+    d_event(10, LE_DATA_SENT, block, tmp);
 #ifdef _DEBUG
     if (st.st_size != 0) {
       total += read_buf;
-      d_printf(10, ("total: %d/%d bytes\n", total, (int)st.st_size));
+      d_event(10, LE_PROGRESS, total, st.st_size);
     }
 #endif
     if (tmp != read_buf + 4) {
@@ -886,48 +1866,91 @@ void send_file(int fd)
       thread_quit();
     }
     d_printf(10, ("send!\n"));
+    sent_at = metrics_now();
+    if (!thread_ptr->first_data) {
+      thread_ptr->first_data = 1;
+      metrics_observe(MH_FIRST_BYTE, sent_at - thread_ptr->start);
+      session_trace(thread_ptr, TE_FIRST_DATA, block);
+    }
 
     for (;;)	{
       /* XXX: TIMEOUT must be exponatial increase. */
       sock_fds[0].events = POLLIN;
-      ret = poll(sock_fds, 1, TIMEOUT * 1000);
+      ret = fault_poll(&thread_ptr->fault, sock_fds, wait_left(sent_at));
       if (ret == 0 || ret == -1) {
-        thread_ptr->total_timeout += TIMEOUT;
-        if (thread_ptr->total_timeout >= MAXTIMEOUT) {
+        thread_ptr->total_timeout += packet_timeout;
+        metrics_count(MC_TIMEOUT, 1);
+        if (thread_ptr->total_timeout >= max_timeout) {
           d_printf(10, ("Quit due to timeout3.\n"));
           thread_quit();
           return;
         }
+        metrics_count(MC_RETRANSMIT, 1);
+        session_trace(thread_ptr, TE_RETRANSMIT, block);
+        resent = 1;
         goto send_data;
       }
       thread_ptr->total_timeout = 0;
 
-      read_pkt = recv(thread_ptr->peer, ack, sizeof(ack), 0);
+      read_pkt = fault_recv(&thread_ptr->fault, thread_ptr->peer,
+                            ack, sizeof(ack));
       d_printf(10, ("wait for recv.\n"));
 
       if (read_pkt < 0) {
-	close(fd);
 	thread_quit();
       }
       ack->th_opcode = ntohs((u_short)ack->th_opcode);
       ack->th_block = ntohs((u_short)ack->th_block);
 	    
       if (ack->th_opcode == ERROR) {
-	close(fd);
 	thread_quit();
       }
 	    
       if(ack->th_opcode == ACK) {
-	if((u_short)ack->th_block == block)
+	if((u_short)ack->th_block == block) {
+	  /* the RTT of a resent block is ambiguous. */
+	  if (!resent) {
+	    metrics_observe(MH_ACK_RTT, metrics_now() - sent_at);
+	  }
+	  metrics_count(MC_BYTES_SENT, read_buf);
+	  thread_ptr->bytes += read_buf;
 	  break;
+	}
 	/* If syncing is necessary, write here. */
       }
 		
     }
-    block++;
+    if (read_buf == SEGSIZE && block_next(thread_ptr, &block) == -1) {
+      send_error(EUNDEF);
+      break;
+    }
   }
-  while (read_buf == 512);
+  while (read_buf == SEGSIZE);
 
+  if (thread_ptr->ra != NULL) {
+    unsigned long ready, waited;
+
+    ra_session_stat(thread_ptr->ra, &ready, &waited);
+    d_printf(1, ("read-ahead: %lu blocks ready, %lu waited.\n",
+                 ready, waited));
+    ra_destroy(thread_ptr->ra);
+    thread_ptr->ra = NULL;
+  }
+  if (thread_ptr->rs != NULL) {
+    unsigned long sessions, shared, loaded;
+
+    rs_session_stat(thread_ptr->rs, &sessions, &shared, &loaded);
+    d_printf(1, ("stream: %lu chunks shared, %lu read.\n", shared, loaded));
+    if ((sessions = rs_close(thread_ptr->rs)) > 0) {
+      d_printf(1, ("stream: %s was shared by %lu sessions.\n",
+                   thread_ptr->filename, sessions));
+    }
+    thread_ptr->rs = NULL;
+  }
+  if (thread_ptr->fp != NULL) {
+    fclose(thread_ptr->fp);
+    thread_ptr->fp = NULL;
+  }
   free(dp);
   free(ack);
   return ;
@@ -936,7 +1959,6 @@ void send_file(int fd)
 void send_file_mmap(int fd)
 {
   struct tftphdr *dp, *ack;
-  FILE *fp;
   int read_buf, read_pkt; 
   size_t read_buf_ascii;
   char *buf;
@@ -945,22 +1967,23 @@ void send_file_mmap(int fd)
   tftpd_thread *thread_ptr;
   char *file_map = NULL;
   char *mmap_ptr = NULL;
-  uint32_t mmap_off = 0;
+  off_t mmap_off = 0, total = 0;
+  long page;
   int ret;
   struct pollfd sock_fds[1];
-  int total = 0;
   struct stat st;
   int read_ascii_done = 0;
+  uint64_t sent_at;
+  int resent;
 
   if (fstat(fd, &st) == -1) {
 	d_printf(10, ("fstat() failed!\n"));
   }
+  page = MMAP_FILE_MAP_SIZE / MMAP_FILE_MAP_MULTIPLY;
 
   thread_ptr = pthread_getspecific(thread_key);
   thread_ptr->total_timeout = 0;
 
-  fp = fdopen(fd, "r");
-
   dp = malloc(sizeof(char)*PKTSIZE);
   memset(dp, '\0', sizeof(char)*PKTSIZE);
   dp->th_opcode = htons((u_short)DATA);
@@ -971,11 +1994,9 @@ void send_file_mmap(int fd)
 
   sock_fds[0].fd = thread_ptr->peer;
 
-#ifdef PERFORMANCE_CHECK
-  rdtsc1 = rdtsc();
-#endif
   do {
     buf = dp->th_data;
+    resent = 0;
       
     d_printf(10, ("%p %p\n", mmap_ptr+SEGSIZE, file_map + MMAP_FILE_MAP_SIZE));
     if (mmap_ptr == NULL ||
@@ -985,14 +2006,20 @@ void send_file_mmap(int fd)
             munmap(file_map, MMAP_FILE_MAP_SIZE);
         }
 
-        d_printf(10, ("Map file from (%d, size:%d)\n",
-                      mmap_off, MMAP_FILE_MAP_SIZE));
-        mmap_ptr = file_map = mmap(0, MMAP_FILE_MAP_SIZE, PROT_READ, 
-			           MAP_FILE|MAP_SHARED, fd, mmap_off);
+        /* from the page of the next byte, a netascii block may end
+           anywhere in the previous map. */
+        mmap_off = total - total % page;
+        d_printf(10, ("Map file from (%lld, size:%d)\n",
+                      (long long)mmap_off, (int)MMAP_FILE_MAP_SIZE));
+        file_map = mmap(0, MMAP_FILE_MAP_SIZE, PROT_READ, 
+			MAP_FILE|MAP_SHARED, fd, mmap_off);
         if (file_map == MAP_FAILED) {
             fprintf(stderr, "read error:%s\n", strerror(errno));
+            file_map = NULL;
+            send_error(EUNDEF);
+            break;
         }
-        mmap_off += MMAP_FILE_MAP_SIZE;
+        mmap_ptr = file_map + (total - mmap_off);
     }
 
     if (total + SEGSIZE >= st.st_size) {
@@ -1003,44 +2030,40 @@ void send_file_mmap(int fd)
 
     if (thread_ptr->mode == OCTET) {
         memcpy(buf, mmap_ptr, read_buf);
-        d_printf(10, ("%d bytes read.\n", read_buf));
+        d_event(10, LE_READ, block, read_buf);
         mmap_ptr+=read_buf; 
+        total += read_buf;
     }
     else {
         read_buf = read_data_ascii_mmap(mmap_ptr, buf, SEGSIZE,
                                         read_buf, &read_buf_ascii);
         d_printf(10, ("%s\n", buf));
         mmap_ptr+=read_buf_ascii; 
+        total += read_buf_ascii;
         d_printf(10, ("%d (read:%d) bytes read.\n", read_buf, read_buf_ascii));
     }
 
   send_data: 
     dp->th_block = htons(block);
     sock_fds[0].events = POLLOUT;
-    ret = poll(sock_fds, 1, TIMEOUT * 1000);
+    ret = poll(sock_fds, 1, packet_timeout * 1000);
     if (ret == 0 || ret == -1) {
-      thread_ptr->total_timeout += TIMEOUT;
-      if (thread_ptr->total_timeout >= MAXTIMEOUT) {
+      thread_ptr->total_timeout += packet_timeout;
+      if (thread_ptr->total_timeout >= max_timeout) {
         d_printf(10, ("Quit due to timeout4.\n"));
         thread_quit();
         return;
       }
       goto send_data;
     }
-    thread_ptr->total_timeout = 0;
+    /* a retransmission comes here, only an ACK resets total_timeout. */
 
-    tmp = send(thread_ptr->peer, dp, read_buf+4, 0) ;
-    d_printf(10, ("[thread:%u]: ack (block:%d) %d byte send.\n",
-		  pthread_self(),
-		  dp->th_block, tmp));
+    shape_wait(&thread_ptr->shape, read_buf + 4);
+    tmp = fault_send(&thread_ptr->fault, thread_ptr->peer, dp, read_buf+4);
+    d_event(10, LE_DATA_SENT, block, tmp);
 #ifdef _DEBUG
     if (st.st_size != 0) {
-      if (thread_ptr->mode == OCTET) {
-        total += read_buf;
-      } else {
-        total += read_buf_ascii;
-      }
-      d_printf(10, ("total: %d/%d bytes\n", total, (int)st.st_size));
+      d_event(10, LE_PROGRESS, total, st.st_size);
     }
 #endif
     if (tmp != read_buf + 4) {
@@ -1049,52 +2072,69 @@ void send_file_mmap(int fd)
       thread_quit();
     }
     d_printf(10, ("send!\n"));
+    sent_at = metrics_now();
+    if (!thread_ptr->first_data) {
+      thread_ptr->first_data = 1;
+      metrics_observe(MH_FIRST_BYTE, sent_at - thread_ptr->start);
+      session_trace(thread_ptr, TE_FIRST_DATA, block);
+    }
 
     for (;;)	{
       /* XXX: TIMEOUT must be exponatial increase. */
       sock_fds[0].events = POLLIN;
-      ret = poll(sock_fds, 1, TIMEOUT * 1000);
+      ret = fault_poll(&thread_ptr->fault, sock_fds, wait_left(sent_at));
       if (ret == 0 || ret == -1) {
-        thread_ptr->total_timeout += TIMEOUT;
-        if (thread_ptr->total_timeout >= MAXTIMEOUT) {
+        thread_ptr->total_timeout += packet_timeout;
+        metrics_count(MC_TIMEOUT, 1);
+        if (thread_ptr->total_timeout >= max_timeout) {
           d_printf(10, ("Quit due to timeout5.\n"));
           thread_quit();
           return;
         }
+        metrics_count(MC_RETRANSMIT, 1);
+        session_trace(thread_ptr, TE_RETRANSMIT, block);
+        resent = 1;
         goto send_data;
       }
       thread_ptr->total_timeout = 0;
 
-      read_pkt = recv(thread_ptr->peer, ack, sizeof(ack), 0);
+      read_pkt = fault_recv(&thread_ptr->fault, thread_ptr->peer,
+                            ack, sizeof(ack));
       d_printf(10, ("wait for recv.\n"));
 
       if (read_pkt < 0) {
-	close(fd);
 	thread_quit();
       }
       ack->th_opcode = ntohs((u_short)ack->th_opcode);
       ack->th_block = ntohs((u_short)ack->th_block);
 	    
       if (ack->th_opcode == ERROR) {
-	close(fd);
 	thread_quit();
       }
 	    
       if(ack->th_opcode == ACK) {
-	if((u_short)ack->th_block == block)
+	if((u_short)ack->th_block == block) {
+	  /* the RTT of a resent block is ambiguous. */
+	  if (!resent) {
+	    metrics_observe(MH_ACK_RTT, metrics_now() - sent_at);
+	  }
+	  metrics_count(MC_BYTES_SENT, read_buf);
+	  thread_ptr->bytes += read_buf;
 	  break;
+	}
 	/* If syncing is necessary, write here. */
       }
 		
     }
-    block++;
+    if (read_buf == SEGSIZE && block_next(thread_ptr, &block) == -1) {
+      send_error(EUNDEF);
+      break;
+    }
   }
   while (read_buf == SEGSIZE);
-#ifdef PERFORMANCE_CHECK
-    rdtsc2 = rdtsc();
-    printf("done: %llu - %llu = %llu\n", rdtsc2, rdtsc1, rdtsc2 - rdtsc1);
-#endif
-  munmap(file_map, MMAP_FILE_MAP_SIZE);
+  if (file_map != NULL) {
+    munmap(file_map, MMAP_FILE_MAP_SIZE);
+  }
   free(dp);
   free(ack);
   return ;
@@ -1104,16 +2144,31 @@ void recv_file(int fd)
 {
   struct tftphdr *dp, *ack;
   char *buf;
-  size_t read_pkt, write_data;
+  size_t read_pkt;
+  ssize_t write_data;
   size_t send_pkt;
-  u_short ack_block;
+  uint16_t ack_block, acked;
+  uint64_t sent_at;
   tftpd_thread *thread_ptr;
-  struct pollfd file_fds[1], sock_fds[1];
+  struct pollfd sock_fds[1];
   int ret;
+  unsigned long writes, stalls;
+  unsigned long long bytes;
     
   thread_ptr = pthread_getspecific(thread_key);
   thread_ptr->total_timeout = 0;
 
+  thread_ptr->newline = 0;
+  thread_ptr->uw = uw_create(fd, upload_chunk, thread_ptr->tsize,
+                             upload_sync, upload_sync_interval,
+                             (size_t)write_behind_depth * SEGSIZE,
+                             prealloc_max);
+  if (thread_ptr->uw == NULL) {
+    fprintf(stderr, "upload writer allocation failed.\n");
+    send_error(EUNDEF);
+    thread_quit();
+  }
+
   dp = malloc(sizeof(char)*PKTSIZE);
   memset(dp, '\0', sizeof(char)*PKTSIZE);
 
@@ -1122,7 +2177,6 @@ void recv_file(int fd)
   ack->th_opcode = htons((u_short)ACK);
   ack_block = 0;
     
-  file_fds[0].fd = fd;
   sock_fds[0].fd = thread_ptr->peer;
 
   do {
@@ -1133,10 +2187,10 @@ void recv_file(int fd)
     ack->th_block = htons(ack_block);
 
     sock_fds[0].events = POLLOUT;
-    ret = poll(sock_fds, 1, TIMEOUT * 1000);
+    ret = poll(sock_fds, 1, packet_timeout * 1000);
     if (ret == 0 || ret == -1) {
-      thread_ptr->total_timeout += TIMEOUT;
-      if (thread_ptr->total_timeout >= MAXTIMEOUT) {
+      thread_ptr->total_timeout += packet_timeout;
+      if (thread_ptr->total_timeout >= max_timeout) {
         d_printf(10, ("Quit due to timeout6.\n"));
         thread_quit();
         return;
@@ -1144,33 +2198,47 @@ void recv_file(int fd)
       goto send_ack;
     }
     thread_ptr->total_timeout = 0;
-    if((send_pkt = send(thread_ptr->peer, ack, 4, 0)) != 4)	{
+    if((send_pkt = fault_send(&thread_ptr->fault, thread_ptr->peer,
+                              ack, 4)) != 4)	{
       d_printf(3, ("[send_ack] send failed.\n"));
-      close(fd);
+      uw_destroy(thread_ptr->uw);
+      thread_ptr->uw = NULL;
       thread_quit();
     }
-    d_printf(10, ("[send_ack] ack (%d) send.\n", ack->th_block));
+    d_event(10, LE_ACK_SENT, ack_block, 0);
     d_printf(9, ("send ack...\n"));
-    ack_block++;
+    sent_at = metrics_now();
+    acked = ack_block;
+    if (block_next(thread_ptr, &ack_block) == -1) {
+      send_error(EUNDEF);
+      uw_destroy(thread_ptr->uw);
+      thread_ptr->uw = NULL;
+      thread_quit();
+    }
 
     for (;;) {
       sock_fds[0].events = POLLIN;
-      ret = poll(sock_fds, 1, TIMEOUT * 1000);
+      ret = fault_poll(&thread_ptr->fault, sock_fds, wait_left(sent_at));
       if (ret == 0 || ret == -1) {
-        thread_ptr->total_timeout += TIMEOUT;
-        if (thread_ptr->total_timeout >= MAXTIMEOUT) {
+        thread_ptr->total_timeout += packet_timeout;
+        metrics_count(MC_TIMEOUT, 1);
+        if (thread_ptr->total_timeout >= max_timeout) {
           d_printf(10, ("Quit due to timeout7.\n"));
           thread_quit();
           return;
         }
-        goto send_ack;
+        metrics_count(MC_RETRANSMIT, 1);
+        session_trace(thread_ptr, TE_RETRANSMIT, acked);
+        goto resend_ack;
       }
       thread_ptr->total_timeout = 0;
 
-      read_pkt = recv(thread_ptr->peer, dp, PKTSIZE, 0);
+      read_pkt = fault_recv(&thread_ptr->fault, thread_ptr->peer,
+                            dp, PKTSIZE);
 	    
       if (read_pkt < 0) {
-	close(fd);
+	uw_destroy(thread_ptr->uw);
+	thread_ptr->uw = NULL;
 	thread_quit();
       }
       dp->th_opcode = ntohs((u_short)dp->th_opcode);
@@ -1181,43 +2249,63 @@ void recv_file(int fd)
 	  break;
 	}
 	/* If syncing is necessary, write here. */
-	if (dp->th_block == (ack_block-1)) {
-	  goto send_ack;
+	if (dp->th_block == acked) {
+	  metrics_count(MC_RETRANSMIT, 1);
+	  session_trace(thread_ptr, TE_RETRANSMIT, acked);
+	  goto resend_ack;
 	}
       }
+      continue;
+
+    resend_ack:
+      /* the ack in the buffer is still the last one sent. */
+      fault_send(&thread_ptr->fault, thread_ptr->peer, ack, 4);
+      d_event(10, LE_ACK_SENT, acked, 0);
+      sent_at = metrics_now();
     }
-	
-  write_file:
-    sock_fds[0].events = POLLOUT;
-    ret = poll(sock_fds, 1, TIMEOUT * 1000);
-    if (ret == 0 || ret == -1) {
-      thread_ptr->total_timeout += TIMEOUT;
-      if (thread_ptr->total_timeout >= MAXTIMEOUT) {
-        d_printf(10, ("Quit due to timeout8.\n"));
-        thread_quit();
-        return;
-      }
-      goto write_file;
-    }
-    thread_ptr->total_timeout = 0;
+
+    metrics_count(MC_BYTES_RECEIVED, read_pkt - 4);
+    thread_ptr->bytes += read_pkt - 4;
+    /* with write-behind, this only waits while the ring is full. */
     if (thread_ptr->mode == OCTET) {
-      write_data = write(fd, dp->th_data, read_pkt-4);
+      write_data = uw_write(thread_ptr->uw, dp->th_data, read_pkt-4);
     }
     else {
-      write_data = write_data_ascii(fd, dp->th_data, read_pkt-4);
+      write_data = write_data_ascii(thread_ptr->uw, dp->th_data, read_pkt-4);
+    }
+    if (write_data == -1) {
+      goto write_error;
     }
 
   }
   while (read_pkt == PKTSIZE);
 
-  close(fd);
+  if (thread_ptr->newline) {
+    /* the last byte was a bare cr. */
+    if (uw_write(thread_ptr->uw, "\r", sizeof(char)) == -1) {
+      goto write_error;
+    }
+  }
+  if (uw_finish(thread_ptr->uw) == -1) {
+    goto write_error;
+  }
+  uw_session_stat(thread_ptr->uw, &writes, &bytes);
+  uw_session_stall(thread_ptr->uw, &stalls);
+  d_printf(1, ("upload: %llu bytes, %lu writes (%.1f writes/MB), "
+               "%lu stalls.\n",
+               bytes, writes,
+               bytes ? (double)writes * 1048576.0 / bytes : 0.0, stalls));
+  uw_destroy(thread_ptr->uw);
+  thread_ptr->uw = NULL;
+  /* fd is closed by thread_packet_parse(), a second close() here would
+     hit whatever another session has opened in the meantime. */
   ack->th_block = htons(ack_block); 
 send_last_ack:
   sock_fds[0].events = POLLOUT;
-  ret = poll(sock_fds, 1, TIMEOUT * 1000);
+  ret = poll(sock_fds, 1, packet_timeout * 1000);
   if (ret == 0 || ret == -1) {
-    thread_ptr->total_timeout += TIMEOUT;
-    if (thread_ptr->total_timeout >= MAXTIMEOUT) {
+    thread_ptr->total_timeout += packet_timeout;
+    if (thread_ptr->total_timeout >= max_timeout) {
       d_printf(10, ("Quit due to timeout.9\n"));
       thread_quit();
       return;
@@ -1226,13 +2314,23 @@ send_last_ack:
   }
   thread_ptr->total_timeout = 0;
 
-  if((send_pkt = send(thread_ptr->peer, ack, 4, 0)) != 4) {
+  if((send_pkt = fault_send(&thread_ptr->fault, thread_ptr->peer,
+                            ack, 4)) != 4) {
     d_printf(9, ("send_final ack(%d) failed.\n", ack->th_block));
   }
   free(dp);
   free(ack);
 
   return ;
+
+ write_error:
+  fprintf(stderr, "write error: %s\n", strerror(errno));
+  send_error((errno == ENOSPC || errno == EDQUOT) ? ENOSPACE : EUNDEF);
+  uw_destroy(thread_ptr->uw);
+  thread_ptr->uw = NULL;
+  free(dp);
+  free(ack);
+  thread_quit();
 }
 
 
@@ -1242,15 +2340,84 @@ send_last_ack:
  */
 int file_open(char *filename, int wr, enum mode mode)
 {
-  int fd;
+  int fd, ret, cache;
+  char f_path[PATH_SIZ], root[PATH_SIZ];
+  unsigned long gen;
+  f_node *tree;
+  tftpd_thread *ptr;
+
+  ptr = pthread_getspecific(thread_key);
+  /* stdio of netascii moves the offset, which the sessions would share. */
+  cache = wr == 0 && mode == OCTET && fdc_enabled();
+
+  /* the tree is not freed, nor the root switched, while it is read. */
+  pthread_mutex_lock(&node_mutex);
+  tree = tree_root(root, &gen);
+  snprintf(f_path, PATH_SIZ, "%s/%s", root, filename);
+  /* opened after the lookup in the same tree, it would pass again. */
+  if (cache && (fd = fdc_get(f_path, gen, &ptr->fdc)) != -1) {
+    pthread_mutex_unlock(&node_mutex);
+    return fd;
+  }
+  ret = file_lookup(tree, filename, wr);
+  pthread_mutex_unlock(&node_mutex);
+  if (ret == -1) {
+    /* not on the disk, it may be made from a template. */
+    if (wr == 0 && vfile_enabled()) {
+      fd = vfile_open(filename, (struct sockaddr *)&ptr->client_addr);
+      if (fd != -1) {
+        return fd;
+      }
+    }
+    /* nor a virtual file, then the upstream may have it. */
+    if (wr == 0 && proxy_enabled()) {
+      return proxy_open(filename, &ptr->fetch);
+    }
+    return -1;
+  }
+
+  if (wr == 1) {
+    fd = open(f_path, (O_WRONLY|O_TRUNC|O_CREAT), 0777);
+  }
+  else if (cache) {
+    fd = fdc_open(f_path, gen, &ptr->fdc);
+  }
+  else {
+    fd = open(f_path, O_RDONLY);
+  }
+
+  return fd;
+}
+
+/*
+ * Close the file of the session, which may be shared by the cache.
+ * thread_cleanup() calls it after the I/O threads reading it stop.
+ */
+void file_close(tftpd_thread *ptr)
+{
+  if (ptr->fdc != NULL) {
+    fdc_release(ptr->fdc);
+    ptr->fdc = NULL;
+  }
+  else if (ptr->fd != -1) {
+    close(ptr->fd);
+  }
+  ptr->fd = -1;
+}
+
+/*
+ * Check filename against the tree fptr.
+ * Return: 0 when it may be opened, -1 otherwise.
+ */
+int file_lookup(f_node *fptr, char *filename, int wr)
+{
   char f_path[PATH_SIZ];
   char *cptr, *last;
-  f_node *fptr, *prev;
+  f_node *prev;
 
   memset(f_path, '\0', sizeof(char) * PATH_SIZ);
   snprintf(f_path, PATH_SIZ, "./%s", filename);
 
-  fptr = root_node;
   last = divide_token(f_path,'/');
   for (cptr = f_path; cptr < last; cptr += strlen(cptr) + 1) {
     if (*cptr != '.') {
@@ -1284,25 +2451,20 @@ int file_open(char *filename, int wr, enum mode mode)
     }
 
   }
-  snprintf(f_path, PATH_SIZ, "%s/%s", tftpd_root, filename);
-  if (wr == 1) {
-    fd = open(f_path, (O_WRONLY|O_TRUNC|O_CREAT), 0777);
-  }
-  else {
-    fd = open(f_path, O_RDONLY);
-  }
-
-  return fd;
+  return 0;
 }
 
 #ifdef TFTPD_V4ONLY
 void thread_main(void *param)
 {
-  int read;
+  int read, cpu;
   tftpd_thread *ptr;
   socklen_t len;
   struct sockaddr_in sin;
+  uint64_t wait;
     
+  /* before the buffers are allocated, to have them on its node. */
+  affinity_apply(AFFINITY_WORKER);
   pthread_once(&thread_once, fun_thread_once);
   ptr = pthread_getspecific(thread_key);
   if (ptr == NULL) {
@@ -1312,6 +2474,17 @@ void thread_main(void *param)
     ptr->block_size = -1;	
     ptr->newline = 0;
     ptr->prevchar = 0;
+    ptr->fd = -1;
+    ptr->fp = NULL;
+    ptr->fdc = NULL;
+    ptr->ra = NULL;
+    ptr->rs = NULL;
+    ptr->fetch = NULL;
+    ptr->uw = NULL;
+    ptr->shape.active = 0;
+    ptr->admitted = 0;
+    ptr->dedup = NULL;
+    ptr->start = 0;
     memset(ptr->buf, 0, sizeof(char)*BUFSIZ);
     pthread_setspecific(thread_key, ptr);
   }
@@ -1320,9 +2493,20 @@ void thread_main(void *param)
 
   d_printf(3, ("waiting....(%d)\n", pthread_self()));
 
-  read = recvfrom(sockfd, ptr->buf, BUFSIZ, 0, 
-		  (struct sockaddr *)&(ptr->client_addr), &len);
+  if (admit_q != NULL) {
+    read = admit_take(admit_q, ptr->buf, BUFSIZ,
+		      (struct sockaddr *)&(ptr->client_addr), &len, &wait,
+		      &ptr->admit_size, &cpu);
+    ptr->admitted = 1;
+  }
+  else {
+    read = recv_request(sockfd, ptr->buf, BUFSIZ,
+			(struct sockaddr *)&(ptr->client_addr), &len, &wait);
+    cpu = affinity_incoming(sockfd);
+  }
   ptr->buflen = read;
+  session_start(ptr, wait);
+  affinity_session(cpu);
 
   ptr->peer = socket(AF_INET, SOCK_DGRAM, 0);
   if (ptr->peer == -1) {
@@ -1343,6 +2527,8 @@ void thread_main(void *param)
   }
 
   thread_packet_parse();
+  ptr->finished = 1;
+  fault_finish(&ptr->fault, ptr->peer);
   close(ptr->peer);
 
   d_printf(1, ("client process finished(%d).\n", pthread_self()));
@@ -1376,46 +2562,61 @@ void server_main (void *param)
   }
   printf("server_main.server_socket: %p\n", param);
 
-  for (cnt = 0; cnt < socket_threads; cnt++) {
-    pthread_create(&(ptr->thread_tid[cnt]), NULL, 
-		   (void *(*)(void *))&thread_main, (void *)ptr);
+  for (cnt = 0; cnt < MAX_THREAD; cnt++) {
+    ptr->thread_tid[cnt] = PTHREAD_T_NULL;
   }
-
+  pthread_mutex_lock(&(ptr->exit_mutex));
   while (1) {
-    pthread_mutex_lock(&(ptr->exit_mutex));
-    while(ptr->exited_tid == PTHREAD_T_NULL) {
+    /* the same as the pool of the IPv4 server, see main(). */
+    for (cnt = 0; cnt < MAX_THREAD && ptr->running < socket_threads; cnt++) {
+      if (ptr->thread_tid[cnt] == PTHREAD_T_NULL) {
+	pthread_create(&(ptr->thread_tid[cnt]), NULL, 
+		       (void *(*)(void *))&thread_main, (void *)ptr);
+	ptr->running++;
+      }
+    }
+    if (ptr->admit != NULL) {
+      admit_resize(ptr->admit, socket_threads);
+    }
+    while (ptr->exited_tid == PTHREAD_T_NULL &&
+	   ptr->running >= socket_threads) {
       pthread_cond_wait(&(ptr->thread_cond), &(ptr->exit_mutex));
     }
-    for (cnt = 0; cnt < socket_threads; cnt++) {
+    if (ptr->exited_tid == PTHREAD_T_NULL) {
+      continue;
+    }
+    for (cnt = 0; cnt < MAX_THREAD; cnt++) {
       if (ptr->thread_tid[cnt] == ptr->exited_tid) {
 	pthread_join(ptr->thread_tid[cnt], NULL);
 	d_printf(1, ("[%d] is exited.\n",ptr->exited_tid));
-#ifndef _DEBUG
-	d_printf(1, "thread restart\n");
-	pthread_create(&(ptr->thread_tid[cnt]), NULL,
-		       (void *(*)(void *))&thread_main, (void *)ptr);
-#endif
-	ptr->exited_tid = PTHREAD_T_NULL;
+	ptr->thread_tid[cnt] = PTHREAD_T_NULL;
+	ptr->running--;
       }
     }
-    pthread_mutex_unlock(&(ptr->exit_mutex));
+    ptr->exited_tid = PTHREAD_T_NULL;
+    pthread_cond_broadcast(&(ptr->thread_cond));
   }
+  pthread_mutex_unlock(&(ptr->exit_mutex));
 
 
 }
 
 void thread_main(void *param)
 {
-  int read;
+  int read, cpu;
   tftpd_thread *ptr;
   socklen_t len;
   struct sockaddr_storage ss;
   struct sockaddr *sa;
   struct server_socket *ssocket;
+  uint64_t wait;
     
   sa = (struct sockaddr *)&ss;
+  memset(&ss, 0, sizeof(ss));
   ssocket = (struct server_socket *)param;
 
+  /* before the buffers are allocated, to have them on its node. */
+  affinity_apply(AFFINITY_WORKER);
   pthread_once(&thread_once, fun_thread_once);
   ptr = pthread_getspecific(thread_key);
   if (ptr == NULL) {
@@ -1425,14 +2626,38 @@ void thread_main(void *param)
     ptr->block_size = -1;
     ptr->newline = 0;
     ptr->prevchar = 0;
+    ptr->fd = -1;
+    ptr->fp = NULL;
+    ptr->fdc = NULL;
+    ptr->ra = NULL;
+    ptr->rs = NULL;
+    ptr->fetch = NULL;
+    ptr->uw = NULL;
+    ptr->shape.active = 0;
+    ptr->admitted = 0;
+    ptr->dedup = NULL;
+    ptr->start = 0;
     ptr->ssocket = ssocket;
     memset(ptr->buf, 0, sizeof(char)*BUFSIZ);
     pthread_setspecific(thread_key, ptr);
   }
 
-  read = recvfrom(ssocket->socket, ptr->buf, BUFSIZ, 0,
-		  (struct sockaddr *)&(ptr->client_addr), &ssocket->addrlen);
+  /* ssocket is shared by the threads, don't let recvmsg() write to it. */
+  len = sizeof(ptr->client_addr);
+  if (ssocket->admit != NULL) {
+    read = admit_take(ssocket->admit, ptr->buf, BUFSIZ,
+		      (struct sockaddr *)&(ptr->client_addr), &len, &wait,
+		      &ptr->admit_size, &cpu);
+    ptr->admitted = 1;
+  }
+  else {
+    read = recv_request(ssocket->socket, ptr->buf, BUFSIZ,
+			(struct sockaddr *)&(ptr->client_addr), &len, &wait);
+    cpu = affinity_incoming(ssocket->socket);
+  }
   ptr->buflen = read;
+  session_start(ptr, wait);
+  affinity_session(cpu);
   d_printf(5, ("thread (%d) reading (%d) byte...\n", pthread_self(), read));
   ptr->peer = socket(ssocket->socket_domain, 
 		     ssocket->socket_type, 
@@ -1453,6 +2678,8 @@ void thread_main(void *param)
   }
 
   thread_packet_parse();
+  ptr->finished = 1;
+  fault_finish(&ptr->fault, ptr->peer);
   close(ptr->peer);
 
   d_printf(1, ("client process finished(%d).\n", pthread_self()));
@@ -1463,12 +2690,174 @@ void thread_main(void *param)
 }
 #endif /* #ifdef TFTPD_V4ONLY */
 
+/*
+ * Release what a session left behind when thread_quit() cuts it short.
+ */
+void thread_cleanup(tftpd_thread *ptr)
+{
+  char host[NI_MAXHOST], serv[NI_MAXSERV], client[NI_MAXHOST + NI_MAXSERV];
+  uint64_t duration;
+
+  if (ptr == NULL) {
+    return;
+  }
+  if (ptr->fp != NULL) {
+    fclose(ptr->fp);
+    ptr->fp = NULL;
+  }
+  if (ptr->ra != NULL) {
+    ra_destroy(ptr->ra);
+    ptr->ra = NULL;
+  }
+  if (ptr->rs != NULL) {
+    rs_close(ptr->rs);
+    ptr->rs = NULL;
+  }
+  if (ptr->uw != NULL) {
+    uw_destroy(ptr->uw);
+    ptr->uw = NULL;
+  }
+  if (ptr->fetch != NULL) {
+    proxy_release(ptr->fetch);
+    ptr->fetch = NULL;
+  }
+  file_close(ptr);
+  shape_finish(&ptr->shape);
+  if (ptr->admitted) {
+    admit_done(ptr->admit_size);
+    ptr->admitted = 0;
+  }
+  if (ptr->dedup != NULL) {
+    dedup_leave(ptr->dedup, ptr->finished);
+    ptr->dedup = NULL;
+  }
+  if (ptr->start != 0) {
+    duration = metrics_now() - ptr->start;
+    metrics_observe(MH_DURATION, duration);
+    metrics_count(MC_SESSION_END, 1);
+    trace_event(&ptr->trace, ptr->session, TE_DONE, ptr->bytes,
+                ptr->finished ? 0 : TF_ABORTED);
+    trace_flush(&ptr->trace);
+    if (fault_enabled()) {
+      /* what is still queued belongs to an aborted session. */
+      fault_finish(&ptr->fault, -1);
+      d_printf(1, ("faults: %lu lost, %lu duplicated, %lu delayed, "
+                   "%lu reordered.\n", ptr->fault.lost,
+                   ptr->fault.duplicated, ptr->fault.delayed,
+                   ptr->fault.reordered));
+    }
+
+    if (getnameinfo((struct sockaddr *)&ptr->client_addr,
+                    sizeof(ptr->client_addr), host, sizeof(host),
+                    serv, sizeof(serv), NI_NUMERICHOST|NI_NUMERICSERV) != 0) {
+      strlcpy(host, "?", sizeof(host));
+      strlcpy(serv, "?", sizeof(serv));
+    }
+    snprintf(client, sizeof(client), "%s:%s", host, serv);
+    log_access(client, ptr->filename[0] != '\0' ? ptr->filename : "-",
+               ptr->mode == NETASCII ? "netascii" : "octet", ptr->wrq,
+               ptr->bytes, duration,
+               ptr->duplicate ? LOG_DUPLICATE : ptr->finished, ptr->error);
+
+    if (capture_enabled() && ptr->capture.request_len > 0) {
+      ptr->capture.bytes = ptr->bytes;
+      /* saturated, a session over 71 minutes would wrap. */
+      ptr->capture.latency = duration > UINT32_MAX ? UINT32_MAX : duration;
+      if (ptr->error != -1) {
+        ptr->capture.outcome = CAPTURE_ERROR(ptr->error);
+      }
+      else {
+        ptr->capture.outcome = ptr->finished ? CAPTURE_OK : CAPTURE_ABORTED;
+      }
+      capture_write(&ptr->capture, ptr->request);
+    }
+    log_session(0);
+    ptr->start = 0;
+  }
+}
+
+void session_start(tftpd_thread *ptr, uint64_t wait)
+{
+  ptr->start = metrics_now();
+  ptr->arrived = ptr->start - wait;
+  ptr->first_data = 0;
+  metrics_count(MC_SESSION_START, 1);
+  metrics_observe(MH_QUEUE_WAIT, wait);
+
+  ptr->session = __atomic_add_fetch(&session_seq, 1, __ATOMIC_RELAXED);
+  ptr->bytes = 0;
+  ptr->finished = 0;
+  ptr->dedup = NULL;
+  ptr->duplicate = 0;
+  ptr->trace.count = 0;
+  ptr->filename[0] = '\0';
+  ptr->wrq = 0;
+  ptr->error = -1;
+  if (capture_enabled()) {
+    memset(&ptr->capture, 0, sizeof(ptr->capture));
+    ptr->capture.time = capture_now() - wait;
+    ptr->capture.client = capture_client((struct sockaddr *)&ptr->client_addr);
+  }
+  if (fault_enabled()) {
+    fault_start(&ptr->fault, ptr->session);
+  }
+  log_session(ptr->session);
+  session_trace(ptr, TE_RECEIVED, wait);
+}
+
+void session_trace(tftpd_thread *ptr, enum trace_event event, uint64_t arg)
+{
+  trace_event(&ptr->trace, ptr->session, event, arg, 0);
+}
+
+/*
+ * Advance *block to the number of the next block of the session.  After
+ * TFTP_BLOCK_MAX, it goes on from the rollover of the session.
+ * Return: 0 on success, -1 when the rollover is off.
+ */
+int block_next(tftpd_thread *ptr, uint16_t *block)
+{
+  if (*block != TFTP_BLOCK_MAX) {
+    (*block)++;
+    return 0;
+  }
+  if (ptr->rollover == -1) {
+    d_printf(1, ("%s: more than %d blocks, no rollover.\n",
+                 ptr->filename, TFTP_BLOCK_MAX));
+    return -1;
+  }
+  d_printf(3, ("block number rolls over to %d.\n", ptr->rollover));
+  *block = (uint16_t)ptr->rollover;
+  return 0;
+}
+
+/*
+ * The msec left of the packet timeout since the last packet was sent.  Stray
+ * packets (a duplicate ACK, for one) must not start the wait over,
+ * or a peer which repeats itself never sees our retransmission.
+ */
+int wait_left(uint64_t since)
+{
+  uint64_t passed;
+
+  passed = metrics_now() - since;
+  if (passed >= packet_timeout * 1000000ULL) {
+    return 0;
+  }
+  return (int)((packet_timeout * 1000000ULL - passed + 999) / 1000);
+}
+
 #ifdef TFTPD_V4ONLY
 void thread_quit(void)
 {
+  thread_cleanup(pthread_getspecific(thread_key));
   pthread_mutex_lock(&exit_mutex);
+  /* there is one slot, wait until main() has taken the previous one. */
+  while (exited_tid != PTHREAD_T_NULL) {
+    pthread_cond_wait(&thread_cond, &exit_mutex);
+  }
   exited_tid = pthread_self();
-  pthread_cond_signal(&thread_cond);
+  pthread_cond_broadcast(&thread_cond);
   pthread_mutex_unlock(&exit_mutex);
   pthread_exit(NULL);
 }
@@ -1478,11 +2867,16 @@ void thread_quit(void)
   struct server_socket *ptr;
   tftpd_thread *tt;
   tt = pthread_getspecific(thread_key);
+  thread_cleanup(tt);
   ptr = tt->ssocket;
   d_printf(3, ("[%d]: server_socket = %p\n",pthread_self(), ptr));
   pthread_mutex_lock(&(ptr->exit_mutex));
+  /* there is one slot, wait until server_main() has taken the previous. */
+  while (ptr->exited_tid != PTHREAD_T_NULL) {
+    pthread_cond_wait(&(ptr->thread_cond), &(ptr->exit_mutex));
+  }
   ptr->exited_tid = pthread_self();
-  pthread_cond_signal(&(ptr->thread_cond));
+  pthread_cond_broadcast(&(ptr->thread_cond));
   pthread_mutex_unlock(&(ptr->exit_mutex));
   pthread_exit(NULL);
 }
@@ -1499,6 +2893,10 @@ void send_error(int error)
   tphdr = (struct tftphdr*)ptr->buf;
   tphdr->th_opcode = htons((u_short)ERROR);
   tphdr->th_code = htons((u_short)error);
+  ptr->error = error;
+  if (error >= EUNDEF && error <= ENOUSER) {
+    metrics_count(MC_ERROR + error, 1);
+  }
 
   for (errptr = errmsgs; errptr->e_code != -1; errptr++) {
     if (errptr->e_code == error)  
@@ -1514,7 +2912,8 @@ void send_error(int error)
   tphdr->th_msg[len] = '\0';
   len += 5; /* for opcode(2bytes) + errorcode(2bytes) + null(1byte) */
     
-  if ((send_len = send(ptr->peer, ptr->buf, len, 0)) != len) {
+  if ((send_len = fault_send(&ptr->fault, ptr->peer,
+                             ptr->buf, len)) != len) {
     fprintf(stderr, "error when sending error packet.\n");
   }
 
@@ -1567,3 +2966,139 @@ void quit(int sig)
 #endif
   exit(0);
 }
+
+/*
+ * Look up a request option (RFC 2347) by name.
+ * opt points the first option name, end is the end of the packet.
+ * Return: the value string, or NULL when the client didn't send it.
+ */
+char *option_value(char *opt, char *end, const char *name)
+{
+  char *value, *next;
+
+  while (opt < end) {
+    value = memchr(opt, '\0', end - opt);
+    if (value == NULL || ++value >= end) {
+      break;
+    }
+    next = memchr(value, '\0', end - value);
+    if (next == NULL) {
+      break;
+    }
+    if (strcasecmp(opt, name) == 0) {
+      return value;
+    }
+    opt = next + 1;
+  }
+  return NULL;
+}
+
+/*
+ * The size of the file a request of from is for, to order the admission
+ * queue: from the tree for an RRQ, under the name the rewrite rules give
+ * it, from the tsize option for a WRQ.
+ * Return: the size, or -1 when it is not known.
+ */
+off_t request_size(const char *buf, size_t len, const struct sockaddr *from)
+{
+  char name[NAME_SIZ], *cp, *end, *last;
+  f_node *dir, *leaf;
+  off_t size;
+
+  if (len < 4) {
+    return -1;
+  }
+  end = (char *)buf + len;
+  if ((cp = memchr(buf + 2, '\0', len - 2)) == NULL) {
+    return -1;
+  }
+  switch (ntohs(((struct tftphdr *)buf)->th_opcode)) {
+  case WRQ:
+    if ((cp = memchr(cp + 1, '\0', end - cp - 1)) == NULL ||
+        (cp = option_value(cp + 1, end, TFTP_OPTION_TSIZE)) == NULL) {
+      return -1;
+    }
+    size = strtoll(cp, NULL, 10);
+    return size >= 0 ? size : -1;
+  case RRQ:
+    break;
+  default:
+    return -1;
+  }
+
+  if (!rewrite_enabled() || rewrite_peek(buf + 2, from, name, NAME_SIZ) == 0) {
+    strlcpy(name, buf + 2, NAME_SIZ);
+  }
+  size = -1;
+  pthread_mutex_lock(&node_mutex);
+  dir = tree_root(NULL, NULL);
+  leaf = NULL;
+  for (cp = strtok_r(name, "/", &last); cp != NULL;
+       cp = strtok_r(NULL, "/", &last)) {
+    if (strcmp(cp, ".") == 0) {
+      continue;
+    }
+    if ((leaf = get_leaf(dir, cp)) == NULL) {
+      break;
+    }
+    dir = leaf->child;
+  }
+  if (leaf != NULL && leaf->is_dir == 0) {
+    size = leaf->size;
+  }
+  pthread_mutex_unlock(&node_mutex);
+  return size;
+}
+
+/*
+ * recvfrom() for requests, which also tells how long (usec) the packet
+ * waited in the socket buffer, using its SO_TIMESTAMP when available.
+ */
+ssize_t recv_request(int s, char *buf, size_t len,
+                     struct sockaddr *from, socklen_t *fromlen,
+                     uint64_t *wait)
+{
+  struct msghdr msg;
+  struct iovec iov;
+  ssize_t read;
+#ifdef SO_TIMESTAMP
+  struct cmsghdr *cmsg;
+  struct timeval now, tv;
+  char control[CMSG_SPACE(sizeof(struct timeval))];
+#endif
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = buf;
+  iov.iov_len = len;
+  msg.msg_name = from;
+  msg.msg_namelen = *fromlen;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+#ifdef SO_TIMESTAMP
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+#endif
+
+  *wait = 0;
+  read = recvmsg(s, &msg, 0);
+  if (read < 0) {
+    return read;
+  }
+  *fromlen = msg.msg_namelen;
+
+#ifdef SO_TIMESTAMP
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMP) {
+      memcpy(&tv, CMSG_DATA(cmsg), sizeof(tv));
+      gettimeofday(&now, NULL);
+      if (timercmp(&now, &tv, >)) {
+        *wait = (uint64_t)(now.tv_sec - tv.tv_sec) * 1000000 +
+          now.tv_usec - tv.tv_usec;
+      }
+      break;
+    }
+  }
+#endif
+  return read;
+}
@@ -48,6 +48,7 @@ extern "C" {
 #include <strings.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
@@ -57,20 +58,26 @@ extern "C" {
 #include <ctype.h>
 #include <pthread.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <netdb.h>
 #include <sys/mman.h>
 #include <poll.h>
 #include <errno.h>
 
+#include "logring.h"
+
 #define _DEBUG
 
 #ifdef _DEBUG
 int debug_level = 0;
 #define d_setlevel(level) {debug_level = level;}
-#define d_printf(level,x) {if (debug_level >= level) printf x;}
+#define d_printf(level,x) {if (debug_level >= level) log_printf x;}
+#define d_event(level,ev,a0,a1) \
+  {if (debug_level >= level) log_event(ev, a0, a1);}
 #else
 #define d_setlevel(level)
 #define d_printf(level,x) 
+#define d_event(level,ev,a0,a1)
 #endif
 
 #ifdef __cplusplus
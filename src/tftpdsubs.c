@@ -56,6 +56,7 @@ f_node *new_node(char *fname, int dir, int wr)
 
     ptr->is_dir = dir;
     ptr->is_wr = wr;
+    ptr->size = -1;
     ptr->next = NULL;
     ptr->child = NULL;
 
@@ -64,11 +65,10 @@ f_node *new_node(char *fname, int dir, int wr)
 
 f_node *get_node(char *path, char *name, int dir, int wr)
 {
-    f_node *r_ptr, *c_ptr;
+    f_node *head, *c_ptr, **tail;
     struct stat st;
     struct dirent *d_ent;
     int ch_dir, ch_wr;
-    int first;
     DIR *dp;
     char fullpath[NAME_SIZ*10], fullname[NAME_SIZ*10];
 
@@ -77,80 +77,76 @@ f_node *get_node(char *path, char *name, int dir, int wr)
     {
 	return new_node(name, dir, wr);
     }
-    else 
+
+    /*
+     * returns the entries of the directory, an entry of a sub directory
+     * holds its own entries as the child.
+     */
+    snprintf(fullpath, NAME_SIZ, "%s/%s", path, name);
+
+    dp = opendir(fullpath);
+    if (dp == NULL) 
     {
-	snprintf(fullpath, NAME_SIZ, "%s/%s\0", path, name);
+	fprintf(stderr, "opendir(%s) is failed.\n", fullpath);
+	perror("");
+	return NULL;
+    } 
+
+    head = NULL;
+    tail = &head;
+    while ((d_ent = readdir(dp)) != NULL) 
+    {
+	if (d_ent->d_name[0] == '.')
+	{
+	    continue;
+	}
 
-	dp = opendir(fullpath);
-	first = 1;
+	snprintf(fullname, NAME_SIZ, "%s/%s", fullpath, d_ent->d_name);
+	memset(&st, 0, sizeof(st));
+	lstat(fullname, &st);
 
-	if (dp == NULL) 
+	if (S_ISDIR(st.st_mode)) 
 	{
-	    fprintf(stderr, "opendir(%s) is failed.\n", fullpath);
-	    perror("");
-	    return NULL;
-	    /*	    return new_node(name, -1, wr); */
-	} 
+	    ch_dir = 1;
+	    if (((st.st_mode & S_IWOTH) > 0) &&
+		((st.st_mode & S_IXOTH) > 0))
+	    {
+		ch_wr = 1;
+	    }
+	    else
+		ch_wr = 0;
+	}
+	else 
+	{
+	    ch_dir = 0;
+	    if (st.st_mode & S_IWOTH)
+		ch_wr = 1;
+	    else
+		ch_wr = 0;
+	}
 
-	while ((d_ent = readdir(dp)) != NULL) 
+	if (ch_dir && !(st.st_mode & S_IXOTH))
+	{
+	    /* the directory can't be entered. */
+	    c_ptr = new_node(d_ent->d_name, -1, ch_wr);
+	}
+	else if (ch_dir)
+	{
+	    c_ptr = new_node(d_ent->d_name, 1, ch_wr);
+	    c_ptr->child = get_node(fullpath, d_ent->d_name, 1, ch_wr);
+	}
+	else
 	{
+	    c_ptr = new_node(d_ent->d_name, 0, ch_wr);
+	    c_ptr->size = S_ISREG(st.st_mode) ? st.st_size : -1;
+	}
 
-	    if (d_ent->d_name[0] != '.')
-	    {
-		snprintf(fullname, NAME_SIZ, "%s/%s", fullpath, d_ent->d_name);
-		memset(&st, 0, sizeof(st));
-		lstat(fullname, &st);
-	      
-/*		if (st.st_mode & S_IROTH)   */
-		{
-					
-		    if (S_ISDIR(st.st_mode)) 
-		    {
-			ch_dir = 1;
-			if (((st.st_mode & S_IWOTH) > 0) &&
-			    ((st.st_mode & S_IXOTH) > 0))
-			{
-			    ch_wr = 1;
-			}
-			else
-			    ch_wr = 0;
-		    }
-		    else 
-		    {
-			ch_dir = 0;
-			if (st.st_mode & S_IWOTH)
-			    ch_wr = 1;
-			else
-			    ch_wr = 0;
-		    }
-
-		    if (ch_dir && !(st.st_mode & S_IXOTH)){
-			closedir(dp);
-			return  new_node(name, -1, wr); 
-		    }
-	
-		    if (first) 
-		    {
-			r_ptr = new_node(name, 1, wr);
-			c_ptr = get_node(fullpath, d_ent->d_name, ch_dir, ch_wr);
-			r_ptr->child = c_ptr;
-			first = 0;
-		    }
-		    else 
-		    {
-			c_ptr->next = get_node(fullpath, d_ent->d_name, ch_dir, ch_wr);
-			c_ptr = c_ptr->next;
-		    }
-
-		} /* if (st.st_mode & S_IROTH)...  */
-	    }	    /* if (strcmp(d_ent->d_name,".")  */
-	} /* while().... */
-    } /* if (dir == 0) else...... */
+	*tail = c_ptr;
+	tail = &c_ptr->next;
+    } /* while().... */
 
     closedir(dp);
-    c_ptr = r_ptr->child;
-    free(r_ptr);
-    return c_ptr;
+    return head;
 }
 
 /* for debug. */
@@ -186,15 +182,19 @@ f_node *get_leaf(f_node *current, char *str)
 
 void free_node(f_node *current)
 {
-    if(current->child != NULL)
-    {
-	free_node(current->child);
-    }
-    if(current->next != NULL)
+    f_node *next;
+
+    /* siblings in a loop, a large directory would overflow the stack. */
+    while (current != NULL)
     {
-	free_node(current->next);
+	if(current->child != NULL)
+	{
+	    free_node(current->child);
+	}
+	next = current->next;
+	free(current);
+	current = next;
     }
-    free(current);
     return ;
 }
 
@@ -64,6 +64,7 @@ typedef struct f_node
 	       */
   int is_wr; /* If writable, the value is 1 */
   int is_rd; /* */
+  off_t size; /* of a file, -1 for a directory */
   struct f_node *next;
   struct f_node *child;
 } f_node;
@@ -0,0 +1,145 @@
+/*
+   trace.c
+   $Id$
+
+   This file is part of t-tftpd.
+
+   Copyright 2002,2007 Tomofumi Hayashi <s1061123@gmail.com>.
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+   3. All advertising materials mentioning features or use of this software
+      must display the following acknowledgement:
+
+        This product includes software developed by
+        Tomofumi Hayashi <s1061123@gmail.com> and its contributors.
+
+   4. Neither the name of authors nor the names of its contributors may be used
+      to endorse or promote products derived from this software without
+      specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND ANY
+   EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "trace.h"
+
+static int trace_fd = -1;
+static uint64_t trace_pid;
+
+/*
+ * Return: 0 on success, -1 on error.
+ */
+int trace_open(const char *path)
+{
+  struct trace_header hdr;
+  struct stat st;
+
+  trace_pid = getpid();
+  trace_fd = open(path, O_WRONLY|O_CREAT|O_APPEND, 0644);
+  if (trace_fd == -1) {
+    perror("trace open");
+    return -1;
+  }
+
+  if (fstat(trace_fd, &st) == 0 && st.st_size == 0) {
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.version = TRACE_VERSION;
+    hdr.record_size = sizeof(struct trace_record);
+    if (write(trace_fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+      perror("trace write");
+      close(trace_fd);
+      trace_fd = -1;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int trace_enabled(void)
+{
+  return trace_fd != -1;
+}
+
+/* a worker of -P numbers its sessions apart from the other workers. */
+void trace_forked(void)
+{
+  trace_pid = getpid();
+}
+
+void trace_event(struct trace_buf *tb, uint64_t session,
+                 enum trace_event event, uint64_t arg, uint16_t flags)
+{
+  struct trace_record *rp;
+  struct timespec ts;
+
+  if (trace_fd == -1) {
+    return;
+  }
+  if (tb->count == TRACE_BUF_RECORDS) {
+    trace_flush(tb);
+  }
+
+  rp = &tb->rec[tb->count++];
+  /* runs appended to one file must not mix their sessions. */
+  rp->session = trace_pid << 32 | (session & 0xffffffff);
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  rp->time = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#ifdef CLOCK_THREAD_CPUTIME_ID
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  rp->cpu = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+  rp->cpu = 0;
+#endif
+  rp->arg = arg;
+  rp->event = event;
+  rp->flags = flags;
+  rp->reserved = 0;
+}
+
+/*
+ * One write() per buffer, O_APPEND keeps the records of concurrent
+ * sessions from overwriting each other.
+ */
+void trace_flush(struct trace_buf *tb)
+{
+  size_t len;
+
+  if (trace_fd == -1 || tb->count == 0) {
+    tb->count = 0;
+    return;
+  }
+  len = sizeof(struct trace_record) * tb->count;
+  if (write(trace_fd, tb->rec, len) != (ssize_t)len) {
+    perror("trace write");
+  }
+  tb->count = 0;
+}
@@ -0,0 +1,105 @@
+/*
+   trace.h
+   $Id$
+
+   This file is part of t-tftpd.
+
+   Copyright 2002,2007 Tomofumi Hayashi <s1061123@gmail.com>.
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+   3. All advertising materials mentioning features or use of this software
+      must display the following acknowledgement:
+
+        This product includes software developed by
+        Tomofumi Hayashi <s1061123@gmail.com> and its contributors.
+
+   4. Neither the name of authors nor the names of its contributors may be used
+      to endorse or promote products derived from this software without
+      specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND ANY
+   EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdint.h>
+
+/*
+ * Per-session transfer trace.
+ * The file starts with a trace_header and is followed by fixed size
+ * trace_records in host byte order.  Records of one session are written
+ * together, t-tftpd-trace turns them into per-phase breakdowns.
+ */
+#define TRACE_MAGIC "TTTR"
+#define TRACE_VERSION 1
+#define TRACE_BUF_RECORDS 64
+
+enum trace_event {
+  TE_RECEIVED,     /* request read by a thread, arg: queue wait (usec) */
+  TE_PARSED,       /* request parsed */
+  TE_OPENED,       /* file_open() succeeded */
+  TE_FIRST_DATA,   /* first DATA packet sent */
+  TE_RETRANSMIT,   /* DATA or ACK sent again, arg: block number */
+  TE_DONE,         /* session finished, arg: bytes transferred */
+  TE_NUM
+};
+
+/* flags of TE_DONE */
+#define TF_WRQ     0x0001
+#define TF_ABORTED 0x0002
+
+struct trace_header {
+  char magic[4];
+  uint16_t version;
+  uint16_t record_size;
+};
+
+struct trace_record {
+  uint64_t session;  /* server pid << 32 | session number */
+  uint64_t time;     /* CLOCK_MONOTONIC, nsec */
+  uint64_t cpu;      /* CPU time of the session thread, nsec */
+  uint64_t arg;
+  uint16_t event;
+  uint16_t flags;
+  uint32_t reserved;
+};
+
+struct trace_buf {
+  int count;
+  struct trace_record rec[TRACE_BUF_RECORDS];
+};
+
+int trace_open(const char *path);
+int trace_enabled(void);
+void trace_forked(void);
+void trace_event(struct trace_buf *tb, uint64_t session,
+                 enum trace_event event, uint64_t arg, uint16_t flags);
+void trace_flush(struct trace_buf *tb);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* !_TRACE_H_ */
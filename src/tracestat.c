@@ -0,0 +1,302 @@
+/*
+   tracestat.c
+   $Id$
+
+   This file is part of t-tftpd.
+
+   Copyright 2002,2007 Tomofumi Hayashi <s1061123@gmail.com>.
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+   3. All advertising materials mentioning features or use of this software
+      must display the following acknowledgement:
+
+        This product includes software developed by
+        Tomofumi Hayashi <s1061123@gmail.com> and its contributors.
+
+   4. Neither the name of authors nor the names of its contributors may be used
+      to endorse or promote products derived from this software without
+      specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND ANY
+   EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "trace.h"
+
+/*
+ * t-tftpd-trace: per-phase breakdown of a trace written by t-tftpd -T.
+ */
+
+enum phase {
+  PH_QUEUE,       /* request waited in the socket buffer */
+  PH_PARSE,       /* received -> parsed */
+  PH_OPEN,        /* parsed -> file opened */
+  PH_FIRST_DATA,  /* file opened -> first DATA sent (RRQ) */
+  PH_TRANSFER,    /* file opened -> done */
+  PH_TOTAL,       /* received -> done */
+  PH_CPU,         /* CPU time of the session */
+  PH_NUM
+};
+
+static const char *phase_names[PH_NUM] = {
+  "queue", "parse", "open", "first-data", "transfer", "total", "cpu"
+};
+
+struct phase_stat {
+  uint64_t *val;
+  size_t num, max;
+};
+
+static struct phase_stat phases[PH_NUM];
+static int show_sessions = 0;
+
+void print_usage(const char *name)
+{
+  fprintf(stderr,
+	  "usage: %s [-s] <trace file>\n"
+	  "  -s \t print every session\n", name);
+}
+
+int record_cmp(const void *a, const void *b)
+{
+  const struct trace_record *ra = a, *rb = b;
+
+  if (ra->session != rb->session) {
+    return ra->session < rb->session ? -1 : 1;
+  }
+  if (ra->time != rb->time) {
+    return ra->time < rb->time ? -1 : 1;
+  }
+  return 0;
+}
+
+int value_cmp(const void *a, const void *b)
+{
+  uint64_t va = *(const uint64_t *)a, vb = *(const uint64_t *)b;
+
+  return va < vb ? -1 : va > vb;
+}
+
+void phase_add(enum phase ph, uint64_t usec)
+{
+  struct phase_stat *ps = &phases[ph];
+
+  if (ps->num == ps->max) {
+    ps->max = ps->max ? ps->max * 2 : 1024;
+    ps->val = realloc(ps->val, ps->max * sizeof(uint64_t));
+    if (ps->val == NULL) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  ps->val[ps->num++] = usec;
+}
+
+/*
+ * Return: records read from fp, or NULL on a broken file.
+ */
+struct trace_record *read_trace(FILE *fp, size_t *num)
+{
+  struct trace_header hdr;
+  struct trace_record *rec = NULL;
+  size_t max = 0, n;
+
+  if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+      memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0) {
+    fprintf(stderr, "not a t-tftpd trace file.\n");
+    return NULL;
+  }
+  if (hdr.version != TRACE_VERSION ||
+      hdr.record_size != sizeof(struct trace_record)) {
+    fprintf(stderr, "unsupported trace version %d (record %d bytes).\n",
+	    hdr.version, hdr.record_size);
+    return NULL;
+  }
+
+  *num = 0;
+  for (;;) {
+    if (*num == max) {
+      max = max ? max * 2 : 4096;
+      rec = realloc(rec, max * sizeof(struct trace_record));
+      if (rec == NULL) {
+	perror("realloc");
+	return NULL;
+      }
+    }
+    n = fread(rec + *num, sizeof(struct trace_record), max - *num, fp);
+    *num += n;
+    if (n == 0) {
+      break;
+    }
+  }
+  return rec;
+}
+
+/*
+ * Fold the records of one session, rec[0..num-1], into the phases.
+ */
+void session_fold(struct trace_record *rec, size_t num,
+		  int *wrq, int *aborted, int *resent)
+{
+  struct trace_record *ev[TE_NUM];
+  size_t cnt;
+
+  memset(ev, 0, sizeof(ev));
+  *wrq = *aborted = *resent = 0;
+  for (cnt = 0; cnt < num; cnt++) {
+    if (rec[cnt].event >= TE_NUM) {
+      continue;
+    }
+    if (rec[cnt].event == TE_RETRANSMIT) {
+      (*resent)++;
+    }
+    else if (ev[rec[cnt].event] == NULL) {
+      ev[rec[cnt].event] = &rec[cnt];
+    }
+  }
+
+#define SPAN(from, to) ((ev[to]->time - ev[from]->time) / 1000)
+  if (ev[TE_PARSED] != NULL && (ev[TE_PARSED]->flags & TF_WRQ)) {
+    *wrq = 1;
+  }
+  if (ev[TE_DONE] == NULL || (ev[TE_DONE]->flags & TF_ABORTED)) {
+    *aborted = 1;
+  }
+  if (ev[TE_RECEIVED] != NULL) {
+    phase_add(PH_QUEUE, ev[TE_RECEIVED]->arg);
+    if (ev[TE_PARSED] != NULL) {
+      phase_add(PH_PARSE, SPAN(TE_RECEIVED, TE_PARSED));
+    }
+    if (ev[TE_DONE] != NULL) {
+      phase_add(PH_TOTAL, SPAN(TE_RECEIVED, TE_DONE));
+      phase_add(PH_CPU, (ev[TE_DONE]->cpu - ev[TE_RECEIVED]->cpu) / 1000);
+    }
+  }
+  if (ev[TE_PARSED] != NULL && ev[TE_OPENED] != NULL) {
+    phase_add(PH_OPEN, SPAN(TE_PARSED, TE_OPENED));
+  }
+  if (ev[TE_OPENED] != NULL) {
+    if (ev[TE_FIRST_DATA] != NULL) {
+      phase_add(PH_FIRST_DATA, SPAN(TE_OPENED, TE_FIRST_DATA));
+    }
+    if (ev[TE_DONE] != NULL) {
+      phase_add(PH_TRANSFER, SPAN(TE_OPENED, TE_DONE));
+    }
+  }
+
+  if (show_sessions) {
+    printf("%" PRIu64 ":%" PRIu64 " %s %s bytes=%" PRIu64
+	   " resent=%d total=%" PRIu64 "us\n",
+	   rec[0].session >> 32, rec[0].session & 0xffffffff,
+	   *wrq ? "WRQ" : "RRQ", *aborted ? "aborted" : "done",
+	   ev[TE_DONE] != NULL ? ev[TE_DONE]->arg : 0, *resent,
+	   ev[TE_RECEIVED] != NULL && ev[TE_DONE] != NULL ?
+	   SPAN(TE_RECEIVED, TE_DONE) : 0);
+  }
+#undef SPAN
+}
+
+void print_phases(void)
+{
+  struct phase_stat *ps;
+  uint64_t sum;
+  size_t cnt;
+  int ph;
+
+  printf("%-11s %8s %10s %10s %10s %10s %10s\n",
+	 "phase(us)", "count", "mean", "p50", "p90", "p99", "max");
+  for (ph = 0; ph < PH_NUM; ph++) {
+    ps = &phases[ph];
+    if (ps->num == 0) {
+      printf("%-11s %8d\n", phase_names[ph], 0);
+      continue;
+    }
+    qsort(ps->val, ps->num, sizeof(uint64_t), value_cmp);
+    for (sum = 0, cnt = 0; cnt < ps->num; cnt++) {
+      sum += ps->val[cnt];
+    }
+    printf("%-11s %8zu %10" PRIu64 " %10" PRIu64 " %10" PRIu64
+	   " %10" PRIu64 " %10" PRIu64 "\n",
+	   phase_names[ph], ps->num, sum / ps->num,
+	   ps->val[ps->num * 50 / 100], ps->val[ps->num * 90 / 100],
+	   ps->val[ps->num * 99 / 100], ps->val[ps->num - 1]);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  FILE *fp;
+  struct trace_record *rec;
+  size_t num, cnt, first;
+  int ch, wrq, aborted, resent;
+  int sessions = 0, wrqs = 0, aborts = 0, resents = 0;
+
+  while ((ch = getopt(argc, argv, "hs")) != EOF) {
+    switch (ch) {
+    case 's':
+      show_sessions = 1;
+      break;
+    default:
+      print_usage(argv[0]);
+      exit(1);
+    }
+  }
+  if (optind + 1 != argc) {
+    print_usage(argv[0]);
+    exit(1);
+  }
+
+  if ((fp = fopen(argv[optind], "r")) == NULL) {
+    perror(argv[optind]);
+    exit(1);
+  }
+  rec = read_trace(fp, &num);
+  fclose(fp);
+  if (rec == NULL) {
+    exit(1);
+  }
+
+  qsort(rec, num, sizeof(struct trace_record), record_cmp);
+  for (first = 0, cnt = 1; cnt <= num; cnt++) {
+    if (cnt == num || rec[cnt].session != rec[first].session) {
+      session_fold(rec + first, cnt - first, &wrq, &aborted, &resent);
+      sessions++;
+      wrqs += wrq;
+      aborts += aborted;
+      resents += resent;
+      first = cnt;
+    }
+  }
+
+  printf("sessions: %d (RRQ %d, WRQ %d, aborted %d), retransmits: %d\n\n",
+	 sessions, sessions - wrqs, wrqs, aborts, resents);
+  print_phases();
+  free(rec);
+  return 0;
+}
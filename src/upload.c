@@ -0,0 +1,433 @@
+/*
+   upload.c
+   $Id$
+
+   This file is part of t-tftpd.
+
+   Copyright 2002,2007 Tomofumi Hayashi <s1061123@gmail.com>.
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+   3. All advertising materials mentioning features or use of this software
+      must display the following acknowledgement:
+
+        This product includes software developed by
+        Tomofumi Hayashi <s1061123@gmail.com> and its contributors.
+
+   4. Neither the name of authors nor the names of its contributors may be used
+      to endorse or promote products derived from this software without
+      specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND ANY
+   EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for fallocate() */
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/statvfs.h>
+
+#include "upload.h"
+
+struct upload_writer {
+  int fd;
+  char *buf;
+  size_t chunk;        /* buffer size, multiple of UPLOAD_CHUNK_ALIGN */
+  size_t fill;         /* bytes waiting in buf */
+  off_t written;       /* bytes already handed to write() */
+  off_t prealloc;      /* bytes reserved by fallocate() */
+  enum uw_sync sync;
+  size_t sync_interval;
+  off_t synced;        /* file offset at the last fdatasync() */
+  int err;             /* first write error, sticky */
+  unsigned long writes;
+  /* write-behind ring, NULL when the caller writes by itself */
+  char *ring;
+  size_t ring_size;
+  size_t ring_head;    /* next byte for the writer thread */
+  size_t ring_fill;
+  int ring_err;        /* err as seen by the receiving side */
+  int closing;         /* no more data, drain and exit */
+  int discard;         /* drop what is left in the ring */
+  unsigned long stalls; /* uw_write() found the ring full */
+  pthread_mutex_t mutex;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  pthread_t tid;
+};
+
+static pthread_mutex_t uw_total_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long uw_total_writes = 0;
+static unsigned long long uw_total_bytes = 0;
+static unsigned long uw_total_stalls = 0;
+
+static int uw_flush(upload_writer *uw);
+static int uw_buffer(upload_writer *uw, const char *data, size_t len);
+static void *uw_thread(void *param);
+static void uw_stop(upload_writer *uw, int discard);
+
+upload_writer *uw_create(int fd, size_t chunk, off_t expect_size,
+                         enum uw_sync sync, size_t sync_interval,
+                         size_t ring_size, off_t prealloc_max)
+{
+  upload_writer *uw;
+  void *mem;
+#ifdef FALLOC_FL_KEEP_SIZE
+  struct statvfs vfs;
+#endif
+
+  uw = (upload_writer *)malloc(sizeof(upload_writer));
+  if (uw == NULL) {
+    return NULL;
+  }
+  memset(uw, 0, sizeof(upload_writer));
+
+  /* round up, so that every flush starts on an aligned file offset. */
+  chunk = (chunk + UPLOAD_CHUNK_ALIGN - 1) & ~(size_t)(UPLOAD_CHUNK_ALIGN - 1);
+  if (chunk == 0) {
+    chunk = UPLOAD_CHUNK_ALIGN;
+  }
+  if (chunk > UPLOAD_CHUNK_MAX) {
+    chunk = UPLOAD_CHUNK_MAX;
+  }
+  if (posix_memalign(&mem, UPLOAD_CHUNK_ALIGN, chunk) != 0) {
+    free(uw);
+    return NULL;
+  }
+
+  uw->fd = fd;
+  uw->buf = (char *)mem;
+  uw->chunk = chunk;
+  uw->sync = sync;
+  uw->sync_interval = sync_interval;
+
+#ifdef FALLOC_FL_KEEP_SIZE
+  /* 
+   * Reserve the whole file in one extent, the size itself grows with
+   * the data, so an aborted upload does not look complete.
+   * expect_size is what the client says: above prealloc_max or half of
+   * the free space, nothing is reserved and the file grows as it comes.
+   */
+  if (expect_size > 0 && expect_size <= prealloc_max &&
+      fstatvfs(fd, &vfs) == 0 &&
+      expect_size <= (off_t)(vfs.f_bavail / 2) * (off_t)vfs.f_frsize &&
+      fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, expect_size) == 0) {
+    uw->prealloc = expect_size;
+  }
+#endif
+
+  if (ring_size > 0) {
+    uw->ring = malloc(ring_size);
+    if (uw->ring != NULL) {
+      uw->ring_size = ring_size;
+      pthread_mutex_init(&uw->mutex, NULL);
+      pthread_cond_init(&uw->not_empty, NULL);
+      pthread_cond_init(&uw->not_full, NULL);
+      if (pthread_create(&uw->tid, NULL, uw_thread, uw) != 0) {
+        pthread_mutex_destroy(&uw->mutex);
+        pthread_cond_destroy(&uw->not_empty);
+        pthread_cond_destroy(&uw->not_full);
+        free(uw->ring);
+        uw->ring = NULL;
+      }
+    }
+    /* without the ring, the caller simply writes by itself. */
+  }
+
+  return uw;
+}
+
+static int uw_flush(upload_writer *uw)
+{
+  size_t done;
+  ssize_t ret;
+
+  for (done = 0; done < uw->fill; done += ret) {
+    ret = write(uw->fd, uw->buf + done, uw->fill - done);
+    uw->writes++;
+    if (ret == -1) {
+      if (errno == EINTR) {
+        ret = 0;
+        continue;
+      }
+      uw->err = errno;
+      return -1;
+    }
+  }
+  uw->written += uw->fill;
+  uw->fill = 0;
+
+  if (uw->sync == UW_SYNC_PERIODIC &&
+      uw->written - uw->synced >= (off_t)uw->sync_interval) {
+    if (fdatasync(uw->fd) == -1) {
+      uw->err = errno;
+      return -1;
+    }
+    uw->synced = uw->written;
+  }
+  return 0;
+}
+
+/*
+ * Copy data to the chunk buffer, flush it when it's full.
+ */
+static int uw_buffer(upload_writer *uw, const char *data, size_t len)
+{
+  size_t siz;
+
+  if (uw->err != 0) {
+    errno = uw->err;
+    return -1;
+  }
+
+  while (len > 0) {
+    siz = uw->chunk - uw->fill;
+    if (siz > len) {
+      siz = len;
+    }
+    memcpy(uw->buf + uw->fill, data, siz);
+    uw->fill += siz;
+    data += siz;
+    len -= siz;
+
+    if (uw->fill == uw->chunk && uw_flush(uw) == -1) {
+      errno = uw->err;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Writer thread: move the ring contents to the chunk buffer (and disk).
+ * Only this thread touches the chunk buffer while the ring is running.
+ */
+static void *uw_thread(void *param)
+{
+  upload_writer *uw;
+  char *data;
+  size_t len;
+  int ret;
+
+  uw = (upload_writer *)param;
+
+  pthread_mutex_lock(&uw->mutex);
+  for (;;) {
+    while (uw->ring_fill == 0 && !uw->closing) {
+      pthread_cond_wait(&uw->not_empty, &uw->mutex);
+    }
+    if (uw->ring_fill == 0 || uw->discard) {
+      break;
+    }
+
+    data = uw->ring + uw->ring_head;
+    len = uw->ring_size - uw->ring_head;
+    if (len > uw->ring_fill) {
+      len = uw->ring_fill;
+    }
+    pthread_mutex_unlock(&uw->mutex);
+
+    ret = 0;
+    if (uw->err == 0) {
+      ret = uw_buffer(uw, data, len);
+    }
+
+    pthread_mutex_lock(&uw->mutex);
+    if (ret == -1) {
+      /* keep draining, so the receiving side never blocks for nothing. */
+      uw->ring_err = uw->err;
+    }
+    uw->ring_head = (uw->ring_head + len) % uw->ring_size;
+    uw->ring_fill -= len;
+    pthread_cond_signal(&uw->not_full);
+  }
+  pthread_mutex_unlock(&uw->mutex);
+
+  return NULL;
+}
+
+/*
+ * Return: 0 on success, -1 (with errno) if the data can't be written.
+ * With the ring, this blocks only while the ring is full.
+ */
+int uw_write(upload_writer *uw, const char *data, size_t len)
+{
+  size_t tail, siz;
+  int stalled;
+
+  if (uw->ring == NULL) {
+    return uw_buffer(uw, data, len);
+  }
+
+  stalled = 0;
+  pthread_mutex_lock(&uw->mutex);
+  while (len > 0) {
+    if (uw->ring_err != 0) {
+      pthread_mutex_unlock(&uw->mutex);
+      errno = uw->ring_err;
+      return -1;
+    }
+    if (uw->ring_fill == uw->ring_size) {
+      if (!stalled) {
+        uw->stalls++;
+        stalled = 1;
+      }
+      pthread_cond_wait(&uw->not_full, &uw->mutex);
+      continue;
+    }
+
+    /* the free area is not touched by the writer thread. */
+    tail = (uw->ring_head + uw->ring_fill) % uw->ring_size;
+    siz = uw->ring_size - uw->ring_fill;
+    if (siz > uw->ring_size - tail) {
+      siz = uw->ring_size - tail;
+    }
+    if (siz > len) {
+      siz = len;
+    }
+    pthread_mutex_unlock(&uw->mutex);
+    memcpy(uw->ring + tail, data, siz);
+    data += siz;
+    len -= siz;
+    pthread_mutex_lock(&uw->mutex);
+
+    uw->ring_fill += siz;
+    pthread_cond_signal(&uw->not_empty);
+  }
+  pthread_mutex_unlock(&uw->mutex);
+
+  return 0;
+}
+
+/*
+ * Wait for the writer thread to drain (or drop) the ring and exit.
+ */
+static void uw_stop(upload_writer *uw, int discard)
+{
+  if (uw->ring == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&uw->mutex);
+  uw->closing = 1;
+  uw->discard = discard;
+  pthread_cond_signal(&uw->not_empty);
+  pthread_mutex_unlock(&uw->mutex);
+  pthread_join(uw->tid, NULL);
+
+  pthread_mutex_destroy(&uw->mutex);
+  pthread_cond_destroy(&uw->not_empty);
+  pthread_cond_destroy(&uw->not_full);
+  free(uw->ring);
+  uw->ring = NULL;
+}
+
+/*
+ * Flush the tail, drop unused preallocation and apply the sync policy.
+ * Return: 0 on success, -1 (with errno) on error.
+ */
+int uw_finish(upload_writer *uw)
+{
+  uw_stop(uw, 0);
+  if (uw->err == 0 && uw->fill > 0) {
+    uw_flush(uw);
+  }
+  if (uw->prealloc > uw->written) {
+    ftruncate(uw->fd, uw->written);
+    uw->prealloc = 0;
+  }
+  if (uw->err == 0 && uw->sync != UW_SYNC_NONE &&
+      uw->synced != uw->written) {
+    if (fdatasync(uw->fd) == -1) {
+      uw->err = errno;
+    }
+    else {
+      uw->synced = uw->written;
+    }
+  }
+
+  if (uw->err != 0) {
+    errno = uw->err;
+    return -1;
+  }
+  return 0;
+}
+
+void uw_session_stat(upload_writer *uw,
+                     unsigned long *writes, unsigned long long *bytes)
+{
+  *writes = uw->writes;
+  *bytes = uw->written;
+}
+
+void uw_total_stat(unsigned long *writes, unsigned long long *bytes)
+{
+  pthread_mutex_lock(&uw_total_mutex);
+  *writes = uw_total_writes;
+  *bytes = uw_total_bytes;
+  pthread_mutex_unlock(&uw_total_mutex);
+}
+
+/*
+ * How often the receiving side had to wait for a full ring.
+ */
+void uw_session_stall(upload_writer *uw, unsigned long *stalls)
+{
+  *stalls = uw->stalls;
+}
+
+void uw_total_stall(unsigned long *stalls)
+{
+  pthread_mutex_lock(&uw_total_mutex);
+  *stalls = uw_total_stalls;
+  pthread_mutex_unlock(&uw_total_mutex);
+}
+
+/*
+ * Buffered data that was not uw_finish()ed is discarded.
+ */
+void uw_destroy(upload_writer *uw)
+{
+  if (uw == NULL) {
+    return;
+  }
+  uw_stop(uw, 1);
+  if (uw->prealloc > uw->written) {
+    ftruncate(uw->fd, uw->written);
+  }
+
+  pthread_mutex_lock(&uw_total_mutex);
+  uw_total_writes += uw->writes;
+  uw_total_bytes += uw->written;
+  uw_total_stalls += uw->stalls;
+  pthread_mutex_unlock(&uw_total_mutex);
+
+  free(uw->buf);
+  free(uw);
+}
@@ -0,0 +1,83 @@
+/*
+   upload.h
+   $Id$
+
+   This file is part of t-tftpd.
+
+   Copyright 2002,2007 Tomofumi Hayashi <s1061123@gmail.com>.
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+   3. All advertising materials mentioning features or use of this software
+      must display the following acknowledgement:
+
+        This product includes software developed by
+        Tomofumi Hayashi <s1061123@gmail.com> and its contributors.
+
+   4. Neither the name of authors nor the names of its contributors may be used
+      to endorse or promote products derived from this software without
+      specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND ANY
+   EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _UPLOAD_H_
+#define _UPLOAD_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <sys/types.h>
+
+/*
+ * Upload writer for recv_file().
+ * Received blocks are coalesced into large aligned chunks, the file is
+ * preallocated when the client tells its size (tsize) and it is not over
+ * the limit nor half the free space, and the data is made durable
+ * according to the sync policy.
+ * With a write-behind ring, uw_write() only queues the data and a writer
+ * thread drains it to disk; a write error is reported by the next
+ * uw_write() or uw_finish().
+ */
+typedef struct upload_writer upload_writer;
+
+enum uw_sync {UW_SYNC_NONE, UW_SYNC_END, UW_SYNC_PERIODIC};
+
+#define UPLOAD_CHUNK_ALIGN 4096
+#define UPLOAD_CHUNK_MAX (16 * 1024 * 1024)
+#define WRITE_BEHIND_MAX_DEPTH 4096
+
+upload_writer *uw_create(int fd, size_t chunk, off_t expect_size,
+                         enum uw_sync sync, size_t sync_interval,
+                         size_t ring_size, off_t prealloc_max);
+int uw_write(upload_writer *uw, const char *data, size_t len);
+int uw_finish(upload_writer *uw);
+void uw_destroy(upload_writer *uw);
+void uw_session_stat(upload_writer *uw,
+                     unsigned long *writes, unsigned long long *bytes);
+void uw_total_stat(unsigned long *writes, unsigned long long *bytes);
+void uw_session_stall(upload_writer *uw, unsigned long *stalls);
+void uw_total_stall(unsigned long *stalls);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* !_UPLOAD_H_ */
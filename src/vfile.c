@@ -0,0 +1,702 @@
+/*
+   vfile.c
+   $Id$
+
+   This file is part of t-tftpd.
+
+   Copyright 2002,2007 Tomofumi Hayashi <s1061123@gmail.com>.
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+   3. All advertising materials mentioning features or use of this software
+      must display the following acknowledgement:
+
+        This product includes software developed by
+        Tomofumi Hayashi <s1061123@gmail.com> and its contributors.
+
+   4. Neither the name of authors nor the names of its contributors may be used
+      to endorse or promote products derived from this software without
+      specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND ANY
+   EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for memfd_create() */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "vfile.h"
+
+#define VFILE_NAME_SIZ 256
+
+enum vfile_var {
+  VV_TEXT,
+  VV_NAME,
+  VV_BASE,
+  VV_MATCH,
+  VV_IP,
+  VV_HEXIP
+};
+
+static const char *var_names[] = {
+  NULL, "name", "base", "match", "ip", "hexip"
+};
+
+struct vfile_seg {
+  enum vfile_var var;
+  size_t off, len;      /* in the text, for VV_TEXT */
+};
+
+struct vfile_template {
+  char pattern[VFILE_PATTERN_SIZ];
+  size_t head, tail;    /* the fixed parts of pattern */
+  char path[PATH_MAX];
+  time_t mtime;
+  char *text;
+  struct vfile_seg *seg;
+  int nseg;
+  unsigned long gen;    /* of the parse, for the cached files */
+};
+
+/* the templates of a spec, before they are installed. */
+struct vfile_set {
+  struct vfile_template *tmpl;
+  int count;
+  size_t cache;
+};
+
+/* a file made from a template, in the hash and in the LRU list. */
+struct vfile_entry {
+  struct vfile_entry *hnext;
+  struct vfile_entry *prev, *next;
+  int idx;
+  unsigned long gen;
+  char name[VFILE_NAME_SIZ];
+  char ip[INET6_ADDRSTRLEN];
+  char *data;
+  size_t len;
+};
+
+static int vfile_on = 0;
+static unsigned long generation = 0;
+
+/* the templates and the cache */
+static pthread_mutex_t vfile_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct vfile_template *tmpl = NULL;
+static int ntmpl = 0;
+static size_t budget = VFILE_DEFAULT_CACHE * 1024, used = 0;
+static struct vfile_entry *hash[VFILE_HASH_SIZE];
+static struct vfile_entry *lru_head = NULL, *lru_tail = NULL;
+static unsigned long total_rendered = 0, total_cached = 0;
+
+/* the head and tail of the pattern without wildcards, for ${match}. */
+static void template_pattern(struct vfile_template *tp, const char *pattern)
+{
+  size_t len, cnt;
+
+  snprintf(tp->pattern, VFILE_PATTERN_SIZ, "%s", pattern);
+  len = strlen(pattern);
+  tp->head = strcspn(pattern, "*?[");
+  tp->tail = 0;
+  for (cnt = len; cnt > tp->head; cnt--) {
+    if (strchr("*?]", pattern[cnt - 1]) != NULL) {
+      break;
+    }
+    tp->tail++;
+  }
+  if (tp->head == len) {
+    tp->tail = 0;
+  }
+}
+
+static void template_free(struct vfile_template *tp)
+{
+  free(tp->text);
+  free(tp->seg);
+  tp->text = NULL;
+  tp->seg = NULL;
+}
+
+static int template_add(struct vfile_template *tp, enum vfile_var var,
+                        size_t off, size_t len)
+{
+  if (var == VV_TEXT && len == 0) {
+    return 0;
+  }
+  tp->seg[tp->nseg].var = var;
+  tp->seg[tp->nseg].off = off;
+  tp->seg[tp->nseg].len = len;
+  return tp->nseg++;
+}
+
+/*
+ * Read and parse the template file of tp.
+ * Return: 0 on success, -1 on error.
+ */
+static int template_compile(struct vfile_template *tp)
+{
+  FILE *fp;
+  struct stat st;
+  char *cp, *start, *end, *close;
+  size_t len, dollars;
+  int var;
+
+  tp->text = NULL;
+  tp->seg = NULL;
+  tp->nseg = 0;
+  if ((fp = fopen(tp->path, "r")) == NULL) {
+    return -1;
+  }
+  if (fstat(fileno(fp), &st) == -1 || st.st_size > VFILE_TEMPLATE_MAX ||
+      (tp->text = (char *)malloc(st.st_size + 1)) == NULL) {
+    fclose(fp);
+    return -1;
+  }
+  len = fread(tp->text, 1, st.st_size, fp);
+  fclose(fp);
+  tp->text[len] = '\0';
+  tp->mtime = st.st_mtime;
+
+  /* a text and a variable for each $ at most, and the text after. */
+  end = tp->text + len;
+  for (dollars = 0, cp = tp->text; cp < end; cp++) {
+    dollars += *cp == '$';
+  }
+  tp->seg = (struct vfile_seg *)malloc(sizeof(struct vfile_seg) *
+                                       (dollars * 2 + 1));
+  if (tp->seg == NULL) {
+    goto error;
+  }
+  for (start = cp = tp->text; cp < end; ) {
+    if (*cp != '$') {
+      cp++;
+      continue;
+    }
+    template_add(tp, VV_TEXT, start - tp->text, cp - start);
+    if (cp[1] == '$') {
+      /* the second one starts the next text. */
+      start = cp + 1;
+      cp += 2;
+      continue;
+    }
+    if (cp[1] != '{' || (close = strchr(cp + 2, '}')) == NULL) {
+      goto error;
+    }
+    for (var = VV_NAME; var <= VV_HEXIP; var++) {
+      if (strlen(var_names[var]) == (size_t)(close - cp - 2) &&
+          strncmp(cp + 2, var_names[var], close - cp - 2) == 0) {
+        break;
+      }
+    }
+    if (var > VV_HEXIP) {
+      goto error;
+    }
+    template_add(tp, (enum vfile_var)var, 0, 0);
+    start = cp = close + 1;
+  }
+  template_add(tp, VV_TEXT, start - tp->text, cp - start);
+  tp->gen = __atomic_add_fetch(&generation, 1, __ATOMIC_RELAXED);
+  return 0;
+
+ error:
+  template_free(tp);
+  return -1;
+}
+
+/*
+ * Read spec into a new set of templates.
+ * Return: 0 on success, -1 on error.
+ */
+static int vfile_parse(const char *spec, struct vfile_template **set,
+                       int *count, size_t *cache)
+{
+  struct vfile_template *tp;
+  char *str, *cp, *value, *end, *last;
+  long num;
+  int n;
+
+  if ((str = strdup(spec)) == NULL) {
+    return -1;
+  }
+  if ((tp = (struct vfile_template *)calloc(VFILE_MAX,
+                                            sizeof(*tp))) == NULL) {
+    free(str);
+    return -1;
+  }
+  n = 0;
+  *cache = VFILE_DEFAULT_CACHE * 1024;
+  for (cp = strtok_r(str, ",", &last); cp != NULL;
+       cp = strtok_r(NULL, ",", &last)) {
+    if ((value = strchr(cp, '=')) == NULL) {
+      goto error;
+    }
+    *value++ = '\0';
+    if (strcmp(cp, "cache") == 0) {
+      num = strtol(value, &end, 10);
+      if (end == value || *end != '\0' || num < 0) {
+        goto error;
+      }
+      *cache = (size_t)num * 1024;
+      continue;
+    }
+    if (n == VFILE_MAX || *cp == '\0' || strlen(cp) >= VFILE_PATTERN_SIZ ||
+        strlen(value) >= PATH_MAX) {
+      goto error;
+    }
+    template_pattern(&tp[n], cp);
+    snprintf(tp[n].path, PATH_MAX, "%s", value);
+    if (template_compile(&tp[n]) == -1) {
+      fprintf(stderr, "template %s can't be read.\n", value);
+      goto error;
+    }
+    n++;
+  }
+  free(str);
+  if (n == 0) {
+    free(tp);
+    return -1;
+  }
+  *set = tp;
+  *count = n;
+  return 0;
+
+ error:
+  while (n > 0) {
+    template_free(&tp[--n]);
+  }
+  free(tp);
+  free(str);
+  return -1;
+}
+
+static unsigned int entry_hash(int idx, const char *name, const char *ip)
+{
+  unsigned int h = 2166136261U ^ (unsigned int)idx;
+
+  for (; *name != '\0'; name++) {
+    h = (h ^ (unsigned char)*name) * 16777619U;
+  }
+  for (; *ip != '\0'; ip++) {
+    h = (h ^ (unsigned char)*ip) * 16777619U;
+  }
+  return h % VFILE_HASH_SIZE;
+}
+
+/* Called with vfile_mutex held, as the others of the cache. */
+static void cache_drop(struct vfile_entry *ep)
+{
+  struct vfile_entry **pp;
+
+  for (pp = &hash[entry_hash(ep->idx, ep->name, ep->ip)]; *pp != ep;
+       pp = &(*pp)->hnext)
+    ;
+  *pp = ep->hnext;
+  if (ep->prev != NULL) {
+    ep->prev->next = ep->next;
+  }
+  else {
+    lru_head = ep->next;
+  }
+  if (ep->next != NULL) {
+    ep->next->prev = ep->prev;
+  }
+  else {
+    lru_tail = ep->prev;
+  }
+  used -= ep->len;
+  free(ep->data);
+  free(ep);
+}
+
+static void cache_flush(void)
+{
+  while (lru_head != NULL) {
+    cache_drop(lru_head);
+  }
+}
+
+static struct vfile_entry *cache_find(int idx, unsigned long gen,
+                                      const char *name, const char *ip)
+{
+  struct vfile_entry *ep;
+
+  for (ep = hash[entry_hash(idx, name, ip)]; ep != NULL; ep = ep->hnext) {
+    if (ep->idx == idx && ep->gen == gen && strcmp(ep->name, name) == 0 &&
+        strcmp(ep->ip, ip) == 0) {
+      break;
+    }
+  }
+  if (ep == NULL || ep == lru_head) {
+    return ep;
+  }
+  /* to the head of the LRU list */
+  ep->prev->next = ep->next;
+  if (ep->next != NULL) {
+    ep->next->prev = ep->prev;
+  }
+  else {
+    lru_tail = ep->prev;
+  }
+  ep->prev = NULL;
+  ep->next = lru_head;
+  lru_head->prev = ep;
+  lru_head = ep;
+  return ep;
+}
+
+/*
+ * Keep data, which the cache owns from now on.
+ * Return: 0 on success, -1 when it is not kept.
+ */
+static int cache_add(int idx, unsigned long gen, const char *name,
+                     const char *ip, char *data, size_t len)
+{
+  struct vfile_entry *ep;
+  unsigned int h;
+
+  if (len > budget || strlen(name) >= VFILE_NAME_SIZ) {
+    return -1;
+  }
+  while (used + len > budget && lru_tail != NULL) {
+    cache_drop(lru_tail);
+  }
+  if ((ep = (struct vfile_entry *)calloc(1, sizeof(*ep))) == NULL) {
+    return -1;
+  }
+  ep->idx = idx;
+  ep->gen = gen;
+  snprintf(ep->name, VFILE_NAME_SIZ, "%s", name);
+  snprintf(ep->ip, sizeof(ep->ip), "%s", ip);
+  ep->data = data;
+  ep->len = len;
+  h = entry_hash(idx, name, ip);
+  ep->hnext = hash[h];
+  hash[h] = ep;
+  ep->next = lru_head;
+  if (lru_head != NULL) {
+    lru_head->prev = ep;
+  }
+  else {
+    lru_tail = ep;
+  }
+  lru_head = ep;
+  used += len;
+  return 0;
+}
+
+/*
+ * Read the templates of spec, for vfile_install() or vfile_discard().
+ * Return: the templates, or NULL when the spec is not valid.
+ */
+vfile_set *vfile_load(const char *spec)
+{
+  struct vfile_set *set;
+
+  if ((set = (struct vfile_set *)malloc(sizeof(*set))) == NULL) {
+    return NULL;
+  }
+  if (vfile_parse(spec, &set->tmpl, &set->count, &set->cache) == -1) {
+    free(set);
+    return NULL;
+  }
+  return set;
+}
+
+/* switch to the templates of vfile_load(). */
+void vfile_install(vfile_set *set)
+{
+  struct vfile_template *old;
+  int oldcount;
+
+  pthread_mutex_lock(&vfile_mutex);
+  cache_flush();
+  old = tmpl;
+  oldcount = ntmpl;
+  tmpl = set->tmpl;
+  ntmpl = set->count;
+  budget = set->cache;
+  pthread_mutex_unlock(&vfile_mutex);
+  free(set);
+  while (oldcount > 0) {
+    template_free(&old[--oldcount]);
+  }
+  free(old);
+  vfile_on = 1;
+}
+
+void vfile_discard(vfile_set *set)
+{
+  while (set->count > 0) {
+    template_free(&set->tmpl[--set->count]);
+  }
+  free(set->tmpl);
+  free(set);
+}
+
+/*
+ * Return: 0 on success, -1 on error.
+ */
+int vfile_config(const char *spec)
+{
+  struct vfile_set *set;
+
+  if ((set = vfile_load(spec)) == NULL) {
+    return -1;
+  }
+  vfile_install(set);
+  return 0;
+}
+
+int vfile_enabled(void)
+{
+  return vfile_on;
+}
+
+/*
+ * Parse the templates again which have been changed.  A broken one is
+ * left as it was.
+ */
+void vfile_reload(void)
+{
+  struct vfile_template next;
+  struct stat st;
+  int idx;
+
+  if (!vfile_on) {
+    return;
+  }
+  pthread_mutex_lock(&vfile_mutex);
+  for (idx = 0; idx < ntmpl; idx++) {
+    if (stat(tmpl[idx].path, &st) == -1 || st.st_mtime == tmpl[idx].mtime) {
+      continue;
+    }
+    next = tmpl[idx];
+    if (template_compile(&next) == -1) {
+      fprintf(stderr, "template %s is invalid, not changed.\n",
+              tmpl[idx].path);
+      tmpl[idx].mtime = st.st_mtime;
+      continue;
+    }
+    template_free(&tmpl[idx]);
+    tmpl[idx] = next;
+    fprintf(stderr, "template %s is reloaded.\n", tmpl[idx].path);
+  }
+  pthread_mutex_unlock(&vfile_mutex);
+}
+
+/* the client address as text, and in hex. */
+static void client_ip(const struct sockaddr *sa, char *ip, size_t iplen,
+                      char *hex)
+{
+  const unsigned char *addr;
+  int len, cnt;
+
+  ip[0] = hex[0] = '\0';
+  if (sa->sa_family == AF_INET) {
+    addr = (const unsigned char *)&((struct sockaddr_in *)sa)->sin_addr;
+    len = 4;
+  }
+  else if (sa->sa_family == AF_INET6) {
+    addr = (const unsigned char *)&((struct sockaddr_in6 *)sa)->sin6_addr;
+    len = 16;
+    if (IN6_IS_ADDR_V4MAPPED((struct in6_addr *)addr)) {
+      addr += 12;
+      len = 4;
+    }
+  }
+  else {
+    return;
+  }
+  inet_ntop(len == 4 ? AF_INET : AF_INET6, addr, ip, iplen);
+  for (cnt = 0; cnt < len; cnt++) {
+    sprintf(hex + cnt * 2, "%02X", addr[cnt]);
+  }
+}
+
+/*
+ * Make the file of tp for a request.
+ * Return: the file (to be freed), NULL on error.
+ */
+static char *template_render(struct vfile_template *tp, const char *name,
+                             const char *ip, const char *hexip, size_t *len)
+{
+  const char *value[VV_HEXIP + 1];
+  size_t vlen[VV_HEXIP + 1], size, namelen;
+  char match[VFILE_NAME_SIZ], *data, *cp;
+  int cnt;
+
+  namelen = strlen(name);
+  match[0] = '\0';
+  if (namelen >= tp->head + tp->tail) {
+    snprintf(match, sizeof(match), "%.*s",
+             (int)(namelen - tp->head - tp->tail), name + tp->head);
+  }
+  value[VV_NAME] = name;
+  value[VV_BASE] = strrchr(name, '/') != NULL ? strrchr(name, '/') + 1 : name;
+  value[VV_MATCH] = match;
+  value[VV_IP] = ip;
+  value[VV_HEXIP] = hexip;
+  for (cnt = VV_NAME; cnt <= VV_HEXIP; cnt++) {
+    vlen[cnt] = strlen(value[cnt]);
+  }
+
+  size = 0;
+  for (cnt = 0; cnt < tp->nseg; cnt++) {
+    size += tp->seg[cnt].var == VV_TEXT ?
+      tp->seg[cnt].len : vlen[tp->seg[cnt].var];
+  }
+  if (size > VFILE_OUTPUT_MAX || (data = (char *)malloc(size + 1)) == NULL) {
+    return NULL;
+  }
+  for (cp = data, cnt = 0; cnt < tp->nseg; cnt++) {
+    if (tp->seg[cnt].var == VV_TEXT) {
+      memcpy(cp, tp->text + tp->seg[cnt].off, tp->seg[cnt].len);
+      cp += tp->seg[cnt].len;
+    }
+    else {
+      memcpy(cp, value[tp->seg[cnt].var], vlen[tp->seg[cnt].var]);
+      cp += vlen[tp->seg[cnt].var];
+    }
+  }
+  *len = size;
+  return data;
+}
+
+/*
+ * An anonymous file with data in it, at offset 0.
+ * Return: the descriptor, -1 on error.
+ */
+static int vfile_fd(const char *data, size_t len)
+{
+  ssize_t ret;
+  size_t done;
+  int fd;
+#ifndef MFD_CLOEXEC
+  char path[] = "/tmp/t-tftpd-XXXXXX";
+#endif
+
+#ifdef MFD_CLOEXEC
+  fd = memfd_create("t-tftpd-vfile", MFD_CLOEXEC);
+#else
+  if ((fd = mkstemp(path)) != -1) {
+    unlink(path);
+  }
+#endif
+  if (fd == -1) {
+    return -1;
+  }
+  for (done = 0; done < len; done += ret) {
+    if ((ret = write(fd, data + done, len - done)) <= 0) {
+      close(fd);
+      return -1;
+    }
+  }
+  lseek(fd, 0, SEEK_SET);
+  return fd;
+}
+
+/*
+ * A copy of data, for the file to be written outside of vfile_mutex.
+ * Return: the copy to be freed, or NULL on error.
+ */
+static char *data_copy(const char *data, size_t len)
+{
+  char *copy;
+
+  if ((copy = (char *)malloc(len + 1)) != NULL) {
+    memcpy(copy, data, len);
+  }
+  return copy;
+}
+
+/*
+ * Open the virtual file of name for client.
+ * Return: the descriptor, -1 when no template matches or on error.
+ */
+int vfile_open(const char *name, const struct sockaddr *client)
+{
+  struct vfile_template *tp;
+  struct vfile_entry *ep;
+  char ip[INET6_ADDRSTRLEN], hexip[33], *data, *copy;
+  size_t len;
+  int idx, fd;
+
+  if (!vfile_on) {
+    return -1;
+  }
+  pthread_mutex_lock(&vfile_mutex);
+  for (idx = 0; idx < ntmpl; idx++) {
+    if (fnmatch(tmpl[idx].pattern, name, 0) == 0) {
+      break;
+    }
+  }
+  if (idx == ntmpl) {
+    pthread_mutex_unlock(&vfile_mutex);
+    return -1;
+  }
+  tp = &tmpl[idx];
+  client_ip(client, ip, sizeof(ip), hexip);
+
+  if ((ep = cache_find(idx, tp->gen, name, ip)) != NULL) {
+    total_cached++;
+    len = ep->len;
+    data = data_copy(ep->data, len);
+  }
+  else if ((data = template_render(tp, name, ip, hexip, &len)) != NULL) {
+    total_rendered++;
+    /* the cache keeps a copy, data is for the file. */
+    if (len <= budget && (copy = data_copy(data, len)) != NULL &&
+        cache_add(idx, tp->gen, name, ip, copy, len) == -1) {
+      free(copy);
+    }
+  }
+  pthread_mutex_unlock(&vfile_mutex);
+
+  /* memfd_create() and the writes don't hold up the other sessions. */
+  if (data == NULL) {
+    return -1;
+  }
+  fd = vfile_fd(data, len);
+  free(data);
+  return fd;
+}
+
+void vfile_total_stat(unsigned long *rendered, unsigned long *cached)
+{
+  *rendered = total_rendered;
+  *cached = total_cached;
+}
@@ -0,0 +1,90 @@
+/*
+   vfile.h
+   $Id$
+
+   This file is part of t-tftpd.
+
+   Copyright 2002,2007 Tomofumi Hayashi <s1061123@gmail.com>.
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+   3. All advertising materials mentioning features or use of this software
+      must display the following acknowledgement:
+
+        This product includes software developed by
+        Tomofumi Hayashi <s1061123@gmail.com> and its contributors.
+
+   4. Neither the name of authors nor the names of its contributors may be used
+      to endorse or promote products derived from this software without
+      specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND ANY
+   EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+   THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _VFILE_H_
+#define _VFILE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/*
+ * Virtual files, made from a template for each client.
+ * -V takes "GLOB=TEMPLATE,...,cache=KB".  An RRQ for a name that is not
+ * in the tree but matches GLOB gets TEMPLATE with these replaced:
+ *   ${name}   the requested name      ${base}  its last component
+ *   ${match}  the part of the name between the fixed head and tail of
+ *             GLOB, e.g. the MAC of "pxelinux.cfg/01-*"
+ *   ${ip}     the client address      ${hexip} the same in upper case
+ *             hex, as pxelinux names its files
+ * and $$ for a $.  A file on the disk goes before a template.
+ *
+ * The templates are parsed once, and again when they are changed.  The
+ * files made from them are kept up to cache=KB (VFILE_DEFAULT_CACHE),
+ * the least recently used ones are dropped first.  Each request gets
+ * the file in an anonymous file of its own (memfd), which the send
+ * path reads like any other, its size included.
+ */
+#define VFILE_MAX 16
+#define VFILE_PATTERN_SIZ 128
+#define VFILE_TEMPLATE_MAX (64 * 1024)   /* bytes */
+#define VFILE_OUTPUT_MAX (1024 * 1024)   /* bytes */
+#define VFILE_DEFAULT_CACHE 1024         /* KB */
+#define VFILE_HASH_SIZE 256
+
+typedef struct vfile_set vfile_set;
+
+vfile_set *vfile_load(const char *spec);
+void vfile_install(vfile_set *set);
+void vfile_discard(vfile_set *set);
+int vfile_config(const char *spec);
+int vfile_enabled(void);
+void vfile_reload(void);
+int vfile_open(const char *name, const struct sockaddr *client);
+void vfile_total_stat(unsigned long *rendered, unsigned long *cached);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* !_VFILE_H_ */